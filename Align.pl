@@ -59,6 +59,7 @@ my $discardMate = 0;
 my $straightThrough = 0;
 my $test = 0;
 my $cntfn = "";
+my $readfilt = "$Bin/soapsnp/readfilt";
 
 sub dieusage {
 	my $msg = shift;
@@ -98,6 +99,7 @@ GetOptions (
 	"discard-small"   => \$discardSmall,
 	"straight-through"=> \$straightThrough,
 	"counters:s"      => \$cntfn,
+	"readfilt:s"      => \$readfilt,
 	"destdir:s"       => \$dest_dir,
 	"test"            => \$test) || dieusage("Bad option", 1);
 
@@ -119,6 +121,8 @@ msg("SAM passthrough: $sam_passthru");
 msg("Straight through: $straightThrough");
 msg("local index path: $indexLocal");
 msg("counters: $cntfn");
+$readfilt = "" unless $readfilt ne "" && -x $readfilt && !$test;
+msg("read filter: ".($readfilt ne "" ? $readfilt : "Perl"));
 msg("dest dir: $dest_dir");
 msg("bowtie args: @ARGV");
 msg("ls -al");
@@ -264,12 +268,6 @@ sub runBowtie($$$) {
 
 my $sthruCmd = ""; # command for bowtie in straight-through mode
 my $efn = ".tmp.Align.pl.$$.err"; # bowtie stderr dump
-if($straightThrough) {
-	$sthruCmd = runBowtie("-", $efn, \%env);
-	open OUT, "| $sthruCmd" || die "Could not open '| $sthruCmd' for writing";
-} else {
-	open OUT, ">.tmp.$$" || die "Could not open .tmp.$$ for writing";
-}
 my $records = 0;
 my $downloaded = 0;
 my $skipped = 0;
@@ -333,100 +331,147 @@ if($test) {
 	%rawQualCnts = ();
 }
 
-# Shunt all of the input to a file
-my %lens = ();
-my $first = 1;
-my $lastLine = "";
-while(<STDIN>) {
-	next if /^\s*FAKE\s*$/;
-	next if /^\s*$/;
-	msg("Read first line of stdin:\n$_") if $first;
-	$first = 0;
-	$lastLine = $_;
-	chomp;
-	$downloaded++;
-	if($discardReads != 0 && rand() < $discardReads) {
-		$skipped++; next;
+if($readfilt ne "") {
+	##
+	# The native filter reads stdin itself; its counters and any error
+	# come back through $ffn.
+	#
+	my $ffn = ".tmp.Align.pl.$$.filt";
+	my $fcmd = "$readfilt -q $qual";
+	$fcmd .= " -t $truncate" if $truncate > 0;
+	$fcmd .= " -s" if $discardSmall;
+	$fcmd .= " -m $discardMate" if $discardMate > 0;
+	$fcmd .= " -d $discardReads" if $discardReads != 0;
+	$fcmd .= " 2>$ffn";
+	if($straightThrough) {
+		$sthruCmd = runBowtie("-", $efn, \%env);
+		$fcmd .= " | $sthruCmd";
+	} else {
+		$fcmd .= " >.tmp.$$";
+	}
+	msg("Running: $fcmd");
+	system($fcmd);
+	my $ret = $?;
+	my $done = 0;
+	open(FFN, $ffn) || die "Could not open '$ffn' for reading\n";
+	while(<FFN>) {
+		chomp;
+		if(/^reporter:counter:(.*)$/) {
+			my $c = $1;
+			$downloaded = $1 if $c =~ /^Bowtie,Reads downloaded,([0-9]+)$/;
+			$records = $1 if $c =~ /^Bowtie,Reads \(all\) passing filters,([0-9]+)$/;
+			$done = 1;
+			counter($c);
+		} else {
+			msg($_);
+		}
+	}
+	close(FFN);
+	unlink($ffn);
+	$done || die "$readfilt failed\n";
+	$? = $ret;
+} else {
+	if($straightThrough) {
+		$sthruCmd = runBowtie("-", $efn, \%env);
+		open OUT, "| $sthruCmd" || die "Could not open '| $sthruCmd' for writing";
+	} else {
+		open OUT, ">.tmp.$$" || die "Could not open .tmp.$$ for writing";
 	}
-	my @altok = split(/\t/);
-	scalar(@altok) == 3 || scalar(@altok) == 5 || die "Bad number of read tokens ; expected 3 or 5:\n$_\n";
-	my $pe = (scalar(@altok) == 5);
-	my $len1 = length($altok[1]);
-	my $len2 = 0;
-	if($pe) {
-		if($discardMate > 0) {
-			if($discardMate == 1) {
-				# First mate is discarded, second is promoted to the
-				# first slot
-				$altok[1] = $altok[3];
-				$altok[2] = $altok[4];
-				$len1 = length($altok[1]);
+	# Shunt all of the input to a file
+	my %lens = ();
+	my $first = 1;
+	my $lastLine = "";
+	while(<STDIN>) {
+		next if /^\s*FAKE\s*$/;
+		next if /^\s*$/;
+		msg("Read first line of stdin:\n$_") if $first;
+		$first = 0;
+		$lastLine = $_;
+		chomp;
+		$downloaded++;
+		if($discardReads != 0 && rand() < $discardReads) {
+			$skipped++; next;
+		}
+		my @altok = split(/\t/);
+		scalar(@altok) == 3 || scalar(@altok) == 5 || die "Bad number of read tokens ; expected 3 or 5:\n$_\n";
+		my $pe = (scalar(@altok) == 5);
+		my $len1 = length($altok[1]);
+		my $len2 = 0;
+		if($pe) {
+			if($discardMate > 0) {
+				if($discardMate == 1) {
+					# First mate is discarded, second is promoted to the
+					# first slot
+					$altok[1] = $altok[3];
+					$altok[2] = $altok[4];
+					$len1 = length($altok[1]);
+				} else {
+					# Second mate is discarded by virtue of $pe = 0
+				}
+				$matesSkipped++;
+				$pe = 0;
+				# $len2 remains =0
 			} else {
-				# Second mate is discarded by virtue of $pe = 0
+				# Mate is intact; tally its length
+				$len2 = length($altok[3]); $lens{$len2}++;
 			}
-			$matesSkipped++;
-			$pe = 0;
-			# $len2 remains =0
+		}
+		$lens{$len1}++;
+		# Is it so small that we should discard it?
+		if($truncate > 0 && $discardSmall &&
+		   ($len1 < $truncate || ($len2 > 0 && $len2 < $truncate)))
+		{
+			# Yes, discard
+			$truncSkipped++;
+			next;
+		}
+		# Print alignment after truncating it
+		my $nlen1 = $len1;
+		$nlen1 = min($truncate, $len1) if $truncate > 0;
+		$truncated++ if ($nlen1 < $len1);
+		if($pe) {
+			my $nlen2 = $len2;
+			$nlen2 = min($truncate, $len2) if $truncate > 0;
+			$truncated++ if ($nlen2 < $len2);
+			my ($nm, $s1, $q1, $s2, $q2) = (@altok);
+			($q1, $q2) = (processQuals($q1), processQuals($q2));
+			$pass++; $pairedPass++;
+			print OUT "r\t".
+				substr($s1, 0, $nlen1)."\t".
+				substr($q1, 0, $nlen1)."\t".
+				substr($s2, 0, $nlen2)."\t".
+				substr($q2, 0, $nlen2)."\n";
 		} else {
-			# Mate is intact; tally its length
-			$len2 = length($altok[3]); $lens{$len2}++;
+			$pass++; $unpairedPass++;
+			my ($nm, $s1, $q1) = (@altok);
+			$q1 = processQuals($q1);
+			print OUT "r\t".
+				substr($s1, 0, $nlen1)."\t".
+				substr($q1, 0, $nlen1)."\n";
 		}
+		$records++;
 	}
-	$lens{$len1}++;
-	# Is it so small that we should discard it?
-	if($truncate > 0 && $discardSmall &&
-	   ($len1 < $truncate || ($len2 > 0 && $len2 < $truncate)))
-	{
-		# Yes, discard
-		$truncSkipped++;
-		next;
+	msg("Read last line of stdin:\n$lastLine");
+	msg("$records reads downloaded\n");
+	counter("Bowtie,Reads downloaded,$downloaded");
+	counter("Bowtie,Reads (all) passing filters,$pass");
+	counter("Bowtie,Reads (unpaired) passing filters,$unpairedPass");
+	counter("Bowtie,Reads (paired) passing filters,$pairedPass");
+	counter("Bowtie,Reads skipped due to -discard-reads,$skipped");
+	counter("Bowtie,Reads skipped due to -truncate-discard,$truncSkipped");
+	counter("Bowtie,Mates skipped due to -discard-mate,$matesSkipped");
+	counter("Bowtie,Reads (mates) truncated due to -truncate*,$truncated");
+	for my $len (keys %lens) {
+		counter("Bowtie,Reads of length $len,$lens{$len}");
 	}
-	# Print alignment after truncating it
-	my $nlen1 = $len1;
-	$nlen1 = min($truncate, $len1) if $truncate > 0;
-	$truncated++ if ($nlen1 < $len1);
-	if($pe) {
-		my $nlen2 = $len2;
-		$nlen2 = min($truncate, $len2) if $truncate > 0;
-		$truncated++ if ($nlen2 < $len2);
-		my ($nm, $s1, $q1, $s2, $q2) = (@altok);
-		($q1, $q2) = (processQuals($q1), processQuals($q2));
-		$pass++; $pairedPass++;
-		print OUT "r\t".
-			substr($s1, 0, $nlen1)."\t".
-			substr($q1, 0, $nlen1)."\t".
-			substr($s2, 0, $nlen2)."\t".
-			substr($q2, 0, $nlen2)."\n";
-	} else {
-		$pass++; $unpairedPass++;
-		my ($nm, $s1, $q1) = (@altok);
-		$q1 = processQuals($q1);
-		print OUT "r\t".
-			substr($s1, 0, $nlen1)."\t".
-			substr($q1, 0, $nlen1)."\n";
+	for my $qual (keys %rawQualCnts) {
+		counter("Bowtie,Occurrences of raw quality value [".($qual*10).":".($qual*10+10)."),$rawQualCnts{$qual}");
 	}
-	$records++;
-}
-msg("Read last line of stdin:\n$lastLine");
-msg("$records reads downloaded\n");
-counter("Bowtie,Reads downloaded,$downloaded");
-counter("Bowtie,Reads (all) passing filters,$pass");
-counter("Bowtie,Reads (unpaired) passing filters,$unpairedPass");
-counter("Bowtie,Reads (paired) passing filters,$pairedPass");
-counter("Bowtie,Reads skipped due to -discard-reads,$skipped");
-counter("Bowtie,Reads skipped due to -truncate-discard,$truncSkipped");
-counter("Bowtie,Mates skipped due to -discard-mate,$matesSkipped");
-counter("Bowtie,Reads (mates) truncated due to -truncate*,$truncated");
-for my $len (keys %lens) {
-	counter("Bowtie,Reads of length $len,$lens{$len}");
-}
-for my $qual (keys %rawQualCnts) {
-	counter("Bowtie,Occurrences of raw quality value [".($qual*10).":".($qual*10+10)."),$rawQualCnts{$qual}");
-}
-for my $qual (keys %qualCnts) {
-	counter("Bowtie,Occurrences of phred-33 quality value [".($qual*10).":".($qual*10+10)."),$qualCnts{$qual}");
+	for my $qual (keys %qualCnts) {
+		counter("Bowtie,Occurrences of phred-33 quality value [".($qual*10).":".($qual*10+10)."),$qualCnts{$qual}");
+	}
+	close(OUT);
 }
-close(OUT);
 if($straightThrough) {
 	if($? != 0) {
 		msg("Fatal error: Bowtie exited with level $?:");
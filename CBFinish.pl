@@ -63,6 +63,7 @@ my $cmap_jar = "";
 my $dest_dir = "";
 my $output = "";
 my $cntfn = "";
+my $cbfinish = "$Bin/soapsnp/cbfinish";
 
 sub dieusage {
 	my $msg = shift;
@@ -94,6 +95,7 @@ GetOptions (
 	"cmap:s"          => \$cmap_file,
 	"cmapjar:s"       => \$cmap_jar,
 	"destdir:s"       => \$dest_dir,
+	"cbfinish:s"      => \$cbfinish,
 	"counters:s"      => \$cntfn) || dieusage("Bad option", 1);
 
 Tools::purgeEnv();
@@ -109,6 +111,8 @@ msg("cmap_file: $cmap_file");
 msg("cmap_jar: $cmap_jar");
 msg("local destination dir: $dest_dir");
 msg("Output dir: $output");
+$cbfinish = "" unless $cbfinish ne "" && -x $cbfinish;
+msg("finisher: ".($cbfinish ne "" ? $cbfinish : "Perl"));
 msg("ls -al");
 msg(`ls -al`);
 
@@ -170,36 +174,54 @@ if($cmap_jar ne "") {
 
 loadCmap($cmap_file) if $cmap_file ne "";
 
-my %outfhs = ();
-my %recs = ();
-my $lines = 0;
-while(<STDIN>) {
-	next if /^\s*FAKE\s*$/;
-	next if /^\s*$/;
-	$lines++;
+if($cbfinish ne "") {
+	# The native finisher reads stdin itself, prints its counters and
+	# lists the .gz files it wrote
+	my $cmd = $cbfinish;
+	$cmd .= " -m $cmap_file" if $cmap_file ne "";
+	msg("Running: $cmd");
+	open(FIN, "$cmd |") || die "Could not run '$cmd'\n";
+	my @fns = <FIN>;
+	close(FIN);
+	$? == 0 || die "$cbfinish exited with level $?\n";
 	flushCounters() if scalar(@counterUpdates) > 0;
-	next unless $_ ne "";
-	my @ss = split(/\t/);
-	my $chr = $ss[0];
-	$chr = $cmap{$chr} if defined($cmap{$chr});
-	unless(defined($outfhs{$chr})) {
-		counter("Postprocess,Chromosomes observed,1");
-		$outfhs{$chr} = new IO::File(".tmp.CBFinish.pl.$$.$chr", "w");
+	for my $fn (@fns) {
+		chomp($fn);
+		pushResult($fn);
+		counter("Postprocess,Chromosome files pushed,1");
 	}
-	$ss[0] = $chr;
-	$ss[1] = int($ss[1]); # remove leading 0s
-	print {$outfhs{$chr}} join("\t", @ss);
-	$recs{$chr}++;
+} else {
+	my %outfhs = ();
+	my %recs = ();
+	my $lines = 0;
+	while(<STDIN>) {
+		next if /^\s*FAKE\s*$/;
+		next if /^\s*$/;
+		$lines++;
+		flushCounters() if scalar(@counterUpdates) > 0;
+		next unless $_ ne "";
+		my @ss = split(/\t/);
+		my $chr = $ss[0];
+		$chr = $cmap{$chr} if defined($cmap{$chr});
+		unless(defined($outfhs{$chr})) {
+			counter("Postprocess,Chromosomes observed,1");
+			$outfhs{$chr} = new IO::File(".tmp.CBFinish.pl.$$.$chr", "w");
+		}
+		$ss[0] = $chr;
+		$ss[1] = int($ss[1]); # remove leading 0s
+		print {$outfhs{$chr}} join("\t", @ss);
+		$recs{$chr}++;
+	}
+	msg("Read $lines lines of output");
+	for my $chr (keys %outfhs) {
+		counter("Postprocess,SNPs for chromosome $chr,$recs{$chr}");
+		$outfhs{$chr}->close();
+		my $fn = ".tmp.CBFinish.pl.$$.$chr";
+		run("gzip -c < $fn > $chr.gz") == 0 || die "Couldn't gzip $fn\n";
+		$fn = "$chr.gz";
+		pushResult($fn);
+		counter("Postprocess,Chromosome files pushed,1");
+	};
+	counter("Postprocess,0-SNP invocations,1") if $lines == 0;
 }
-msg("Read $lines lines of output");
-for my $chr (keys %outfhs) {
-	counter("Postprocess,SNPs for chromosome $chr,$recs{$chr}");
-	$outfhs{$chr}->close();
-	my $fn = ".tmp.CBFinish.pl.$$.$chr";
-	run("gzip -c < $fn > $chr.gz") == 0 || die "Couldn't gzip $fn\n";
-	$fn = "$chr.gz";
-	pushResult($fn);
-	counter("Postprocess,Chromosome files pushed,1");
-};
-counter("Postprocess,0-SNP invocations,1") if $lines == 0;
 flushCounters() if scalar(@counterUpdates) > 0;
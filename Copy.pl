@@ -57,6 +57,7 @@ my $keep = 0;
 my $verbose = 0;
 my $labReadGroup = 0;
 my $cntfn = "";
+my $readprep = "$Bin/soapsnp/readprep";
 
 sub msg($) {
 	my $m = shift;
@@ -87,6 +88,7 @@ GetOptions(
 	"owner:s"      => \$owner,
 	"label-rg"     => \$labReadGroup,
 	"counters:s"   => \$cntfn,
+	"readprep:s"   => \$readprep,
 	"verbose"      => \$verbose)
 	|| die "GetOptions failed\n";
 
@@ -97,6 +99,14 @@ my $ws = 0;
 $labReadGroup = 0 unless ($labReadGroup);
 $stopAfter = 0 unless($stopAfter);
 $maxPerFile = 500000 unless($maxPerFile);
+$readprep = "" unless $readprep ne "" && -x $readprep;
+msg("Read preprocessor: ".($readprep ne "" ? $readprep : "Perl")) if $verbose;
+# bzip2 support in the native preprocessor is a build option
+my $readprepBzip2 = 0;
+if($readprep ne "") {
+	my $comps = `$readprep -z`;
+	$readprepBzip2 = ($comps =~ /\bbzip2\b/) ? 1 : 0;
+}
 
 my $firstEnsureS3cmd = 1;
 my $s3cmdHasListMD5 = 1;
@@ -223,6 +233,19 @@ sub s3get($$$$) {
 	die "s3cmd get failed: $url $rc\n" if $rc;
 }
 
+##
+# Name of a fetched file once it's gunzipped or bunzipped.
+#
+sub unzippedName($) {
+	my $fn = shift;
+	if($fn =~ /\.gz$/ || $fn =~ /\.gzip$/) {
+		$fn =~ s/\.gzi?p?$//;
+	} elsif($fn =~ /\.bz2$/ || $fn =~ /\.bzip2$/) {
+		$fn =~ s/\.bzi?p?2$//;
+	}
+	return $fn;
+}
+
 ## Fetch a file
 sub fetch($$$$) {
 	my ($fname, $url, $md, $env) = @_;
@@ -247,6 +270,10 @@ sub fetch($$$$) {
 	}
 
 	counter("Short read preprocessor,Read data fetched,".(-s $fname));
+	# The native preprocessor decompresses gzip, and bzip2 if it was
+	# built with it, itself
+	return $fname if $readprep ne "" && unzippedName($fname) ne $fname &&
+		($readprepBzip2 || $fname =~ /\.gzi?p?$/);
 	
 	my $newfname = $fname;
 	if($fname =~ /\.gz$/ || $fname =~ /\.gzip$/) {
@@ -388,6 +415,44 @@ sub parseRead($$$) {
 	}
 }
 
+##
+# Convert the reads in one file, or two mate files, with the native
+# preprocessor, pushing each output file as soon as it is finished.
+# Output is named after the decompressed first file, as in the Perl
+# path.  Returns the number of reads or pairs.
+#
+sub runReadprep($$$$$) {
+	my ($fns, $lab, $sam, $color, $env) = @_;
+	my $cmd = "$readprep -n ".unzippedName($fns->[0])." -m $maxPerFile";
+	$cmd .= " -f sam" if $sam;
+	if($labReadGroup) {
+		$cmd .= " -g";
+	} elsif(defined($lab)) {
+		$cmd .= " -l $lab";
+	}
+	$cmd .= " -c" if $color;
+	if($stopAfter != 0) {
+		my $left = $stopAfter - $rtot;
+		$cmd .= " -s ".($left > 0 ? $left : 0);
+	}
+	$cmd .= " @$fns";
+	msg("Running: $cmd");
+	open(PREP, "$cmd |") || die "Could not run '$cmd'\n";
+	my $n = 0;
+	while(<PREP>) {
+		chomp;
+		my ($ofn, $recs) = split(/\t/);
+		$n += $recs;
+		if($push ne "") {
+			pushBatch($ofn, $env);
+			system("rm -f $ofn $ofn.* >&2");
+		}
+	}
+	close(PREP);
+	$? == 0 || die "$readprep exited with level $?\n";
+	return $n;
+}
+
 ##
 # Handle the copy for a single unpaired entry
 #
@@ -404,6 +469,13 @@ sub doUnpairedUrl($$$$$$) {
 	# fetch the file
 	my $origFn = $fn;
 	$fn = fetch($fn, $url, $md, $env);
+	if($readprep ne "") {
+		my $n = runReadprep([$fn], $lab, $sam, $color, $env);
+		$rtot += $n;
+		$totunpaired += $n;
+		system("rm -f $fn $origFn >&2") unless $keep;
+		return;
+	}
 	
 	# turn FASTQ entries into single-line reads
 	my $fh;
@@ -446,6 +518,7 @@ sub doUnpairedUrl($$$$$$) {
 		}
 	}
 	counter("Short read preprocessor,Unpaired reads,$unpaired");
+	$unpaired = 0;
 	close($fh);
 	close($of);
 	flushDelayedCounters("Short read preprocessor");
@@ -477,6 +550,14 @@ sub doPairedUrl($$$$$$$$) {
 	if(defined($lab)) {
 		$lab =~ /[:\s]/ && die "Label may not contain a colon or whitespace character; was \"$lab\"\n";
 	}
+	if($readprep ne "") {
+		my $n = runReadprep([$fn1, $fn2], $lab, $sam, $color, $env);
+		$rtot += 2 * $n;
+		$totpaired += $n;
+		system("rm -f $fn1 $origFn1 >&2") unless $keep;
+		system("rm -f $fn2 $origFn2 >&2") unless $keep;
+		return;
+	}
 	
 	# turn FASTQ pairs into tuples
 	my ($fh1, $fh2);
@@ -526,6 +607,7 @@ sub doPairedUrl($$$$$$$$) {
 		}
 	}
 	counter("Short read preprocessor,Paired reads,$paired");
+	$paired = 0;
 	close($fh1);
 	close($fh2);
 	close($of);
@@ -37,6 +37,7 @@ my $maxFiles = 40;
 my $force = 0;
 my $keep = 0;
 my $externalSort = 0;
+my $binsort = "$Bin/soapsnp/binsort";
 my $verbose = 0;
 my $VERSION = `cat $Bin/VERSION`; $VERSION =~ s/\s//g;
 
@@ -96,6 +97,7 @@ GetOptions (
 	"bin-fields:i"      => \$binFields,
 	"sort-fields:i"     => \$sortFields,
 	"external-sort"     => \$externalSort,
+	"binsort:s"         => \$binsort,
 	"S:i"               => \$sortSize,
 	"size:i"            => \$sortSize,
 	"max-sort-records:i"=> \$maxRecords,
@@ -169,6 +171,18 @@ if(defined($cntfn) && $cntfn ne "") {
 my $cmd = join(" ", @ARGV);
 msg("Command:\n$cmd");
 
+# Use the native binner/sorter unless it's missing, disabled with
+# --binsort= or some input is bzip2-compressed
+my @infiles = ();
+for my $dir (split(/,/, $input)) {
+	$dir = abs_path($dir);
+	-d $dir || mydie("No such input directory as \"$dir\"", 100);
+	push @infiles, <$dir/*>;
+}
+$binsort = "" unless $binsort ne "" && -x $binsort;
+$binsort = "" if grep { /\.bz2$/ } @infiles;
+msg("Binning and sorting with ".($binsort ne "" ? $binsort : "Perl"));
+
 ########################################
 # Stage 1. Partition bins into tasks
 ########################################
@@ -190,134 +204,142 @@ $pm->run_on_finish(
 	}
 );
 
-##
-# Count size of bins in each input file in parallel.
-#
-msg("Calculating per-input bin counts in parallel");
-my $ninfiles = 0;
-for my $dir (split(/,/, $input)) {
-	$dir = abs_path($dir);
-	-d $dir || mydie("No such input directory as \"$dir\"", 100);
-	my @fs = <$dir/*>;
-	$ninfiles += scalar(@fs);
-}
-my $fi = 0;
-for my $dir (split(/,/, $input)) {
-	$dir = abs_path($dir);
-	-d $dir || mydie("No such input directory as \"$dir\"", 110);
-	for my $f (<$dir/*>) {
-		$fi++;
-		$pm->start and next;
-		msg("Pid $$ processing input $f [$fi of $ninfiles]...");
-		my %binSizes = ();
-		if($f =~ /\.gz$/) {
-			open(F, "gzip -dc $f |") || mydie("Could not open gz file \"$f\" for reading", 120);
-		} elsif($f =~ /\.bz2$/) {
-			open(F, "bzip2 -dc $f |") || mydie("Could not open bzip2 file \"$f\" for reading", 130);
-		} else {
-			open(F, "$f") || mydie("Could not open \"$f\" for reading", 140);
+my $ninfiles = scalar(@infiles);
+my $nonemptyTasks = 0;
+my %binPids = ();
+if($binsort ne "") {
+	##
+	# Bin, partition and sort every task in one pass; the sorted tasks
+	# land in $taskDir/task-NNNNN and are moved into place by each child.
+	#
+	my $sortMb = int($sortSize * $nred / 1024);
+	my $files = join(' ', @infiles);
+	my $bcmd = "$binsort -o $taskDir -b $binFields -s $sortFields -n $ntasks -t $nred -m $sortMb -T $intermediate $files";
+	msg("Running: $bcmd") if $verbose;
+	system("$bcmd 2>&1") == 0 || mydie("binsort command: '$bcmd' failed", 335);
+	my @tfs = <$taskDir/task-*>;
+	$nonemptyTasks = scalar(@tfs);
+} else {
+	##
+	# Count size of bins in each input file in parallel.
+	#
+	msg("Calculating per-input bin counts in parallel");
+	my $fi = 0;
+	for my $dir (split(/,/, $input)) {
+		$dir = abs_path($dir);
+		-d $dir || mydie("No such input directory as \"$dir\"", 110);
+		for my $f (<$dir/*>) {
+			$fi++;
+			$pm->start and next;
+			msg("Pid $$ processing input $f [$fi of $ninfiles]...");
+			my %binSizes = ();
+			if($f =~ /\.gz$/) {
+				open(F, "gzip -dc $f |") || mydie("Could not open gz file \"$f\" for reading", 120);
+			} elsif($f =~ /\.bz2$/) {
+				open(F, "bzip2 -dc $f |") || mydie("Could not open bzip2 file \"$f\" for reading", 130);
+			} else {
+				open(F, "$f") || mydie("Could not open \"$f\" for reading", 140);
+			}
+			while(<F>) {
+				chomp;
+				my @s = split(/\t/);
+				my $joined = join("\t", @s[0..min($binFields-1, $#s)]);
+				scalar(@s) >= $sortFields || $joined eq "FAKE" || mydie("$sortFields sort fields, but line doesn't have that many:\n$_", 150);
+				my $k = $joined;
+				$binSizes{$k}++;
+			}
+			my $ofn = sprintf "$binSizeDir/sizes-%05d", $$;
+			open (COUT, ">$ofn") || mydie("Could not open \"$ofn\" for writing", 160);
+			for my $k (keys %binSizes) {
+				print COUT "$k\t$binSizes{$k}\n";
+			}
+			close(COUT);
+			$pm->finish;
 		}
+	}
+	$pm->wait_all_children;
+
+	##
+	# Sum all per-input sizes
+	#
+	msg("Summing per-input counts");
+	my %binSizes = ();
+	for my $f (<$binSizeDir/*>) {
+		open (F, $f) || mydie("Could not open \"$f\" for reading", 170);
 		while(<F>) {
 			chomp;
-			my @s = split(/\t/);
-			my $joined = join("\t", @s[0..min($binFields-1, $#s)]);
-			scalar(@s) >= $sortFields || $joined eq "FAKE" || mydie("$sortFields sort fields, but line doesn't have that many:\n$_", 150);
-			my $k = $joined;
-			$binSizes{$k}++;
-		}
-		my $ofn = sprintf "$binSizeDir/sizes-%05d", $$;
-		open (COUT, ">$ofn") || mydie("Could not open \"$ofn\" for writing", 160);
-		for my $k (keys %binSizes) {
-			print COUT "$k\t$binSizes{$k}\n";
+			my @s = split /\t/;
+			scalar(@s) >= 2 ||
+				mydie("Too few fields in subtotal line in $f:\n$_", 180);
+			my $k = join("\t", @s[0..($#s-1)]);
+			$s[-1] == int($s[-1]) ||
+				mydie("Malformed subtotal line in $f; final field isn't integer:\n$s[-1]", 190);
+			$binSizes{$k} += $s[-1];
 		}
-		close(COUT);
-		$pm->finish;
-	}
-}
-$pm->wait_all_children;
-
-##
-# Sum all per-input sizes
-#
-msg("Summing per-input counts");
-my %binSizes = ();
-for my $f (<$binSizeDir/*>) {
-	open (F, $f) || mydie("Could not open \"$f\" for reading", 170);
-	while(<F>) {
-		chomp;
-		my @s = split /\t/;
-		scalar(@s) >= 2 ||
-			mydie("Too few fields in subtotal line in $f:\n$_", 180);
-		my $k = join("\t", @s[0..($#s-1)]);
-		$s[-1] == int($s[-1]) ||
-			mydie("Malformed subtotal line in $f; final field isn't integer:\n$s[-1]", 190);
-		$binSizes{$k} += $s[-1];
+		close(F);
 	}
-	close(F);
-}
 
-##
-# In one pass, allocate every bin to a task.  Greedily allocate each
-# bin to the task with the fewest records in it.
-#
-msg("Factoring input into $ntasks tasks");
-my %tasks = ();
-my $nonemptyTasks = 0;
-my @taskSzs = (0) x $ntasks;
-for my $k (sort { $binSizes{$b} <=> $binSizes{$a} } keys %binSizes) {
-	my $min = -1;
-	for(my $i = 0; $i <= $#taskSzs; $i++) {
-		if($taskSzs[$i] < $min || $min == -1) {
-			$min = $taskSzs[$i];
-			$tasks{$k} = $i;
+	##
+	# In one pass, allocate every bin to a task.  Greedily allocate each
+	# bin to the task with the fewest records in it.
+	#
+	msg("Factoring input into $ntasks tasks");
+	my %tasks = ();
+	my @taskSzs = (0) x $ntasks;
+	for my $k (sort { $binSizes{$b} <=> $binSizes{$a} } keys %binSizes) {
+		my $min = -1;
+		for(my $i = 0; $i <= $#taskSzs; $i++) {
+			if($taskSzs[$i] < $min || $min == -1) {
+				$min = $taskSzs[$i];
+				$tasks{$k} = $i;
+			}
 		}
+		defined($tasks{$k}) || mydie("Couldn't map key \"$k\" to a task; sizes: @taskSzs", 200);
+		$nonemptyTasks++ if $taskSzs[$tasks{$k}] == 0;
+		$taskSzs[$tasks{$k}] += $binSizes{$k};
 	}
-	defined($tasks{$k}) || mydie("Couldn't map key \"$k\" to a task; sizes: @taskSzs", 200);
-	$nonemptyTasks++ if $taskSzs[$tasks{$k}] == 0;
-	$taskSzs[$tasks{$k}] += $binSizes{$k};
-}
 
-# Allocate and write bins
-$fi = 0;
-my %binPids = ();
-for my $dir (split(/,/, $input)) {
-	$dir = abs_path($dir);
-	-d $dir || mydie("No such input directory as \"$dir\"", 210);
-	for my $f (<$dir/*>) {
-		$fi++;
-		my $pid = $pm->start;
-		$binPids{$pid} = 1;
-		next if $pid;
-		msg("Pid $$ processing input $f [$fi of $ninfiles]...");
-		mkpath("$taskDir/$$");
-		for(my $i = 0; $i < $ntasks; $i++) {
-			my $nfn = sprintf "task-%05d", $i;
-			push @taskFns, "$taskDir/$$/$nfn";
-			my $cmd2 = ">$taskFns[-1]";
-			push @taskFhs, undef;
-			open ($taskFhs[-1], $cmd2) || mydie("Could not open pipe for writing: \"$cmd2\"", 220);
-		}
-		if($f =~ /\.gz$/) {
-			open(F, "gzip -dc $f |") || mydie("Could not open gz file \"$f\" for reading", 230);
-		} elsif($f =~ /\.bz2$/) {
-			open(F, "bzip2 -dc $f |") || mydie("Could not open bzip2 file \"$f\" for reading", 240);
-		} else {
-			open(F, "$f") || mydie("Could not open \"$f\" for reading", 250);
-		}
-		while(<F>) {
-			chomp;
-			my @s = split(/\t/);
-			my $k = join("\t", @s[0..min($binFields-1, $#s)]);
-			defined($tasks{$k}) || mydie("Bin \"$k\" wasn't assigned a task!", 260);
-			print {$taskFhs[$tasks{$k}]} "$_\n";
+	# Allocate and write bins
+	$fi = 0;
+	for my $dir (split(/,/, $input)) {
+		$dir = abs_path($dir);
+		-d $dir || mydie("No such input directory as \"$dir\"", 210);
+		for my $f (<$dir/*>) {
+			$fi++;
+			my $pid = $pm->start;
+			$binPids{$pid} = 1;
+			next if $pid;
+			msg("Pid $$ processing input $f [$fi of $ninfiles]...");
+			mkpath("$taskDir/$$");
+			for(my $i = 0; $i < $ntasks; $i++) {
+				my $nfn = sprintf "task-%05d", $i;
+				push @taskFns, "$taskDir/$$/$nfn";
+				my $cmd2 = ">$taskFns[-1]";
+				push @taskFhs, undef;
+				open ($taskFhs[-1], $cmd2) || mydie("Could not open pipe for writing: \"$cmd2\"", 220);
+			}
+			if($f =~ /\.gz$/) {
+				open(F, "gzip -dc $f |") || mydie("Could not open gz file \"$f\" for reading", 230);
+			} elsif($f =~ /\.bz2$/) {
+				open(F, "bzip2 -dc $f |") || mydie("Could not open bzip2 file \"$f\" for reading", 240);
+			} else {
+				open(F, "$f") || mydie("Could not open \"$f\" for reading", 250);
+			}
+			while(<F>) {
+				chomp;
+				my @s = split(/\t/);
+				my $k = join("\t", @s[0..min($binFields-1, $#s)]);
+				defined($tasks{$k}) || mydie("Bin \"$k\" wasn't assigned a task!", 260);
+				print {$taskFhs[$tasks{$k}]} "$_\n";
+			}
+			close(F);
+			# Close task pipes.
+			for(my $i = 0; $i < $ntasks; $i++) { close($taskFhs[$i]); }
+			$pm->finish;
 		}
-		close(F);
-		# Close task pipes.
-		for(my $i = 0; $i < $ntasks; $i++) { close($taskFhs[$i]); }
-		$pm->finish;
 	}
+	$pm->wait_all_children;
 }
-$pm->wait_all_children;
 msg("Factored $ninfiles files into $nonemptyTasks non-empty tasks");
 
 ########################################
@@ -427,8 +449,14 @@ for(my $i = 0; $i < $nonemptyTasks; $i++) {
 	chdir($wd) || mydie("Could not change to working directory $wd", 320);
 	my $cmd;
 	#if($nonemptyTasks > 0) {
-		msg("Pid $$ sorting task $nfn [".($i+1)." of ".max($nonemptyTasks, 1)."]...");
-		doSort($i, $nonemptyTasks, $externalSort);
+		if($binsort ne "") {
+			my $tfn = "$taskDir/$nfn";
+			my $sfn = sprintf "$sortedTaskDir/stask-%05d", $$;
+			rename($tfn, $sfn) || mydie("Could not move sorted task $tfn to $sfn", 283);
+		} else {
+			msg("Pid $$ sorting task $nfn [".($i+1)." of ".max($nonemptyTasks, 1)."]...");
+			doSort($i, $nonemptyTasks, $externalSort);
+		}
 	#} else {
 	#	# Make dummy input file
 	#	my $sfn = sprintf "$sortedTaskDir/stask-%05d", $$;
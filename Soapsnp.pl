@@ -166,31 +166,6 @@ sub lookAtFile() {
 	print STDERR `ls -l $snpdir/chr$lchr.snps`;
 }
 
-##
-# Flush quality range counters.
-#
-my %qualCnts = ();
-my $qualCntsToFlush = 0;
-sub flushQualCounters() {
-	for my $qual (keys %qualCnts) {
-		counter("SOAPsnp,Occurrences of quality value [".($qual*10).":".($qual*10+10).") in wrapper,$qualCnts{$qual}");
-		$qualCnts{$qual} = 0;
-	}
-	$qualCntsToFlush = 0;
-}
-
-##
-# Argument is a quality string.  Update counters.
-#
-sub processQuals($) {
-	for(my $i = 0; $i < length($_[0]); $i++) {
-		my $q = ord(substr($_[0], $i, 1))-33;
-		$qualCnts{int($q/10)}++;
-		$qualCntsToFlush++;
-	}
-	flushQualCounters() if $qualCntsToFlush > 10000;
-}
-
 my $maxlen = 1; # per-partition maximum read length
 open TMP, ">.tmp.$plen.0" || die;
 my $jarEnsured = 0;
@@ -206,11 +181,11 @@ while(1) {
 	my $parti;
 	my $lmaxlen = $maxlen;
 	if(defined($line)) {
-		# Parse chromosome and partition for this alignment
-		my @s = split(/[\t]/, $line);
+		# Parse chromosome, partition and read length for this
+		# alignment; soapsnp tallies the qualities itself (-H)
+		my @s = split(/[\t]/, $line, 6);
 		($chromo, $parti) = ($s[0], $s[1]);
 		my $len = length($s[4]);
-		processQuals($s[5]);
 		if($parti != $lpart || $chromo != $lchr) {
 			# New partition so start a separate tally
 			$maxlen = $len;
@@ -392,5 +367,4 @@ while(1) {
 counter("SOAPsnp,0-range invocations,1") if $ranges == 0;
 counter("SOAPsnp,0-alignment invocations,1") if $alstot == 0;
 close(TMP);
-flushQualCounters();
 flushCounters() if scalar(@counterUpdates) > 0;
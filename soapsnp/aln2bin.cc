@@ -0,0 +1,84 @@
+/*
+ * aln2bin.cc
+ *
+ *  Convert sorted SOAP or Crossbow text alignments to soapsnp's compact
+ *  binary alignment format (see Binary_format in soap_snp.h).  Record
+ *  order is preserved.
+ */
+
+#include "soap_snp.h"
+#include <getopt.h>
+
+using namespace std;
+
+unsigned long alignments_read = 0;
+unsigned long alignments_read_unique = 0;
+unsigned long alignments_read_unpaired = 0;
+unsigned long alignments_read_paired = 0;
+
+int usage() {
+	cerr<<"aln2bin: convert SOAP/Crossbow alignments to soapsnp binary format"<<endl;
+	cerr<<"Usage: aln2bin [-c] [-i <FILE>] [-o <FILE>]"<<endl;
+	cerr<<"-i <FILE> Input alignments, possibly compressed [stdin]"<<endl;
+	cerr<<"-o <FILE> Output binary alignments [stdout]"<<endl;
+	cerr<<"-c Input is in Crossbow format [Off]"<<endl;
+	cerr<<"-h Display this help"<<endl;
+	exit(1);
+	return 0;
+}
+
+/// Returns the number of alignments converted
+template<typename T>
+static unsigned long convert(Aln_istream & in, ostream & out) {
+	T aln;
+	std::string last_chr;
+	unsigned long n = 0;
+	out.write(BINARY_ALN_MAGIC, 4);
+	while(read_aln(in, aln)) {
+		write_binary_aln(out, aln, last_chr);
+		n++;
+	}
+	return n;
+}
+
+int main(int argc, char **argv) {
+	int c;
+	bool crossbow = false;
+	string in_name = "/dev/stdin", out_name;
+	while((c = getopt(argc, argv, "ci:o:h")) != -1) {
+		switch(c) {
+			case 'c': crossbow = true; break;
+			case 'i': in_name = optarg; break;
+			case 'o': out_name = optarg; break;
+			case 'h': usage(); break;
+			default: usage();
+		}
+	}
+	Aln_istream in(in_name.c_str());
+	if(!in) {
+		cerr << "No such file or directory:" << in_name << endl;
+		exit(1);
+	}
+	ofstream out_file;
+	if(!out_name.empty()) {
+		out_file.open(out_name.c_str(), ios::binary);
+		if(!out_file) {
+			cerr << "Cannot creat file:" << out_name << endl;
+			exit(1);
+		}
+	}
+	ostream & out = out_name.empty() ? cout : out_file;
+	unsigned long converted;
+	if(crossbow) {
+		converted = convert<Crossbow_format>(in, out);
+	} else {
+		converted = convert<Soap_format>(in, out);
+	}
+	out.flush();
+	if(!out.good()) {
+		cerr << "Error writing binary alignments" << endl;
+		exit(255);
+	}
+	cerr << "Converted " << converted << " alignments" << endl;
+	return 0;
+}
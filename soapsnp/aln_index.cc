@@ -0,0 +1,97 @@
+#include "soap_snp.h"
+#include <algorithm>
+
+/**
+ * Record the offset of the first alignment seen in each bucket.  Later
+ * alignments in a bucket that's already indexed are ignored.
+ */
+void Aln_index::add(const std::string & chr, int pos, long long off) {
+	std::vector<std::pair<int, long long> > & b = buckets[chr];
+	if(b.empty() && (chr_order.empty() || chr_order.back() != chr)) {
+		chr_order.push_back(chr);
+	}
+	int bucket = pos / BUCKET;
+	if(b.empty() || b.back().first < bucket) {
+		b.push_back(make_pair(bucket, off));
+	}
+	last_chr = chr;
+	last_bucket = b.back().first;
+}
+
+void Aln_index::append(const Aln_index & other, long long base) {
+	for(size_t i = 0; i != other.chr_order.size(); i++) {
+		const std::vector<std::pair<int, long long> > & b = other.buckets.find(other.chr_order[i])->second;
+		for(size_t j = 0; j != b.size(); j++) {
+			add(other.chr_order[i], b[j].first * BUCKET, base + b[j].second);
+		}
+	}
+}
+
+long long Aln_index::lookup(const std::string & chr, int pos) const {
+	std::map<std::string, std::vector<std::pair<int, long long> > >::const_iterator it = buckets.find(chr);
+	if(it == buckets.end()) {
+		return -1;
+	}
+	const std::vector<std::pair<int, long long> > & b = it->second;
+	// First non-empty bucket at or after pos's
+	std::vector<std::pair<int, long long> >::const_iterator lb =
+		lower_bound(b.begin(), b.end(), make_pair((pos < 0 ? 0 : pos) / BUCKET, -1LL));
+	return lb == b.end() ? -1 : lb->second;
+}
+
+bool Aln_index::load(const std::string & fn) {
+	ifstream in(fn.c_str());
+	if(!in) {
+		return false;
+	}
+	std::string line;
+	const std::string head = "#SOAPsnp " + title + " index\t";
+	if(!getline(in, line) || line.compare(0, head.size(), head) != 0) {
+		cerr << fn << " is not a soapsnp " << title << " index" << endl;
+		return false;
+	}
+	std::istringstream h(line.substr(head.size()));
+	int bucket_size;
+	if(!(h >> bucket_size >> file_size) || bucket_size != BUCKET) {
+		cerr << fn << " has an unsupported bucket size" << endl;
+		return false;
+	}
+	chr_order.clear();
+	buckets.clear();
+	last_chr.clear();
+	last_bucket = -1;
+	std::string chr;
+	int bucket;
+	long long off;
+	while(getline(in, line)) {
+		std::istringstream s(line);
+		if(!(s >> chr >> bucket >> off)) {
+			cerr << "Wrong format in " << title << " index " << fn << endl;
+			return false;
+		}
+		std::vector<std::pair<int, long long> > & b = buckets[chr];
+		if(b.empty()) {
+			chr_order.push_back(chr);
+		}
+		b.push_back(make_pair(bucket, off));
+		last_chr = chr;
+		last_bucket = bucket;
+	}
+	return true;
+}
+
+bool Aln_index::write(const std::string & fn) const {
+	ofstream out(fn.c_str());
+	if(!out) {
+		return false;
+	}
+	out << "#SOAPsnp " << title << " index\t" << BUCKET << '\t' << file_size << '\n';
+	for(size_t i = 0; i != chr_order.size(); i++) {
+		const std::vector<std::pair<int, long long> > & b = buckets.find(chr_order[i])->second;
+		for(size_t j = 0; j != b.size(); j++) {
+			out << chr_order[i] << '\t' << b[j].first << '\t' << b[j].second << '\n';
+		}
+	}
+	out.close();
+	return !out.fail();
+}
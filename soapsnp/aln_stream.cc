@@ -0,0 +1,528 @@
+/*
+ * aln_stream.cc
+ *
+ *  Background reader/decompressor behind Aln_istream.
+ */
+
+#include "aln_stream.h"
+#include <iostream>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <zlib.h>
+#ifdef WITH_ZSTD
+#include <zstd.h>
+#endif
+#ifdef WITH_BZIP2
+#include <bzlib.h>
+#endif
+
+using namespace std;
+
+static const size_t IN_BUF_SIZE = 1024 * 1024;
+
+int Bg_read_buf::bgzf_threads = 0;
+
+Bg_read_buf::Bg_read_buf(const char * fn, bool read_ahead) :
+	name(fn), fd(-1), comp(PLAIN_INPUT), codec(NULL), threads(1), read_ahead(read_ahead),
+	in_buf(NULL), in_len(0), in_off(0), in_eof(false), mid_stream(false),
+	cur(0), consumed(0), started(false), at_eof(false), stop(false)
+{
+	for(size_t i = 0; i != NUM_BUFS; i++) {
+		bufs[i] = NULL;
+		lens[i] = 0;
+		full[i] = false;
+	}
+	pthread_mutex_init(&lock, NULL);
+	pthread_cond_init(&cond_full, NULL);
+	pthread_cond_init(&cond_empty, NULL);
+	fd = open(fn, O_RDONLY);
+	if(fd < 0) {
+		return;
+	}
+	in_buf = new char[IN_BUF_SIZE];
+	// Sniff the magic bytes; they stay in in_buf to be decoded
+	in_len = read_raw(in_buf, read_ahead ? IN_BUF_SIZE : PROBE_BUF_SIZE);
+	const unsigned char * m = (const unsigned char *)in_buf;
+	if(in_len >= 16 && m[0] == 0x1f && m[1] == 0x8b && (m[3] & 4) != 0 &&
+	   m[12] == 'B' && m[13] == 'C' && m[14] == 2 && m[15] == 0)
+	{
+		// BGZF: independent gzip members of known size, which can be
+		// inflated in parallel
+		comp = BGZF_INPUT;
+		threads = read_ahead ? bgzf_threads : 1;
+		if(threads <= 0) {
+			long cores = sysconf(_SC_NPROCESSORS_ONLN);
+			threads = (cores < 1) ? 1 : (cores > 4 ? 4 : (int)cores);
+		}
+	} else if(in_len >= 2 && m[0] == 0x1f && m[1] == 0x8b) {
+		comp = GZIP_INPUT;
+		z_stream * z = new z_stream;
+		memset(z, 0, sizeof(z_stream));
+		// 15+32: accept gzip or zlib headers
+		if(inflateInit2(z, 15 + 32) != Z_OK) {
+			cerr << "Could not initialize zlib for " << name << endl;
+			exit(255);
+		}
+		codec = z;
+	} else if(in_len >= 4 && m[0] == 0x28 && m[1] == 0xb5 && m[2] == 0x2f && m[3] == 0xfd) {
+		comp = ZSTD_INPUT;
+#ifdef WITH_ZSTD
+		ZSTD_DStream * zs = ZSTD_createDStream();
+		ZSTD_initDStream(zs);
+		codec = zs;
+#else
+		cerr << name << " is zstd-compressed, but soapsnp was built without zstd support; rebuild with WITH_ZSTD=1" << endl;
+		exit(255);
+#endif
+	} else if(in_len >= 4 && m[0] == 'B' && m[1] == 'Z' && m[2] == 'h' && m[3] >= '1' && m[3] <= '9') {
+		comp = BZIP2_INPUT;
+#ifdef WITH_BZIP2
+		bz_stream * bz = new bz_stream;
+		memset(bz, 0, sizeof(bz_stream));
+		if(BZ2_bzDecompressInit(bz, 0, 0) != BZ_OK) {
+			cerr << "Could not initialize bzip2 for " << name << endl;
+			exit(255);
+		}
+		codec = bz;
+#else
+		cerr << name << " is bzip2-compressed, but soapsnp was built without bzip2 support; rebuild with WITH_BZIP2=1" << endl;
+		exit(255);
+#endif
+	}
+	if(!read_ahead) {
+		bufs[0] = new char[PROBE_BUF_SIZE];
+		return;
+	}
+	for(size_t i = 0; i != NUM_BUFS; i++) {
+		bufs[i] = new char[BUF_SIZE];
+	}
+	start_reader();
+}
+
+Bg_read_buf::~Bg_read_buf() {
+	stop_reader();
+	if(comp == GZIP_INPUT && codec != NULL) {
+		inflateEnd((z_stream *)codec);
+		delete (z_stream *)codec;
+	}
+#ifdef WITH_ZSTD
+	if(comp == ZSTD_INPUT && codec != NULL) {
+		ZSTD_freeDStream((ZSTD_DStream *)codec);
+	}
+#endif
+#ifdef WITH_BZIP2
+	if(comp == BZIP2_INPUT && codec != NULL) {
+		BZ2_bzDecompressEnd((bz_stream *)codec);
+		delete (bz_stream *)codec;
+	}
+#endif
+	for(size_t i = 0; i != NUM_BUFS; i++) {
+		delete [] bufs[i];
+	}
+	delete [] in_buf;
+	if(fd >= 0) {
+		close(fd);
+	}
+	pthread_cond_destroy(&cond_empty);
+	pthread_cond_destroy(&cond_full);
+	pthread_mutex_destroy(&lock);
+}
+
+void Bg_read_buf::start_reader() {
+	stop = false;
+	if(pthread_create(&thread, NULL, Bg_read_buf::run, this) != 0) {
+		cerr << "Could not start reader thread for " << name << endl;
+		exit(255);
+	}
+	started = true;
+}
+
+void Bg_read_buf::stop_reader() {
+	if(started) {
+		pthread_mutex_lock(&lock);
+		stop = true;
+		pthread_cond_broadcast(&cond_empty);
+		pthread_mutex_unlock(&lock);
+		pthread_join(thread, NULL);
+		started = false;
+	}
+}
+
+void * Bg_read_buf::run(void * self) {
+	((Bg_read_buf *)self)->produce();
+	return NULL;
+}
+
+/**
+ * Reader thread: fill the ring one buffer at a time, waiting whenever
+ * the consumer falls behind.  A zero-length buffer marks end of input
+ * (or an error, if err is set).
+ */
+void Bg_read_buf::produce() {
+	size_t wr = 0;
+	while(true) {
+		pthread_mutex_lock(&lock);
+		while(full[wr] && !stop) {
+			pthread_cond_wait(&cond_empty, &lock);
+		}
+		if(stop) {
+			pthread_mutex_unlock(&lock);
+			return;
+		}
+		pthread_mutex_unlock(&lock);
+		size_t n = err.empty() ? fill(bufs[wr], BUF_SIZE) : 0;
+		pthread_mutex_lock(&lock);
+		lens[wr] = n;
+		full[wr] = true;
+		pthread_cond_signal(&cond_full);
+		pthread_mutex_unlock(&lock);
+		if(n == 0) {
+			return;
+		}
+		wr = (wr + 1) % NUM_BUFS;
+	}
+}
+
+void Bg_read_buf::fail(const std::string & msg) {
+	err = name + ": " + msg;
+}
+
+/// Read up to cap bytes from the file, retrying short reads
+size_t Bg_read_buf::read_raw(char * out, size_t cap) {
+	size_t got = 0;
+	while(got < cap) {
+		ssize_t r = read(fd, out + got, cap - got);
+		if(r < 0) {
+			fail("read error");
+			break;
+		}
+		if(r == 0) {
+			in_eof = true;
+			break;
+		}
+		got += r;
+	}
+	return got;
+}
+
+/**
+ * Produce up to cap bytes of decoded text into out.  Returns 0 only at
+ * end of input or on error.
+ */
+size_t Bg_read_buf::fill(char * out, size_t cap) {
+	if(comp == PLAIN_INPUT) {
+		// Hand over whatever is left from sniffing first
+		if(in_off < in_len) {
+			size_t n = in_len - in_off;
+			if(n > cap) n = cap;
+			memcpy(out, in_buf + in_off, n);
+			in_off += n;
+			return n;
+		}
+		return in_eof ? 0 : read_raw(out, cap);
+	}
+	if(comp == BGZF_INPUT) {
+		return fill_bgzf(out, cap);
+	}
+	size_t produced = 0;
+	while(produced < cap) {
+		if(in_off == in_len) {
+			if(in_eof) break;
+			in_len = read_raw(in_buf, IN_BUF_SIZE);
+			in_off = 0;
+			if(in_len == 0) break;
+		}
+		if(comp == GZIP_INPUT) {
+			z_stream * z = (z_stream *)codec;
+			z->next_in = (Bytef *)(in_buf + in_off);
+			z->avail_in = (uInt)(in_len - in_off);
+			z->next_out = (Bytef *)(out + produced);
+			z->avail_out = (uInt)(cap - produced);
+			int ret = inflate(z, Z_NO_FLUSH);
+			in_off = in_len - z->avail_in;
+			produced = cap - z->avail_out;
+			if(ret == Z_STREAM_END) {
+				// Concatenated members (e.g. BGZF); keep going
+				inflateReset(z);
+				mid_stream = false;
+			} else if(ret != Z_OK && ret != Z_BUF_ERROR) {
+				fail("gzip data error");
+				break;
+			} else {
+				mid_stream = true;
+			}
+		}
+#ifdef WITH_BZIP2
+		else if(comp == BZIP2_INPUT) {
+			bz_stream * bz = (bz_stream *)codec;
+			bz->next_in = in_buf + in_off;
+			bz->avail_in = (unsigned int)(in_len - in_off);
+			bz->next_out = out + produced;
+			bz->avail_out = (unsigned int)(cap - produced);
+			int ret = BZ2_bzDecompress(bz);
+			in_off = in_len - bz->avail_in;
+			produced = cap - bz->avail_out;
+			if(ret == BZ_STREAM_END) {
+				// Concatenated streams (e.g. from pbzip2); keep going
+				BZ2_bzDecompressEnd(bz);
+				memset(bz, 0, sizeof(bz_stream));
+				BZ2_bzDecompressInit(bz, 0, 0);
+				mid_stream = false;
+			} else if(ret != BZ_OK) {
+				fail("bzip2 data error");
+				break;
+			} else {
+				mid_stream = true;
+			}
+		}
+#endif
+#ifdef WITH_ZSTD
+		else {
+			ZSTD_inBuffer zin = { in_buf, in_len, in_off };
+			ZSTD_outBuffer zout = { out, cap, produced };
+			size_t ret = ZSTD_decompressStream((ZSTD_DStream *)codec, &zout, &zin);
+			if(ZSTD_isError(ret)) {
+				fail(std::string("zstd data error: ") + ZSTD_getErrorName(ret));
+				break;
+			}
+			in_off = zin.pos;
+			produced = zout.pos;
+			mid_stream = (ret != 0);
+		}
+#endif
+	}
+	if(produced == 0 && mid_stream && err.empty()) {
+		fail("compressed input is truncated");
+	}
+	return produced;
+}
+
+namespace {
+
+struct Bgzf_block {
+	const unsigned char * data; // raw deflate data
+	size_t clen;
+	char * out;
+	size_t ulen;
+	unsigned long crc;
+	bool ok;
+};
+
+struct Bgzf_job {
+	std::vector<Bgzf_block> * blocks;
+	size_t first, step;
+};
+
+static inline size_t le16(const unsigned char * p) {
+	return p[0] | (p[1] << 8);
+}
+
+static inline unsigned long le32(const unsigned char * p) {
+	return (unsigned long)p[0] | ((unsigned long)p[1] << 8) |
+	       ((unsigned long)p[2] << 16) | ((unsigned long)p[3] << 24);
+}
+
+/// Inflate every step'th block of a batch, starting at first
+static void * inflate_blocks(void * arg) {
+	Bgzf_job * job = (Bgzf_job *)arg;
+	std::vector<Bgzf_block> & blocks = *job->blocks;
+	z_stream z;
+	memset(&z, 0, sizeof(z));
+	bool init = (inflateInit2(&z, -15) == Z_OK);
+	for(size_t i = job->first; i < blocks.size(); i += job->step) {
+		Bgzf_block & b = blocks[i];
+		if(!init) {
+			b.ok = false;
+			continue;
+		}
+		inflateReset(&z);
+		z.next_in = (Bytef *)b.data;
+		z.avail_in = (uInt)b.clen;
+		z.next_out = (Bytef *)b.out;
+		z.avail_out = (uInt)b.ulen;
+		int ret = inflate(&z, Z_FINISH);
+		b.ok = (ret == Z_STREAM_END && z.avail_out == 0 &&
+		        crc32(0L, (const Bytef *)b.out, (uInt)b.ulen) == b.crc);
+	}
+	if(init) {
+		inflateEnd(&z);
+	}
+	return NULL;
+}
+
+}
+
+/**
+ * BGZF flavour of fill(): cut as many whole blocks out of the
+ * compressed buffer as fit in cap (each block's header and footer give
+ * its compressed and inflated sizes), then inflate them on several
+ * threads straight into place.
+ */
+size_t Bg_read_buf::fill_bgzf(char * out, size_t cap) {
+	std::vector<Bgzf_block> blocks;
+	size_t produced = 0;
+	while(produced == 0) {
+		// Top up the compressed buffer so one batch can take many blocks
+		if(!in_eof && in_len - in_off < IN_BUF_SIZE / 2) {
+			memmove(in_buf, in_buf + in_off, in_len - in_off);
+			in_len -= in_off;
+			in_off = 0;
+			in_len += read_raw(in_buf + in_len, IN_BUF_SIZE - in_len);
+		}
+		blocks.clear();
+		while(true) {
+			size_t avail = in_len - in_off;
+			const unsigned char * h = (const unsigned char *)in_buf + in_off;
+			if(avail < 18) break;
+			size_t xlen = le16(h + 10);
+			if(h[0] != 0x1f || h[1] != 0x8b || h[2] != 8 || (h[3] & 4) == 0 ||
+			   h[12] != 'B' || h[13] != 'C' || le16(h + 14) != 2)
+			{
+				fail("gzip member is not a BGZF block");
+				return 0;
+			}
+			size_t bsize = le16(h + 16) + 1;
+			if(bsize < 12 + xlen + 8) {
+				fail("corrupt BGZF block header");
+				return 0;
+			}
+			if(avail < bsize) break;
+			size_t isize = le32(h + bsize - 4);
+			if(produced + isize > cap) break;
+			Bgzf_block b;
+			b.data = h + 12 + xlen;
+			b.clen = bsize - 12 - xlen - 8;
+			b.out = out + produced;
+			b.ulen = isize;
+			b.crc = le32(h + bsize - 8);
+			b.ok = false;
+			blocks.push_back(b);
+			produced += isize;
+			in_off += bsize;
+		}
+		if(blocks.empty()) {
+			if(in_off < in_len && in_eof) {
+				fail("compressed input is truncated");
+			}
+			return 0;
+		}
+	}
+	size_t nthreads = (size_t)threads < blocks.size() ? (size_t)threads : blocks.size();
+	std::vector<Bgzf_job> jobs(nthreads);
+	std::vector<pthread_t> tids(nthreads);
+	for(size_t t = 0; t != nthreads; t++) {
+		jobs[t].blocks = &blocks;
+		jobs[t].first = t;
+		jobs[t].step = nthreads;
+	}
+	// Job 0 runs on this (the reader) thread
+	size_t spawned = 1;
+	for(; spawned < nthreads; spawned++) {
+		if(pthread_create(&tids[spawned], NULL, inflate_blocks, &jobs[spawned]) != 0) {
+			break;
+		}
+	}
+	for(size_t t = spawned; t < nthreads; t++) {
+		inflate_blocks(&jobs[t]);
+	}
+	inflate_blocks(&jobs[0]);
+	for(size_t t = 1; t < spawned; t++) {
+		pthread_join(tids[t], NULL);
+	}
+	for(size_t i = 0; i != blocks.size(); i++) {
+		if(!blocks[i].ok) {
+			fail("BGZF block is corrupt");
+			return 0;
+		}
+	}
+	return produced;
+}
+
+/**
+ * Consumer side: hand the current buffer back to the reader thread and
+ * wait for the next one.
+ */
+Bg_read_buf::int_type Bg_read_buf::underflow() {
+	if(gptr() < egptr()) {
+		return traits_type::to_int_type(*gptr());
+	}
+	if(at_eof || fd < 0 || (read_ahead && !started)) {
+		return traits_type::eof();
+	}
+	size_t n;
+	if(!read_ahead) {
+		// No reader thread; decode the next stretch here
+		if(eback() != NULL) {
+			consumed += egptr() - eback();
+		}
+		n = err.empty() ? fill(bufs[cur], PROBE_BUF_SIZE) : 0;
+	} else {
+		pthread_mutex_lock(&lock);
+		if(eback() != NULL) {
+			// Done with the current buffer
+			consumed += egptr() - eback();
+			full[cur] = false;
+			pthread_cond_signal(&cond_empty);
+			cur = (cur + 1) % NUM_BUFS;
+		}
+		while(!full[cur]) {
+			pthread_cond_wait(&cond_full, &lock);
+		}
+		n = lens[cur];
+		pthread_mutex_unlock(&lock);
+	}
+	if(n == 0) {
+		at_eof = true;
+		setg(NULL, NULL, NULL);
+		if(!err.empty()) {
+			cerr << "Error reading alignments from " << err << endl;
+			exit(255);
+		}
+		return traits_type::eof();
+	}
+	setg(bufs[cur], bufs[cur], bufs[cur] + n);
+	return traits_type::to_int_type(*gptr());
+}
+
+Bg_read_buf::pos_type Bg_read_buf::seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) {
+	if(dir == std::ios_base::cur && off == 0) {
+		// Telling the position works for any input; for compressed
+		// input it is an offset into the decompressed data
+		return pos_type(consumed + (gptr() - eback()));
+	}
+	if(dir == std::ios_base::beg) {
+		return seekpos(pos_type(off), which);
+	}
+	return pos_type(off_type(-1));
+}
+
+/**
+ * Restart reading uncompressed input at byte pos: stop the reader
+ * thread, drop everything buffered and start over from pos.
+ */
+Bg_read_buf::pos_type Bg_read_buf::seekpos(pos_type pos, std::ios_base::openmode) {
+	if(fd < 0 || comp != PLAIN_INPUT) {
+		return pos_type(off_type(-1));
+	}
+	stop_reader();
+	if(lseek(fd, (off_t)pos, SEEK_SET) == (off_t)-1) {
+		return pos_type(off_type(-1));
+	}
+	for(size_t i = 0; i != NUM_BUFS; i++) {
+		full[i] = false;
+		lens[i] = 0;
+	}
+	cur = 0;
+	consumed = pos;
+	in_len = in_off = 0;
+	in_eof = at_eof = false;
+	err.clear();
+	setg(NULL, NULL, NULL);
+	if(read_ahead) {
+		start_reader();
+	}
+	return pos;
+}
@@ -0,0 +1,145 @@
+/*
+ * aln_stream.h
+ *
+ *  Read-ahead input streams for alignment files.  A background thread
+ *  reads (and, for compressed files, decompresses) the file into a
+ *  ring of large buffers that the parser consumes through an ordinary
+ *  std::istream, so disk I/O and decompression overlap with calling.
+ */
+
+#ifndef ALN_STREAM_H_
+#define ALN_STREAM_H_
+
+#include <istream>
+#include <sstream>
+#include <streambuf>
+#include <string>
+#include <vector>
+#include <pthread.h>
+
+typedef enum {
+	PLAIN_INPUT = 0,
+	GZIP_INPUT,
+	BGZF_INPUT,
+	ZSTD_INPUT,
+	BZIP2_INPUT
+} input_compression;
+
+class Bg_read_buf : public std::streambuf {
+public:
+	/**
+	 * Open fn and start the reader thread; check is_open() afterwards.
+	 * Without read_ahead there is no thread, and each underflow decodes
+	 * at most PROBE_BUF_SIZE bytes in the caller's thread, which is all
+	 * that is needed to look at the start of a file.
+	 */
+	explicit Bg_read_buf(const char * fn, bool read_ahead = true);
+	~Bg_read_buf();
+
+	bool is_open() const { return fd >= 0; }
+	input_compression compression() const { return comp; }
+
+	static const size_t NUM_BUFS = 4;
+	static const size_t BUF_SIZE = 2 * 1024 * 1024;
+	static const size_t PROBE_BUF_SIZE = 64 * 1024; // holds a BGZF block
+	/// Threads used to inflate BGZF blocks; 0 picks one per core, up to 4
+	static int bgzf_threads;
+
+protected:
+	int_type underflow();
+	// Only telling the position and seeking uncompressed input are
+	// supported
+	pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which);
+	pos_type seekpos(pos_type pos, std::ios_base::openmode which);
+
+private:
+	Bg_read_buf(const Bg_read_buf &);
+	Bg_read_buf & operator=(const Bg_read_buf &);
+
+	static void * run(void * self);
+	void start_reader();
+	void stop_reader();
+	void produce();
+	size_t fill(char * out, size_t cap);
+	size_t fill_bgzf(char * out, size_t cap);
+	size_t read_raw(char * out, size_t cap);
+	void fail(const std::string & msg);
+
+	std::string name;
+	int fd;
+	input_compression comp;
+	void * codec; // z_stream, ZSTD_DStream or bz_stream, depending on comp
+	int threads; // BGZF decoding threads
+	bool read_ahead; // false: no reader thread, and only bufs[0]
+
+	// Compressed bytes waiting to be decoded
+	char * in_buf;
+	size_t in_len, in_off;
+	bool in_eof;
+	bool mid_stream; // decoder is partway through a gzip member/zstd frame/bzip2 stream
+
+	// Ring of decoded buffers; full[i] is set by the reader thread and
+	// cleared by the consumer once it's done with buffer i
+	char * bufs[NUM_BUFS];
+	size_t lens[NUM_BUFS];
+	bool full[NUM_BUFS];
+	size_t cur; // buffer the consumer is reading from
+	long long consumed; // bytes in the buffers before the current one
+	bool started, at_eof;
+
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond_full, cond_empty;
+	bool stop;
+	std::string err; // set by the reader thread on a read/decode error
+};
+
+/// String fields of a SAM text record; see Sam_format::parse()
+struct Sam_fields {
+	std::string qname, rname, cigar, rnext, seq, qual, tag;
+};
+
+/// A stretch of one chromosome to read, and where its alignments start
+struct Aln_target {
+	std::string chr;
+	int start, end;
+	long long offset;
+};
+
+/**
+ * Input stream for a plain, gzip (BGZF), zstd or bzip2 alignment file;
+ * the format is detected from the file's magic bytes.
+ */
+class Aln_istream : public std::istream {
+	Bg_read_buf buf;
+public:
+	/// read_ahead: see Bg_read_buf; probes that only look at the start of
+	/// a file pass false
+	explicit Aln_istream(const char * fn, bool read_ahead = true) : std::istream(NULL), buf(fn, read_ahead), bin_header_read(false), cur_target(0), target_entered(false) {
+		init(&buf);
+		if(!buf.is_open()) {
+			setstate(std::ios::failbit);
+		}
+	}
+	input_compression compression() const { return buf.compression(); }
+
+	// State kept by the binary and BAM alignment readers (see
+	// Binary_format and Bam_format)
+	std::string bin_chr; // chromosome of the records that follow
+	bool bin_header_read;
+	std::vector<std::string> bam_refs; // reference names from the BAM header
+
+	// If not empty, only alignments in these targets (in file order) are
+	// read, seeking past the rest; see read_targeted_aln()
+	std::vector<Aln_target> targets;
+	size_t cur_target;
+	bool target_entered;
+
+	// Scratch of read_aln(), reused for every text record so that once
+	// they have grown, parsing a record allocates nothing
+	std::string line;
+	std::istringstream fields;
+	Sam_fields sam;
+};
+
+#endif /*ALN_STREAM_H_*/
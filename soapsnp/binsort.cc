@@ -0,0 +1,613 @@
+/*
+ * binsort.cc
+ *
+ *  Bin tab-delimited records (Crossbow alignments, or SOAPsnp calls on
+ *  their way to postprocessing) on their leading fields and sort each
+ *  bin on the fields after those.  This is the shuffle of a local run
+ *  without Hadoop, which ReduceWrap.pl and BinSort.pl otherwise do in
+ *  Perl and with external sorts.
+ *
+ *  Reader threads take the input files in turn, tally the records of
+ *  each bin and buffer them.  A thread whose buffer outgrows its share
+ *  of the memory budget sorts it and spills it to a run file.  Sorting
+ *  groups records by bin, then radix-sorts each bin on its last sort
+ *  field when that is a fixed-width number, like the zero-padded
+ *  reference offset of a Crossbow alignment; otherwise it compares
+ *  bytes.  Records with equal keys are ordered by the whole line, as
+ *  sort(1) does.  Finally the buffers and runs are merged and every
+ *  record is written to the file of its bin, or of the task its bin was
+ *  assigned to.
+ */
+
+#include "aln_stream.h"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <queue>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <getopt.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <pthread.h>
+
+using namespace std;
+
+typedef unsigned long long ubit64_t;
+typedef unsigned int ubit32_t;
+
+int usage() {
+	cerr<<"binsort: bin tab-delimited records on their leading fields and sort each bin"<<endl;
+	cerr<<"Usage: binsort -o <DIR> [options] <FILE> [<FILE>...]"<<endl;
+	cerr<<"-o <DIR> Output directory"<<endl;
+	cerr<<"-b <int> Number of leading fields making up the bin [1]"<<endl;
+	cerr<<"-s <int> Number of leading fields to sort on; at least -b [-b]"<<endl;
+	cerr<<"-n <int> Spread the bins over <int> tasks and write the non-empty ones to task-00000, task-00001, ... [Off: one file per bin]"<<endl;
+	cerr<<"-p <STR> Prefix for one-per-bin output file names; a bin's fields are joined with '+' and other bytes outside [.,#A-Za-z0-9_-] written as %XX"<<endl;
+	cerr<<"-x <STR> Suffix for one-per-bin output file names"<<endl;
+	cerr<<"-t <int> Reader threads [1]"<<endl;
+	cerr<<"-m <int> Memory budget for buffered records in MB; beyond it sorted runs are spilled [1024]"<<endl;
+	cerr<<"-T <DIR> Directory for spilled runs [-o]"<<endl;
+	cerr<<"-h Display this help"<<endl;
+	exit(1);
+	return 0;
+}
+
+static int bin_fields = 1, sort_fields = 0;
+static ubit64_t budget_per_thread;
+static size_t chunk_size; // of the arenas buffered lines are copied into
+static const size_t MAX_OPEN_RUNS = 64;
+static string tmp_dir;
+
+/// A buffered record; line points into its reader's arena
+struct Rec {
+	const char * line;
+	ubit32_t len;
+	ubit32_t bin_len; // bytes of the bin fields
+	ubit32_t key_len; // bytes of the sort fields
+	ubit32_t bin; // reader-local bin id
+	ubit64_t num; // the last sort field, if it is a number
+	ubit32_t width; // its width, or 0 if it isn't a number
+};
+
+/// Byte order, shorter first on a tie, as memcmp-based sorts compare
+static inline int compare_bytes(const char * a, size_t alen, const char * b, size_t blen) {
+	int c = memcmp(a, b, alen < blen ? alen : blen);
+	if(c != 0) return c;
+	return (alen < blen ? -1 : (alen > blen ? 1 : 0));
+}
+
+/// Sort key first, then the whole line
+static inline int compare_lines(const char * a, ubit32_t alen, ubit32_t akey, const char * b, ubit32_t blen, ubit32_t bkey) {
+	int c = compare_bytes(a, akey, b, bkey);
+	if(c != 0) return c;
+	return compare_bytes(a, alen, b, blen);
+}
+
+struct Rec_less {
+	bool operator()(const Rec & a, const Rec & b) const {
+		return compare_lines(a.line, a.len, a.key_len, b.line, b.len, b.key_len) < 0;
+	}
+};
+
+struct Line_less {
+	bool operator()(const Rec & a, const Rec & b) const {
+		return compare_bytes(a.line, a.len, b.line, b.len) < 0;
+	}
+};
+
+/**
+ * Find where the bin and sort fields of line end, and read the last
+ * sort field as a number if it is all digits.  Returns false if the
+ * line is short of sort fields.
+ */
+static bool parse_key(const char * line, ubit32_t len, Rec & r) {
+	ubit32_t field = 0, start = 0;
+	r.bin_len = r.key_len = len;
+	r.width = 0;
+	r.num = 0;
+	for(ubit32_t i = 0; i <= len; i++) {
+		if(i != len && line[i] != '\t') continue;
+		field++;
+		if(field == (ubit32_t)bin_fields) r.bin_len = i;
+		if(field == (ubit32_t)sort_fields) {
+			r.key_len = i;
+			if(sort_fields > bin_fields && i > start && i - start <= 18) {
+				ubit64_t v = 0;
+				ubit32_t j = start;
+				for(; j != i && line[j] >= '0' && line[j] <= '9'; j++) {
+					v = v * 10 + (line[j] - '0');
+				}
+				if(j == i) {
+					r.num = v;
+					r.width = i - start;
+				}
+			}
+			return true;
+		}
+		start = i + 1;
+	}
+	return false;
+}
+
+struct Name_less {
+	const vector<string> & names;
+	Name_less(const vector<string> & n) : names(n) { }
+	bool operator()(ubit32_t a, ubit32_t b) const {
+		return compare_bytes(names[a].data(), names[a].size(), names[b].data(), names[b].size()) < 0;
+	}
+};
+
+/**
+ * Sort recs into key order.  Records are first grouped by bin in bin
+ * name order; a bin whose last sort field is a number of the same width
+ * throughout is radix-sorted on it, since its numeric and byte order
+ * agree.
+ */
+static void sort_recs(vector<Rec> & recs, const vector<string> & bin_names) {
+	size_t nbins = bin_names.size();
+	vector<ubit32_t> order(nbins);
+	for(size_t i = 0; i != nbins; i++) order[i] = i;
+	sort(order.begin(), order.end(), Name_less(bin_names));
+	vector<size_t> first(nbins + 1, 0);
+	for(size_t i = 0; i != recs.size(); i++) first[recs[i].bin]++;
+	// Turn counts into starts in sorted bin order
+	vector<size_t> start(nbins + 1, 0);
+	size_t at = 0;
+	for(size_t i = 0; i != nbins; i++) {
+		start[order[i]] = at;
+		at += first[order[i]];
+	}
+	vector<size_t> fill(start.begin(), start.end());
+	vector<Rec> grouped(recs.size());
+	for(size_t i = 0; i != recs.size(); i++) grouped[fill[recs[i].bin]++] = recs[i];
+	vector<Rec> tmp;
+	for(size_t i = 0; i != nbins; i++) {
+		size_t lo = start[order[i]], hi = lo + first[order[i]];
+		if(hi - lo < 2) continue;
+		bool numeric = true;
+		ubit64_t max_num = 0;
+		for(size_t j = lo; j != hi && numeric; j++) {
+			numeric = (grouped[j].width != 0 && grouped[j].width == grouped[lo].width);
+			if(grouped[j].num > max_num) max_num = grouped[j].num;
+		}
+		if(!numeric) {
+			sort(grouped.begin() + lo, grouped.begin() + hi, Rec_less());
+			continue;
+		}
+		// LSD radix sort on the number, a byte at a time
+		tmp.resize(hi - lo);
+		for(int shift = 0; shift < 64 && (max_num >> shift) != 0; shift += 8) {
+			size_t count[257];
+			memset(count, 0, sizeof(count));
+			for(size_t j = lo; j != hi; j++) count[((grouped[j].num >> shift) & 0xFF) + 1]++;
+			for(int d = 0; d != 256; d++) count[d+1] += count[d];
+			for(size_t j = lo; j != hi; j++) tmp[count[(grouped[j].num >> shift) & 0xFF]++] = grouped[j];
+			copy(tmp.begin(), tmp.end(), grouped.begin() + lo);
+		}
+		// Equal keys go by the whole line
+		for(size_t j = lo; j != hi; ) {
+			size_t k = j + 1;
+			while(k != hi && grouped[k].num == grouped[j].num) k++;
+			if(k - j > 1) sort(grouped.begin() + j, grouped.begin() + k, Line_less());
+			j = k;
+		}
+	}
+	recs.swap(grouped);
+}
+
+/// Writes merged records to a run file
+struct Run_sink {
+	string name;
+	ofstream out;
+	Run_sink(const string & fn) : name(fn), out(fn.c_str(), ios::binary) { }
+	void put(const Rec & r) {
+		out.write(r.line, r.len);
+		out.put('\n');
+	}
+	void close() {
+		out.close();
+		if(out.fail()) {
+			cerr << "Could not write spilled run " << name << endl;
+			exit(1);
+		}
+	}
+};
+
+/// One reader thread's buffered records and bin tallies
+struct Binner {
+	int id;
+	vector<char *> chunks;
+	size_t chunk_used;
+	vector<Rec> recs;
+	map<string, ubit32_t> bin_ids;
+	vector<string> bin_names;
+	vector<ubit64_t> bin_counts; // over everything read, spilled or not
+	vector<string> runs; // spilled run files
+	ubit64_t bytes;
+
+	Binner() : id(0), chunk_used(chunk_size), bytes(0) { }
+	~Binner() { release(); }
+
+	void release() {
+		for(size_t i = 0; i != chunks.size(); i++) delete [] chunks[i];
+		chunks.clear();
+		chunk_used = chunk_size;
+		recs.clear();
+		bytes = 0;
+	}
+
+	void add(const string & line, const string & src) {
+		Rec r;
+		if(!parse_key(line.data(), line.size(), r) && line != "FAKE") {
+			cerr << sort_fields << " sort fields, but line in " << src << " doesn't have that many:" << endl << line << endl;
+			exit(1);
+		}
+		string bin(line, 0, r.bin_len);
+		map<string, ubit32_t>::iterator it = bin_ids.find(bin);
+		if(it == bin_ids.end()) {
+			it = bin_ids.insert(make_pair(bin, (ubit32_t)bin_names.size())).first;
+			bin_names.push_back(bin);
+			bin_counts.push_back(0);
+		}
+		r.bin = it->second;
+		bin_counts[r.bin]++;
+		if(line.size() > chunk_size - chunk_used) {
+			size_t sz = max(line.size(), chunk_size);
+			chunks.push_back(new char [sz]);
+			chunk_used = 0;
+			bytes += sz;
+		}
+		char * p = chunks.back() + chunk_used;
+		memcpy(p, line.data(), line.size());
+		// An outsized line has a chunk to itself
+		chunk_used = min(chunk_used + line.size(), chunk_size);
+		r.line = p;
+		r.len = line.size();
+		recs.push_back(r);
+		if(bytes + recs.size() * sizeof(Rec) > budget_per_thread) {
+			spill();
+		}
+	}
+
+	/// Sort the buffer and write it out as a run
+	void spill() {
+		sort_recs(recs, bin_names);
+		ostringstream fn;
+		fn << tmp_dir << "/binsort." << getpid() << "." << id << "." << runs.size();
+		Run_sink run(fn.str());
+		for(size_t i = 0; i != recs.size(); i++) {
+			run.put(recs[i]);
+		}
+		run.close();
+		runs.push_back(fn.str());
+		release();
+	}
+};
+
+struct Reader_pool {
+	const vector<string> * inputs;
+	size_t next;
+	pthread_mutex_t lock;
+	vector<Binner> binners;
+};
+
+static void * read_inputs(void * arg) {
+	pair<Reader_pool*, int> * self = (pair<Reader_pool*, int>*)arg;
+	Reader_pool & pool = *self->first;
+	Binner & binner = pool.binners[self->second];
+	while(true) {
+		pthread_mutex_lock(&pool.lock);
+		size_t f = pool.next++;
+		pthread_mutex_unlock(&pool.lock);
+		if(f >= pool.inputs->size()) break;
+		const string & name = (*pool.inputs)[f];
+		Aln_istream in(name.c_str());
+		if(!in) {
+			cerr << "No such file or directory:" << name << endl;
+			exit(1);
+		}
+		for(string line; getline(in, line); ) {
+			if(line.empty()) continue;
+			binner.add(line, name);
+		}
+	}
+	return NULL;
+}
+
+/// A sorted stream of records being merged: a buffer or a spilled run
+struct Merge_src {
+	const Rec * mem, * mem_end;
+	ifstream * file;
+	string buf;
+	Rec cur;
+
+	bool next() {
+		if(file == NULL) {
+			if(mem == mem_end) return false;
+			cur = *mem++;
+			return true;
+		}
+		if(!getline(*file, buf)) return false;
+		cur.line = buf.data();
+		cur.len = buf.size();
+		parse_key(cur.line, cur.len, cur);
+		return true;
+	}
+};
+
+static Merge_src open_run(const string & fn) {
+	Merge_src m;
+	m.mem = m.mem_end = NULL;
+	m.file = new ifstream(fn.c_str(), ios::binary);
+	if(!*m.file) {
+		cerr << "Could not reopen spilled run " << fn << endl;
+		exit(1);
+	}
+	return m;
+}
+
+struct Src_greater {
+	const vector<Merge_src> * srcs;
+	Src_greater(const vector<Merge_src> * s) : srcs(s) { }
+	bool operator()(size_t a, size_t b) const {
+		const Rec & x = (*srcs)[a].cur;
+		const Rec & y = (*srcs)[b].cur;
+		return compare_lines(x.line, x.len, x.key_len, y.line, y.len, y.key_len) > 0;
+	}
+};
+
+/// Merge srcs into sink, then close the run files among them
+template<typename Sink>
+static void merge(vector<Merge_src> & srcs, Sink & sink) {
+	priority_queue<size_t, vector<size_t>, Src_greater> heap((Src_greater(&srcs)));
+	for(size_t i = 0; i != srcs.size(); i++) {
+		if(srcs[i].next()) heap.push(i);
+	}
+	while(!heap.empty()) {
+		size_t i = heap.top();
+		heap.pop();
+		sink.put(srcs[i].cur);
+		if(srcs[i].next()) heap.push(i);
+	}
+	for(size_t i = 0; i != srcs.size(); i++) {
+		delete srcs[i].file;
+		srcs[i].file = NULL;
+	}
+}
+
+/**
+ * The file name of a bin: its fields joined with '+', with any byte
+ * outside BinSort.pl's safe set [.,#A-Za-z0-9_-] written as %XX.
+ * Unlike BinSort.pl, which runs the fields together and maps unsafe
+ * bytes to '_', distinct bins never share a name ("chr1","10" and
+ * "chr11","0" stay apart).
+ */
+static string file_name(const string & bin) {
+	static const char hex[] = "0123456789ABCDEF";
+	string ret;
+	for(size_t i = 0; i != bin.size(); i++) {
+		unsigned char c = bin[i];
+		if(c == '\t') {
+			ret += '+';
+		} else if(isalnum(c) || c == '.' || c == ',' || c == '#' || c == '_' || c == '-') {
+			ret += c;
+		} else {
+			ret += '%';
+			ret += hex[c >> 4];
+			ret += hex[c & 0xF];
+		}
+	}
+	return ret;
+}
+
+/// Writes merged records to the file of their bin, or of its task
+struct File_sink {
+	string dir, prefix, suffix;
+	const map<string, int> * task_of; // NULL for one file per bin
+	map<int, ofstream*> task_out;
+	ofstream bin_out;
+	ofstream * out;
+	string last_bin;
+	bool any;
+
+	File_sink(const string & d, const string & p, const string & x, const map<string, int> * tasks) :
+		dir(d), prefix(p), suffix(x), task_of(tasks), out(NULL), any(false) { }
+
+	void put(const Rec & r) {
+		if(!any || r.bin_len != last_bin.size() || memcmp(r.line, last_bin.data(), r.bin_len) != 0) {
+			any = true;
+			last_bin.assign(r.line, r.bin_len);
+			string fn;
+			if(task_of != NULL) {
+				int t = task_of->find(last_bin)->second;
+				if(task_out.find(t) == task_out.end()) {
+					char name[32];
+					sprintf(name, "/task-%05d", t);
+					fn = dir + name;
+					task_out[t] = new ofstream(fn.c_str(), ios::binary);
+				}
+				out = task_out[t];
+			} else {
+				if(bin_out.is_open()) bin_out.close();
+				bin_out.clear();
+				fn = dir + "/" + prefix + file_name(last_bin) + suffix;
+				bin_out.open(fn.c_str(), ios::binary);
+				out = &bin_out;
+			}
+			if(!*out) {
+				cerr << "Could not open " << fn << " for writing" << endl;
+				exit(1);
+			}
+		}
+		out->write(r.line, r.len);
+		out->put('\n');
+	}
+
+	/// Close every file; false if any couldn't be written
+	bool close() {
+		bool ok = true;
+		for(map<int, ofstream*>::iterator it = task_out.begin(); it != task_out.end(); it++) {
+			it->second->close();
+			ok = ok && !it->second->fail();
+			delete it->second;
+		}
+		task_out.clear();
+		if(bin_out.is_open()) {
+			bin_out.close();
+			ok = ok && !bin_out.fail();
+		}
+		return ok;
+	}
+};
+
+int main(int argc, char **argv) {
+	int c, threads = 1, tasks = 0;
+	ubit64_t budget_mb = 1024;
+	string out_dir, prefix, suffix;
+	while((c = getopt(argc, argv, "o:b:s:n:p:x:t:m:T:h")) != -1) {
+		switch(c) {
+			case 'o': out_dir = optarg; break;
+			case 'b': bin_fields = atoi(optarg); break;
+			case 's': sort_fields = atoi(optarg); break;
+			case 'n': tasks = atoi(optarg); break;
+			case 'p': prefix = optarg; break;
+			case 'x': suffix = optarg; break;
+			case 't': threads = atoi(optarg); break;
+			case 'm': budget_mb = atoi(optarg); break;
+			case 'T': tmp_dir = optarg; break;
+			case 'h': usage(); break;
+			default: usage();
+		}
+	}
+	if(sort_fields == 0) sort_fields = bin_fields;
+	vector<string> inputs(argv + optind, argv + argc);
+	if(out_dir.empty() || inputs.empty()) {
+		usage();
+	}
+	if(bin_fields < 1 || sort_fields < bin_fields) {
+		cerr << "-s must be >= -b, and -b must be >= 1" << endl;
+		exit(1);
+	}
+	if(threads < 1 || budget_mb < 1 || tasks < 0) {
+		cerr << "-t and -m must be positive, and -n not negative" << endl;
+		exit(1);
+	}
+	mkdir(out_dir.c_str(), 0777);
+	struct stat st;
+	if(stat(out_dir.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) {
+		cerr << "Could not create output directory " << out_dir << endl;
+		exit(1);
+	}
+	if(tmp_dir.empty()) tmp_dir = out_dir;
+	budget_per_thread = budget_mb * 1024 * 1024 / threads;
+	chunk_size = min((ubit64_t)4 * 1024 * 1024, max((ubit64_t)64 * 1024, budget_per_thread / 8));
+
+	// Bin and buffer (or spill) every input
+	Reader_pool pool;
+	pool.inputs = &inputs;
+	pool.next = 0;
+	pthread_mutex_init(&pool.lock, NULL);
+	pool.binners.resize(threads);
+	vector<pthread_t> workers(threads);
+	vector<pair<Reader_pool*, int> > args(threads);
+	for(int i = 0; i != threads; i++) {
+		pool.binners[i].id = i;
+		args[i] = make_pair(&pool, i);
+		if(pthread_create(&workers[i], NULL, read_inputs, &args[i]) != 0) {
+			cerr << "Could not start reader thread" << endl;
+			exit(1);
+		}
+	}
+	for(int i = 0; i != threads; i++) {
+		pthread_join(workers[i], NULL);
+	}
+
+	// Total each bin over the readers, and assign bins to tasks: the
+	// biggest first, each to the task with the fewest records so far
+	map<string, ubit64_t> bin_sizes;
+	ubit64_t records = 0;
+	size_t runs = 0;
+	for(int i = 0; i != threads; i++) {
+		Binner & b = pool.binners[i];
+		for(size_t j = 0; j != b.bin_names.size(); j++) {
+			bin_sizes[b.bin_names[j]] += b.bin_counts[j];
+			records += b.bin_counts[j];
+		}
+		runs += b.runs.size();
+	}
+	map<string, int> task_of;
+	int nonempty = 0;
+	if(tasks > 0) {
+		vector<pair<ubit64_t, string> > by_size;
+		for(map<string, ubit64_t>::iterator it = bin_sizes.begin(); it != bin_sizes.end(); it++) {
+			by_size.push_back(make_pair(~it->second, it->first));
+		}
+		sort(by_size.begin(), by_size.end());
+		vector<ubit64_t> task_size(tasks, 0);
+		for(size_t i = 0; i != by_size.size(); i++) {
+			int t = min_element(task_size.begin(), task_size.end()) - task_size.begin();
+			if(task_size[t] == 0) nonempty++;
+			task_size[t] += ~by_size[i].first;
+			task_of[by_size[i].second] = t;
+		}
+	}
+
+	// Merge runs a batch at a time while there are too many to open at
+	// once, then merge the rest with the buffers, routing each record to
+	// its file
+	vector<string> run_names;
+	for(int i = 0; i != threads; i++) {
+		run_names.insert(run_names.end(), pool.binners[i].runs.begin(), pool.binners[i].runs.end());
+	}
+	while(run_names.size() > MAX_OPEN_RUNS) {
+		vector<Merge_src> batch;
+		for(size_t j = 0; j != MAX_OPEN_RUNS; j++) {
+			batch.push_back(open_run(run_names[j]));
+		}
+		ostringstream fn;
+		fn << tmp_dir << "/binsort." << getpid() << ".merged." << run_names.size();
+		Run_sink run(fn.str());
+		merge(batch, run);
+		run.close();
+		for(size_t j = 0; j != MAX_OPEN_RUNS; j++) {
+			remove(run_names[j].c_str());
+		}
+		run_names.erase(run_names.begin(), run_names.begin() + MAX_OPEN_RUNS);
+		run_names.push_back(fn.str());
+	}
+	vector<Merge_src> srcs;
+	for(int i = 0; i != threads; i++) {
+		Binner & b = pool.binners[i];
+		if(!b.recs.empty()) {
+			sort_recs(b.recs, b.bin_names);
+			Merge_src m;
+			m.mem = &b.recs[0];
+			m.mem_end = m.mem + b.recs.size();
+			m.file = NULL;
+			srcs.push_back(m);
+		}
+	}
+	for(size_t j = 0; j != run_names.size(); j++) {
+		srcs.push_back(open_run(run_names[j]));
+	}
+	File_sink files(out_dir, prefix, suffix, tasks > 0 ? &task_of : NULL);
+	merge(srcs, files);
+	bool ok = files.close();
+	for(size_t j = 0; j != run_names.size(); j++) {
+		remove(run_names[j].c_str());
+	}
+	if(!ok) {
+		cerr << "Error writing output to " << out_dir << endl;
+		exit(1);
+	}
+	cerr << "binsort: " << records << " records in " << bin_sizes.size() << " bins";
+	if(tasks > 0) cerr << ", " << nonempty << " non-empty tasks";
+	cerr << ", " << runs << " spilled runs" << endl;
+	return 0;
+}
@@ -1,90 +1,458 @@
 #include "soap_snp.h"
 
 int Call_win::initialize(ubit64_t start) {
-	std::string::size_type i;
-	for(i = 0; i != read_len + win_size; i++) {
-		sites[i].pos = i + start;
+	win_start = start;
+	head = 0;
+	for(ubit64_t i = 0; i != ring_size; i++) {
+		reset(i);
 	}
 	return 1;
 }
 
+/**
+ * Move on to the next window, or to the one at start.  The slots of
+ * the sites left behind are reset to hold those at the far end of the
+ * ring; sites the alignments already spilled into stay where they are.
+ * Whether a slot needs clearing is read off counts.depth, so this
+ * scans contiguous memory rather than every site's evidence.
+ */
 int Call_win::recycle(int start) {
-	std::string::size_type i;
-	// Move the
-	if(sites[win_size].depth > 0 && start == -1) {
-		for(i = 0; i != read_len ; i++) {
-			sites[i].pos         = sites[i+win_size].pos;
-			sites[i].ori         = sites[i+win_size].ori;
-			sites[i].depth       = sites[i+win_size].depth;
-			sites[i].repeat_time = sites[i+win_size].repeat_time;
-			sites[i].dep_uni     = sites[i+win_size].dep_uni;
-			sites[i].dep_pair    = sites[i+win_size].dep_uni;
-			sites[i].dep_uni_pair= sites[i+win_size].dep_uni;
+	Prof_timer timer(PROF_FILL);
+	const bool next = (start == -1);
+	if(next) {
+		start = win_start + win_size;
+	}
+	if((ubit64_t)(start - win_start) >= ring_size) {
+		return initialize(start);
+	}
+	if(next) {
+		// Sites carried into the next window report their unique depth as
+		// their paired depth, as the old tail copy did; if the first of
+		// them was not covered, the tail was not carried at all.
+		const int tail = win_start + win_size;
+		const bool carried = counts.depth[slot(tail)] > 0;
+		for(int pos = tail; pos != tail + (int)read_len; pos++) {
+			const int sub = slot(pos);
+			if(carried) {
+				counts.dep_pair[sub] = counts.dep_uni_pair[sub] = counts.dep_uni[sub];
+			} else {
+				reset(sub);
+			}
+		}
+	}
+	for(int pos = win_start; pos != start; pos++) {
+		reset(slot(pos));
+	}
+	head = slot(start);
+	win_start = start;
+	return 1;
+}
+
+// Per thread, so that shards can be called concurrently (see Call_counts)
+extern __thread unsigned long poscalled;            // positions called
+extern __thread unsigned long poscalled_knownsnp;   // ... where there was a known SNP
+extern __thread unsigned long poscalled_uncov_uni;  // ... uncovered by unique reads
+extern __thread unsigned long poscalled_uncov;      // ... uncovered by any reads
+extern __thread unsigned long poscalled_n_no_depth; // ... where ref=N and there's no reads
+extern __thread unsigned long poscalled_nonref;     // ... where allele other than ref was called
+extern __thread unsigned long poscalled_reported;   // ... # positions called already counted
+extern __thread unsigned long poscalled_downsampled; // ... where unique depth exceeded -D
+
+void Call_counts::take() {
+	called = poscalled;             poscalled = 0;
+	knownsnp = poscalled_knownsnp;  poscalled_knownsnp = 0;
+	uncov_uni = poscalled_uncov_uni; poscalled_uncov_uni = 0;
+	uncov = poscalled_uncov;        poscalled_uncov = 0;
+	n_no_depth = poscalled_n_no_depth; poscalled_n_no_depth = 0;
+	nonref = poscalled_nonref;      poscalled_nonref = 0;
+	reported = poscalled_reported;  poscalled_reported = 0;
+	downsampled = poscalled_downsampled; poscalled_downsampled = 0;
+	for(int i = 0; i != PROF_PHASES; i++) {
+		prof[i] = prof_time[i]; prof_time[i] = 0;
+	}
+	for(int i = 0; i != PROF_HIST; i++) {
+		prof_hist[i] = prof_win_hist[i]; prof_win_hist[i] = 0;
+	}
+}
+
+void Call_counts::give() const {
+	poscalled += called;
+	poscalled_knownsnp += knownsnp;
+	poscalled_uncov_uni += uncov_uni;
+	poscalled_uncov += uncov;
+	poscalled_n_no_depth += n_no_depth;
+	poscalled_nonref += nonref;
+	poscalled_reported += reported;
+	poscalled_downsampled += downsampled;
+	for(int i = 0; i != PROF_PHASES; i++) {
+		prof_time[i] += prof[i];
+	}
+	for(int i = 0; i != PROF_HIST; i++) {
+		prof_win_hist[i] += prof_hist[i];
+	}
+}
+
+static unsigned long report_every = 100000;
+
+/// Count a called position, reporting progress every report_every
+static void count_position(Parameter * para) {
+	if((++poscalled % report_every) == 0) {
+		poscalled_reported += report_every;
+		if(para->verbose) {
+			clog << "  Processed " << poscalled << " positions" << endl;
+		}
+		if(para->hadoop_out) {
+			// One write, since calling threads may report at once
+			std::ostringstream msg;
+			msg << "reporter:counter:SOAPsnp,Positions called," << report_every << endl;
+			cerr << msg.str();
+		}
+	}
+}
+
+/**
+ * Extend the open -B block with the site at pos, or write it out and
+ * start a new one if the site doesn't continue it.
+ */
+void Call_win::add_to_block(const Chr_name & name, int pos, int depth, int q_cns, std::ostream & consensus) {
+	bool covered = (depth > 0);
+	if(block.start >= 0 &&
+	   (pos != block.end + 1 || covered != block.covered || pos % Ref_block::SPAN == 0))
+	{
+		flush_block(name, consensus);
+	}
+	if(block.start < 0) {
+		block.start = pos;
+		block.min_depth = depth;
+		block.min_qual = q_cns;
+		block.covered = covered;
+	}
+	block.end = pos;
+	if(depth < block.min_depth) block.min_depth = depth;
+	if(q_cns < block.min_qual) block.min_qual = q_cns;
+}
+
+/// Write the open -B block, if any
+void Call_win::flush_block(const Chr_name & name, std::ostream & consensus) {
+	if(block.start < 0) {
+		return;
+	}
+	// B\tChrID\tStart\tEnd\tMinDepth\tMinQual
+	consensus << "B\t" << name
+	          << '\t' << (block.start+1)
+	          << '\t' << (block.end+1)
+	          << '\t' << block.min_depth
+	          << '\t' << block.min_qual
+	          << endl;
+	block.start = -1;
+}
+
+/**
+ * Pick the three best-supported bases at a site: by summed quality of
+ * its unique observations or, if it is covered only by repeats, by
+ * count of all observations.
+ */
+void Call_win::top_bases(int sub, Site_call & call) {
+	int i, qual1, qual2, qual3, all_count1, all_count2, all_count3;
+	char base1, base2, base3;
+	base1 = 0, base2 = 0, base3 = 0;
+	qual1 = -1, qual2 = -2, qual3 = -3;
+	all_count1 = 0, all_count2 = 0, all_count3 = 0;
+	// dep_uni = Depth of unique bases?
+	if(counts.dep_uni[sub]) {
+		// This position is uniquely covered by at least one
+		// nucleotide.  BTL: This loop seems to collect the most
+		// frequent three bases according to sum-of-Phred-calls
+		// for that base.  q_sum is already calculated
+		for(i = 0; i != 4; i++) {
+			// i is four kind of alleles
+			if(counts.q_sum[sub][i] >= qual1) {
+				base3 = base2;
+				qual3 = qual2;
+				base2 = base1;
+				qual2 = qual1;
+				base1 = i;
+				qual1 = counts.q_sum[sub][i];
+			}
+			else if (counts.q_sum[sub][i] >= qual2) {
+				base3 = base2;
+				qual3 = qual2;
+				base2 = i;
+				qual2  = counts.q_sum[sub][i];
+			}
+			else if (counts.q_sum[sub][i] >= qual3) {
+				base3 = i;
+				qual3  = counts.q_sum[sub][i];
+			}
+			else {
+				;
+			}
+		}
+		if(qual1 == 0) {
+			// Adjust the best base so that things won't look ugly
+			// if the pos is not covered
+			base1 = (counts.ori[sub] & 7);
+		}
+		else if(qual2 ==0 && base1 != (counts.ori[sub] & 7)) {
+			base2 = (counts.ori[sub] & 7);
+		}
+		else {
+			;
+		}
+	} // if(dep_uni)
+	else {
+		// This position is covered by all repeats
+		for(i = 0; i != 4; i++) {
+			if(counts.count_all[sub][i] >= all_count1) {
+				base3 = base2;
+				all_count3 = all_count2;
+				base2 = base1;
+				all_count2 = all_count1;
+				base1 = i;
+				all_count1 = counts.count_all[sub][i];
+			}
+			else if (counts.count_all[sub][i] >= all_count2) {
+				base3 = base2;
+				all_count3 = all_count2;
+				base2 = i;
+				all_count2  = counts.count_all[sub][i];
+			}
+			else if (counts.count_all[sub][i] >= all_count3) {
+				base3 = i;
+				all_count3  = counts.count_all[sub][i];
+			}
+		}
+		if(all_count1 == 0) {
+			// none found
+			base1 = (counts.ori[sub]&7);
+		}
+		else if(all_count2 == 0 && base1 != (counts.ori[sub]&7)) {
+			base2 = (counts.ori[sub]&7);
+		}
+	}
+	call.base1 = base1, call.base2 = base2, call.base3 = base3;
+	call.qual1 = qual1, call.qual2 = qual2, call.qual3 = qual3;
+}
+
+/**
+ * Fill type_likely with the log10 likelihood of each genotype given
+ * the site's unique observations.
+ */
+void Call_win::likelihood(int sub, Prob_matrix * mat, Parameter * para) {
+	const Pos_info & site = sites[sub];
+	std::string::size_type coord;
+	small_int k;
+	ubit64_t o_base, strand;
+	char allele1, allele2, genotype;
+	int q_score, q_adjusted, global_dep_count;
+
+	for(genotype = 0; genotype != 16; genotype++){
+		type_likely[genotype] = 0.0;
+	}
+
+	//
+	// The next set of nested loops is looping over (a) the H, q
+	// and c dimensions of the 4-dim recal matrix, then (b) over
+	// all aligned bases matching that H, q and c, then (c) over
+	// all possible alleles for the current reference position.
+	// The result is that each aligned base's mojo gets spread
+	// across the candidate alleles according to the equations in
+	// the Genome Res paper.
+	//
+
 #ifdef FAST_BOUNDS
-			sites[i].coordmin    = sites[i+win_size].coordmin;
-			sites[i].coordmax    = sites[i+win_size].coordmax;
-			sites[i].qmin        = sites[i+win_size].qmin;
-			sites[i].qmax        = sites[i+win_size].qmax;
+	char qmin = (site.qmin == 0 ? 1 : site.qmin-1);
+	char qmax = (site.qmax == 0 ? 0 : site.qmax-1);
+	small_int coordmin = (site.coordmin == 0 ? 1 : site.coordmin-1);
+	small_int coordmax = (site.coordmax == 0 ? 0 : site.coordmax-1);
 #endif
-			memcpy(sites[i].base_info, sites[i+win_size].base_info, sizeof(small_int)*4*2*64*256); // 4 types of bases, 2 strands, max quality score is 64, and max read length 256
-			memcpy(sites[i].count_uni, sites[i+win_size].count_uni, sizeof(int)*4);
-			memcpy(sites[i].q_sum,     sites[i+win_size].q_sum,     sizeof(int)*4);
-			memcpy(sites[i].count_all, sites[i+win_size].count_all, sizeof(int)*4);
+	// Looping over haplo-genotypes (H) in the 4-dim table?
+	for(o_base = 0; o_base != 4; o_base++) {
+		if(counts.count_uni[sub][o_base] == 0) {
+			// No unique alignments with this reference haplotype
+			continue;
 		}
-	} else {
-		Pos_info::clear(&sites[0], read_len);
-		if(start == -1) {
-			for(i = 0; i != read_len ; i++) {
-				sites[i].ori = 0xFF;
-				sites[i].pos = sites[i+win_size].pos;
-			}
-		} else {
-			for(i = 0; i != read_len ; i++) {
-				sites[i].ori = 0xFF;
-				sites[i].pos = start + i;
+		// Reset the
+		global_dep_count = -1;
+		memset(pcr_dep_count, 0, sizeof(int) * 2 * para->read_length);
+		// Looping over quality scores (q) in the 4-dim table
+#ifdef FAST_BOUNDS
+		for(q_score = qmax; q_score >= qmin; q_score--) {
+#else
+		for(q_score = para->q_max - para->q_min; q_score != -1; q_score--) {
+#endif
+			// Looping over cycles (c) in the 4-dim table
+#ifdef FAST_BOUNDS
+			for(coord = coordmin; coord <= coordmax; coord++) {
+#else
+			for(coord = 0; coord != para->read_length; coord++) {
+#endif
+				// Looping over reference strands
+				for(strand = 0; strand != 2; strand++) {
+					// Now iterate over all the aligned bases with:
+					//  (a) character 'o_base'
+					//  (b) ...aligned to reference strand 'strand'
+					//  (c) ...with quality score 'q_score'
+					//  (d) ...generated in sequencing cycle 'coord'
+					const int bi = o_base << 15 | strand << 14 | q_score << 8 | coord;
+					for(k = 0; k != site.base_info[bi]; k++) {
+						// pcr_dep_count is indexed by coordinate,
+						// and cares about which strand was read
+						if(pcr_dep_count[strand*para->read_length+coord] == 0) {
+							global_dep_count += 1; // sets it to 0
+						}
+						pcr_dep_count[strand*para->read_length+coord] += 1;
+						// This is where the dependency coefficient
+						// is calculated and taken into account.
+						// q_score is iterated over in an outer
+						// loop.
+						q_adjusted = int( pow(10, (log10(q_score) +
+						                           (pcr_dep_count[strand*para->read_length+coord]-1) *
+						                              para->pcr_dependency +
+						                           global_dep_count*para->global_dependency)) + 0.5 );
+						if(q_adjusted < 1) {
+							q_adjusted = 1;
+						}
+						// For all 10 diploid alleles...
+						for(allele1 = 0; allele1 != 4; allele1++) {
+							for(allele2 = allele1; allele2 != 4; allele2++) {
+								// Here's where we calculate P(D|T)
+								// given all the P(dk|T)s
+								double hm = mat->p_matrix[((ubit64_t)q_adjusted << 12) | (coord << 4) | (allele1 << 2) | o_base];
+								double hn = mat->p_matrix[((ubit64_t)q_adjusted << 12) | (coord << 4) | (allele2 << 2) | o_base];
+								type_likely[allele1 << 2 | allele2] +=
+									// Here's where we calculate
+									// P(dk|T) given P(dk|Hm) and
+									// P(dk|Hn); see p8 of the
+									// Genome Res paper
+									log10(0.5 * hm + 0.5 * hn);
+							}
+						}
+					}
+				}
 			}
 		}
 	}
-	// Fill in a window's worth of 0s
-	Pos_info::clear(&sites[read_len], win_size);
-	for(i = read_len; i != read_len + win_size; i++) {
-		sites[i].ori = 0xFF;
-		sites[i].pos = sites[i-1].pos+1;
+}
+
+/**
+ * The log10 genotype priors for the site at pos: those of its reference
+ * base, or in -2 mode, those worked out for a known SNP there.
+ */
+const rate_t * Call_win::site_prior(int pos, small_int ori, Chr_info * chr, Prob_matrix * mat, Parameter * para) {
+	if ( (ori & 0x8) && para->refine_mode) {
+		return chr->find_snp(pos)->get_log_prior();
 	}
-	return 1;
+	return &mat->log_prior[((ubit64_t)ori&0x7)<<4];
 }
 
-extern unsigned long poscalled;            // positions called
-extern unsigned long poscalled_knownsnp;   // ... where there was a known SNP
-extern unsigned long poscalled_uncov_uni;  // ... uncovered by unique reads
-extern unsigned long poscalled_uncov;      // ... uncovered by any reads
-extern unsigned long poscalled_n_no_depth; // ... where ref=N and there's no reads
-extern unsigned long poscalled_nonref;     // ... where allele other than ref was called
-extern unsigned long poscalled_reported;   // ... # positions called already counted
+/**
+ * Given log10 priors and the likelihoods in type_likely, calculate the
+ * posteriors into type_prob and keep the two genotypes with the highest
+ * posterior probabilities.
+ */
+void Call_win::posterior(const rate_t * log_prior, Parameter * para, Site_call & call) {
+	char allele1, allele2, genotype, type1, type2;
+	memset(type_prob, 0, sizeof(rate_t) * 17);
+	type2 = type1 = 16;
+	for (allele1 = 0; allele1 != 4; allele1++) {
+		for (allele2 = allele1; allele2 != 4; allele2++) {
+			genotype = allele1 << 2 | allele2;
+			if (para->is_monoploid && allele1 != allele2) {
+				continue;
+			}
+			type_prob[genotype] = type_likely[genotype] + log_prior[genotype];
 
-static unsigned long report_every = 100000;
+			if (type_prob[genotype] >= type_prob[type1] || type1 == 16) {
+				type2 = type1;
+				type1 = genotype; // new most-likely genotype
+			}
+			else if (type_prob[genotype] >= type_prob[type2] || type2 ==16) {
+				type2 = genotype; // new second-most-likely genotype
+			}
+		}
+	}
+	call.type1 = type1, call.type2 = type2;
+}
+
+/**
+ * Quality of the consensus call: the posterior margin of the best
+ * genotype, penalised by the rank sum test (-u) and capped by the
+ * quality margins of the observed bases.
+ */
+void Call_win::cns_quality(int sub, Prob_matrix * mat, Parameter * para, Site_call & call) {
+	char type1 = call.type1, base1 = call.base1, base2 = call.base2;
+	int q_cns;
+	if (para->rank_sum_mode) {
+		call.rank_sum = rank_test(sub, type1, mat->p_rank, para);
+	}
+	else {
+		call.rank_sum = 1.0;
+	}
+
+	if(call.rank_sum == 0.0) {
+		// avoid double genotype overflow
+		q_cns = 0;
+	}
+	else {
+		// Quality of the consensus call is related to the
+		// difference between the probabilities of the first and
+		// second most probable calls.
+		q_cns = (int)(10*(type_prob[type1] -
+		                  type_prob[call.type2]) +
+		              10*log10(call.rank_sum));
+	}
 
-int Call_win::call_cns(Chr_name call_name,
+	if ((type1 & 3) == ((type1 >> 2) & 3)) { // Called Homozygous
+		if (call.qual1 > 0 && base1 != (type1 & 3)) {
+			// Wired: best base is not the consensus!
+			q_cns = 0;
+		}
+		else if (/*qual2>0 &&*/ q_cns > call.qual1-call.qual2) {
+			// Should not bigger than this
+			q_cns = call.qual1-call.qual2;
+		}
+	}
+	else {	// Called Heterozygous
+		if(counts.q_sum[sub][base1] > 0 &&
+		   counts.q_sum[sub][base2] > 0 &&
+		   type1 == (base1 < base2 ? (base1 << 2 | base2) : (base2 << 2 | base1)))
+		{
+			// The best bases are in the heterozygote
+
+			// Quality is limited by the difference in quality
+			// between the second-best call and the third-best call
+			if (q_cns > call.qual2-call.qual3) {
+				q_cns = call.qual2-call.qual3;
+			}
+		}
+		else {	// Ok, wired things happened
+			q_cns = 0;
+		}
+	}
+	if(q_cns > 99) {
+		q_cns = 99;
+	}
+	if (q_cns < 0) {
+		q_cns = 0;
+	}
+	call.q_cns = q_cns;
+}
+
+int Call_win::call_cns(const Chr_name & call_name,
                        Chr_info* call_chr,
                        ubit64_t call_length,
                        Prob_matrix * mat,
                        Parameter * para,
-                       std::ofstream & consensus)
+                       std::ostream & consensus)
 {
-	std::string::size_type coord;
-	small_int k;
-	ubit64_t o_base, strand;
-	char allele1, allele2, genotype, type, type1/*best genotype*/, type2/*suboptimal genotype*/, base1, base2, base3;
-	int i, q_score, q_adjusted, qual1, qual2, qual3, q_cns, all_count1, all_count2, all_count3;
-	int global_dep_count, *pcr_dep_count;
-	pcr_dep_count = new int [para->read_length*2];
-	double  rank_sum_test_value, binomial_test_value;
-	bool is_out;
-	double * real_p_prior = new double [16];
+	Prof_timer timer(PROF_CALL);
+	char allele1, allele2, genotype, type, type1;
+	Site_call call;
 
 	if(para->verbose) {
 		clog << "  call_cns called with chr " << call_name
-		     << ", first pos: " << sites[0].pos
+		     << ", first pos: " << win_start
 		     << ", call length:" << call_length
 		     << ", is SNP only: " << para->is_snp_only
 		     << ", is region only: " << para->region_only
@@ -99,54 +467,52 @@ int Call_win::call_cns(Chr_name call_name,
 	   para->region_only &&
 	   call_chr->get_regions().size() == 1)
 	{
-		if(call_chr->get_regions()[0].first >= sites[0].pos + call_length) {
+		if(call_chr->get_regions()[0].first >= win_start + call_length) {
 			// Skip this window - too early
 			if(para->verbose) {
-				clog << "  Skipping " << sites[0].pos << " because it's too early" << endl;
+				clog << "  Skipping " << win_start << " because it's too early" << endl;
 			}
 			return -1;
 		}
-		if(call_chr->get_regions()[0].second <= sites[0].pos) {
+		if(call_chr->get_regions()[0].second <= win_start) {
 			// Skip this window - too late
 			if(para->verbose) {
-				clog << "  Skipping " << sites[0].pos << " because it's too late" << endl;
+				clog << "  Skipping " << win_start << " because it's too late" << endl;
 			}
 			return -2;
 		}
 	}
+	call_chr->decode(win_start, call_length, ref_code);
 	// Iterate over every reference position that we'd like to call
 	for(std::string::size_type j = 0; j != call_length; j++) {
-		if(para->region_only && !call_chr->is_in_region(sites[j].pos)) {
+		const int pos = win_start + j, sub = slot(pos);
+		if(para->region_only && !call_chr->is_in_region(pos)) {
 			// Skip region that user asked us to skip using -T
 			continue;
 		}
-		if((++poscalled % report_every) == 0) {
-			poscalled_reported += report_every;
-			if(para->verbose) {
-				clog << "  Processed " << poscalled << " positions" << endl;
-			}
-			if(para->hadoop_out) {
-				cerr << "reporter:counter:SOAPsnp,Positions called," << report_every << endl;
-			}
+		count_position(para);
+		if(out_index != NULL && out_index->wants(call_name, pos)) {
+			out_index->add(call_name, pos, (long long)consensus.tellp());
 		}
 		// Get "original" reference base
-		sites[j].ori = (call_chr->get_bin_base(sites[j].pos))&0xF;
+		counts.ori[sub] = ref_code[j];
 		// Check whether this is a known SNP that we should dump the
 		// consensus for even if -q is specified
-		bool known_snp = (((sites[j].ori & 0x8) != 0) && para->dump_dbsnp_evidence);
-		if((sites[j].ori & 0x8) != 0) poscalled_knownsnp++;
+		bool known_snp = (((counts.ori[sub] & 0x8) != 0) && para->dump_dbsnp_evidence);
+		if((counts.ori[sub] & 0x8) != 0) poscalled_knownsnp++;
 
 		// Check whether we can skip this reference position entirely
 		// because (a) we're only interested in SNPs, and (b) the
 		// position is not covered by any evidence that we can use to
 		// call SNPs.
-		if(sites[j].dep_uni == 0) poscalled_uncov_uni++;
-		if(sites[j].depth == 0) poscalled_uncov++;
-		if(sites[j].dep_uni == 0 && para->is_snp_only) {
-			assert(sites[j].count_uni[0] == 0);
-			assert(sites[j].count_uni[1] == 0);
-			assert(sites[j].count_uni[2] == 0);
-			assert(sites[j].count_uni[3] == 0);
+		if(counts.dep_uni[sub] == 0) poscalled_uncov_uni++;
+		if(counts.depth[sub] == 0) poscalled_uncov++;
+		if(para->max_depth > 0 && counts.dep_uni[sub] > para->max_depth) poscalled_downsampled++;
+		if(counts.dep_uni[sub] == 0 && para->is_snp_only) {
+			assert(counts.count_uni[sub][0] == 0);
+			assert(counts.count_uni[sub][1] == 0);
+			assert(counts.count_uni[sub][2] == 0);
+			assert(counts.count_uni[sub][3] == 0);
 			if(known_snp) {
 				// This is a known-SNP site that is not covered by any
 				// alignments; if the user asked us to dump all dbSNP
@@ -154,23 +520,28 @@ int Call_win::call_cns(Chr_name call_name,
 				// there was no coverage at the site.
 				consensus << "K"
 				          << '\t' << call_name // chromosome name
-				          << '\t' << (sites[j].pos+1)
-				          << '\t' << ("ACTGNNNN"[(sites[j].ori & 0x7)]) // ref allele
+				          << '\t' << (pos+1)
+				          << '\t' << ("ACTGNNNN"[(counts.ori[sub] & 0x7)]) // ref allele
 				          << '\t' << "no-coverage"
 				          << endl;
 			}
 			continue;
 		}
 		// N on the reference, no "depth"
-		bool n_no_dep = ((sites[j].ori & 4) != 0)/*an N*/ && sites[j].depth == 0;
+		bool n_no_dep = ((counts.ori[sub] & 4) != 0)/*an N*/ && counts.depth[sub] == 0;
 		if(n_no_dep) poscalled_n_no_depth++;
+		if(!para->is_snp_only && n_no_dep && para->block_qual >= 0 && !known_snp) {
+			add_to_block(call_name, pos, 0, 0, consensus);
+			continue;
+		}
 		if(!para->is_snp_only && n_no_dep) {
+			flush_block(call_name, consensus);
 			// CNS text format:
 			// ChrID\tPos\tRef\tCns\tQual\tBase1\tAvgQ1\tCountUni1\tCountAll1\tBase2\tAvgQ2\tCountUni2\tCountAll2\tDepth\tRank_sum\tCopyNum\tSNPstauts\n"
 			if(!para->glf_format) {
 				consensus << call_name
 				          << '\t'
-				          << (sites[j].pos+1)
+				          << (pos+1)
 				          << "\tN\tN\t0\tN\t0\t0\t0\tN\t0\t0\t0\t0\t1.000\t255.000\t0"
 				          << endl;
 			}
@@ -181,176 +552,16 @@ int Call_win::call_cns(Chr_name call_name,
 				}
 				consensus<<flush;
 				if(!consensus.good()) {
-					cerr<<"Broken ofstream after writting Position "<<(sites[j].pos+1)<<" at "<<call_name<<endl;
+					cerr<<"Broken ofstream after writting Position "<<(pos+1)<<" at "<<call_name<<endl;
 					exit(255);
 				}
 			}
 			continue;
 		}
-		base1 = 0, base2 = 0, base3 = 0;
-		qual1 = -1, qual2 = -2, qual3 = -3;
-		all_count1 = 0, all_count2 = 0, all_count3 = 0;
-		// .dep_uni = Depth of unique bases?
-		if(sites[j].dep_uni) {
-			// This position is uniquely covered by at least one
-			// nucleotide.  BTL: This loop seems to collect the most
-			// frequent three bases according to sum-of-Phred-calls
-			// for that base.  sites[].q_sum is already calculated
-			for(i = 0; i != 4; i++) {
-				// i is four kind of alleles
-				if(sites[j].q_sum[i] >= qual1) {
-					base3 = base2;
-					qual3 = qual2;
-					base2 = base1;
-					qual2 = qual1;
-					base1 = i;
-					qual1 = sites[j].q_sum[i];
-				}
-				else if (sites[j].q_sum[i] >= qual2) {
-					base3 = base2;
-					qual3 = qual2;
-					base2 = i;
-					qual2  = sites[j].q_sum[i];
-				}
-				else if (sites[j].q_sum[i] >= qual3) {
-					base3 = i;
-					qual3  = sites[j].q_sum[i];
-				}
-				else {
-					;
-				}
-			}
-			if(qual1 == 0) {
-				// Adjust the best base so that things won't look ugly
-				// if the pos is not covered
-				base1 = (sites[j].ori & 7);
-			}
-			else if(qual2 ==0 && base1 != (sites[j].ori & 7)) {
-				base2 = (sites[j].ori & 7);
-			}
-			else {
-				;
-			}
-		} // if(sites[j].dep_uni)
-		else {
-			// This position is covered by all repeats
-			for(i = 0; i != 4; i++) {
-				if(sites[j].count_all[i] >= all_count1) {
-					base3 = base2;
-					all_count3 = all_count2;
-					base2 = base1;
-					all_count2 = all_count1;
-					base1 = i;
-					all_count1 = sites[j].count_all[i];
-				}
-				else if (sites[j].count_all[i] >= all_count2) {
-					base3 = base2;
-					all_count3 = all_count2;
-					base2 = i;
-					all_count2  = sites[j].count_all[i];
-				}
-				else if (sites[j].count_all[i] >= all_count3) {
-					base3 = i;
-					all_count3  = sites[j].count_all[i];
-				}
-			}
-			if(all_count1 == 0) {
-				// none found
-				base1 = (sites[j].ori&7);
-			}
-			else if(all_count2 == 0 && base1 != (sites[j].ori&7)) {
-				base2 = (sites[j].ori&7);
-			}
-		}
+		top_bases(sub, call);
 
 		// Calculate likelihood
-		for(genotype = 0; genotype != 16; genotype++){
-			mat->type_likely[genotype] = 0.0;
-		}
-
-		//
-		// The next set of nested loops is looping over (a) the H, q
-		// and c dimensions of the 4-dim recal matrix, then (b) over
-		// all aligned bases matching that H, q and c, then (c) over
-		// all possible alleles for the current reference position.
-		// The result is that each aligned base's mojo gets spread
-		// across the candidate alleles according to the equations in
-		// the Genome Res paper.
-		//
-
-#ifdef FAST_BOUNDS
-		char qmin = (sites[j].qmin == 0 ? 1 : sites[j].qmin-1);
-		char qmax = (sites[j].qmax == 0 ? 0 : sites[j].qmax-1);
-		small_int coordmin = (sites[j].coordmin == 0 ? 1 : sites[j].coordmin-1);
-		small_int coordmax = (sites[j].coordmax == 0 ? 0 : sites[j].coordmax-1);
-#endif
-		// Looping over haplo-genotypes (H) in the 4-dim table?
-		for(o_base = 0; o_base != 4; o_base++) {
-			if(sites[j].count_uni[o_base] == 0) {
-				// No unique alignments with this reference haplotype
-				continue;
-			}
-			// Reset the
-			global_dep_count = -1;
-			memset(pcr_dep_count, 0, sizeof(int) * 2 * para->read_length);
-			// Looping over quality scores (q) in the 4-dim table
-#ifdef FAST_BOUNDS
-			for(q_score = qmax; q_score >= qmin; q_score--) {
-#else
-			for(q_score = para->q_max - para->q_min; q_score != -1; q_score--) {
-#endif
-				// Looping over cycles (c) in the 4-dim table
-#ifdef FAST_BOUNDS
-				for(coord = coordmin; coord <= coordmax; coord++) {
-#else
-				for(coord = 0; coord != para->read_length; coord++) {
-#endif
-					// Looping over reference strands
-					for(strand = 0; strand != 2; strand++) {
-						// Now iterate over all the aligned bases with:
-						//  (a) character 'o_base'
-						//  (b) ...aligned to reference strand 'strand'
-						//  (c) ...with quality score 'q_score'
-						//  (d) ...generated in sequencing cycle 'coord'
-						const int bi = o_base << 15 | strand << 14 | q_score << 8 | coord;
-						for(k = 0; k != sites[j].base_info[bi]; k++) {
-							// pcr_dep_count is indexed by coordinate,
-							// and cares about which strand was read
-							if(pcr_dep_count[strand*para->read_length+coord] == 0) {
-								global_dep_count += 1; // sets it to 0
-							}
-							pcr_dep_count[strand*para->read_length+coord] += 1;
-							// This is where the dependency coefficient
-							// is calculated and taken into account.
-							// q_score is iterated over in an outer
-							// loop.
-							q_adjusted = int( pow(10, (log10(q_score) +
-							                           (pcr_dep_count[strand*para->read_length+coord]-1) *
-							                              para->pcr_dependency +
-							                           global_dep_count*para->global_dependency)) + 0.5 );
-							if(q_adjusted < 1) {
-								q_adjusted = 1;
-							}
-							// For all 10 diploid alleles...
-							for(allele1 = 0; allele1 != 4; allele1++) {
-								for(allele2 = allele1; allele2 != 4; allele2++) {
-									// Here's where we calculate P(D|T)
-									// given all the P(dk|T)s
-									double hm = mat->p_matrix[((ubit64_t)q_adjusted << 12) | (coord << 4) | (allele1 << 2) | o_base];
-									double hn = mat->p_matrix[((ubit64_t)q_adjusted << 12) | (coord << 4) | (allele2 << 2) | o_base];
-									mat->type_likely[allele1 << 2 | allele2] +=
-										// Here's where we calculate
-										// P(dk|T) given P(dk|Hm) and
-										// P(dk|Hn); see p8 of the
-										// Genome Res paper
-										log10(0.5 * hm + 0.5 * hn);
-								}
-							}
-						}
-					}
-				}
-			}
-		}
+		likelihood(sub, mat, para);
 
 		//
 		// The GLF format takes information about copy-number depth.
@@ -358,227 +569,298 @@ int Call_win::call_cns(Chr_name call_name,
 		if(1==para->glf_format) {
 			// Generate GLFv2 format
 			int copy_num;
-			if(sites[j].depth == 0) {
+			if(counts.depth[sub] == 0) {
 				copy_num = 15;
 			}
 			else {
-				copy_num = int(1.442695041*log(sites[j].repeat_time/sites[j].depth));
+				copy_num = int(1.442695041*log(counts.repeat_time[sub]/counts.depth[sub]));
 				if(copy_num > 15) {
 					copy_num = 15;
 				}
 			}
-			if(sites[j].depth > 255) {
-				sites[j].depth = 255;
+			if(counts.depth[sub] > 255) {
+				counts.depth[sub] = 255;
 			}
-			consensus << (unsigned char)(glf_base_code[sites[j].ori&7]<<4|((sites[j].depth>>4)&0xF))<<(unsigned char)((sites[j].depth&0xF)<<4|copy_num&0xF)<<flush;
+			consensus << (unsigned char)(glf_base_code[counts.ori[sub]&7]<<4|((counts.depth[sub]>>4)&0xF))<<(unsigned char)((counts.depth[sub]&0xF)<<4|copy_num&0xF)<<flush;
 			type1 = 0;
 			// Find the largest likelihood
 			for (allele1=0; allele1!=4; allele1++) {
 				for (allele2=allele1; allele2!=4; allele2++) {
 					genotype = allele1 << 2 | allele2;
-					if (mat->type_likely[genotype] > mat->type_likely[type1]) {
+					if (type_likely[genotype] > type_likely[type1]) {
 						type1 = genotype;
 					}
 				}
 			}
 			for(type = 0; type != 10; type++) {
-				if(mat->type_likely[type1] -
-				   mat->type_likely[glf_type_code[type]] > 25.5)
+				if(type_likely[type1] -
+				   type_likely[glf_type_code[type]] > 25.5)
 				{
 					consensus << (unsigned char)255;
 				} else {
 					consensus << (unsigned char)(unsigned int)
-						(10 * (mat->type_likely[type1] -
-						       mat->type_likely[glf_type_code[type]]));
+						(10 * (type_likely[type1] -
+						       type_likely[glf_type_code[type]]));
 				}
 			}
 			consensus << flush;
 			if(!consensus.good()) {
-				cerr << "Broken ofstream after writing Position " << (sites[j].pos+1) << " at " << call_name << endl;
+				cerr << "Broken ofstream after writing Position " << (pos+1) << " at " << call_name << endl;
 				exit(255);
 			}
 			continue;
 		}
-		// Calculate prior probability
-		memcpy(real_p_prior, &mat->p_prior[((ubit64_t)sites[j].ori&0x7)<<4], sizeof(double)*16);
-		if ( (sites[j].ori & 0x8) && para->refine_mode) {
-			// Refine the prior probability by taking into account that
-			// this position is the site of a known SNP
-			snp_p_prior_gen(real_p_prior, call_chr->find_snp(sites[j].pos), para, sites[j].ori);
-		}
-		// Given priors and likelihoods, calculate posteriors and keep
-		// the two genotypes with the highest posterior probabilities.
-		memset(mat->type_prob, 0, sizeof(rate_t) * 17);
-		type2 = type1 = 16;
-		for (allele1 = 0; allele1 != 4; allele1++) {
-			for (allele2 = allele1; allele2 != 4; allele2++) {
-				genotype = allele1 << 2 | allele2;
-				if (para->is_monoploid && allele1 != allele2) {
-					continue;
-				}
-				mat->type_prob[genotype] = mat->type_likely[genotype] + log10(real_p_prior[genotype]) ;
-
-				if (mat->type_prob[genotype] >= mat->type_prob[type1] || type1 == 16) {
-					type2 = type1;
-					type1 = genotype; // new most-likely genotype
-				}
-				else if (mat->type_prob[genotype] >= mat->type_prob[type2] || type2 ==16) {
-					type2 = genotype; // new second-most-likely genotype
-				}
-			}
-		}
+		// Posteriors, from the precomputed priors
+		posterior(site_prior(pos, counts.ori[sub], call_chr, mat, para), para, call);
 		if(2 == para->glf_format) {
 			// Generate GLFv2 format
 			int copy_num;
-			if(sites[j].depth == 0) {
+			if(counts.depth[sub] == 0) {
 				copy_num = 15;
 			}
 			else {
-				copy_num = int(1.442695041*log(sites[j].repeat_time/sites[j].depth));
+				copy_num = int(1.442695041*log(counts.repeat_time[sub]/counts.depth[sub]));
 				if(copy_num>15) {
 					copy_num = 15;
 				}
 			}
-			if(sites[j].depth >255) {
-				sites[j].depth = 255;
+			if(counts.depth[sub] >255) {
+				counts.depth[sub] = 255;
 			}
-			consensus<<(unsigned char)(glf_base_code[sites[j].ori&7]<<4|((sites[j].depth>>4)&0xF))<<(unsigned char)((sites[j].depth&0xF)<<4|copy_num&0xF)<<flush;
+			consensus<<(unsigned char)(glf_base_code[counts.ori[sub]&7]<<4|((counts.depth[sub]>>4)&0xF))<<(unsigned char)((counts.depth[sub]&0xF)<<4|copy_num&0xF)<<flush;
 			type1 = 0;
 			// Find the largest likelihood
 			for (allele1=0; allele1!=4; allele1++) {
 				for (allele2=allele1; allele2!=4; allele2++) {
 					genotype = allele1<<2|allele2;
-					if (mat->type_prob[genotype] > mat->type_prob[type1]) {
+					if (type_prob[genotype] > type_prob[type1]) {
 						type1 = genotype;
 					}
 				}
 			}
 			for(type=0;type!=10;type++) {
-				if(mat->type_prob[type1]-mat->type_prob[glf_type_code[type]]>25.5) {
+				if(type_prob[type1]-type_prob[glf_type_code[type]]>25.5) {
 					consensus<<(unsigned char)255;
 				}
 				else {
-					consensus<<(unsigned char)(unsigned int)(10*(mat->type_prob[type1]-mat->type_prob[glf_type_code[type]]));
+					consensus<<(unsigned char)(unsigned int)(10*(type_prob[type1]-type_prob[glf_type_code[type]]));
 				}
 			}
 			consensus<<flush;
 			if(!consensus.good()) {
-				cerr<<"Broken ofstream after writting Position "<<(sites[j].pos+1)<<" at "<<call_name<<endl;
+				cerr<<"Broken ofstream after writting Position "<<(pos+1)<<" at "<<call_name<<endl;
 				exit(255);
 			}
 			continue;
 		}
-		is_out = true; // Check if the position needs to be output, useful in snp-only mode
-
-		if (para->rank_sum_mode) {
-			rank_sum_test_value = rank_test(sites[j], type1, mat->p_rank, para);
-		}
-		else {
-			rank_sum_test_value = 1.0;
-		}
-
-		if(rank_sum_test_value == 0.0) {
-			// avoid double genotype overflow
-			q_cns = 0;
-		}
-		else {
-			// Quality of the consensus call is related to the
-			// difference between the probabilities of the first and
-			// second most probable calls.
-			q_cns = (int)(10*(mat->type_prob[type1] -
-			                  mat->type_prob[type2]) +
-			              10*log10(rank_sum_test_value));
-		}
-
-		if ((type1 & 3) == ((type1 >> 2) & 3)) { // Called Homozygous
-			if (qual1 > 0 && base1 != (type1 & 3)) {
-				// Wired: best base is not the consensus!
-				q_cns = 0;
-			}
-			else if (/*qual2>0 &&*/ q_cns > qual1-qual2) {
-				// Should not bigger than this
-				q_cns = qual1-qual2;
-			}
-		}
-		else {	// Called Heterozygous
-			if(sites[j].q_sum[base1] > 0 &&
-			   sites[j].q_sum[base2] > 0 &&
-			   type1 == (base1 < base2 ? (base1 << 2 | base2) : (base2 << 2 | base1)))
-			{
-				// The best bases are in the heterozygote
-
-				// Quality is limited by the difference in quality
-				// between the second-best call and the third-best call
-				if (q_cns > qual2-qual3) {
-					q_cns = qual2-qual3;
-				}
-			}
-			else {	// Ok, wired things happened
-				q_cns = 0;
-			}
-		}
-		if(q_cns > 99) {
-			q_cns = 99;
-		}
-		if (q_cns < 0) {
-			q_cns = 0;
-		}
+		cns_quality(sub, mat, para, call);
 		// ChrID\tPos\tRef\tCns\tQual\tBase1\tAvgQ1\tCountUni1\tCountAll1\tBase2\tAvgQ2\tCountUni2\tCountAll2\tDepth\tRank_sum\tCopyNum\tSNPstauts\n"
-		bool non_ref = (abbv[type1] != "ACTGNNNN"[(sites[j].ori&0x7)] && sites[j].depth > 0);
+		bool non_ref = (abbv[call.type1] != "ACTGNNNN"[(counts.ori[sub]&0x7)] && counts.depth[sub] > 0);
 		if(non_ref) poscalled_nonref++;
+		if(para->block_qual >= 0 && !known_snp &&
+		   (counts.depth[sub] == 0 || (!non_ref && call.base1 < 4 && call.q_cns >= para->block_qual)))
+		{
+			add_to_block(call_name, pos, counts.depth[sub], call.q_cns, consensus);
+			continue;
+		}
 		if(!para->is_snp_only || known_snp || non_ref) {
-			if(base1 < 4 && base2 < 4) {
+			flush_block(call_name, consensus);
+			if(call.base1 < 4 && call.base2 < 4) {
 				if(known_snp && !non_ref) consensus << "K\t";
 				consensus << call_name // chromosome name
-				          << '\t' << (sites[j].pos+1) // position
-				          << '\t' << ("ACTGNNNN"[(sites[j].ori & 0x7)]) // reference allele
-				          << '\t' << abbv[type1] // called type
-				          << '\t' << q_cns // quality of call
-				          << '\t' << ("ACTGNNNN"[base1]) // base1 call
-				          << '\t' << (sites[j].q_sum[base1] == 0 ? 0 : sites[j].q_sum[base1]/sites[j].count_uni[base1])
-				          << '\t' << sites[j].count_uni[base1]
-				          << '\t' << sites[j].count_all[base1]
-				          << '\t' << ("ACTGNNNN"[base2]) // base2 call
-				          << '\t' << (sites[j].q_sum[base2]==0?0:sites[j].q_sum[base2]/sites[j].count_uni[base2])
-				          << '\t' << sites[j].count_uni[base2]
-				          << '\t' << sites[j].count_all[base2]
-				          << '\t' << sites[j].depth
-				          << '\t' << sites[j].dep_pair
-				          << '\t' << showpoint << rank_sum_test_value
-				          << '\t' << (sites[j].depth == 0 ? 255 : (double)(sites[j].repeat_time)/sites[j].depth)
-				          << '\t' << ((sites[j].ori & 8) ? 1 : 0) // dbSNP locus?
+				          << '\t' << (pos+1) // position
+				          << '\t' << ("ACTGNNNN"[(counts.ori[sub] & 0x7)]) // reference allele
+				          << '\t' << abbv[call.type1] // called type
+				          << '\t' << call.q_cns // quality of call
+				          << '\t' << ("ACTGNNNN"[call.base1]) // base1 call
+				          << '\t' << (counts.q_sum[sub][call.base1] == 0 ? 0 : counts.q_sum[sub][call.base1]/counts.count_uni[sub][call.base1])
+				          << '\t' << counts.count_uni[sub][call.base1]
+				          << '\t' << counts.count_all[sub][call.base1]
+				          << '\t' << ("ACTGNNNN"[call.base2]) // base2 call
+				          << '\t' << (counts.q_sum[sub][call.base2]==0?0:counts.q_sum[sub][call.base2]/counts.count_uni[sub][call.base2])
+				          << '\t' << counts.count_uni[sub][call.base2]
+				          << '\t' << counts.count_all[sub][call.base2]
+				          << '\t' << counts.depth[sub]
+				          << '\t' << counts.dep_pair[sub]
+				          << '\t' << showpoint << call.rank_sum
+				          << '\t' << (counts.depth[sub] == 0 ? 255 : (double)(counts.repeat_time[sub])/counts.depth[sub])
+				          << '\t' << ((counts.ori[sub] & 8) ? 1 : 0) // dbSNP locus?
 				          << endl;
 			}
-			else if(base1 < 4) {
+			else if(call.base1 < 4) {
 				if(known_snp && !non_ref) consensus << "K\t";
 				consensus << call_name // chromosome name
-				          << '\t' << (sites[j].pos+1) // position
-				          << '\t' << ("ACTGNNNN"[(sites[j].ori&0x7)]) // reference char
-				          << '\t' << abbv[type1] // called type
-				          << '\t' << q_cns // quality of call
-				          << '\t' << ("ACTGNNNN"[base1]) // first heterozygous base
-				          << '\t' << (sites[j].q_sum[base1] == 0 ? 0 : sites[j].q_sum[base1]/sites[j].count_uni[base1])
-				          << '\t' << sites[j].count_uni[base1]
-				          << '\t' << sites[j].count_all[base1]
+				          << '\t' << (pos+1) // position
+				          << '\t' << ("ACTGNNNN"[(counts.ori[sub]&0x7)]) // reference char
+				          << '\t' << abbv[call.type1] // called type
+				          << '\t' << call.q_cns // quality of call
+				          << '\t' << ("ACTGNNNN"[call.base1]) // first heterozygous base
+				          << '\t' << (counts.q_sum[sub][call.base1] == 0 ? 0 : counts.q_sum[sub][call.base1]/counts.count_uni[sub][call.base1])
+				          << '\t' << counts.count_uni[sub][call.base1]
+				          << '\t' << counts.count_all[sub][call.base1]
 				          << '\t' << "N\t0\t0\t0"
-				          << '\t' << sites[j].depth
-				          << '\t' << sites[j].dep_pair
-				          << '\t' << showpoint << rank_sum_test_value
-				          << '\t' << (sites[j].depth == 0 ? 255 : (double)(sites[j].repeat_time)/sites[j].depth)
-				          << '\t' << ((sites[j].ori & 8) ? 1 : 0) // dbSNP locus?
+				          << '\t' << counts.depth[sub]
+				          << '\t' << counts.dep_pair[sub]
+				          << '\t' << showpoint << call.rank_sum
+				          << '\t' << (counts.depth[sub] == 0 ? 255 : (double)(counts.repeat_time[sub])/counts.depth[sub])
+				          << '\t' << ((counts.ori[sub] & 8) ? 1 : 0) // dbSNP locus?
 				          << endl;
 			}
 			else {
 				if(known_snp && !non_ref) consensus << "K\t";
 				consensus << call_name
 				          << '\t'
-				          << (sites[j].pos+1)
+				          << (pos+1)
 				          << "\tN\tN\t0\tN\t0\t0\t0\tN\t0\t0\t0\t0\t0\t1.000\t255.000\t0"
 				          << endl;
 			}
 		}
 	}
-	delete [] real_p_prior;
-	delete [] pcr_dep_count;
+	return 1;
+}
+
+Joint_call::Joint_call(const std::vector<std::string> & sample_names, Parameter * para) :
+	names(sample_names), win_size(1000), calls(sample_names.size()), out_index(NULL)
+{
+	for(size_t i = 0; i != names.size(); i++) {
+		wins.push_back(new Call_win(para->read_length, win_size, para->max_depth));
+	}
+}
+
+Joint_call::~Joint_call() {
+	for(size_t i = 0; i != wins.size(); i++) {
+		delete wins[i];
+	}
+}
+
+void Joint_call::initialize(ubit64_t start) {
+	for(size_t i = 0; i != wins.size(); i++) {
+		wins[i]->initialize(start);
+	}
+}
+
+void Joint_call::recycle(int start) {
+	for(size_t i = 0; i != wins.size(); i++) {
+		wins[i]->recycle(start);
+	}
+}
+
+/// Call every remaining window of a chromosome
+void Joint_call::finish_chr(map<Chr_name, Chr_info*>::iterator chr, Prob_matrix * mat, Parameter * para, std::ostream & consensus) {
+	while(chr->second->length() > wins[0]->win_start + win_size - 1) {
+		int ret = call_cns(chr->first, chr->second, win_size, mat, para, consensus);
+		recycle();
+		if(ret == -2) break;
+	}
+	call_cns(chr->first, chr->second, chr->second->length() % win_size, mat, para, consensus);
+	recycle();
+}
+
+/**
+ * Call the current window of every sample.  Each record holds the
+ * consensus genotype, its quality and the depth of each sample; with
+ * -q, only sites where some sample has a non-reference call are
+ * written.
+ */
+int Joint_call::call_cns(const Chr_name & call_name,
+                         Chr_info* call_chr,
+                         ubit64_t call_length,
+                         Prob_matrix * mat,
+                         Parameter * para,
+                         std::ostream & consensus)
+{
+	Prof_timer timer(PROF_CALL);
+	int start = wins[0]->win_start;
+	if(para->is_snp_only &&
+	   para->region_only &&
+	   call_chr->get_regions().size() == 1)
+	{
+		if(call_chr->get_regions()[0].first >= start + call_length) {
+			return -1;
+		}
+		if(call_chr->get_regions()[0].second <= start) {
+			return -2;
+		}
+	}
+	call_chr->decode(start, call_length, wins[0]->ref_code);
+	for(std::string::size_type j = 0; j != call_length; j++) {
+		int pos = start + j;
+		if(para->region_only && !call_chr->is_in_region(pos)) {
+			continue;
+		}
+		count_position(para);
+		if(out_index != NULL && out_index->wants(call_name, pos)) {
+			out_index->add(call_name, pos, (long long)consensus.tellp());
+		}
+		char ori = wins[0]->ref_code[j];
+		int depth = 0, dep_uni = 0;
+		bool downsampled = false;
+		for(size_t i = 0; i != wins.size(); i++) {
+			Site_counts & cnt = wins[i]->counts;
+			const int sub = wins[i]->slot(pos);
+			cnt.ori[sub] = ori;
+			depth += cnt.depth[sub];
+			dep_uni += cnt.dep_uni[sub];
+			if(para->max_depth > 0 && cnt.dep_uni[sub] > para->max_depth) downsampled = true;
+		}
+		bool known_snp = (((ori & 0x8) != 0) && para->dump_dbsnp_evidence);
+		if((ori & 0x8) != 0) poscalled_knownsnp++;
+		if(dep_uni == 0) poscalled_uncov_uni++;
+		if(depth == 0) poscalled_uncov++;
+		if(downsampled) poscalled_downsampled++;
+		if(dep_uni == 0 && para->is_snp_only) {
+			if(known_snp) {
+				consensus << "K"
+				          << '\t' << call_name
+				          << '\t' << (pos+1)
+				          << '\t' << ("ACTGNNNN"[(ori & 0x7)])
+				          << '\t' << "no-coverage"
+				          << endl;
+			}
+			continue;
+		}
+		bool n_no_dep = ((ori & 4) != 0) && depth == 0;
+		if(n_no_dep) poscalled_n_no_depth++;
+		if(!para->is_snp_only && n_no_dep) {
+			consensus << call_name << '\t' << (pos+1) << "\tN";
+			for(size_t i = 0; i != wins.size(); i++) {
+				consensus << "\tN\t0\t0";
+			}
+			consensus << "\t0" << endl;
+			continue;
+		}
+		// The prior depends only on the reference, so it's shared
+		const rate_t * prior = wins[0]->site_prior(pos, ori, call_chr, mat, para);
+		bool non_ref = false;
+		for(size_t i = 0; i != wins.size(); i++) {
+			Call_win & win = *wins[i];
+			const int sub = win.slot(pos);
+			win.top_bases(sub, calls[i]);
+			win.likelihood(sub, mat, para);
+			win.posterior(prior, para, calls[i]);
+			win.cns_quality(sub, mat, para, calls[i]);
+			if(abbv[calls[i].type1] != "ACTGNNNN"[(ori&0x7)] && win.counts.depth[sub] > 0) {
+				non_ref = true;
+			}
+		}
+		if(non_ref) poscalled_nonref++;
+		if(!para->is_snp_only || known_snp || non_ref) {
+			if(known_snp && !non_ref) consensus << "K\t";
+			consensus << call_name
+			          << '\t' << (pos+1)
+			          << '\t' << ("ACTGNNNN"[(ori & 0x7)]);
+			for(size_t i = 0; i != wins.size(); i++) {
+				if(calls[i].base1 >= 4) {
+					// No usable evidence over an N, as in call_cns
+					consensus << "\tN\t0\t0";
+					continue;
+				}
+				consensus << '\t' << abbv[calls[i].type1]
+				          << '\t' << calls[i].q_cns
+				          << '\t' << wins[i]->counts.depth[wins[i]->slot(pos)];
+			}
+			consensus << '\t' << ((ori & 8) ? 1 : 0) << endl;
+		}
+	}
 	return 1;
 }
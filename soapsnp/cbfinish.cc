@@ -0,0 +1,362 @@
+/*
+ * cbfinish.cc
+ *
+ *  Finish Crossbow's SNP calls, as CBFinish.pl does in Perl: put the
+ *  proper chromosome name back onto every record, strip the leading
+ *  zeros from its offset, and write the records of each chromosome to
+ *  <chr>.gz.  The names of the files written are printed to stdout, in
+ *  the order their chromosomes were first seen, and the Postprocess
+ *  counters to stderr.
+ *
+ *  Records are sliced at their first two tabs and copied straight into
+ *  their chromosome's buffer.  Every BLOCK bytes a buffer is handed to
+ *  a pool of threads that compress it as a gzip member of its own; a
+ *  .gz file is the members of its chromosome concatenated in order,
+ *  which gzip -d reads back as one stream.
+ */
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <queue>
+#include <cstring>
+#include <cctype>
+#include <cstdlib>
+#include <cstdio>
+#include <cerrno>
+#include <getopt.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <zlib.h>
+
+using namespace std;
+
+typedef unsigned long long ubit64_t;
+
+int usage() {
+	cerr<<"cbfinish: rename chromosomes in Crossbow SNP calls and write one gzipped file per chromosome"<<endl;
+	cerr<<"Usage: cbfinish [options] < calls"<<endl;
+	cerr<<"-m <FILE> Chromosome map; lines of \"<name> <Crossbow name>\""<<endl;
+	cerr<<"-o <DIR> Directory for the <chr>.gz files [.]"<<endl;
+	cerr<<"-t <int> Compression threads [number of CPUs]"<<endl;
+	cerr<<"-l <int> gzip compression level [6]"<<endl;
+	cerr<<"-h Display this help"<<endl;
+	exit(1);
+	return 0;
+}
+
+static const size_t BLOCK = 1 << 20;
+static int level = 6;
+
+struct Chr_out;
+
+/// BLOCK or so bytes of a chromosome's records, compressed by a worker
+struct Block {
+	Chr_out * out;
+	ubit64_t seq;
+	string data, gz;
+};
+
+struct Chr_out {
+	string name, file;
+	FILE * f;
+	string buf;
+	ubit64_t recs;
+	ubit64_t submitted, written; // blocks
+	map<ubit64_t, Block*> ready; // compressed, waiting for earlier ones
+	Chr_out() : f(NULL), recs(0), submitted(0), written(0) {}
+};
+
+/// Compress data as one gzip member into gz
+static void gzip_block(const string & data, string & gz) {
+	z_stream zs;
+	memset(&zs, 0, sizeof(zs));
+	if(deflateInit2(&zs, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		cerr << "Could not initialize zlib" << endl;
+		exit(1);
+	}
+	gz.resize(deflateBound(&zs, data.size()) + 32);
+	zs.next_in = (Bytef *)data.data();
+	zs.avail_in = data.size();
+	zs.next_out = (Bytef *)&gz[0];
+	zs.avail_out = gz.size();
+	if(deflate(&zs, Z_FINISH) != Z_STREAM_END) {
+		cerr << "Could not compress a block" << endl;
+		exit(1);
+	}
+	gz.resize(zs.total_out);
+	deflateEnd(&zs);
+}
+
+/**
+ * Workers take blocks off a queue, compress them and write out every
+ * block of the chromosome that is now next in line.  At most max_flight
+ * blocks are queued or waiting to be written at a time.
+ */
+class Gz_pool {
+	vector<pthread_t> threads;
+	queue<Block*> jobs;
+	pthread_mutex_t lock;
+	pthread_cond_t has_job, has_room;
+	size_t in_flight, max_flight;
+	bool closing, failed;
+
+	static void * run(void * arg) {
+		Gz_pool * pool = (Gz_pool *)arg;
+		while(true) {
+			pthread_mutex_lock(&pool->lock);
+			while(pool->jobs.empty() && !pool->closing) {
+				pthread_cond_wait(&pool->has_job, &pool->lock);
+			}
+			if(pool->jobs.empty()) {
+				pthread_mutex_unlock(&pool->lock);
+				return NULL;
+			}
+			Block * b = pool->jobs.front();
+			pool->jobs.pop();
+			pthread_mutex_unlock(&pool->lock);
+			gzip_block(b->data, b->gz);
+			b->data.clear();
+			pthread_mutex_lock(&pool->lock);
+			Chr_out * out = b->out;
+			out->ready[b->seq] = b;
+			map<ubit64_t, Block*>::iterator it;
+			while((it = out->ready.find(out->written)) != out->ready.end()) {
+				Block * w = it->second;
+				if(fwrite(w->gz.data(), 1, w->gz.size(), out->f) != w->gz.size()) {
+					pool->failed = true;
+				}
+				out->ready.erase(it);
+				delete w;
+				out->written++;
+				pool->in_flight--;
+				pthread_cond_signal(&pool->has_room);
+			}
+			pthread_mutex_unlock(&pool->lock);
+		}
+	}
+public:
+	Gz_pool(int n) : in_flight(0), max_flight(2 * n + 2), closing(false), failed(false) {
+		pthread_mutex_init(&lock, NULL);
+		pthread_cond_init(&has_job, NULL);
+		pthread_cond_init(&has_room, NULL);
+		threads.resize(n);
+		for(int i = 0; i != n; i++) {
+			if(pthread_create(&threads[i], NULL, run, this) != 0) {
+				cerr << "Could not start compression thread" << endl;
+				exit(1);
+			}
+		}
+	}
+	~Gz_pool() {
+		pthread_mutex_destroy(&lock);
+		pthread_cond_destroy(&has_job);
+		pthread_cond_destroy(&has_room);
+	}
+	/// Queue out's buffered records as its next block
+	void submit(Chr_out * out) {
+		Block * b = new Block;
+		b->out = out;
+		b->data.swap(out->buf);
+		out->buf.reserve(BLOCK + 1024);
+		pthread_mutex_lock(&lock);
+		while(in_flight >= max_flight) {
+			pthread_cond_wait(&has_room, &lock);
+		}
+		b->seq = out->submitted++;
+		in_flight++;
+		jobs.push(b);
+		pthread_cond_signal(&has_job);
+		pthread_mutex_unlock(&lock);
+	}
+	/// Wait for every block to be written; false if a write failed
+	bool finish() {
+		pthread_mutex_lock(&lock);
+		closing = true;
+		pthread_cond_broadcast(&has_job);
+		pthread_mutex_unlock(&lock);
+		for(size_t i = 0; i != threads.size(); i++) {
+			pthread_join(threads[i], NULL);
+		}
+		return !failed;
+	}
+};
+
+static bool is_space(char c) {
+	return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f' || c == '\v';
+}
+
+/// True for lines CBFinish.pl skips: blank or FAKE
+static bool skip_line(const char * s, const char * end) {
+	while(s != end && is_space(*s)) s++;
+	while(end != s && is_space(end[-1])) end--;
+	return s == end || (end - s == 4 && memcmp(s, "FAKE", 4) == 0);
+}
+
+/// Append the integer value of the decimal field [s, e), as Perl's int()
+/// would read it: leading zeros and anything after the digits dropped
+static void append_int(string & buf, const char * s, const char * e) {
+	while(s != e && (*s == ' ' || *s == '\t')) s++;
+	bool neg = false;
+	if(s != e && (*s == '-' || *s == '+')) {
+		neg = (*s == '-');
+		s++;
+	}
+	while(s != e && *s == '0' && s + 1 != e && isdigit(s[1])) s++;
+	const char * d = s;
+	while(d != e && isdigit(*d)) d++;
+	if(d == s) {
+		buf += '0';
+		return;
+	}
+	if(neg && !(d - s == 1 && *s == '0')) buf += '-';
+	buf.append(s, d - s);
+}
+
+int main(int argc, char **argv) {
+	int c;
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	int threads = (ncpu > 0 ? (int)ncpu : 1);
+	string cmap_file, out_dir(".");
+	while((c = getopt(argc, argv, "m:o:t:l:h")) != -1) {
+		switch(c) {
+			case 'm': cmap_file = optarg; break;
+			case 'o': out_dir = optarg; break;
+			case 't': threads = atoi(optarg); break;
+			case 'l': level = atoi(optarg); break;
+			case 'h': usage(); break;
+			default: usage();
+		}
+	}
+	if(optind != argc) {
+		usage();
+	}
+	if(threads < 1 || level < 0 || level > 9) {
+		cerr << "-t must be positive and -l from 0 to 9" << endl;
+		exit(1);
+	}
+	map<string, string> cmap;
+	if(!cmap_file.empty()) {
+		ifstream in(cmap_file.c_str());
+		if(!in) {
+			cerr << "Could not open chromosome map " << cmap_file << endl;
+			exit(1);
+		}
+		for(string line; getline(in, line);) {
+			istringstream s(line);
+			string name, cb_name;
+			if(s >> name >> cb_name) {
+				cmap[cb_name] = name;
+			}
+		}
+	}
+
+	Gz_pool pool(threads);
+	map<string, Chr_out*> outs, by_cb_name; // by final and Crossbow name
+	vector<Chr_out*> order;
+	ubit64_t lines = 0;
+	Chr_out * last = NULL;
+	string chr;
+	// Input is read in blocks; a partial last line moves to the front
+	size_t in_size = 1 << 20, in_used = 0;
+	char * in = (char *)malloc(in_size);
+	bool eof = false;
+	while(!eof || in_used > 0) {
+		if(!eof) {
+			if(in_used == in_size) {
+				in_size *= 2;
+				in = (char *)realloc(in, in_size);
+			}
+			size_t n = fread(in + in_used, 1, in_size - in_used, stdin);
+			in_used += n;
+			eof = (n == 0);
+		}
+		char * p = in, * end = in + in_used;
+		while(p != end) {
+			char * nl = (char *)memchr(p, '\n', end - p);
+			if(nl == NULL) {
+				if(!eof) break;
+				nl = end;
+			}
+			char * line = p;
+			char * line_end = (nl == end) ? end : nl + 1; // keeps the newline
+			p = line_end;
+			if(skip_line(line, nl)) {
+				continue;
+			}
+			lines++;
+			char * tab1 = (char *)memchr(line, '\t', nl - line);
+			char * chr_end = (tab1 == NULL) ? nl : tab1;
+			// Records of a chromosome come in runs, so the last one is
+			// usually the one
+			if(last == NULL || (size_t)(chr_end - line) != chr.size() || memcmp(line, chr.data(), chr.size()) != 0) {
+				chr.assign(line, chr_end);
+				map<string, Chr_out*>::iterator it = by_cb_name.find(chr);
+				if(it == by_cb_name.end()) {
+					map<string, string>::iterator m = cmap.find(chr);
+					const string & name = (m == cmap.end()) ? chr : m->second;
+					map<string, Chr_out*>::iterator o = outs.find(name);
+					if(o == outs.end()) {
+						Chr_out * out = new Chr_out;
+						out->name = name;
+						out->file = out_dir + "/" + name + ".gz";
+						out->f = fopen(out->file.c_str(), "wb");
+						if(out->f == NULL) {
+							cerr << "Could not open " << out->file << " for writing: " << strerror(errno) << endl;
+							exit(1);
+						}
+						out->buf.reserve(BLOCK + 1024);
+						o = outs.insert(make_pair(name, out)).first;
+						order.push_back(out);
+						cerr << "reporter:counter:Postprocess,Chromosomes observed,1" << endl;
+					}
+					it = by_cb_name.insert(make_pair(chr, o->second)).first;
+				}
+				last = it->second;
+			}
+			string & buf = last->buf;
+			buf += last->name;
+			if(tab1 == NULL) {
+				buf.append(chr_end, line_end);
+			} else {
+				char * tab2 = (char *)memchr(tab1 + 1, '\t', nl - tab1 - 1);
+				char * off_end = (tab2 == NULL) ? nl : tab2;
+				buf += '\t';
+				append_int(buf, tab1 + 1, off_end);
+				buf.append(off_end, line_end);
+			}
+			last->recs++;
+			if(buf.size() >= BLOCK) {
+				pool.submit(last);
+			}
+		}
+		in_used = end - p;
+		memmove(in, p, in_used);
+	}
+	free(in);
+	for(size_t i = 0; i != order.size(); i++) {
+		if(!order[i]->buf.empty()) {
+			pool.submit(order[i]);
+		}
+	}
+	bool ok = pool.finish();
+	for(size_t i = 0; i != order.size(); i++) {
+		ok = (fclose(order[i]->f) == 0) && ok;
+	}
+	if(!ok) {
+		cerr << "Error writing compressed output" << endl;
+		exit(1);
+	}
+	cerr << "cbfinish: read " << lines << " lines of output" << endl;
+	for(size_t i = 0; i != order.size(); i++) {
+		cerr << "reporter:counter:Postprocess,SNPs for chromosome " << order[i]->name << "," << order[i]->recs << endl;
+		cout << order[i]->file << endl;
+	}
+	if(lines == 0) {
+		cerr << "reporter:counter:Postprocess,0-SNP invocations,1" << endl;
+	}
+	return 0;
+}
@@ -0,0 +1,203 @@
+#include "soap_snp.h"
+#include <sys/stat.h>
+#include <cstdio>
+
+Checkpoint::Checkpoint(const std::string & fn, const std::vector<std::string> & input_names) :
+	file(fn), inputs(input_names), resumed(false), start(0), out_off(0),
+	offsets(input_names.size(), -1), offset_chrs(input_names.size()),
+	counted(input_names.size(), -1), qual_hist(256, 0),
+	saved(time(NULL))
+{
+	memset(&alns, 0, sizeof(alns));
+	memset(&calls, 0, sizeof(calls));
+	for(size_t i = 0; i != inputs.size(); i++) {
+		struct stat st;
+		sizes.push_back(stat(inputs[i].c_str(), &st) == 0 ? (long long)st.st_size : -1);
+	}
+}
+
+bool Checkpoint::load() {
+	ifstream in(file.c_str());
+	if(!in) {
+		return false;
+	}
+	std::string line, key;
+	if(!getline(in, line) || line != "#SOAPsnp checkpoint") {
+		cerr << file << " is not a soapsnp checkpoint" << endl;
+		return false;
+	}
+	size_t n_in = 0, n_off = 0, n_counted = 0;
+	while(getline(in, line)) {
+		std::istringstream s(line);
+		s >> key;
+		if(key == "input") {
+			std::string name;
+			long long size;
+			if(!(s >> name >> size) || n_in >= inputs.size() ||
+			   name != inputs[n_in] || size != sizes[n_in])
+			{
+				cerr << "Checkpoint " << file << " is for other alignment inputs; starting over" << endl;
+				return false;
+			}
+			n_in++;
+		} else if(key == "chr") {
+			s >> chr;
+		} else if(key == "start") {
+			s >> start;
+		} else if(key == "output") {
+			s >> out_off;
+		} else if(key == "block") {
+			s >> block.start >> block.end >> block.min_depth >> block.min_qual >> block.covered;
+		} else if(key == "offset" && n_off < offsets.size()) {
+			s >> offsets[n_off];
+			s >> offset_chrs[n_off];
+			n_off++;
+		} else if(key == "counted" && n_counted < counted.size()) {
+			s >> counted[n_counted++];
+		} else if(key == "alignments") {
+			s >> alns.read >> alns.unique >> alns.unpaired >> alns.paired
+			  >> alns.secondary >> alns.dup >> alns.long_span;
+		} else if(key == "positions") {
+			s >> calls.called >> calls.knownsnp >> calls.uncov_uni >> calls.uncov
+			  >> calls.n_no_depth >> calls.nonref >> calls.reported >> calls.downsampled;
+		} else if(key == "window_hist") {
+			for(int i = 0; i != PROF_HIST; i++) {
+				s >> calls.prof_hist[i];
+			}
+		} else if(key == "qual_hist") {
+			size_t c;
+			if(s >> c && c < qual_hist.size()) {
+				s >> qual_hist[c];
+			}
+		} else if(key == "len_hist") {
+			size_t len;
+			if(s >> len) {
+				if(len >= len_hist.size()) {
+					len_hist.resize(len + 1, 0);
+				}
+				s >> len_hist[len];
+			}
+		} else {
+			cerr << "Wrong format in checkpoint " << file << endl;
+			return false;
+		}
+	}
+	if(n_in != inputs.size() || n_off != offsets.size() || n_counted != counted.size() || chr.empty()) {
+		cerr << "Checkpoint " << file << " is incomplete; starting over" << endl;
+		return false;
+	}
+	resumed = true;
+	return true;
+}
+
+void Checkpoint::note(const std::vector<Aln_mark> & marks, const std::string & at_chr, int at_start, int win_size) {
+	int halo = at_start / win_size - 1;
+	chr = at_chr;
+	start = at_start;
+	for(size_t i = 0; i != marks.size(); i++) {
+		const Aln_mark & m = marks[i];
+		if(m.end < 0) {
+			// Nothing taken from this input in this run yet, so it is
+			// still where this run started reading it: from the top, or
+			// from the offset of the checkpoint resumed
+			continue;
+		}
+		if(m.chr == at_chr && m.win >= halo) {
+			offsets[i] = (m.win > halo && m.prev_win == halo) ? m.prev_off : m.off;
+			offset_chrs[i] = at_chr;
+		}
+		else {
+			// Everything this input has left starts at or after at_start
+			offsets[i] = m.end;
+			offset_chrs[i] = m.chr;
+		}
+	}
+}
+
+void Checkpoint::take_counts(const std::vector<long long> & parsed) {
+	counted = parsed;
+	alns.get();
+	// Leave this thread's tallies as they are
+	calls.take();
+	calls.give();
+	qual_hist.assign(read_qual_hist, read_qual_hist + 256);
+	len_hist = read_len_hist;
+}
+
+void Checkpoint::give_counts() const {
+	Aln_counts now;
+	now.get();
+	now.read += alns.read;
+	now.unique += alns.unique;
+	now.unpaired += alns.unpaired;
+	now.paired += alns.paired;
+	now.secondary += alns.secondary;
+	now.dup += alns.dup;
+	now.long_span += alns.long_span;
+	now.set();
+	// Phase times are this run's own
+	Call_counts c = calls;
+	for(int i = 0; i != PROF_PHASES; i++) {
+		c.prof[i] = 0;
+	}
+	c.give();
+	for(size_t i = 0; i != qual_hist.size(); i++) {
+		read_qual_hist[i] += qual_hist[i];
+	}
+	if(len_hist.size() > read_len_hist.size()) {
+		read_len_hist.resize(len_hist.size(), 0);
+	}
+	for(size_t i = 0; i != len_hist.size(); i++) {
+		read_len_hist[i] += len_hist[i];
+	}
+}
+
+bool Checkpoint::save() {
+	std::string tmp = file + ".tmp";
+	ofstream out(tmp.c_str());
+	if(!out) {
+		return false;
+	}
+	out << "#SOAPsnp checkpoint\n";
+	for(size_t i = 0; i != inputs.size(); i++) {
+		out << "input\t" << inputs[i] << '\t' << sizes[i] << '\n';
+	}
+	out << "chr\t" << chr << '\n'
+	    << "start\t" << start << '\n'
+	    << "output\t" << out_off << '\n';
+	for(size_t i = 0; i != offsets.size(); i++) {
+		out << "offset\t" << offsets[i] << '\t' << offset_chrs[i] << '\n';
+	}
+	for(size_t i = 0; i != counted.size(); i++) {
+		out << "counted\t" << counted[i] << '\n';
+	}
+	out << "alignments\t" << alns.read << '\t' << alns.unique << '\t' << alns.unpaired << '\t' << alns.paired
+	    << '\t' << alns.secondary << '\t' << alns.dup << '\t' << alns.long_span << '\n';
+	out << "positions\t" << calls.called << '\t' << calls.knownsnp << '\t' << calls.uncov_uni << '\t' << calls.uncov
+	    << '\t' << calls.n_no_depth << '\t' << calls.nonref << '\t' << calls.reported << '\t' << calls.downsampled << '\n';
+	out << "window_hist";
+	for(int i = 0; i != PROF_HIST; i++) {
+		out << '\t' << calls.prof_hist[i];
+	}
+	out << '\n';
+	for(size_t c = 0; c != qual_hist.size(); c++) {
+		if(qual_hist[c] > 0) {
+			out << "qual_hist\t" << c << '\t' << qual_hist[c] << '\n';
+		}
+	}
+	for(size_t len = 0; len != len_hist.size(); len++) {
+		if(len_hist[len] > 0) {
+			out << "len_hist\t" << len << '\t' << len_hist[len] << '\n';
+		}
+	}
+	if(block.start >= 0) {
+		out << "block\t" << block.start << '\t' << block.end << '\t' << block.min_depth
+		    << '\t' << block.min_qual << '\t' << block.covered << '\n';
+	}
+	out.close();
+	if(out.fail() || rename(tmp.c_str(), file.c_str()) != 0) {
+		return false;
+	}
+	saved = time(NULL);
+	return true;
+}
@@ -11,30 +11,36 @@ bool Genome::add_chr(Chr_name & name) {
 	return insert_pair.second;
 }
 
+int Genome::chr_id(const Chr_name & name) const {
+	map<Chr_name, Chr_info*>::const_iterator it = chromosomes.find(name);
+	return it == chromosomes.end() ? -1 : it->second->id;
+}
+
 Genome::~Genome(){
 	for( map<Chr_name, Chr_info*>::iterator iter=chromosomes.begin(); iter!= chromosomes.end(); iter++ ){
 		;
 	}
 }
 Chr_info::Chr_info(const Chr_info & other) {
+	id = other.id;
 	dbsnp = other.dbsnp;
 	len = other.len;
 	elts = other.elts;
-	if (len%capacity==0) {
-		bin_seq = new ubit64_t [len/capacity];
-		memcpy(bin_seq, other.bin_seq, sizeof(ubit64_t)*len/capacity);
-	}
-	else {
-		bin_seq = new ubit64_t [1+len/capacity];
-		memcpy(bin_seq, other.bin_seq, sizeof(ubit64_t)*len/capacity);
-	}
+	bin_seq_is_mm = false;
+	bin_seq = new ubit64_t [elts];
+	memcpy(bin_seq, other.bin_seq, sizeof(ubit64_t)*elts);
+	region_mask = NULL;
+	n_runs = other.n_runs;
+	n_first = other.n_first;
+	snp_pos = other.snp_pos;
+	snp_first = other.snp_first;
 	regions = other.regions;
 }
 
 int Chr_info::binarize(std::string & seq) {
 	len = seq.length();
 	//cerr<<len<<endl;
-	// 4bit for each base
+	// 2bit for each base
 	// Allocate memory
 	if (len%capacity==0) {
 		elts = len/capacity;
@@ -47,13 +53,85 @@ int Chr_info::binarize(std::string & seq) {
 		memset(bin_seq,0,sizeof(ubit64_t)*(elts));
 	}
 
-	// Add each base, 7 is 0b111
+	// Add each base, 7 is 0b111: the low two bits are the base and the
+	// third marks an N, which goes to n_runs instead
+	n_runs.clear();
 	for(std::string::size_type i=0;i!=seq.length();i++) {
-		bin_seq[i/capacity] |= ((((ubit64_t)seq[i]>>1)&7)<<(i%capacity*4));
+		ubit64_t code = ((ubit64_t)seq[i]>>1)&7;
+		bin_seq[i/capacity] |= ((code&3)<<(i%capacity*2));
+		if(code & 4) {
+			if(!n_runs.empty() && n_runs.back().second == i) {
+				n_runs.back().second++;
+			}
+			else {
+				n_runs.push_back(make_pair((ubit32_t)i, (ubit32_t)i+1));
+			}
+		}
 	}
+	index_runs();
 	return 1;
 }
 
+/**
+ * Fill n_first: for each block, the first N run that ends after the
+ * block starts.
+ */
+void Chr_info::index_runs() {
+	ubit32_t blocks = len/BLOCK+1;
+	n_first.assign(blocks, 0);
+	ubit32_t i = 0;
+	for(ubit32_t b = 0; b != blocks; b++) {
+		while(i != n_runs.size() && n_runs[i].second <= b*BLOCK) {
+			i++;
+		}
+		n_first[b] = i;
+	}
+}
+
+/**
+ * Collect the positions of the known SNPs inserted so far and fill
+ * snp_first.  Called once the dbSNP file has been read.
+ */
+void Chr_info::index_snps() {
+	ubit32_t blocks = len/BLOCK+1;
+	snp_pos.clear();
+	for(map<ubit64_t, Snp_info*>::iterator it = dbsnp.begin(); it != dbsnp.end() && it->first < len; it++) {
+		snp_pos.push_back((ubit32_t)it->first);
+	}
+	snp_first.assign(blocks+1, snp_pos.size());
+	ubit32_t i = 0;
+	for(ubit32_t b = 0; b != blocks; b++) {
+		while(i != snp_pos.size() && snp_pos[i] < b*BLOCK) {
+			i++;
+		}
+		snp_first[b] = i;
+	}
+}
+
+/**
+ * Write the 4-bit codes returned by get_bin_base for the n positions
+ * starting at start into code.  This decodes a whole calling window
+ * with one pass over the runs and sites it overlaps.
+ */
+void Chr_info::decode(ubit64_t start, ubit64_t n, small_int * code) {
+	ubit64_t end = start+n;
+	for(ubit64_t pos = start; pos != end; pos++) {
+		code[pos-start] = (bin_seq[pos/capacity]>>(pos%capacity*2))&0x3;
+	}
+	for(ubit32_t i = n_first[start/BLOCK]; i != n_runs.size() && n_runs[i].first < end; i++) {
+		ubit64_t from = n_runs[i].first > start ? n_runs[i].first : start;
+		ubit64_t to = n_runs[i].second < end ? n_runs[i].second : end;
+		for(ubit64_t pos = from; pos < to; pos++) {
+			code[pos-start] |= 0x4;
+		}
+	}
+	for(ubit32_t i = snp_first[start/BLOCK]; i != snp_pos.size() && snp_pos[i] < end; i++) {
+		if(snp_pos[i] >= start) {
+			code[snp_pos[i]-start] |= 0x8;
+		}
+	}
+}
+
 /**
  * Dump the bin_seq sequence to a file with the given name.
  */
@@ -77,11 +155,7 @@ int Chr_info::insert_snp(std::string::size_type pos, Snp_info & snp_form, bool q
 	}
 	pair<ubit64_t, Snp_info*> p(pos,new_snp);
 	insert_pair = dbsnp.insert(p);
-	if(insert_pair.second) {
-		// Successful insertion
-		// Modify the binary sequence! Mark SNPs
-		bin_seq[pos/capacity] |= (1ULL<<(pos%capacity*4+3));
-	} else {
+	if(!insert_pair.second) {
 		cerr << "Warning: SNP insertion failed for SNP with name "
 		     << snp_form.get_name() << " at position " << pos << endl;
 		return 0;
@@ -148,23 +222,24 @@ int Chr_info::region_mask_ini(){
 int Genome::read_region(std::ifstream & region, Parameter * para) {
 	Chr_name current_name(""), prev_name("");
 	int start, end;
-	map<Chr_name, Chr_info*>::iterator chr_iter;
+	Chr_info * chr = NULL;
 	// Lines appear to be formatted as: name, start, end
 	for(std::string buff; getline(region,buff); ) {
 		std::istringstream s(buff);
 		if(s >> current_name >> start >> end) {
 			if(current_name != prev_name) {
-				chr_iter = chromosomes.find(current_name);
-				if(chr_iter == chromosomes.end()) {
+				int id = chr_id(current_name);
+				if(id < 0) {
 					// Chromosome was not known
 					cerr << "Unexpected Chromosome:" << current_name<<endl;
 					continue;
 				}
-				if(NULL == chr_iter->second->get_region()) {
-					chr_iter->second->region_mask_ini();
+				chr = by_id[id]->second;
+				if(NULL == chr->get_region()) {
+					chr->region_mask_ini();
 				}
 			}
-			chr_iter->second->set_region(start-para->read_length, end-1);
+			chr->set_region(start-para->read_length, end-1);
 			prev_name = current_name;
 		}
 		else {
@@ -188,6 +263,7 @@ Genome::Genome(std::ifstream &fasta, std::ifstream & known_snp, bool quiet)
 	Chr_name current_name("");
 	map<Chr_name, Chr_info*>::iterator chr_iter;
 	// Read the fasta file
+	Prof_timer genome_timer(PROF_GENOME);
 	size_t lines = 0, chars = 0;
 	for(std::string buff; getline(fasta,buff); ) {
 		// Name line?
@@ -224,11 +300,19 @@ Genome::Genome(std::ifstream &fasta, std::ifstream & known_snp, bool quiet)
 		chr_iter = chromosomes.find(current_name);
 		chr_iter->second->binarize(seq);
 	}
+	// Number the chromosomes now that they're all known
+	for(chr_iter = chromosomes.begin(); chr_iter != chromosomes.end(); chr_iter++) {
+		chr_iter->second->id = by_id.size();
+		by_id.push_back(chr_iter);
+	}
 	clog << "Finished loading and binarizing chromosome "; logTime(); clog << endl;
+	genome_timer.stop();
+	Prof_timer dbsnp_timer(PROF_DBSNP);
 	lines = 0;
 	if(known_snp) {
 		// Read in the SNP file
 		Chr_name current_name;
+		Chr_lookup lookup(this);
 		Snp_info snp_form;
 		std::string::size_type pos;
 		for(std::string buff; getline(known_snp, buff); ) {
@@ -240,15 +324,19 @@ Genome::Genome(std::ifstream &fasta, std::ifstream & known_snp, bool quiet)
 			// Snp_info has a special operator>> that reads the rest
 			// of the line; see soap_snp.h
 			s >> snp_form;
-			if(chromosomes.find(current_name) != chromosomes.end()) {
+			int id = lookup(current_name);
+			if(id >= 0) {
 				// The SNP is located on an valid chromosome
 				pos -= 1; // Coordinates starts from 0
 				// Stick the SNP in a chromosome-specific map that maps
 				// positions to SNP_Infos
-				(chromosomes.find(current_name)->second)->insert_snp(pos, snp_form, quiet);
+				by_id[id]->second->insert_snp(pos, snp_form, quiet);
 			}
 		}
 		// Now possibly dump SNPs
 	}
+	for(chr_iter = chromosomes.begin(); chr_iter != chromosomes.end(); chr_iter++) {
+		chr_iter->second->index_snps();
+	}
 	clog << "Finished parsing " << lines << " known SNPs "; logTime(); clog << endl;
 }
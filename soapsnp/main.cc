@@ -1,12 +1,17 @@
 #include "soap_snp.h"
 #include <getopt.h>
+#include <climits>
+#include <algorithm>
+#include <sys/stat.h>
+#include <unistd.h>
 
 using namespace std;
 
 int usage() {
 	cerr<<"SoapSNP version 1.02, Crossbow modifications (last changed 10/10/2010)"<<endl;
 	cerr<<"Compulsory Parameters:"<<endl;
-	cerr<<"-i <FILE> Input SORTED Soap Result"<<endl;
+	cerr<<"-i <FILE>[,<FILE>...] Input SORTED Soap Result(s); several inputs are merged on the fly; may be gzip or zstd compressed"<<endl;
+	cerr<<"   or -A <NAME>=<FILE>[,<FILE>...] SORTED alignments of sample NAME; repeat -A to call several samples jointly"<<endl;
 	cerr<<"-d <FILE> Reference Sequence in fasta format"<<endl;
 	cerr<<"-o <FILE> Output consensus file"<<endl;
 	cerr<<"Optional Parameters:(Default in [])"<<endl;
@@ -33,7 +38,16 @@ int usage() {
 	cerr<<"-F <int> Output format. 0: Text; 1: GLFv2; 2: GPFv2.[0]"<<endl;
 	cerr<<"-E <String> Extra headers EXCEPT CHROMOSOME FIELD specified in GLFv2 output. Format is \"TypeName1:DataName1:TypeName2:DataName2\"[""]"<<endl;
 	cerr<<"-T <FILE> Only call consensus on regions specified in FILE. Format: ChrName\\tStart\\tEnd."<<endl;
-	cerr<<"-c Use the crossbow input format [Off]"<<endl;
+	cerr<<"-D <int> Maximum unique depth per site; deeper sites are downsampled by reservoir sampling. 0: ignore evidence beyond 255 [0]"<<endl;
+	cerr<<"-R <int> Accept alignments arriving up to <int> bp out of order [0]"<<endl;
+	cerr<<"-P <int> Call with <int> threads, each taking 100 kb shards of a chromosome; output is the same as with 1 [1]"<<endl;
+	cerr<<"-B <int> Merge runs of uncovered sites, and of reference calls with quality >= <int>, into block records; text output without -q only"<<endl;
+	cerr<<"-C <FILE> Save a checkpoint to FILE every minute, and resume from it if it's there; needs uncompressed inputs"<<endl;
+	cerr<<"-O Also write a position index of the output to <FILE>.cidx, for -o <FILE>"<<endl;
+	cerr<<"-J <FILE> Write a profile of time per phase, call_cns time per window, throughput and peak RSS to FILE as JSON; with -H also as counters"<<endl;
+	cerr<<"-X Write a position index <FILE>.sidx for each uncompressed -i input and exit; -T then seeks straight to its regions"<<endl;
+	cerr<<"-c Use the crossbow input format [Off]; SAM, BAM and binary input from aln2bin are detected automatically"<<endl;
+	cerr<<"-x Keep SAM/BAM records flagged as duplicates (0x400) [Off]"<<endl;
 	cerr<<"-K In -q mode, print consensus info for every dbsnp pos even if there's no SNP [Off]"<<endl;
 	//cerr<<"-S <FILE> Output summary of consensus"<<endl;
 	cerr<<"-H Print Hadoop status updates" << endl;
@@ -52,39 +66,210 @@ int readme() {
 	return usage();
 }
 
-unsigned long poscalled = 0;
-unsigned long poscalled_knownsnp = 0;
-unsigned long poscalled_uncov_uni = 0;
-unsigned long poscalled_uncov = 0;
-unsigned long poscalled_n_no_depth = 0;
-unsigned long poscalled_nonref = 0;
-unsigned long poscalled_reported = 0;
+__thread unsigned long poscalled = 0;
+__thread unsigned long poscalled_knownsnp = 0;
+__thread unsigned long poscalled_uncov_uni = 0;
+__thread unsigned long poscalled_uncov = 0;
+__thread unsigned long poscalled_n_no_depth = 0;
+__thread unsigned long poscalled_nonref = 0;
+__thread unsigned long poscalled_reported = 0;
+__thread unsigned long poscalled_downsampled = 0;
 
 unsigned long alignments_read = 0;
 unsigned long alignments_read_unique = 0;
 unsigned long alignments_read_unpaired = 0;
 unsigned long alignments_read_paired = 0;
+unsigned long alignments_skipped_secondary = 0;
+unsigned long alignments_skipped_dup = 0;
+unsigned long alignments_skipped_long = 0;
+bool Sam_format::keep_dups = false;
+unsigned long read_qual_hist[256];
+std::vector<unsigned long> read_len_hist;
+
+/**
+ * Work out the format of an alignment input from its first bytes:
+ * binary, BAM and SAM are recognized, and anything else is left as the
+ * text format in fmt.  Returns false if the input is empty.
+ */
+static bool probe_format(const std::string & name, alignment_format & fmt) {
+	Aln_istream probe(name.c_str(), false);
+	char magic[4];
+	if(!probe.read(magic, 4)) {
+		return probe.gcount() > 0;
+	}
+	std::string line;
+	if(memcmp(magic, BINARY_ALN_MAGIC, 4) == 0) {
+		fmt = BINARY_FORMAT;
+	} else if(memcmp(magic, BAM_MAGIC, 4) == 0) {
+		fmt = BAM_FORMAT;
+	} else if(getline(probe, line), looks_like_sam(std::string(magic, 4) + line)) {
+		fmt = SAM_FORMAT;
+	}
+	return true;
+}
+
+static const char * format_name(alignment_format fmt) {
+	switch(fmt) {
+		case BINARY_FORMAT: return "binary";
+		case BAM_FORMAT: return "BAM";
+		case SAM_FORMAT: return "SAM";
+		case CROSSBOW_FORMAT: return "Crossbow";
+		default: return "SOAP";
+	}
+}
+
+/**
+ * Write a position index, <FILE>.sidx, for each sorted, uncompressed
+ * alignment input.
+ */
+template<typename T>
+static void index_alignments(const std::vector<std::string> & names) {
+	for(size_t i = 0; i != names.size(); i++) {
+		Aln_istream in(names[i].c_str());
+		if(in.compression() != PLAIN_INPUT) {
+			cerr << names[i] << " is compressed; only uncompressed alignments can be indexed" << endl;
+			exit(1);
+		}
+		Aln_index idx;
+		build_aln_index<T>(in, idx);
+		struct stat st;
+		if(stat(names[i].c_str(), &st) != 0) {
+			cerr << "Cannot stat " << names[i] << endl;
+			exit(255);
+		}
+		idx.file_size = st.st_size;
+		std::string fn = names[i] + ".sidx";
+		if(!idx.write(fn)) {
+			cerr << "Cannot write alignment index " << fn << endl;
+			exit(255);
+		}
+		clog << "Wrote alignment index " << fn << endl;
+	}
+}
+
+/**
+ * Work out which parts of an alignment input the -T regions need, from
+ * its position index.  Leaves targets empty (read everything) if there's
+ * no usable index.
+ */
+static void region_targets(const std::string & name, Genome * genome, Parameter * para, std::vector<Aln_target> & targets) {
+	Aln_index idx;
+	std::string fn = name + ".sidx";
+	struct stat st;
+	if(stat(fn.c_str(), &st) != 0 || !idx.load(fn)) {
+		return;
+	}
+	if(stat(name.c_str(), &st) != 0 || st.st_size != idx.file_size) {
+		cerr << "Ignoring out-of-date alignment index " << fn << "; rebuild it with -X" << endl;
+		return;
+	}
+	{
+		Aln_istream probe(name.c_str(), false);
+		if(probe.compression() != PLAIN_INPUT) {
+			cerr << "Ignoring alignment index " << fn << " for compressed input" << endl;
+			return;
+		}
+	}
+	const std::vector<std::string> & chrs = idx.chromosomes();
+	for(size_t i = 0; i != chrs.size(); i++) {
+		int id = genome->chr_id(chrs[i]);
+		if(id < 0) {
+			continue;
+		}
+		Chr_info * chr = genome->by_id[id]->second;
+		Aln_target t;
+		t.chr = chrs[i];
+		if(chr->get_region() == NULL) {
+			// Not mentioned in -T, so the whole chromosome is called
+			t.start = 0;
+			t.end = INT_MAX;
+			t.offset = idx.lookup(t.chr, 0);
+			targets.push_back(t);
+			continue;
+		}
+		std::vector<pair<int, int> > regions = chr->get_regions();
+		sort(regions.begin(), regions.end());
+		for(size_t r = 0; r != regions.size(); r++) {
+			// Alignments may be up to -R bp out of order
+			int start = regions[r].first - para->reorder_dist;
+			if(!targets.empty() && targets.back().chr == t.chr &&
+			   start / Aln_index::BUCKET <= targets.back().end / Aln_index::BUCKET + 1)
+			{
+				// Close enough to the previous region to read through
+				targets.back().end = max(targets.back().end, regions[r].second);
+				continue;
+			}
+			t.start = start;
+			t.end = regions[r].second;
+			t.offset = idx.lookup(t.chr, start);
+			if(t.offset >= 0) {
+				targets.push_back(t);
+			}
+		}
+	}
+	clog << "Using alignment index " << fn << ": " << targets.size() << " stretches to read" << endl;
+}
 
 int main ( int argc, char * argv[]) {
 	// This part is the default values of all parameters
 	Parameter * para = new Parameter;
-	std::string alignment_name, consensus_name;
+	std::string consensus_name;
+	std::vector<std::string> alignment_names;
+	std::vector<std::string> sample_names; // -A
+	std::vector<size_t> sample_of; // sample of each alignment input, with -A
 	bool is_matrix_in = false; // Generate the matrix or just read it?
+	bool build_index = false; // Just write position indexes for the inputs?
+	std::string checkpoint_name; // -C
+	bool index_output = false; // -O
+	std::string profile_name; // -J
 	int c;
 	Files files;
-	while((c=getopt(argc,argv,"Ki:d:o:z:g:p:r:e:ts:2a:b:j:k:unmqM:I:L:Q:S:F:E:T:clhHv")) != -1) {
+	while((c=getopt(argc,argv,"KA:i:d:o:z:g:p:r:e:ts:2a:b:j:k:unmqM:I:L:Q:S:F:E:T:D:R:P:B:C:J:OXcxlhHv")) != -1) {
 		switch(c) {
 			case 'i':
 			{
-				// Soap Alignment Result
-				files.soap_result.clear();
-				files.soap_result.open(optarg);
-				if( ! files.soap_result) {
-					cerr<<"No such file or directory:"<<optarg<<endl;
+				// Soap Alignment Result(s); several sorted inputs may be
+				// given, comma-separated or with repeated -i
+				std::istringstream names(optarg);
+				for(std::string name; getline(names, name, ',');) {
+					if(name.empty()) continue;
+					ifstream test(name.c_str());
+					if( ! test) {
+						cerr<<"No such file or directory:"<<name<<endl;
+						exit(1);
+					}
+					alignment_names.push_back(name);
+					cerr << "-i is set to " << name << endl;
+				}
+				break;
+			}
+			case 'A':
+			{
+				// One sample's alignment input(s), for joint calling
+				std::string arg(optarg);
+				std::string::size_type eq = arg.find('=');
+				if(eq == 0 || eq == std::string::npos || eq+1 == arg.size()) {
+					cerr << "-A takes <NAME>=<FILE>[,<FILE>...]" << endl;
+					exit(1);
+				}
+				std::string sample = arg.substr(0, eq);
+				if(std::find(sample_names.begin(), sample_names.end(), sample) != sample_names.end()) {
+					cerr << "Sample " << sample << " is given twice with -A" << endl;
 					exit(1);
 				}
-				alignment_name = optarg;
-				cerr << "-i is set to " << alignment_name << endl;
+				sample_names.push_back(sample);
+				std::istringstream names(arg.substr(eq+1));
+				for(std::string name; getline(names, name, ',');) {
+					if(name.empty()) continue;
+					ifstream test(name.c_str());
+					if( ! test) {
+						cerr<<"No such file or directory:"<<name<<endl;
+						exit(1);
+					}
+					alignment_names.push_back(name);
+					sample_of.push_back(sample_names.size()-1);
+				}
+				cerr << "-A is set to " << optarg << endl;
 				break;
 			}
 			case 'd':
@@ -102,13 +287,8 @@ int main ( int argc, char * argv[]) {
 			}
 			case 'o':
 			{
-				files.consensus.clear();
-				files.consensus.open(optarg);
-				if( ! files.consensus ) {
-					cerr<<"Cannot creat file:" <<optarg <<endl;
-					exit(1);
-				}
-				files.consensus.clear();
+				// Opened once it's known whether a checkpoint is
+				// being resumed
 				consensus_name = optarg;
 				cerr << "-o is set to " << consensus_name << endl;
 				break;
@@ -308,11 +488,73 @@ int main ( int argc, char * argv[]) {
 				cerr << "-T is set to " << optarg << endl;
 				break;
 			}
+			case 'D': {
+				para->max_depth = atoi(optarg);
+				if(para->max_depth < 0) {
+					cerr << "-D must be non-negative" << endl;
+					exit(1);
+				}
+				cerr << "-D is set to " << para->max_depth << endl;
+				break;
+			}
+			case 'R': {
+				para->reorder_dist = atoi(optarg);
+				if(para->reorder_dist < 0) {
+					cerr << "-R must be non-negative" << endl;
+					exit(1);
+				}
+				cerr << "-R is set to " << para->reorder_dist << endl;
+				break;
+			}
+			case 'P': {
+				para->threads = atoi(optarg);
+				if(para->threads < 1) {
+					cerr << "-P must be at least 1" << endl;
+					exit(1);
+				}
+				cerr << "-P is set to " << para->threads << endl;
+				break;
+			}
+			case 'B': {
+				para->block_qual = atoi(optarg);
+				if(para->block_qual < 0) {
+					cerr << "-B must be non-negative" << endl;
+					exit(1);
+				}
+				cerr << "-B is set to " << para->block_qual << endl;
+				break;
+			}
+			case 'C': {
+				checkpoint_name = optarg;
+				cerr << "-C is set to " << optarg << endl;
+				break;
+			}
+			case 'J': {
+				profile_name = optarg;
+				profiling = true;
+				cerr << "-J is set to " << optarg << endl;
+				break;
+			}
+			case 'O': {
+				index_output = true;
+				cerr << "-O is set" << endl;
+				break;
+			}
+			case 'X': {
+				build_index = true;
+				cerr << "-X is set" << endl;
+				break;
+			}
 			case 'c': {
 				para->format = CROSSBOW_FORMAT;
 				cerr << "-c is set" << endl;
 				break;
 			}
+			case 'x': {
+				Sam_format::keep_dups = true;
+				cerr << "-x is set" << endl;
+				break;
+			}
 			case 'v': para->verbose = true; break;
 			case 'H': para->hadoop_out = true; break;
 			case 'h':readme();break;
@@ -320,10 +562,123 @@ int main ( int argc, char * argv[]) {
 			default: cerr<<"Unknown error in command line parameters"<<endl;
 		}
 	}
-	if( !files.consensus || !files.ref_seq || !files.soap_result ) {
+	if( alignment_names.empty() || (!build_index && (consensus_name.empty() || !files.ref_seq)) ) {
 		// These are compulsory parameters
 		usage();
 	}
+	if(!sample_names.empty()) {
+		if(sample_of.size() != alignment_names.size()) {
+			cerr << "Give alignments either with -i or with -A, not both" << endl;
+			exit(1);
+		}
+		if(para->glf_format) {
+			cerr << "Joint calling with -A writes text output only; -F can't be used" << endl;
+			exit(1);
+		}
+		if(para->threads > 1) {
+			cerr << "Joint calling with -A runs on one thread; -P can't be used" << endl;
+			exit(1);
+		}
+	}
+	{
+		// Binary, BAM and SAM alignment input are recognized by their
+		// contents, whatever -c says.  Every input is probed, since
+		// they're all parsed the same way; empty ones fit any format.
+		alignment_format text_format = para->format;
+		int first = -1;
+		for(size_t i = 0; i != alignment_names.size(); i++) {
+			alignment_format fmt = text_format;
+			if(!probe_format(alignment_names[i], fmt)) {
+				continue;
+			}
+			if(first < 0) {
+				first = i;
+				para->format = fmt;
+			} else if(fmt != para->format) {
+				cerr << "Alignment inputs " << alignment_names[first] << " (" << format_name(para->format) << ") and "
+				     << alignment_names[i] << " (" << format_name(fmt) << ") are in different formats" << endl;
+				exit(1);
+			}
+		}
+		if(para->format != text_format) {
+			cerr << "Alignment input is in " << format_name(para->format) << " format" << endl;
+		}
+	}
+	if(para->block_qual >= 0 && (para->glf_format || para->is_snp_only || !sample_names.empty())) {
+		cerr << "-B blocks are only written in text output, and can't be combined with -q or -A" << endl;
+		exit(1);
+	}
+	Checkpoint * ckpt = NULL;
+	if(!checkpoint_name.empty() && !build_index) {
+		if(!sample_names.empty() || para->threads > 1 || para->reorder_dist > 0) {
+			cerr << "-C can't be combined with -A, -P or -R" << endl;
+			exit(1);
+		}
+		for(size_t i = 0; i != alignment_names.size(); i++) {
+			Aln_istream in(alignment_names[i].c_str(), false);
+			if(in.compression() != PLAIN_INPUT || para->format == BAM_FORMAT) {
+				cerr << "-C needs uncompressed alignment inputs, so that they can be reread from a checkpoint; "
+				     << alignment_names[i] << " is compressed" << endl;
+				exit(1);
+			}
+		}
+		ckpt = new Checkpoint(checkpoint_name, alignment_names);
+		if(ckpt->load()) {
+			struct stat st;
+			if(stat(consensus_name.c_str(), &st) != 0 || (long long)st.st_size < ckpt->out_off) {
+				cerr << "Output " << consensus_name << " is shorter than checkpoint " << checkpoint_name << " says; starting over" << endl;
+				ckpt->resumed = false;
+			}
+		}
+	}
+	bool resumed = (ckpt != NULL && ckpt->resumed);
+	if(build_index) {
+		if(para->format == SOAP_FORMAT) {
+			index_alignments<Soap_format>(alignment_names);
+		} else if(para->format == BINARY_FORMAT) {
+			index_alignments<Binary_format>(alignment_names);
+		} else if(para->format == SAM_FORMAT) {
+			index_alignments<Sam_format>(alignment_names);
+		} else if(para->format == BAM_FORMAT) {
+			cerr << "BAM input can't be indexed with -X; it's compressed" << endl;
+			exit(1);
+		} else {
+			index_alignments<Crossbow_format>(alignment_names);
+		}
+		return 0;
+	}
+	if(resumed) {
+		// Drop whatever was written after the checkpoint and carry on
+		if(truncate(consensus_name.c_str(), ckpt->out_off) != 0) {
+			cerr << "Cannot truncate " << consensus_name << " to resume from checkpoint" << endl;
+			exit(255);
+		}
+		ios::openmode mode = ios::in | ios::out;
+		if(para->glf_format) {
+			mode |= ios::binary;
+		}
+		files.consensus.open(consensus_name.c_str(), mode);
+		files.consensus.seekp(0, ios::end);
+	}
+	else {
+		// Truncated now, so that a run failing early doesn't leave the
+		// output of an earlier run looking valid
+		files.consensus.open(consensus_name.c_str(), para->glf_format ? ios::out | ios::binary : ios::out);
+	}
+	if(!files.consensus) {
+		cerr<<"Cannot creat file:" <<consensus_name <<endl;
+		exit(1);
+	}
+	Profiler profiler;
+	if(profiling) {
+		profiler.start();
+		for(size_t i = 0; i != alignment_names.size(); i++) {
+			struct stat st;
+			if(stat(alignment_names[i].c_str(), &st) == 0) {
+				profiler.input_bytes += st.st_size;
+			}
+		}
+	}
 	//Read the chromosomes into memory
 	Genome * genome = new Genome(files.ref_seq, files.dbsnp, true);
 	files.ref_seq.close();
@@ -333,14 +688,15 @@ int main ( int argc, char * argv[]) {
 		genome->read_region(files.region, para);
 		clog<<"Read target region done."<<endl;
 	}
-	if(para->glf_format) { // GLF or GPF
-		files.consensus.close();
-		files.consensus.clear();
-		files.consensus.open(consensus_name.c_str(), ios::binary);
-		if(!files.consensus) {
-			cerr<<"Cannot write result to the specified output file."<<endl;
-			exit(255);
+	// With -T, inputs that have a position index are read only where
+	// there's something to call
+	std::vector<std::vector<Aln_target> > targets(alignment_names.size());
+	if(para->region_only && !resumed) {
+		for(size_t i = 0; i != alignment_names.size(); i++) {
+			region_targets(alignment_names[i], genome, para, targets[i]);
 		}
+	}
+	if(!resumed && para->glf_format) { // GLF or GPF
 		if (1==para->glf_format) {
 			files.consensus<<'g'<<'l'<<'f';
 		}
@@ -389,14 +745,37 @@ int main ( int argc, char * argv[]) {
 		}
 	}
 	Prob_matrix * mat = new Prob_matrix;
-	if(!is_matrix_in) {
+	Prof_timer matrix_timer(PROF_MATRIX);
+	if(resumed) {
+		clog << "Reading correction matrix from checkpoint"; logTime(); clog << endl;
+		fstream mat_in(ckpt->matrix_name().c_str(), fstream::in);
+		if(!mat_in) {
+			cerr << "No such file or directory:" << ckpt->matrix_name() << endl;
+			exit(255);
+		}
+		mat->matrix_read(mat_in, para);
+		if (files.matrix_file && !is_matrix_in) {
+			mat->matrix_write(files.matrix_file, para);
+		}
+	}
+	else if(!is_matrix_in) {
 		// Read the soap result and give the calibration matrix
+		files.open_alignments(alignment_names);
 		if(para->format == SOAP_FORMAT) {
 			clog << "Training correction matrix in SOAP format"; logTime(); clog << endl;
-			mat->matrix_gen<Soap_format>(files.soap_result, para, genome);
+			mat->matrix_gen<Soap_format>(files.soap_results, para, genome);
+		} else if(para->format == BINARY_FORMAT) {
+			clog << "Training correction matrix in binary format"; logTime(); clog << endl;
+			mat->matrix_gen<Binary_format>(files.soap_results, para, genome);
+		} else if(para->format == SAM_FORMAT) {
+			clog << "Training correction matrix in SAM format"; logTime(); clog << endl;
+			mat->matrix_gen<Sam_format>(files.soap_results, para, genome);
+		} else if(para->format == BAM_FORMAT) {
+			clog << "Training correction matrix in BAM format"; logTime(); clog << endl;
+			mat->matrix_gen<Bam_format>(files.soap_results, para, genome);
 		} else {
 			clog << "Training correction matrix in Crossbow format"; logTime(); clog << endl;
-			mat->matrix_gen<Crossbow_format>(files.soap_result, para, genome);
+			mat->matrix_gen<Crossbow_format>(files.soap_results, para, genome);
 		}
 		if (files.matrix_file) {
 			clog << "Writing correction matrix"; logTime(); clog << endl;
@@ -408,51 +787,161 @@ int main ( int argc, char * argv[]) {
 		mat->matrix_read(files.matrix_file, para);
 	}
 	files.matrix_file.close();
+	if(ckpt != NULL && !resumed) {
+		fstream mat_out(ckpt->matrix_name().c_str(), fstream::out);
+		mat->matrix_write(mat_out, para);
+		mat_out.close();
+		if(!mat_out) {
+			cerr << "Cannot write " << ckpt->matrix_name() << endl;
+			exit(255);
+		}
+	}
+	matrix_timer.stop();
 	clog << "Correction Matrix Done "; logTime(); clog << endl;
+	Prof_timer rank_timer(PROF_RANK);
 	mat->prior_gen(para);
+	if(para->refine_mode) {
+		genome->snp_priors(mat, para);
+	}
 	if(para->verbose) clog << "Just did prior_gen" << endl;
 	mat->rank_table_gen();
 	if(para->verbose) clog << "Just did rank_table_gen" << endl;
-	Call_win *info = new Call_win(para->read_length, 1000);
-	if(para->verbose) clog << "Just allocated Call_win" << endl;
-	info->initialize(0);
+	rank_timer.stop();
+	Call_win *info = NULL;
+	if(sample_names.empty()) {
+		info = new Call_win(para->read_length, 1000, para->max_depth);
+		if(para->verbose) clog << "Just allocated Call_win" << endl;
+		info->initialize(0);
+		info->ckpt = ckpt;
+	}
+	Aln_index out_index("consensus");
+	if(info != NULL && index_output) {
+		info->out_index = &out_index;
+	}
 	//Call the consensus
-	files.soap_result.close();
-	files.soap_result.clear();
-	files.soap_result.open(alignment_name.c_str());
-	files.soap_result.clear();
+	if(!files.open_alignments(alignment_names)) {
+		cerr << "Could not reopen alignment input" << endl;
+		exit(255);
+	}
+	for(size_t i = 0; i != alignment_names.size(); i++) {
+		files.soap_results[i]->targets = targets[i];
+	}
 	if(para->verbose) clog << "Just reopened alignment file" << endl;
 	alignments_read = 0;
 	alignments_read_unique = 0;
-	if(para->format == SOAP_FORMAT) {
-		info->soap2cns<Soap_format>(files.soap_result, files.consensus, genome, mat, para);
+	alignments_skipped_secondary = 0;
+	alignments_skipped_dup = 0;
+	alignments_skipped_long = 0;
+	profiler.begin_calling();
+	if(!sample_names.empty()) {
+		// Group the inputs by sample
+		std::vector<Aln_inputs> samples(sample_names.size());
+		for(size_t i = 0; i != alignment_names.size(); i++) {
+			samples[sample_of[i]].push_back(files.soap_results[i]);
+		}
+		Joint_call joint(sample_names, para);
+		if(index_output) {
+			joint.out_index = &out_index;
+		}
+		if(para->format == SOAP_FORMAT) {
+			joint.soap2cns<Soap_format>(samples, files.consensus, genome, mat, para);
+		} else if(para->format == BINARY_FORMAT) {
+			joint.soap2cns<Binary_format>(samples, files.consensus, genome, mat, para);
+		} else if(para->format == SAM_FORMAT) {
+			joint.soap2cns<Sam_format>(samples, files.consensus, genome, mat, para);
+		} else if(para->format == BAM_FORMAT) {
+			joint.soap2cns<Bam_format>(samples, files.consensus, genome, mat, para);
+		} else {
+			joint.soap2cns<Crossbow_format>(samples, files.consensus, genome, mat, para);
+		}
+	} else if(para->format == SOAP_FORMAT) {
+		info->soap2cns<Soap_format>(files.soap_results, files.consensus, genome, mat, para);
+	} else if(para->format == BINARY_FORMAT) {
+		info->soap2cns<Binary_format>(files.soap_results, files.consensus, genome, mat, para);
+	} else if(para->format == SAM_FORMAT) {
+		info->soap2cns<Sam_format>(files.soap_results, files.consensus, genome, mat, para);
+	} else if(para->format == BAM_FORMAT) {
+		info->soap2cns<Bam_format>(files.soap_results, files.consensus, genome, mat, para);
 	} else {
-		info->soap2cns<Crossbow_format>(files.soap_result, files.consensus, genome, mat, para);
+		info->soap2cns<Crossbow_format>(files.soap_results, files.consensus, genome, mat, para);
 	}
+	profiler.end_calling();
 	if(para->verbose) clog << "Just called soap2cns" << endl;
-	files.soap_result.close();
+	files.close_alignments();
 	files.consensus.close();
+	if(index_output) {
+		Prof_timer index_timer(PROF_OUTPUT);
+		struct stat st;
+		std::string fn = consensus_name + ".cidx";
+		out_index.file_size = (stat(consensus_name.c_str(), &st) == 0 ? (long long)st.st_size : -1);
+		if(!out_index.write(fn)) {
+			cerr << "Could not write output index " << fn << endl;
+			exit(255);
+		}
+	}
+	if(ckpt != NULL) {
+		// Finished; a rerun should start over
+		remove(ckpt->file.c_str());
+		remove(ckpt->matrix_name().c_str());
+		remove(ckpt->index_name().c_str());
+	}
+	if(alignments_skipped_long > 0) {
+		cerr << "Warning: skipped " << alignments_skipped_long << " SAM/BAM alignments spanning over 255 bp of reference" << endl;
+	}
 	if(para->hadoop_out) {
 		cerr << "reporter:counter:SOAPsnp,Alignments read," << alignments_read << endl;
 		cerr << "reporter:counter:SOAPsnp,Unique alignments read," << alignments_read_unique << endl;
 		cerr << "reporter:counter:SOAPsnp,Unpaired alignments read," << alignments_read_unpaired << endl;
 		cerr << "reporter:counter:SOAPsnp,Paired alignments read," << alignments_read_paired << endl;
+		cerr << "reporter:counter:SOAPsnp,Secondary or supplementary alignments skipped," << alignments_skipped_secondary << endl;
+		cerr << "reporter:counter:SOAPsnp,Duplicate alignments skipped," << alignments_skipped_dup << endl;
+		cerr << "reporter:counter:SOAPsnp,Alignments skipped for spanning over 255 bp," << alignments_skipped_long << endl;
 		cerr << "reporter:counter:SOAPsnp,Positions called," << (poscalled-poscalled_reported) << endl;
 		cerr << "reporter:counter:SOAPsnp,Positions called with known SNP info," << poscalled_knownsnp << endl;
 		cerr << "reporter:counter:SOAPsnp,Positions called uncovered by unique alignments," << poscalled_uncov_uni << endl;
 		cerr << "reporter:counter:SOAPsnp,Positions called uncovered by any alignments," << poscalled_uncov << endl;
 		cerr << "reporter:counter:SOAPsnp,Positions with non-reference allele called," << poscalled_nonref << endl;
+		cerr << "reporter:counter:SOAPsnp,Positions downsampled," << poscalled_downsampled << endl;
+		// Quality values relative to -z, in bins of 10 truncated toward
+		// zero, as the wrapper used to count them
+		std::map<int, unsigned long> qual_bins;
+		for(int c = 0; c != 256; c++) {
+			if(read_qual_hist[c] > 0) {
+				qual_bins[(c - para->q_min) / 10] += read_qual_hist[c];
+			}
+		}
+		for(std::map<int, unsigned long>::iterator it = qual_bins.begin(); it != qual_bins.end(); it++) {
+			cerr << "reporter:counter:SOAPsnp,Occurrences of quality value [" << it->first * 10 << ":" << it->first * 10 + 10 << ")," << it->second << endl;
+		}
+		for(size_t len = 0; len != read_len_hist.size(); len++) {
+			if(read_len_hist[len] > 0) {
+				cerr << "reporter:counter:SOAPsnp,Alignments of length " << len << "," << read_len_hist[len] << endl;
+			}
+		}
 	}
 	if(para->verbose) {
 		clog << "Alignments read: " << alignments_read << endl;
 		clog << "Unique alignments read: " << alignments_read_unique << endl;
 		clog << "Unpaired alignments read: " << alignments_read_unpaired << endl;
 		clog << "Paired alignments read: " << alignments_read_paired << endl;
+		clog << "Secondary or supplementary alignments skipped: " << alignments_skipped_secondary << endl;
+		clog << "Duplicate alignments skipped: " << alignments_skipped_dup << endl;
+		clog << "Alignments skipped for spanning over 255 bp: " << alignments_skipped_long << endl;
 		clog << "Positions called: " << (poscalled-poscalled_reported) << endl;
 		clog << "Positions called with known SNP info: " << poscalled_knownsnp << endl;
 		clog << "Positions called uncovered by unique alignments: " << poscalled_uncov_uni << endl;
 		clog << "Positions called uncovered by any alignments: " << poscalled_uncov << endl;
 		clog << "Positions with non-reference allele called: " << poscalled_nonref << endl;
+		clog << "Positions downsampled: " << poscalled_downsampled << endl;
+	}
+	if(profiling) {
+		if(!profiler.write(profile_name)) {
+			cerr << "Could not write profile " << profile_name << endl;
+			exit(255);
+		}
+		if(para->hadoop_out) {
+			profiler.counters();
+		}
 	}
 	clog << "Consensus Done!"; logTime(); clog << endl;
 	return 0;
@@ -2,26 +2,22 @@
 Prob_matrix::Prob_matrix(){
 	int i;
 	// p_matrix has 1 million entires; rate_t is a double
-	p_matrix = new rate_t [256*256*4*4]; // 8bit: q_max, 8bit: read_len, 4bit: number of types of all mismatch/match 4x4
+	p_matrix = (rate_t *)huge_alloc(sizeof(rate_t)*256*256*4*4); // 8bit: q_max, 8bit: read_len, 4bit: number of types of all mismatch/match 4x4
 	p_prior = new rate_t [8*4*4]; // 8(ref ACTGNNNN) * diploid(4x4)
+	log_prior = new rate_t [8*4*4];
 	base_freq = new rate_t [4]; // 4 base
-	type_likely = new rate_t [16+1]; //The 17th element rate_t[16] will be used in comparison
-	type_prob = new rate_t [16+1];
-	p_rank = new rate_t [64*64*2048]; // 6bit: N; 5bit: n1; 11bit; T1
+	p_rank = (rate_t *)huge_alloc(sizeof(rate_t)*64*64*2048); // 6bit: N; 5bit: n1; 11bit; T1
 	p_binom = new rate_t [256*256]; // Total * case
 	for(i=0;i!=256*256*4*4;i++) {
 		p_matrix[i] = 1.0;
 	}
 	for(i=0;i!=8*4*4;i++) {
 		p_prior[i] = 1.0;
+		log_prior[i] = 0.0;
 	}
 	for(i=0;i!=4;i++) {
 		base_freq[i] = 1.0;
 	}
-	for(i=0;i!=16+1;i++) {
-		type_likely[i] = 0.0; // LOG10 Scale
-		type_prob[i] = 0.0; // LOG10 Scale
-	}
 	for(i=0;i!=64*64*2048;i++) {
 		p_rank[i] = 1.0;
 	}
@@ -31,12 +27,11 @@ Prob_matrix::Prob_matrix(){
 }
 
 Prob_matrix::~Prob_matrix(){
-	delete [] p_matrix; // 8bit: q_max, 8bit: read_len, 4bit: number of types of all mismatch/match 4x4
+	huge_free(p_matrix, sizeof(rate_t)*256*256*4*4); // 8bit: q_max, 8bit: read_len, 4bit: number of types of all mismatch/match 4x4
 	delete [] p_prior; // 8(ref ACTGNNNN) * diploid(4x4)
+	delete [] log_prior;
 	delete [] base_freq; // 4 base
-	delete [] type_likely; //The 17th element rate_t[16] will be used in comparison
-	delete [] type_prob;
-	delete [] p_rank; // 6bit: N; 5bit: n1; 11bit; T1
+	huge_free(p_rank, sizeof(rate_t)*64*64*2048); // 6bit: N; 5bit: n1; 11bit; T1
 	delete [] p_binom; // Total * case;
 }
 
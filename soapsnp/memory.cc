@@ -0,0 +1,42 @@
+#include "soap_snp.h"
+#include <sys/mman.h>
+
+// Transparent huge pages on x86-64; tables are aligned to this
+static const size_t huge_page = 2 << 20;
+
+ubit64_t huge_allocs = 0, huge_bytes = 0;
+
+static size_t huge_len(size_t bytes) {
+	return (bytes + huge_page - 1) / huge_page * huge_page;
+}
+
+void * huge_alloc(size_t bytes) {
+	size_t len = huge_len(bytes);
+	// Map a huge page more than needed so that the table can start on
+	// a huge page boundary, and trim the rest
+	char * map = (char *)mmap(NULL, len + huge_page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(map == MAP_FAILED) {
+		cerr << "Could not allocate " << bytes << " bytes" << endl;
+		exit(255);
+	}
+	char * p = map + (huge_page - (size_t)map % huge_page) % huge_page;
+	if(p != map) {
+		munmap(map, p - map);
+	}
+	if(p + len != map + len + huge_page) {
+		munmap(p + len, map + len + huge_page - (p + len));
+	}
+#ifdef MADV_HUGEPAGE
+	// Only a hint; without THP the table gets ordinary pages
+	madvise(p, len, MADV_HUGEPAGE);
+#endif
+	__sync_fetch_and_add(&huge_allocs, 1);
+	__sync_fetch_and_add(&huge_bytes, len);
+	return p;
+}
+
+void huge_free(void * p, size_t bytes) {
+	if(p != NULL) {
+		munmap(p, huge_len(bytes));
+	}
+}
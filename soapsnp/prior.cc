@@ -39,6 +39,10 @@ int Prob_matrix::prior_gen(Parameter * para) {
 			p_prior[0x7<<4|allele1<<2|allele2] = (allele1==allele2? 1: (2*para->het_novel_r)) * 0.25 *0.25;
 		}
 	}
+	// Calls only ever add priors in log10 scale
+	for(int i = 0; i != 8*4*4; i++) {
+		log_prior[i] = log10(p_prior[i]);
+	}
 	return 1;
 }
 
@@ -46,8 +50,8 @@ int Prob_matrix::prior_gen(Parameter * para) {
  * Generate a prior probability for each diploid genotype given SNPdb
  * allele frequency data.
  */
-int Call_win::snp_p_prior_gen(double * real_p_prior, Snp_info* snp,
-                              Parameter * para, char ref)
+int Prob_matrix::snp_prior_gen(double * real_p_prior, Snp_info* snp,
+                               Parameter * para, char ref)
 {
 	if (snp->is_indel()) {
 		return 0;
@@ -109,3 +113,27 @@ int Call_win::snp_p_prior_gen(double * real_p_prior, Snp_info* snp,
 	}
 	return 1;
 }
+
+/**
+ * Work out the log10 genotype priors of the known SNPs on this
+ * chromosome once, rather than at every call.  They start from those
+ * of the reference base at the SNP.
+ */
+void Chr_info::snp_priors(Prob_matrix * mat, Parameter * para) {
+	double prior[16];
+	for(map<ubit64_t, Snp_info*>::iterator it = dbsnp.begin(); it != dbsnp.end() && it->first < len; it++) {
+		char ref = get_bin_base(it->first);
+		memcpy(prior, &mat->p_prior[((ubit64_t)ref&0x7)<<4], sizeof(double)*16);
+		mat->snp_prior_gen(prior, it->second, para, ref);
+		for(int i = 0; i != 16; i++) {
+			prior[i] = log10(prior[i]);
+		}
+		it->second->set_log_prior(prior);
+	}
+}
+
+void Genome::snp_priors(Prob_matrix * mat, Parameter * para) {
+	for(map<Chr_name, Chr_info*>::iterator it = chromosomes.begin(); it != chromosomes.end(); it++) {
+		it->second->snp_priors(mat, para);
+	}
+}
@@ -0,0 +1,152 @@
+#include "soap_snp.h"
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#ifdef WITH_PERF
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+bool profiling = false;
+__thread double prof_time[PROF_PHASES];
+__thread ubit64_t prof_win_hist[PROF_HIST];
+
+static const char * const phase_names[PROF_PHASES] = {
+	"genome_load", "dbsnp_load", "matrix_gen", "rank_table_gen",
+	"parse", "window_fill", "call_cns", "output"
+};
+
+static const char * const hw_names[] = {
+	"cycles", "instructions", "cache_misses", "branch_misses", "dtlb_load_misses"
+};
+
+Profiler::Profiler() :
+	input_bytes(0), started(0), ended(0), calling_start(0), calling_end(0), peak_rss_kb(0),
+	minor_faults(0), anon_huge_kb(-1)
+{
+	for(int i = 0; i != HW_COUNTERS; i++) {
+		hw_fd[i] = -1;
+		hw_value[i] = -1;
+	}
+}
+
+void Profiler::start() {
+	started = prof_now();
+#ifdef WITH_PERF
+	// Counted for this thread and the calling threads it starts later
+	static const ubit64_t configs[HW_COUNTERS] = {
+		PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+		PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES,
+		PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)
+	};
+	for(int i = 0; i != HW_COUNTERS; i++) {
+		struct perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = (i == HW_COUNTERS-1) ? PERF_TYPE_HW_CACHE : PERF_TYPE_HARDWARE;
+		attr.config = configs[i];
+		attr.inherit = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		hw_fd[i] = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+		if(hw_fd[i] < 0) {
+			cerr << "Warning: hardware counter " << hw_names[i] << " is not available" << endl;
+		}
+	}
+#endif
+}
+
+void Profiler::finish() {
+	if(ended > 0) {
+		return;
+	}
+	ended = prof_now();
+	struct rusage ru;
+	if(getrusage(RUSAGE_SELF, &ru) == 0) {
+		peak_rss_kb = ru.ru_maxrss;
+		minor_faults = ru.ru_minflt;
+	}
+	// How much of the memory still mapped is backed by huge pages
+	ifstream smaps("/proc/self/smaps_rollup");
+	for(std::string line; getline(smaps, line);) {
+		if(line.compare(0, 14, "AnonHugePages:") == 0) {
+			anon_huge_kb = atol(line.c_str() + 14);
+		}
+	}
+	for(int i = 0; i != HW_COUNTERS; i++) {
+		if(hw_fd[i] >= 0) {
+			long long v;
+			if(read(hw_fd[i], &v, sizeof(v)) == (ssize_t)sizeof(v)) {
+				hw_value[i] = v;
+			}
+			close(hw_fd[i]);
+			hw_fd[i] = -1;
+		}
+	}
+}
+
+bool Profiler::write(const std::string & fn) {
+	finish();
+	ofstream out(fn.c_str());
+	if(!out) {
+		return false;
+	}
+	double calling = calling_end - calling_start;
+	out << fixed << setprecision(6);
+	out << "{" << endl;
+	out << "  \"wall_seconds\": " << ended - started << "," << endl;
+	out << "  \"calling_seconds\": " << calling << "," << endl;
+	out << "  \"phase_seconds\": {";
+	for(int i = 0; i != PROF_PHASES; i++) {
+		out << (i ? ", " : "") << "\"" << phase_names[i] << "\": " << prof_time[i];
+	}
+	out << "}," << endl;
+	// Upper bound of each bucket in microseconds, and how many windows
+	// call_cns took at most that long for
+	out << "  \"call_cns_window_us\": [";
+	int last = PROF_HIST-1;
+	while(last > 0 && prof_win_hist[last] == 0) {
+		last--;
+	}
+	for(int i = 0; i <= last; i++) {
+		out << (i ? ", " : "") << "[" << (1ULL << i) << ", " << prof_win_hist[i] << "]";
+	}
+	out << "]," << endl;
+	out << setprecision(1);
+	out << "  \"alignments\": " << alignments_read << "," << endl;
+	out << "  \"alignments_per_second\": " << (calling > 0 ? alignments_read / calling : 0) << "," << endl;
+	out << "  \"input_bytes\": " << input_bytes << "," << endl;
+	out << "  \"bytes_per_second\": " << (calling > 0 ? input_bytes / calling : 0) << "," << endl;
+	out << "  \"peak_rss_kb\": " << peak_rss_kb << "," << endl;
+	out << "  \"minor_faults\": " << minor_faults << "," << endl;
+	out << "  \"huge_tables\": " << huge_allocs << "," << endl;
+	out << "  \"huge_table_kb\": " << huge_bytes / 1024;
+	if(anon_huge_kb >= 0) {
+		out << "," << endl << "  \"anon_huge_kb\": " << anon_huge_kb;
+	}
+	bool hw = false;
+	for(int i = 0; i != HW_COUNTERS; i++) {
+		if(hw_value[i] >= 0) {
+			out << (hw ? ", " : ",\n  \"hardware\": {") << "\"" << hw_names[i] << "\": " << hw_value[i];
+			hw = true;
+		}
+	}
+	out << (hw ? "}" : "") << endl << "}" << endl;
+	return out.good();
+}
+
+void Profiler::counters() {
+	finish();
+	for(int i = 0; i != PROF_PHASES; i++) {
+		cerr << "reporter:counter:SOAPsnp,Milliseconds in " << phase_names[i] << "," << (ubit64_t)(prof_time[i] * 1000) << endl;
+	}
+	cerr << "reporter:counter:SOAPsnp,Milliseconds calling," << (ubit64_t)((calling_end - calling_start) * 1000) << endl;
+	cerr << "reporter:counter:SOAPsnp,Peak RSS MB," << peak_rss_kb / 1024 << endl;
+	cerr << "reporter:counter:SOAPsnp,Minor page faults," << minor_faults << endl;
+	for(int i = 0; i != HW_COUNTERS; i++) {
+		if(hw_value[i] >= 0) {
+			cerr << "reporter:counter:SOAPsnp,Hardware " << hw_names[i] << "," << hw_value[i] << endl;
+		}
+	}
+}
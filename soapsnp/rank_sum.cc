@@ -24,8 +24,8 @@ int Prob_matrix::rank_table_gen() {
 		fact[i] = fact[i-1]*i;
 	}
 
-	ubit64_t * rank_sum= new ubit64_t [64*64*2048]; // 6bit: N; 5bit: n1; 11bit; T1
-	memset(rank_sum, 0, sizeof(ubit64_t)*64*64*2048);
+	// Only the cells the recurrence reaches are ever touched
+	ubit64_t * rank_sum = (ubit64_t *)huge_alloc(sizeof(ubit64_t)*64*64*2048); // 6bit: N; 5bit: n1; 11bit; T1
 	rank_sum[0]=1;
 	for(N=1;N!=64;N++) {
 		for(n1=0;n1<=N;n1++) {
@@ -43,7 +43,7 @@ int Prob_matrix::rank_table_gen() {
 			}
 		}
 	}
-	delete [] rank_sum;
+	huge_free(rank_sum, sizeof(ubit64_t)*64*64*2048);
 	delete [] fact;
 	return 1;
 }
@@ -64,12 +64,14 @@ double Call_win::table_test(rate_t *p_rank, int n1, int n2, double T1, double T2
 	}
 }
 
-double Call_win::rank_test(Pos_info & info, char best_type, rate_t * p_rank, Parameter * para) {
+double Call_win::rank_test(int sub, char best_type, rate_t * p_rank, Parameter * para) {
+	const Pos_info & info = sites[sub];
+	const int * count_uni = counts.count_uni[sub];
 	if( (best_type&3) == ((best_type>>2)&3) ) {
 		// HOM
 		return 1.0;
 	}
-	if( info.count_uni[best_type&3]==0 || info.count_uni[(best_type>>2)&3]==0) {
+	if( count_uni[best_type&3]==0 || count_uni[(best_type>>2)&3]==0) {
 		// HET with one allele...
 		return 0.0;
 	}
@@ -78,10 +80,13 @@ double Call_win::rank_test(Pos_info & info, char best_type, rate_t * p_rank, Par
 	//memset(same_qual_count, 0, sizeof(int)*(para->q_max-para->q_min+1));
 	//double * rank_array= new double [para->q_max-para->q_min+1];
 	//memset(rank_array, 0, sizeof(double)*(para->q_max-para->q_min+1));
-	int *same_qual_count = new int [64];
-	double *rank_array = new double [64];
-	memset(same_qual_count,0,sizeof(int)*64);
-	memset(rank_array,0,sizeof(double)*64);
+	// On the stack rather than the heap, as this runs for every
+	// heterozygous candidate; the loop below reaches one past the
+	// largest quality
+	int same_qual_count[64+1];
+	double rank_array[64+1];
+	memset(same_qual_count,0,sizeof(same_qual_count));
+	memset(rank_array,0,sizeof(rank_array));
 
 	int rank(0);
 	double T[4]={0.0, 0.0, 0.0, 0.0};
@@ -90,7 +95,7 @@ double Call_win::rank_test(Pos_info & info, char best_type, rate_t * p_rank, Par
 	std::string::size_type o_base, strand;
 	int  q_score, coord;
 	for(o_base=0;o_base!=4;o_base++) {
-		if(info.count_uni[o_base]==0 || !is_need[o_base]) continue;
+		if(count_uni[o_base]==0 || !is_need[o_base]) continue;
 		for(q_score=para->q_max-para->q_min;q_score>=0;q_score--) {
 			for(coord=para->read_length-1;coord>=0;coord--) {
 				for(strand=0;strand<2;strand++) {
@@ -108,7 +113,7 @@ double Call_win::rank_test(Pos_info & info, char best_type, rate_t * p_rank, Par
 		rank += same_qual_count[q_score];
 	}
 	for(o_base=0;o_base!=4;o_base++) {
-		if(info.count_uni[o_base]==0 || !is_need[o_base]) continue;
+		if(count_uni[o_base]==0 || !is_need[o_base]) continue;
 		for(q_score=para->q_max-para->q_min;q_score>=0;q_score--) {
 			for(coord=para->read_length-1;coord>=0;coord--) {
 				for(strand=0;strand<2;strand++) {
@@ -117,12 +122,10 @@ double Call_win::rank_test(Pos_info & info, char best_type, rate_t * p_rank, Par
 			}
 		}
 	}
-	delete [] same_qual_count;
-	delete [] rank_array;
-	if (info.count_uni[best_type&3]+info.count_uni[(best_type>>2)&3]<64) {
-		return table_test(p_rank, info.count_uni[best_type&3], info.count_uni[(best_type>>2)&3], T[best_type&3], T[(best_type>>2)&3]);
+	if (count_uni[best_type&3]+count_uni[(best_type>>2)&3]<64) {
+		return table_test(p_rank, count_uni[best_type&3], count_uni[(best_type>>2)&3], T[best_type&3], T[(best_type>>2)&3]);
 	}
 	else {
-		return normal_test(info.count_uni[best_type&3], info.count_uni[(best_type>>2)&3],T[best_type&3], T[(best_type>>2)&3]);
+		return normal_test(count_uni[best_type&3], count_uni[(best_type>>2)&3],T[best_type&3], T[(best_type>>2)&3]);
 	}
 }
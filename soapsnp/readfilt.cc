@@ -0,0 +1,310 @@
+/*
+ * readfilt.cc
+ *
+ *  Filter preprocessed Crossbow reads on their way into bowtie, as
+ *  Align.pl does in Perl.  Each input line is a read, "name\tseq\tqual"
+ *  or "name\tseq1\tqual1\tseq2\tqual2" for a pair.  Reads may be
+ *  randomly discarded, mates dropped, and reads truncated or discarded
+ *  when shorter than the truncation length.  Qualities are converted
+ *  to Phred+33 and every surviving read is written in bowtie's --12
+ *  format, "r\tseq\tqual[\tseq2\tqual2]".  The same Hadoop counters as
+ *  Align.pl are printed to stderr at the end.
+ *
+ *  Qualities go through a 256-entry table built once from the encoding,
+ *  and each raw quality character is tallied in a byte histogram; the
+ *  per-decade counters are folded from it at the end.
+ */
+
+#include <iostream>
+#include <string>
+#include <map>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <ctime>
+#include <getopt.h>
+#include <unistd.h>
+
+using namespace std;
+
+typedef unsigned long long ubit64_t;
+
+int usage() {
+	cerr<<"readfilt: filter preprocessed reads and convert their qualities for bowtie --12"<<endl;
+	cerr<<"Usage: readfilt [options] < reads > bowtie_input"<<endl;
+	cerr<<"-q <STR> Quality encoding of the input: phred33, phred64, solexa64 [phred33]"<<endl;
+	cerr<<"-t <int> Truncate reads and mates to <int> bases [Off]"<<endl;
+	cerr<<"-s Discard reads or pairs with a mate shorter than -t instead of keeping them"<<endl;
+	cerr<<"-m <int> Discard mate 1 or 2 of every pair [Off]"<<endl;
+	cerr<<"-d <float> Randomly discard this fraction of the reads [0]"<<endl;
+	cerr<<"-r <int> Seed for -d [time and pid]"<<endl;
+	cerr<<"-h Display this help"<<endl;
+	exit(1);
+	return 0;
+}
+
+// Solexa qualities from -10 to 19 as Phred
+static const int sol2phred_map[30] = {
+	 0,  1,  1,  1,  1,  1,  1,  2,  2,  3,
+	 3,  4,  4,  5,  5,  6,  7,  8,  9, 10,
+	10, 11, 12, 13, 14, 15, 16, 17, 18, 19
+};
+
+static int sol2phred(int q) {
+	if(q < -10) return 0;
+	if(q < 20) return sol2phred_map[q + 10];
+	return q;
+}
+
+// Decoded quality of each raw character
+static int qual_value[256];
+static unsigned char qual_conv[256];
+static ubit64_t qual_hist[256];
+
+static void init_quals(const string & qual) {
+	int off = (qual.size() >= 2 && qual.compare(qual.size() - 2, 2, "33") == 0) ? 33 : 64;
+	bool sol = strncasecmp(qual.c_str(), "solexa", 6) == 0;
+	for(int c = 0; c != 256; c++) {
+		int q = c - off;
+		if(sol) q = sol2phred(q);
+		qual_value[c] = q;
+		qual_conv[c] = (unsigned char)(q + 33);
+	}
+}
+
+/// Convert a quality string into out and tally its raw characters
+static char * conv_quals(const char * q, size_t len, char * out) {
+	const unsigned char * u = (const unsigned char *)q;
+	for(size_t i = 0; i != len; i++) {
+		qual_hist[u[i]]++;
+		out[i] = qual_conv[u[i]];
+	}
+	return out;
+}
+
+/// Buffered stdout; the --12 output is written in large blocks
+struct Out_buf {
+	char * buf;
+	size_t size, used;
+	Out_buf(size_t size) : buf(new char[size]), size(size), used(0) {}
+	~Out_buf() { delete [] buf; }
+	void flush() {
+		if(used > 0 && fwrite(buf, 1, used, stdout) != used) {
+			cerr << "Error writing reads to stdout" << endl;
+			exit(1);
+		}
+		used = 0;
+	}
+	char * reserve(size_t len) {
+		if(used + len > size) {
+			flush();
+			if(len > size) {
+				delete [] buf;
+				size = len;
+				buf = new char[size];
+			}
+		}
+		return buf + used;
+	}
+	void put(const char * s, size_t len) {
+		memcpy(reserve(len), s, len);
+		used += len;
+	}
+	void put(char c) {
+		*reserve(1) = c;
+		used++;
+	}
+};
+
+static bool is_space(char c) {
+	return c == ' ' || c == '\t' || c == '\r' || c == '\f' || c == '\v';
+}
+
+/// True for lines Align.pl skips without counting: blank or FAKE
+static bool skip_line(const char * s, const char * end) {
+	while(s != end && is_space(*s)) s++;
+	while(end != s && is_space(end[-1])) end--;
+	return s == end || (end - s == 4 && memcmp(s, "FAKE", 4) == 0);
+}
+
+int main(int argc, char **argv) {
+	int c;
+	string qual("phred33");
+	int truncate = 0, discard_mate = 0;
+	bool discard_small = false;
+	double discard_reads = 0.0;
+	long seed = (long)time(NULL) ^ ((long)getpid() << 16);
+	while((c = getopt(argc, argv, "q:t:sm:d:r:h")) != -1) {
+		switch(c) {
+			case 'q': qual = optarg; break;
+			case 't': truncate = atoi(optarg); break;
+			case 's': discard_small = true; break;
+			case 'm': discard_mate = atoi(optarg); break;
+			case 'd': discard_reads = atof(optarg); break;
+			case 'r': seed = atol(optarg); break;
+			case 'h': usage(); break;
+			default: usage();
+		}
+	}
+	if(optind != argc) {
+		usage();
+	}
+	init_quals(qual);
+	srand48(seed);
+
+	ubit64_t downloaded = 0, skipped = 0, trunc_skipped = 0, unpaired_pass = 0, paired_pass = 0, mates_skipped = 0, truncated = 0;
+	map<size_t, ubit64_t> lens;
+	Out_buf out(1 << 20);
+	char * qbuf = NULL;
+	size_t qbuf_size = 0;
+	// Input is read in blocks; a partial last line moves to the front
+	size_t in_size = 1 << 20, in_used = 0;
+	char * in = (char *)malloc(in_size);
+	bool eof = false;
+	while(!eof || in_used > 0) {
+		if(!eof) {
+			if(in_used == in_size) {
+				in_size *= 2;
+				in = (char *)realloc(in, in_size);
+			}
+			size_t n = fread(in + in_used, 1, in_size - in_used, stdin);
+			in_used += n;
+			eof = (n == 0);
+		}
+		char * p = in, * end = in + in_used;
+		while(p != end) {
+			char * nl = (char *)memchr(p, '\n', end - p);
+			if(nl == NULL) {
+				if(!eof) break;
+				nl = end;
+			}
+			char * line = p;
+			p = (nl == end) ? end : nl + 1;
+			if(skip_line(line, nl)) {
+				continue;
+			}
+			downloaded++;
+			if(discard_reads != 0 && drand48() < discard_reads) {
+				skipped++;
+				continue;
+			}
+			// Split on tabs, dropping trailing empty fields as Perl's split does
+			const char * tok[5];
+			size_t tok_len[5];
+			int ntok = 0, nempty = 0;
+			bool bad = false;
+			for(char * s = line; ; ) {
+				char * tab = (char *)memchr(s, '\t', nl - s);
+				char * e = (tab == NULL) ? nl : tab;
+				if(e == s) {
+					nempty++;
+				} else {
+					if(ntok + nempty >= 5) {
+						bad = true;
+						break;
+					}
+					while(nempty > 0) {
+						tok[ntok] = s;
+						tok_len[ntok++] = 0;
+						nempty--;
+					}
+					tok[ntok] = s;
+					tok_len[ntok++] = e - s;
+				}
+				if(tab == NULL) break;
+				s = tab + 1;
+			}
+			if(bad || (ntok != 3 && ntok != 5)) {
+				cerr << "Bad number of read tokens ; expected 3 or 5:" << endl << string(line, nl) << endl;
+				exit(1);
+			}
+			bool pe = (ntok == 5);
+			size_t len1 = tok_len[1], len2 = 0;
+			if(pe) {
+				if(discard_mate > 0) {
+					if(discard_mate == 1) {
+						// First mate is discarded, second is promoted
+						tok[1] = tok[3]; tok_len[1] = tok_len[3];
+						tok[2] = tok[4]; tok_len[2] = tok_len[4];
+						len1 = tok_len[1];
+					}
+					mates_skipped++;
+					pe = false;
+				} else {
+					len2 = tok_len[3];
+					lens[len2]++;
+				}
+			}
+			lens[len1]++;
+			if(truncate > 0 && discard_small &&
+			   (len1 < (size_t)truncate || (len2 > 0 && len2 < (size_t)truncate)))
+			{
+				trunc_skipped++;
+				continue;
+			}
+			size_t nlen1 = len1, nlen2 = len2;
+			if(truncate > 0) {
+				nlen1 = min(nlen1, (size_t)truncate);
+				nlen2 = min(nlen2, (size_t)truncate);
+			}
+			if(nlen1 < len1) truncated++;
+			if(pe && nlen2 < len2) truncated++;
+			size_t qlen = max(tok_len[2], pe ? tok_len[4] : 0);
+			if(qlen > qbuf_size) {
+				delete [] qbuf;
+				qbuf_size = qlen * 2;
+				qbuf = new char[qbuf_size];
+			}
+			out.put("r\t", 2);
+			out.put(tok[1], nlen1);
+			out.put('\t');
+			conv_quals(tok[2], tok_len[2], qbuf);
+			out.put(qbuf, min(nlen1, tok_len[2]));
+			if(pe) {
+				out.put('\t');
+				out.put(tok[3], nlen2);
+				out.put('\t');
+				conv_quals(tok[4], tok_len[4], qbuf);
+				out.put(qbuf, min(nlen2, tok_len[4]));
+				paired_pass++;
+			} else {
+				unpaired_pass++;
+			}
+			out.put('\n');
+		}
+		in_used = end - p;
+		memmove(in, p, in_used);
+	}
+	out.flush();
+	fflush(stdout);
+	free(in);
+	delete [] qbuf;
+
+	cerr << "reporter:counter:Bowtie,Reads downloaded," << downloaded << endl;
+	cerr << "reporter:counter:Bowtie,Reads (all) passing filters," << unpaired_pass + paired_pass << endl;
+	cerr << "reporter:counter:Bowtie,Reads (unpaired) passing filters," << unpaired_pass << endl;
+	cerr << "reporter:counter:Bowtie,Reads (paired) passing filters," << paired_pass << endl;
+	cerr << "reporter:counter:Bowtie,Reads skipped due to -discard-reads," << skipped << endl;
+	cerr << "reporter:counter:Bowtie,Reads skipped due to -truncate-discard," << trunc_skipped << endl;
+	cerr << "reporter:counter:Bowtie,Mates skipped due to -discard-mate," << mates_skipped << endl;
+	cerr << "reporter:counter:Bowtie,Reads (mates) truncated due to -truncate*," << truncated << endl;
+	for(map<size_t, ubit64_t>::iterator it = lens.begin(); it != lens.end(); it++) {
+		cerr << "reporter:counter:Bowtie,Reads of length " << it->first << "," << it->second << endl;
+	}
+	// Fold the character histogram into decades, truncating toward zero
+	// as Perl's int() does
+	map<int, ubit64_t> raw_cnts, cnts;
+	for(int c = 0; c != 256; c++) {
+		if(qual_hist[c] > 0) {
+			raw_cnts[c / 10] += qual_hist[c];
+			cnts[qual_value[c] / 10] += qual_hist[c];
+		}
+	}
+	for(map<int, ubit64_t>::iterator it = raw_cnts.begin(); it != raw_cnts.end(); it++) {
+		cerr << "reporter:counter:Bowtie,Occurrences of raw quality value [" << it->first * 10 << ":" << it->first * 10 + 10 << ")," << it->second << endl;
+	}
+	for(map<int, ubit64_t>::iterator it = cnts.begin(); it != cnts.end(); it++) {
+		cerr << "reporter:counter:Bowtie,Occurrences of phred-33 quality value [" << it->first * 10 << ":" << it->first * 10 + 10 << ")," << it->second << endl;
+	}
+	return 0;
+}
@@ -0,0 +1,382 @@
+/*
+ * readprep.cc
+ *
+ *  Turn FASTQ or SAM reads into Crossbow's preprocessed-read format, as
+ *  the parsers in Copy.pl do in Perl.  Every read becomes one line,
+ *
+ *    FN:<file>[;LB:<label>];RN:<name>[;SM:<chr>,<pos>,<fw>,<mapq>,<cigar>]<TAB>seq<TAB>qual
+ *
+ *  with a second seq and qual for a pair read from two files.  SAM reads
+ *  aligned to the forward strand are reverse-complemented, as Copy.pl
+ *  does.  Output goes to <name>_1.out, <name>_2.out, ... of at most -m
+ *  reads or pairs each; as each file is finished its path and the
+ *  number of reads or pairs in it are printed to stdout, so that it can
+ *  be pushed while the rest are written.  Counters go to stderr.
+ *
+ *  Inputs are read, and decompressed if gzip or bzip2, on a background
+ *  thread (see Aln_istream), and split into lines with memchr over
+ *  large blocks.
+ */
+
+#include "aln_stream.h"
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <getopt.h>
+
+using namespace std;
+
+typedef unsigned long long ubit64_t;
+
+int usage() {
+	cerr<<"readprep: convert FASTQ or SAM reads into Crossbow preprocessed reads"<<endl;
+	cerr<<"Usage: readprep -n <NAME> [options] <FILE> [<MATE FILE>]"<<endl;
+	cerr<<"-n <NAME> Name of the input for FN: and the output files <NAME>_1.out, ..."<<endl;
+	cerr<<"-f <STR> Input format, fastq or sam [fastq]"<<endl;
+	cerr<<"-l <STR> Label every read with LB:<STR>"<<endl;
+	cerr<<"-g Label every read with its SAM read group (RG:Z) instead"<<endl;
+	cerr<<"-c Reads are in colorspace; reverse without complementing"<<endl;
+	cerr<<"-m <int> Maximum reads or pairs per output file [500000]"<<endl;
+	cerr<<"-s <int> Stop after this many reads, counting both mates of a pair [Off]"<<endl;
+	cerr<<"-z Print the compressed input formats this build reads and exit"<<endl;
+	cerr<<"-h Display this help"<<endl;
+	exit(1);
+	return 0;
+}
+
+/// Lines of an input, found with memchr in large blocks
+class Line_reader {
+	Aln_istream in;
+	vector<char> buf;
+	size_t beg, end;
+	bool eof;
+public:
+	ubit64_t bytes; // read so far, decompressed
+	Line_reader(const char * fn) : in(fn), buf(4 << 20), beg(0), end(0), eof(false), bytes(0) {}
+	bool good() { return !in.fail(); }
+	/// Next line without its newline; false at end of input.  s stays
+	/// valid until the next call.
+	bool next(const char *& s, size_t & len) {
+		while(true) {
+			char * nl = (char *)memchr(&buf[beg], '\n', end - beg);
+			if(nl != NULL || (eof && end > beg)) {
+				s = &buf[beg];
+				len = (nl != NULL) ? (size_t)(nl - s) : end - beg;
+				beg += len + (nl != NULL);
+				return true;
+			}
+			if(eof) {
+				return false;
+			}
+			// Move the partial line to the front and read more
+			memmove(&buf[0], &buf[beg], end - beg);
+			end -= beg;
+			beg = 0;
+			if(end == buf.size()) {
+				buf.resize(buf.size() * 2);
+			}
+			in.read(&buf[end], buf.size() - end);
+			size_t n = in.gcount();
+			end += n;
+			bytes += n;
+			if(n == 0) {
+				eof = true;
+			}
+		}
+	}
+};
+
+/// Everything Copy.pl keeps of a parsed read
+struct Read {
+	string name, seq, qual, group;
+	bool has_group;
+};
+
+static bool is_space(char c) {
+	return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f' || c == '\v';
+}
+
+/// Perl's $name =~ s/\s.*//
+static size_t first_word(const char * s, size_t len) {
+	size_t i = 0;
+	while(i != len && !is_space(s[i])) i++;
+	return i;
+}
+
+static void die(const string & msg) {
+	cerr << msg << endl;
+	exit(1);
+}
+
+static bool parse_fastq(Line_reader & in, Read & r) {
+	const char * s;
+	size_t len;
+	if(!in.next(s, len)) return false;
+	r.name.assign("RN:", 3);
+	r.name.append(s, first_word(s, len));
+	if(!in.next(s, len)) return false;
+	r.seq.assign(s, len);
+	if(!in.next(s, len)) return false;
+	if(!in.next(s, len)) return false;
+	r.qual.assign(s, len);
+	r.has_group = false;
+	return true;
+}
+
+static char comp_map[256];
+
+static void init_comp() {
+	for(int c = 0; c != 256; c++) comp_map[c] = (char)c;
+	const char * from = "aAcCgGtT", * to = "tTgGcCaA";
+	for(int i = 0; i != 8; i++) comp_map[(unsigned char)from[i]] = to[i];
+}
+
+static bool color = false, label_rg = false;
+
+static bool parse_sam(Line_reader & in, Read & r) {
+	const char * s;
+	size_t len;
+	if(!in.next(s, len)) return false;
+	// Split on tabs, dropping trailing empty fields as Perl's split does
+	vector<pair<const char *, size_t> > tok;
+	for(size_t i = 0; ; ) {
+		const char * tab = (const char *)memchr(s + i, '\t', len - i);
+		size_t e = (tab == NULL) ? len : (size_t)(tab - s);
+		tok.push_back(make_pair(s + i, e - i));
+		if(tab == NULL) break;
+		i = e + 1;
+	}
+	while(!tok.empty() && tok.back().second == 0) tok.pop_back();
+	if(tok.size() < 11) {
+		die("Malformed SAM line; not enough tokens:\n" + string(s, len));
+	}
+	string flags(tok[1].first, tok[1].second);
+	double fval = strtod(flags.c_str(), NULL);
+	long flag = (long)fval;
+	if(fval != (double)flag) {
+		die("SAM flags field must be an integer; was " + flags + "\n" + string(s, len));
+	}
+	bool fw = (flag & 16) == 0;
+	const char * seq = tok[9].first, * qual = tok[10].first;
+	size_t n = tok[9].second, qn = tok[10].second;
+	if(fw) {
+		r.seq.resize(n);
+		for(size_t i = 0; i != n; i++) {
+			char c = seq[n - 1 - i];
+			r.seq[i] = color ? c : comp_map[(unsigned char)c];
+		}
+		r.qual.assign(qual, qn);
+		for(size_t i = 0; i != qn / 2; i++) {
+			swap(r.qual[i], r.qual[qn - 1 - i]);
+		}
+	} else {
+		r.seq.assign(seq, n);
+		r.qual.assign(qual, qn);
+	}
+	// Optional fields, split on whitespace and then on colons; each must
+	// have a name, a type and a value
+	r.has_group = false;
+	for(size_t t = 11; t < tok.size(); t++) {
+		const char * p = tok[t].first, * e = p + tok[t].second;
+		while(p != e && is_space(*p)) p++;
+		while(p != e) {
+			const char * w = p;
+			while(p != e && !is_space(*p)) p++;
+			const char * c1 = (const char *)memchr(w, ':', p - w);
+			const char * c2 = (c1 == NULL) ? NULL : (const char *)memchr(c1 + 1, ':', p - c1 - 1);
+			const char * v = (c2 == NULL) ? p : c2 + 1;
+			const char * ve = p;
+			while(ve != v && ve[-1] == ':') ve--;
+			if(c2 == NULL || ve == v) {
+				die("Malformed SAM optional field:\n" + string(s, len));
+			}
+			if(c2 - w == 4 && memcmp(w, "RG:Z", 4) == 0) {
+				r.group.assign(v, ve);
+				r.has_group = true;
+			}
+			while(p != e && is_space(*p)) p++;
+		}
+	}
+	if(label_rg && !r.has_group) {
+		die("No read group for read " + string(tok[0].first, tok[0].second) + "\n" + string(s, len));
+	}
+	r.name.assign("RN:", 3);
+	r.name.append(tok[0].first, first_word(tok[0].first, tok[0].second));
+	r.name += ";SM:";
+	for(int i = 2; i <= 5; i++) {
+		r.name.append(tok[i].first, tok[i].second);
+		r.name += (i == 3) ? (fw ? ",1," : ",0,") : (i == 5 ? "" : ",");
+	}
+	return true;
+}
+
+/// Output files of at most max_per_file reads or pairs each
+class Out_files {
+	string prefix;
+	ubit64_t max_per_file, in_file;
+	int fileno;
+	FILE * f;
+	string fn;
+	char * buf;
+
+	void open_next() {
+		char num[32];
+		sprintf(num, "_%d.out", ++fileno);
+		fn = prefix + num;
+		f = fopen(fn.c_str(), "w");
+		if(f == NULL) {
+			die("Could not open output file " + fn);
+		}
+		setvbuf(f, buf, _IOFBF, 1 << 20);
+		in_file = 0;
+	}
+public:
+	Out_files(const string & prefix, ubit64_t max_per_file) :
+		prefix(prefix), max_per_file(max_per_file), in_file(0), fileno(0), f(NULL), buf(new char[1 << 20])
+	{
+		open_next();
+	}
+	~Out_files() { delete [] buf; }
+	FILE * file() { return f; }
+	/// Count a record written; finish the file when it is full
+	void written() {
+		if(++in_file == max_per_file && max_per_file > 0) {
+			finish();
+			open_next();
+		}
+	}
+	/// Close the current file and report it
+	void finish() {
+		if(fclose(f) != 0) {
+			die("Error writing output file " + fn);
+		}
+		f = NULL;
+		printf("%s\t%llu\n", fn.c_str(), in_file);
+		fflush(stdout);
+	}
+};
+
+static void put(FILE * f, const string & s) {
+	fwrite(s.data(), 1, s.size(), f);
+}
+
+/// Report how much an input decompressed to, as Copy.pl's fetch does
+static void fetched_counters(const string & fn, ubit64_t bytes) {
+	const char * kind = NULL;
+	size_t n = fn.size();
+	if((n > 3 && fn.compare(n - 3, 3, ".gz") == 0) || (n > 5 && fn.compare(n - 5, 5, ".gzip") == 0)) {
+		kind = "un-gzipped";
+	} else if((n > 4 && fn.compare(n - 4, 4, ".bz2") == 0) || (n > 6 && fn.compare(n - 6, 6, ".bzip2") == 0)) {
+		kind = "un-bzip2ed";
+	}
+	if(kind != NULL) {
+		cerr << "reporter:counter:Short read preprocessor,Read data fetched (uncompressed)," << bytes << endl;
+		cerr << "reporter:counter:Short read preprocessor,Read data fetched (" << kind << ")," << bytes << endl;
+	}
+}
+
+int main(int argc, char **argv) {
+	int c;
+	string name, format("fastq"), label;
+	bool has_label = false;
+	ubit64_t max_per_file = 500000;
+	long long stop_after = -1;
+	while((c = getopt(argc, argv, "n:f:l:gcm:s:zh")) != -1) {
+		switch(c) {
+			case 'n': name = optarg; break;
+			case 'f': format = optarg; break;
+			case 'l': label = optarg; has_label = true; break;
+			case 'g': label_rg = true; break;
+			case 'c': color = true; break;
+			case 'm': max_per_file = strtoull(optarg, NULL, 10); break;
+			case 's': stop_after = atoll(optarg); break;
+			case 'z':
+				cout << "gzip";
+#ifdef WITH_BZIP2
+				cout << " bzip2";
+#endif
+#ifdef WITH_ZSTD
+				cout << " zstd";
+#endif
+				cout << endl;
+				return 0;
+			case 'h': usage(); break;
+			default: usage();
+		}
+	}
+	vector<string> inputs(argv + optind, argv + argc);
+	if(name.empty() || inputs.empty() || inputs.size() > 2) {
+		usage();
+	}
+	bool sam = (strcasecmp(format.c_str(), "sam") == 0);
+	bool paired = (inputs.size() == 2);
+	init_comp();
+
+	Line_reader * in1 = new Line_reader(inputs[0].c_str());
+	Line_reader * in2 = paired ? new Line_reader(inputs[1].c_str()) : NULL;
+	if(!in1->good() || (paired && !in2->good())) {
+		die("Could not open input file " + inputs[!in1->good() ? 0 : 1]);
+	}
+	string rname("FN:");
+	for(size_t i = 0; i != name.size(); i++) {
+		if(!is_space(name[i])) rname += name[i];
+	}
+	Out_files out(name, max_per_file);
+	const char * what = paired ? "Paired reads" : "Unpaired reads";
+	map<string, ubit64_t> labels;
+	ubit64_t reads = 0, since_report = 0;
+	Read r1, r2;
+	string fullname;
+	while(stop_after < 0 || (long long)reads < stop_after) {
+		bool got = sam ? parse_sam(*in1, r1) : parse_fastq(*in1, r1);
+		if(paired) {
+			bool got2 = sam ? parse_sam(*in2, r2) : parse_fastq(*in2, r2);
+			if(got != got2) {
+				die("Mate files didn't come together properly: " + inputs[0] + "," + inputs[1]);
+			}
+		}
+		if(!got) break;
+		// The name, and read group, are those of the second mate
+		Read & last = paired ? r2 : r1;
+		fullname = rname;
+		if(label_rg || has_label) {
+			const string & lab = label_rg ? last.group : label;
+			fullname += ";LB:";
+			fullname += lab;
+			labels[lab]++;
+		}
+		fullname += ';';
+		fullname += last.name;
+		FILE * f = out.file();
+		put(f, fullname);
+		putc('\t', f); put(f, r1.seq);
+		putc('\t', f); put(f, r1.qual);
+		if(paired) {
+			putc('\t', f); put(f, r2.seq);
+			putc('\t', f); put(f, r2.qual);
+		}
+		putc('\n', f);
+		out.written();
+		reads += paired ? 2 : 1;
+		if(++since_report >= 100000) {
+			cerr << "reporter:counter:Short read preprocessor," << what << "," << since_report << endl;
+			since_report = 0;
+		}
+	}
+	out.finish();
+	cerr << "reporter:counter:Short read preprocessor," << what << "," << since_report << endl;
+	for(map<string, ubit64_t>::iterator it = labels.begin(); it != labels.end(); it++) {
+		cerr << "reporter:counter:Short read preprocessor," << (paired ? "Pairs" : "Unpaired reads") << " with label " << it->first << "," << it->second << endl;
+	}
+	fetched_counters(inputs[0], in1->bytes);
+	if(paired) {
+		fetched_counters(inputs[1], in2->bytes);
+	}
+	delete in1;
+	delete in2;
+	return 0;
+}
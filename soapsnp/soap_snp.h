@@ -5,18 +5,22 @@
 #include <sstream>
 #include <cstring>
 #include <cstdlib>
+#include <cctype>
 #include <map>
 #include <vector>
+#include <queue>
+#include <deque>
 #include <cmath>
 #include <iomanip>
 #include <cassert>
 #include <time.h>
+#include "aln_stream.h"
 typedef unsigned long long ubit64_t;
 typedef unsigned int ubit32_t;
 typedef double rate_t;
 typedef unsigned char small_int;
 using namespace std;
-const size_t capacity = sizeof(ubit64_t)*8/4;
+const size_t capacity = sizeof(ubit64_t)*8/2;
 const char abbv[17]={'A','M','W','R','M','C','Y','S','W','Y','T','K','R','S','K','G','N'};
 const ubit64_t glf_base_code[8]={1,2,8,4,15,15,15,15}; // A C T G
 const ubit64_t glf_type_code[10]={0,5,15,10,1,3,2,7,6,11};// AA,CC,GG,TT,AC,AG,AT,CG,CT,GT
@@ -26,11 +30,11 @@ const ubit64_t glf_type_code[10]={0,5,15,10,1,3,2,7,6,11};// AA,CC,GG,TT,AC,AG,A
 // Some global variables
 class Files {
 public:
-	ifstream soap_result, ref_seq, dbsnp, region;
+	ifstream ref_seq, dbsnp, region;
+	std::vector<Aln_istream*> soap_results; // one per -i input
 	ofstream consensus, summary;
 	fstream matrix_file;
 	Files(){
-		soap_result.close();
 		ref_seq.close();
 		dbsnp.close();
 		consensus.close();
@@ -38,12 +42,36 @@ public:
 		matrix_file.close();
 		region.close();
 	};
+	~Files(){
+		close_alignments();
+	}
+	/// (Re)open every alignment input so that a pass starts at the top
+	bool open_alignments(const std::vector<std::string> & names) {
+		close_alignments();
+		for(size_t i = 0; i != names.size(); i++) {
+			Aln_istream * in = new Aln_istream(names[i].c_str());
+			soap_results.push_back(in);
+			if(!(*in)) {
+				return false;
+			}
+		}
+		return true;
+	}
+	void close_alignments() {
+		for(size_t i = 0; i != soap_results.size(); i++) {
+			delete soap_results[i];
+		}
+		soap_results.clear();
+	}
 };
 
 typedef enum {
 	SOAP_FORMAT = 1,
 	BOWTIE_FORMAT,
-	CROSSBOW_FORMAT
+	CROSSBOW_FORMAT,
+	BINARY_FORMAT,
+	SAM_FORMAT,
+	BAM_FORMAT
 } alignment_format;
 
 class Parameter {
@@ -67,6 +95,10 @@ public:
 	alignment_format format;
 	bool do_recal, verbose, dump_dbsnp_evidence;
 	bool hadoop_out;
+	int max_depth; // Max unique depth kept per site; 0: stop at 255 (legacy)
+	int reorder_dist; // How far out of order alignments may arrive
+	int threads; // Threads calling chromosome shards in parallel
+	int block_qual; // -B: least quality of reference calls merged into blocks; -1: off
 // Default onstruction
 	Parameter(){
 		q_min = 64;
@@ -84,6 +116,10 @@ public:
 		verbose = false;
 		hadoop_out = false;
 		dump_dbsnp_evidence = false;
+		max_depth = 0;
+		reorder_dist = 0;
+		threads = 1;
+		block_qual = -1;
 	};
 };
 
@@ -91,6 +127,149 @@ extern unsigned long alignments_read;
 extern unsigned long alignments_read_unique;
 extern unsigned long alignments_read_unpaired;
 extern unsigned long alignments_read_paired;
+// SAM/BAM records passed over: secondary and supplementary alignments,
+// duplicates (kept with -x), and reads whose reference span is longer
+// than a record can hold
+extern unsigned long alignments_skipped_secondary;
+extern unsigned long alignments_skipped_dup;
+extern unsigned long alignments_skipped_long;
+// Quality characters and read lengths of the alignments given to the
+// calling pass, reported with -H
+extern unsigned long read_qual_hist[256];
+extern std::vector<unsigned long> read_len_hist;
+
+/// The alignment counters above, copied and set as one (see -C)
+struct Aln_counts {
+	unsigned long read, unique, unpaired, paired, secondary, dup, long_span;
+	void get() {
+		read = alignments_read;
+		unique = alignments_read_unique;
+		unpaired = alignments_read_unpaired;
+		paired = alignments_read_paired;
+		secondary = alignments_skipped_secondary;
+		dup = alignments_skipped_dup;
+		long_span = alignments_skipped_long;
+	}
+	void set() const {
+		alignments_read = read;
+		alignments_read_unique = unique;
+		alignments_read_unpaired = unpaired;
+		alignments_read_paired = paired;
+		alignments_skipped_secondary = secondary;
+		alignments_skipped_dup = dup;
+		alignments_skipped_long = long_span;
+	}
+};
+
+/**
+ * Phases timed for the -J profile.  parse, fill, call and output are
+ * parts of the calling pass; matrix_gen includes reading its own pass
+ * over the alignments.  Calling threads (-P) keep their own times,
+ * which are handed back with their Call_counts, so those phases add up
+ * thread time rather than wall time.
+ */
+enum Prof_phase {
+	PROF_GENOME,  // reading and packing the FASTA reference
+	PROF_DBSNP,   // reading known SNPs
+	PROF_MATRIX,  // training or reading the correction matrix
+	PROF_RANK,    // prior_gen and rank_table_gen
+	PROF_PARSE,   // reading alignments for calling
+	PROF_FILL,    // adding alignments to the calling window, and clearing it
+	PROF_CALL,    // call_cns, including formatting its output
+	PROF_OUTPUT,  // writing out shards, flushing and writing indexes
+	PROF_PHASES
+};
+const int PROF_HIST = 24; // call_cns time per window, in 2^i microsecond buckets
+
+extern bool profiling; // -J
+extern __thread double prof_time[PROF_PHASES]; // seconds
+extern __thread ubit64_t prof_win_hist[PROF_HIST];
+
+/**
+ * Tallies of called positions (see main.cc).  Each calling thread keeps
+ * its own; shard workers hand theirs back to the main thread.
+ */
+struct Call_counts {
+	unsigned long called, knownsnp, uncov_uni, uncov, n_no_depth, nonref, reported, downsampled;
+	double prof[PROF_PHASES]; // -J
+	ubit64_t prof_hist[PROF_HIST];
+	/// Move this thread's tallies into *this, zeroing them
+	void take();
+	/// Add *this to this thread's tallies
+	void give() const;
+};
+
+static inline double prof_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+ * Charges the time until it is stopped or goes out of scope to a
+ * phase.  Costs a branch when not profiling.
+ */
+class Prof_timer {
+	Prof_phase phase;
+	double start;
+public:
+	Prof_timer(Prof_phase p) : phase(p), start(profiling ? prof_now() : 0) { }
+	~Prof_timer() { stop(); }
+	void stop() {
+		if(!profiling || start < 0) return;
+		double spent = prof_now() - start;
+		prof_time[phase] += spent;
+		if(phase == PROF_CALL) {
+			int b = 0;
+			for(double us = spent * 1e6; us >= 1 && b < PROF_HIST-1; us /= 2) {
+				b++;
+			}
+			prof_win_hist[b]++;
+		}
+		start = -1;
+	}
+};
+
+/**
+ * Everything the -J report needs beyond the per-phase times: the wall
+ * clock of the calling pass, input sizes, peak RSS, page faults, huge
+ * page use and, when built with WITH_PERF=1, hardware counters for the
+ * whole process.
+ */
+class Profiler {
+public:
+	Profiler();
+	/// Start the clock and open hardware counters, if built with them
+	void start();
+	void begin_calling() { calling_start = prof_now(); }
+	void end_calling() { calling_end = prof_now(); }
+	/// Write the JSON report; false if it couldn't be written
+	bool write(const std::string & fn);
+	/// Print the phases as Hadoop counters (-H)
+	void counters();
+
+	long long input_bytes;
+private:
+	void finish();
+	double started, ended, calling_start, calling_end;
+	long peak_rss_kb, minor_faults;
+	long anon_huge_kb; // still mapped at the end; -1 if unknown
+	static const int HW_COUNTERS = 5;
+	int hw_fd[HW_COUNTERS];
+	long long hw_value[HW_COUNTERS];
+};
+
+/**
+ * Zeroed memory for soapsnp's big tables: the correction and rank sum
+ * tables and the sites of a calling window.  Each gets a mapping of its
+ * own, aligned to a huge page and, where the kernel has transparent
+ * huge pages, advised to use them, so that a table of hundreds of MB
+ * needs hundreds of TLB entries rather than tens of thousands.  Pages
+ * are only backed once touched.
+ */
+void * huge_alloc(size_t bytes);
+void huge_free(void * p, size_t bytes);
+extern ubit64_t huge_allocs, huge_bytes; // so far, for -J
 
 class Crossbow_format {
 	// Crossbow alignment result
@@ -98,8 +277,9 @@ class Crossbow_format {
 	int part, read_len, position, hit;
 	unsigned mate;
 	char strand;
+	int chr_id;
 public:
-	Crossbow_format() { }
+	Crossbow_format() : chr_id(-1) { }
 	friend std::istringstream & operator>>(std::istringstream & alignment, Crossbow_format & bowf) {
 		alignment >> bowf.chr_name
 		          >> bowf.part
@@ -144,12 +324,19 @@ public:
 	int get_read_len() {
 		return read_len;
 	}
-	inline int get_pos() {
+	inline int get_pos() const {
 		return position;
 	}
-	std::string get_chr_name() {
+	const std::string & get_chr_name() const {
 		return chr_name;
 	}
+	/// Reference ID of the chromosome, once Aln_merge has looked it up
+	int get_chr_id() const {
+		return chr_id;
+	}
+	void set_chr_id(int id) {
+		chr_id = id;
+	}
 	int get_hit() {
 		return hit;
 	}
@@ -173,10 +360,11 @@ class Soap_format {
 	int hit, read_len, position, mismatch;
 	char ab, strand;
 	unsigned mate;
+	int chr_id;
 	// 'ab' is not used in consensus/SNP calling, just for printing out
 	// the alignment
 public:
-	Soap_format(){;};
+	Soap_format() : chr_id(-1) { }
 	friend std::istringstream & operator>>(std::istringstream & alignment, Soap_format & soap) {
 		alignment >> soap.read_id
 		          >> soap.read
@@ -230,12 +418,19 @@ public:
 	int get_read_len(){
 		return read_len;
 	}
-	inline int get_pos(){
+	inline int get_pos() const {
 		return position;
 	}
-	std::string get_chr_name(){
+	const std::string & get_chr_name() const {
 		return chr_name;
 	}
+	/// Reference ID of the chromosome, once Aln_merge has looked it up
+	int get_chr_id() const {
+		return chr_id;
+	}
+	void set_chr_id(int id) {
+		chr_id = id;
+	}
 	int get_hit(){
 		return hit;
 	}
@@ -248,18 +443,1056 @@ public:
 	unsigned get_mate() const { return mate; }
 };
 
+/**
+ * Compact binary alignment records, written by aln2bin and read with
+ * no per-field text parsing.  A file starts with the 4-byte magic
+ * BINARY_ALN_MAGIC and is followed by records, each introduced by a
+ * type byte:
+ *
+ *   'C' <uint16 len> <name>           following alignments are on chr name
+ *   'A' <int32 pos> <uint16 read_len> <uint16 hit> <uint8 flags>
+ *       <bases: 2 bits each, ACTG = 0123, ceil(read_len/4) bytes>
+ *       <N mask: 1 bit each, ceil(read_len/8) bytes>
+ *       <quals: read_len raw FASTQ chars>
+ *
+ * Integers are little-endian.  pos is 0-based, hit is the number of
+ * equally good alignments (1 = unique) and flags holds the strand in
+ * bit 0 (1 = reverse) and the mate (0, 1 or 2) in bits 1-2.  The read
+ * name is not kept since soapsnp never uses it.
+ */
+static const char BINARY_ALN_MAGIC[4] = { 'C', 'B', 'A', 0x01 };
+
+class Binary_format {
+	std::string chr_name;
+	int read_len, position, hit;
+	unsigned mate;
+	bool fwd;
+	char read[256], qual[256];
+	int chr_id;
+public:
+	Binary_format() : read_len(0), position(0), hit(0), mate(0), fwd(true), chr_id(-1) { }
+	friend bool read_binary_aln(Aln_istream & in, Binary_format & aln);
+	friend std::ostream & operator<<(std::ostream & o, Binary_format & b) {
+		o << "(binary)" << '\t'
+		  << std::string(b.read, b.read_len) << '\t'
+		  << std::string(b.qual, b.read_len) << '\t'
+		  << b.hit << '\t'
+		  << (b.mate < 3 ? "aab"[b.mate] : '?') << '\t'
+		  << b.read_len << '\t'
+		  << (b.fwd ? '+' : '-') << '\t'
+		  << b.chr_name << '\t'
+		  << b.position << '\t'
+		  << "0";
+		return o;
+	}
+	char get_base(std::string::size_type coord) {
+		return read[coord];
+	}
+	char get_qual(std::string::size_type coord) {
+		return qual[coord];
+	}
+	bool is_fwd() {
+		return fwd;
+	}
+	int get_read_len() {
+		return read_len;
+	}
+	inline int get_pos() const {
+		return position;
+	}
+	const std::string & get_chr_name() const {
+		return chr_name;
+	}
+	/// Reference ID of the chromosome, once Aln_merge has looked it up
+	int get_chr_id() const {
+		return chr_id;
+	}
+	void set_chr_id(int id) {
+		chr_id = id;
+	}
+	int get_hit() {
+		return hit;
+	}
+	bool is_unique() {
+		return (hit==1);
+	}
+	bool is_N(int coord) {
+		return (read[coord] == 'N');
+	}
+	unsigned get_mate() const { return mate; }
+};
+
+/**
+ * Write one alignment of any supported text format as a binary record,
+ * preceded by a chromosome record if it's on a different chromosome
+ * than the previous one.
+ */
+template<typename T>
+void write_binary_aln(std::ostream & out, T & aln, std::string & last_chr) {
+	if(aln.get_chr_name() != last_chr) {
+		last_chr = aln.get_chr_name();
+		unsigned char h[3] = { 'C', (unsigned char)(last_chr.size() & 0xFF), (unsigned char)(last_chr.size() >> 8) };
+		out.write((const char *)h, 3);
+		out.write(last_chr.data(), last_chr.size());
+	}
+	int len = aln.get_read_len();
+	if(len > 255) {
+		cerr << "Read is too long for binary format (max 255): " << aln << endl;
+		exit(255);
+	}
+	unsigned char rec[10 + 64 + 32];
+	ubit32_t pos = (ubit32_t)aln.get_pos();
+	int hit = aln.get_hit() > 0xFFFF ? 0xFFFF : aln.get_hit();
+	rec[0] = 'A';
+	rec[1] = pos & 0xFF; rec[2] = (pos >> 8) & 0xFF; rec[3] = (pos >> 16) & 0xFF; rec[4] = pos >> 24;
+	rec[5] = len & 0xFF; rec[6] = len >> 8;
+	rec[7] = hit & 0xFF; rec[8] = hit >> 8;
+	rec[9] = (aln.is_fwd() ? 0 : 1) | ((aln.get_mate() & 3) << 1);
+	unsigned char * bases = rec + 10;
+	unsigned char * nmask = bases + (len + 3) / 4;
+	memset(bases, 0, (len + 3) / 4 + (len + 7) / 8);
+	for(int i = 0; i != len; i++) {
+		if(aln.is_N(i)) {
+			nmask[i >> 3] |= (1 << (i & 7));
+		} else {
+			// Same 2-bit code soapsnp derives from the ASCII base
+			bases[i >> 2] |= ((aln.get_base(i) >> 1) & 3) << ((i & 3) * 2);
+		}
+	}
+	out.write((const char *)rec, 10 + (len + 3) / 4 + (len + 7) / 8);
+	for(int i = 0; i != len; i++) {
+		out.put(aln.get_qual(i));
+	}
+}
+
+typedef std::vector<Aln_istream*> Aln_inputs;
+
+/**
+ * Read the next alignment from a text input, skipping lines that don't
+ * parse.  Returns false at end of input.
+ */
+template<typename T>
+bool read_aln(Aln_istream & in, T & aln) {
+	while(getline(in, in.line)) {
+		in.fields.clear();
+		in.fields.str(in.line);
+		if(in.fields >> aln) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ * Read the next binary alignment record, handling chromosome records
+ * and the file's magic along the way.
+ */
+inline bool read_binary_aln(Aln_istream & in, Binary_format & aln) {
+	if(!in.bin_header_read) {
+		char magic[4];
+		if(!in.read(magic, 4)) {
+			return false;
+		}
+		if(memcmp(magic, BINARY_ALN_MAGIC, 4) != 0) {
+			cerr << "Alignment input is not in soapsnp binary format" << endl;
+			exit(255);
+		}
+		in.bin_header_read = true;
+	}
+	unsigned char rec[10 + 64 + 32];
+	while(in.read((char *)rec, 1)) {
+		if(rec[0] == 'C') {
+			if(!in.read((char *)rec + 1, 2)) break;
+			size_t len = rec[1] | (rec[2] << 8);
+			in.bin_chr.resize(len);
+			if(len > 0 && !in.read(&in.bin_chr[0], len)) break;
+			continue;
+		}
+		if(rec[0] != 'A' || !in.read((char *)rec + 1, 9)) {
+			cerr << "Corrupt binary alignment record" << endl;
+			exit(255);
+		}
+		int len = rec[5] | (rec[6] << 8);
+		aln.position = (int)((ubit32_t)rec[1] | ((ubit32_t)rec[2] << 8) | ((ubit32_t)rec[3] << 16) | ((ubit32_t)rec[4] << 24));
+		aln.read_len = len;
+		aln.hit = rec[7] | (rec[8] << 8);
+		aln.fwd = (rec[9] & 1) == 0;
+		aln.mate = (rec[9] >> 1) & 3;
+		const unsigned char * bases = rec + 10;
+		const unsigned char * nmask = bases + (len + 3) / 4;
+		if(len > 255 ||
+		   !in.read((char *)rec + 10, (len + 3) / 4 + (len + 7) / 8) ||
+		   !in.read(aln.qual, len))
+		{
+			cerr << "Truncated binary alignment record" << endl;
+			exit(255);
+		}
+		for(int i = 0; i != len; i++) {
+			aln.read[i] = ((nmask[i >> 3] >> (i & 7)) & 1) ? 'N' : "ACTG"[(bases[i >> 2] >> ((i & 3) * 2)) & 3];
+		}
+		aln.chr_name = in.bin_chr;
+		alignments_read++;
+		if(aln.hit == 1)  alignments_read_unique++;
+		if(aln.mate == 0) alignments_read_unpaired++;
+		if(aln.mate > 0)  alignments_read_paired++;
+		return true;
+	}
+	return false;
+}
+
+template<>
+inline bool read_aln<Binary_format>(Aln_istream & in, Binary_format & aln) {
+	return read_binary_aln(in, aln);
+}
+
+/**
+ * SAM alignments.  The read is projected onto the reference by walking
+ * its CIGAR, so that base i of the record lies on reference position
+ * get_pos()+i like in the other formats: soft clips and inserted bases
+ * are dropped, and deletions and skipped regions are filled with Ns.
+ * The hit count is taken from the NH tag when present; otherwise a
+ * MAPQ of 0 marks the alignment as repetitive.  Unmapped and QC-failed
+ * records, header lines, and records without a sequence or qualities
+ * are skipped.  So are secondary and supplementary alignments, which
+ * would count a read more than once, duplicates unless keep_dups is
+ * set, and reads spanning more than 255 bp of reference; these are
+ * counted in alignments_skipped_*.
+ */
+class Sam_format {
+protected:
+	std::string chr_name;
+	int read_len, position, hit;
+	unsigned mate;
+	bool fwd;
+	char read[256], qual[256];
+	std::vector<ubit32_t> cigar; // BAM encoding: length<<4 | op
+	int chr_id;
+public:
+	static bool keep_dups; // -x: keep records flagged as duplicates
+	Sam_format() : read_len(0), position(0), hit(0), mate(0), fwd(true), chr_id(-1) { }
+	/**
+	 * Fill in the record from already-split SAM fields; seq and qu are
+	 * l_seq characters in read order (qualities phred+33).  Returns
+	 * false if the record should be skipped.
+	 */
+	bool set(int flag, int pos, int mapq, int nh, const char * seq, const char * qu, int l_seq) {
+		if((flag & 0x204) != 0 || pos < 0 || l_seq <= 0) {
+			return false;
+		}
+		if((flag & 0x900) != 0) {
+			alignments_skipped_secondary++;
+			return false;
+		}
+		if((flag & 0x400) != 0 && !keep_dups) {
+			alignments_skipped_dup++;
+			return false;
+		}
+		int rp = 0, out = 0;
+		for(size_t i = 0; i != cigar.size(); i++) {
+			int len = cigar[i] >> 4;
+			switch(cigar[i] & 0xF) {
+				case 0: case 7: case 8: // M = X
+					if(rp + len > l_seq) return false;
+					if(out + len > 255) {
+						alignments_skipped_long++;
+						return false;
+					}
+					memcpy(read + out, seq + rp, len);
+					memcpy(qual + out, qu + rp, len);
+					rp += len;
+					out += len;
+					break;
+				case 1: case 4: // I S
+					rp += len;
+					break;
+				case 2: case 3: // D N
+					if(out + len > 255) {
+						alignments_skipped_long++;
+						return false;
+					}
+					// Same filler Soap_format uses for gaps in the read
+					memset(read + out, 'N', len);
+					memset(qual + out, 'N', len);
+					out += len;
+					break;
+				default: // H P
+					break;
+			}
+		}
+		if(out == 0 || rp != l_seq) {
+			return false;
+		}
+		read_len = out;
+		position = pos;
+		fwd = (flag & 0x10) == 0;
+		mate = (flag & 1) == 0 ? 0 : ((flag & 0x40) ? 1 : ((flag & 0x80) ? 2 : 0));
+		hit = (nh > 0) ? nh : (mapq == 0 ? 2 : 1);
+		alignments_read++;
+		if(hit == 1)  alignments_read_unique++;
+		if(mate == 0) alignments_read_unpaired++;
+		if(mate > 0)  alignments_read_paired++;
+		return true;
+	}
+	/**
+	 * Fill in the record from a line of SAM text.  f holds its string
+	 * fields, and is kept by the input so that they don't allocate once
+	 * they have grown.  Returns false if the line is a header, doesn't
+	 * parse or should be skipped.
+	 */
+	bool parse(std::istringstream & alignment, Sam_fields & f) {
+		int flag, pos, mapq, pnext, tlen, nh = 0;
+		if(alignment.peek() == '@' ||
+		   !(alignment >> f.qname >> flag >> f.rname >> pos >> mapq >> f.cigar
+		               >> f.rnext >> pnext >> tlen >> f.seq >> f.qual))
+		{
+			return false;
+		}
+		while(alignment >> f.tag) {
+			if(f.tag.compare(0, 5, "NH:i:") == 0) {
+				nh = atoi(f.tag.c_str() + 5);
+			}
+		}
+		cigar.clear();
+		if(f.cigar != "*") {
+			const char * c = f.cigar.c_str();
+			while(*c != '\0') {
+				char * end;
+				long len = strtol(c, &end, 10);
+				const char * op = strchr("MIDNSHP=X", *end);
+				if(end == c || *end == '\0' || op == NULL) {
+					return false;
+				}
+				cigar.push_back((ubit32_t)len << 4 | (ubit32_t)(op - "MIDNSHP=X"));
+				c = end + 1;
+			}
+		}
+		if(f.seq == "*" || f.qual == "*" || f.seq.size() != f.qual.size() ||
+		   !set(flag, pos - 1, mapq, nh, f.seq.data(), f.qual.data(), f.seq.size()))
+		{
+			return false;
+		}
+		chr_name = f.rname;
+		return true;
+	}
+	friend std::ostream & operator<<(std::ostream & o, Sam_format & sam) {
+		o << "(sam)" << '\t'
+		  << std::string(sam.read, sam.read_len) << '\t'
+		  << std::string(sam.qual, sam.read_len) << '\t'
+		  << sam.hit << '\t'
+		  << (sam.mate < 3 ? "aab"[sam.mate] : '?') << '\t'
+		  << sam.read_len << '\t'
+		  << (sam.fwd ? '+' : '-') << '\t'
+		  << sam.chr_name << '\t'
+		  << sam.position << '\t'
+		  << "0";
+		return o;
+	}
+	char get_base(std::string::size_type coord) {
+		return read[coord];
+	}
+	char get_qual(std::string::size_type coord) {
+		return qual[coord];
+	}
+	bool is_fwd() {
+		return fwd;
+	}
+	int get_read_len() {
+		return read_len;
+	}
+	inline int get_pos() const {
+		return position;
+	}
+	const std::string & get_chr_name() const {
+		return chr_name;
+	}
+	/// Reference ID of the chromosome, once Aln_merge has looked it up
+	int get_chr_id() const {
+		return chr_id;
+	}
+	void set_chr_id(int id) {
+		chr_id = id;
+	}
+	int get_hit() {
+		return hit;
+	}
+	bool is_unique() {
+		return (hit==1);
+	}
+	bool is_N(int coord) {
+		return (read[coord] == 'N');
+	}
+	unsigned get_mate() const { return mate; }
+};
+
+/// Like read_aln() for the other text formats, with the SAM fields
+/// kept in the input
+template<>
+inline bool read_aln<Sam_format>(Aln_istream & in, Sam_format & aln) {
+	while(getline(in, in.line)) {
+		in.fields.clear();
+		in.fields.str(in.line);
+		if(aln.parse(in.fields, in.sam)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ * Does this first line of a text input look like SAM: a header line,
+ * or at least 11 fields with numeric FLAG and POS?
+ */
+inline bool looks_like_sam(const std::string & line) {
+	if(line.size() > 3 && line[0] == '@' && isupper(line[1]) && isupper(line[2]) && line[3] == '\t') {
+		return true;
+	}
+	std::vector<std::string> fields;
+	std::istringstream s(line);
+	for(std::string f; getline(s, f, '\t');) {
+		fields.push_back(f);
+	}
+	return fields.size() >= 11 &&
+	       fields[1].find_first_not_of("0123456789") == std::string::npos &&
+	       fields[3].find_first_not_of("0123456789") == std::string::npos;
+}
+
+static const char BAM_MAGIC[4] = { 'B', 'A', 'M', 0x01 };
+
+/**
+ * BAM alignments: the binary encoding of SAM, decoded straight from the
+ * (BGZF-compressed) stream.  Records are handled like Sam_format.
+ */
+class Bam_format : public Sam_format {
+	std::vector<char> raw; // the current record
+	std::string seq, qu;
+public:
+	friend bool read_bam_aln(Aln_istream & in, Bam_format & aln);
+};
+
+static inline ubit32_t bam_le32(const char * p) {
+	const unsigned char * u = (const unsigned char *)p;
+	return (ubit32_t)u[0] | ((ubit32_t)u[1] << 8) | ((ubit32_t)u[2] << 16) | ((ubit32_t)u[3] << 24);
+}
+
+/// Size of the value of a BAM optional field of the given type at p
+static inline size_t bam_aux_size(char type, const char * p, const char * end) {
+	switch(type) {
+		case 'A': case 'c': case 'C': return 1;
+		case 's': case 'S': return 2;
+		case 'i': case 'I': case 'f': return 4;
+		case 'Z': case 'H': {
+			size_t sz = 0;
+			while(p + sz < end && p[sz] != '\0') sz++;
+			return sz + 1;
+		}
+		case 'B': {
+			if(p + 5 > end) break;
+			size_t esz = (p[0] == 'c' || p[0] == 'C') ? 1 : ((p[0] == 's' || p[0] == 'S') ? 2 : 4);
+			return 5 + esz * bam_le32(p + 1);
+		}
+	}
+	return end - p; // unknown type; give up on the rest
+}
+
+/**
+ * Read the next usable BAM record, parsing the header (reference names)
+ * the first time through.
+ */
+inline bool read_bam_aln(Aln_istream & in, Bam_format & aln) {
+	char b[4];
+	if(!in.bin_header_read) {
+		if(!in.read(b, 4)) {
+			return false;
+		}
+		if(memcmp(b, BAM_MAGIC, 4) != 0) {
+			cerr << "Alignment input is not in BAM format" << endl;
+			exit(255);
+		}
+		if(!in.read(b, 4)) {
+			cerr << "Truncated BAM header" << endl;
+			exit(255);
+		}
+		in.ignore(bam_le32(b)); // header text
+		if(!in.read(b, 4)) {
+			cerr << "Truncated BAM header" << endl;
+			exit(255);
+		}
+		ubit32_t n_ref = bam_le32(b);
+		in.bam_refs.resize(n_ref);
+		for(ubit32_t i = 0; i != n_ref; i++) {
+			if(!in.read(b, 4)) break;
+			std::string & name = in.bam_refs[i];
+			name.resize(bam_le32(b));
+			if(!in.read(&name[0], name.size()) || !in.read(b, 4)) {
+				cerr << "Truncated BAM header" << endl;
+				exit(255);
+			}
+			name.resize(strlen(name.c_str())); // drop the NUL
+		}
+		if(!in) {
+			cerr << "Truncated BAM header" << endl;
+			exit(255);
+		}
+		in.bin_header_read = true;
+	}
+	while(in.read(b, 4)) {
+		ubit32_t block_size = bam_le32(b);
+		aln.raw.resize(block_size < 32 ? 32 : block_size);
+		if(!in.read(&aln.raw[0], block_size) || block_size < 32) {
+			cerr << "Truncated BAM record" << endl;
+			exit(255);
+		}
+		const char * r = &aln.raw[0];
+		const char * end = r + block_size;
+		int ref_id = (int)bam_le32(r);
+		int pos = (int)bam_le32(r + 4);
+		int l_read_name = (unsigned char)r[8];
+		int mapq = (unsigned char)r[9];
+		int n_cigar = (unsigned char)r[12] | ((unsigned char)r[13] << 8);
+		int flag = (unsigned char)r[14] | ((unsigned char)r[15] << 8);
+		int l_seq = (int)bam_le32(r + 16);
+		const char * p = r + 32 + l_read_name;
+		if(l_seq < 0 || p + 4 * n_cigar + (l_seq + 1) / 2 + l_seq > end) {
+			cerr << "Corrupt BAM record" << endl;
+			exit(255);
+		}
+		if(ref_id < 0 || ref_id >= (int)in.bam_refs.size()) {
+			continue; // unmapped
+		}
+		aln.cigar.resize(n_cigar);
+		for(int i = 0; i != n_cigar; i++, p += 4) {
+			aln.cigar[i] = bam_le32(p);
+		}
+		aln.seq.resize(l_seq);
+		aln.qu.resize(l_seq);
+		for(int i = 0; i != l_seq; i++) {
+			aln.seq[i] = "=ACMGRSVTWYHKDBN"[((unsigned char)p[i >> 1] >> ((~i & 1) << 2)) & 0xF];
+		}
+		p += (l_seq + 1) / 2;
+		if(l_seq > 0 && (unsigned char)p[0] == 0xFF) {
+			continue; // no qualities
+		}
+		for(int i = 0; i != l_seq; i++) {
+			aln.qu[i] = p[i] + 33;
+		}
+		p += l_seq;
+		// Look for NH among the optional fields
+		int nh = 0;
+		while(p + 3 <= end) {
+			bool is_nh = (p[0] == 'N' && p[1] == 'H');
+			char type = p[2];
+			p += 3;
+			size_t sz = bam_aux_size(type, p, end);
+			if(is_nh && sz <= 4 && p + sz <= end && type != 'A' && type != 'f') {
+				ubit32_t v = 0;
+				for(size_t i = 0; i != sz; i++) {
+					v |= (ubit32_t)(unsigned char)p[i] << (8 * i);
+				}
+				nh = (int)v;
+			}
+			p += sz;
+		}
+		if(aln.set(flag, pos, mapq, nh, aln.seq.data(), aln.qu.data(), l_seq)) {
+			aln.chr_name = in.bam_refs[ref_id];
+			return true;
+		}
+	}
+	return false;
+}
+
+template<>
+inline bool read_aln<Bam_format>(Aln_istream & in, Bam_format & aln) {
+	return read_bam_aln(in, aln);
+}
+
+/**
+ * Sidecar position index for a sorted, uncompressed alignment file,
+ * written next to it as <FILE>.sidx by -X, or for soapsnp's own output,
+ * written as <FILE>.cidx by -O.  For each chromosome (in file order) it
+ * records the byte offset of the first record in every non-empty
+ * BUCKET-bp bucket, so a region's records can be reached with one
+ * seek.  The file is text:
+ *
+ *   #SOAPsnp <what> index<TAB><bucket size><TAB><indexed file size>
+ *   <chr><TAB><bucket><TAB><offset>
+ *   ...
+ *
+ * where <what> is "alignment" or "consensus".
+ */
+class Aln_index {
+public:
+	static const int BUCKET = 16384;
+	Aln_index(const std::string & what = "alignment") :
+		file_size(-1), title(what), last_bucket(-1) { }
+	/// Note a record at pos on chr starting at byte off
+	void add(const std::string & chr, int pos, long long off);
+	/// Whether a record at pos on chr would start a bucket
+	bool wants(const std::string & chr, int pos) const {
+		return pos / BUCKET > last_bucket || chr != last_chr;
+	}
+	/// Add the entries of an index of output written starting at base
+	void append(const Aln_index & other, long long base);
+	/**
+	 * Byte offset of the first alignment on chr that may be at or
+	 * after pos, or -1 if the file has none.
+	 */
+	long long lookup(const std::string & chr, int pos) const;
+	bool load(const std::string & fn);
+	bool write(const std::string & fn) const;
+	const std::vector<std::string> & chromosomes() const { return chr_order; }
+
+	long long file_size;
+private:
+	std::string title;
+	std::string last_chr; // of the last record added
+	int last_bucket;
+	std::vector<std::string> chr_order;
+	std::map<std::string, std::vector<std::pair<int, long long> > > buckets;
+};
+
+/// Index every alignment in a sorted, uncompressed input
+template<typename T>
+void build_aln_index(Aln_istream & in, Aln_index & idx) {
+	T aln;
+	while(true) {
+		long long off = (long long)in.tellg();
+		if(!read_aln(in, aln)) {
+			break;
+		}
+		if(aln.get_pos() >= 0) {
+			idx.add(aln.get_chr_name(), aln.get_pos(), off);
+		}
+	}
+}
+
+/**
+ * A run of consecutive sites written as one record with -B: either all
+ * uncovered, or all covered and confidently called as the reference.
+ * Blocks don't cross multiples of SPAN, so they come out the same
+ * whether or not the chromosome is called in shards.
+ */
+struct Ref_block {
+	static const int SPAN = 100000;
+	int start, end; // 0-based, inclusive; start is -1 if no block is open
+	int min_depth, min_qual;
+	bool covered;
+	Ref_block() : start(-1), end(-1), min_depth(0), min_qual(0), covered(false) { }
+};
+
+/**
+ * The alignments one input has yielded so far, as far as a checkpoint
+ * needs to know to find where to reread it from.
+ */
+struct Aln_mark {
+	std::string chr; // chromosome of the last alignment taken
+	int win, prev_win; // its window, and the window taken before it on chr
+	long long off, prev_off; // offsets of the first alignments taken in those
+	long long end; // offset just past the last alignment taken
+	Aln_mark() : win(-1), prev_win(-1), off(-1), prev_off(-1), end(-1) { }
+	void note(const std::string & c, int w, long long start, long long stop) {
+		if(c != chr || w != win) {
+			prev_win = (c == chr ? win : -1);
+			prev_off = (c == chr ? off : -1);
+			chr = c;
+			win = w;
+			off = start;
+		}
+		end = stop;
+	}
+};
+
+// Seconds between checkpoints; "make soapsnp-ckpt" builds with 0, to
+// save one after every window for tests/checkpoint.sh
+#ifndef CKPT_INTERVAL
+#define CKPT_INTERVAL 60
+#endif
+
+/**
+ * Calling progress saved every INTERVAL seconds with -C, so that a
+ * rerun on the same inputs resumes where the last one got to instead
+ * of starting over.  The correction matrix is kept beside it in
+ * <FILE>.matrix, and the -O output index in <FILE>.cidx.  Calling
+ * restarts at window start of chr, with the output cut back to out_off
+ * bytes and each input read from its offset, which is early enough to
+ * see every alignment reaching that window.  The file is text:
+ *
+ *   #SOAPsnp checkpoint
+ *   input<TAB><file><TAB><file size>
+ *   chr<TAB><chromosome>
+ *   start<TAB><window start>
+ *   output<TAB><bytes of output>
+ *   offset<TAB><byte offset><TAB><chromosome at that offset>
+ *   ...
+ *   counted<TAB><input offset up to which alignments are counted>
+ *   ...
+ *   alignments<TAB>..., positions<TAB>..., window_hist<TAB>...
+ *   qual_hist<TAB><quality><TAB><count>
+ *   len_hist<TAB><read length><TAB><count>
+ *   ...
+ *   block<TAB><start><TAB><end><TAB><min depth><TAB><min quality><TAB><covered>
+ *
+ * with one input, offset and counted line per input, and the -H
+ * counters after them.  An offset of -1 means the input is read from
+ * the top.  The block line is only there if a -B block was open.
+ */
+class Checkpoint {
+public:
+	static const int INTERVAL = CKPT_INTERVAL;
+	Checkpoint(const std::string & fn, const std::vector<std::string> & input_names);
+	/// Read a checkpoint left by an earlier run on the same inputs
+	bool load();
+	/// Write the checkpoint, replacing the previous one atomically
+	bool save();
+	/**
+	 * Record that calling is to resume at window at_start of at_chr.
+	 * Every input is reread from its first alignment in the window
+	 * before, which may spill over into at_start.
+	 */
+	void note(const std::vector<Aln_mark> & marks, const std::string & at_chr, int at_start, int win_size);
+	/// Copy the -H counters, for alignments parsed up to parsed
+	void take_counts(const std::vector<long long> & parsed);
+	/// Add the counters saved with the checkpoint to this run's
+	void give_counts() const;
+	bool due() const { return time(NULL) - saved >= INTERVAL; }
+	std::string matrix_name() const { return file + ".matrix"; }
+	std::string index_name() const { return file + ".cidx"; } // -O
+
+	std::string file;
+	std::vector<std::string> inputs;
+	std::vector<long long> sizes;
+	bool resumed; // load() found a checkpoint to resume from
+	std::string chr;
+	int start;
+	long long out_off;
+	Ref_block block; // block still open at start (-B)
+	std::vector<long long> offsets;
+	std::vector<std::string> offset_chrs;
+	// -H counters as of the checkpoint.  The alignment counters take in
+	// every input up to its counted offset, which a resumed run rereads
+	// without counting again.
+	std::vector<long long> counted;
+	Aln_counts alns;
+	Call_counts calls;
+	std::vector<unsigned long> qual_hist, len_hist;
+private:
+	time_t saved;
+};
+
+/// Tally an alignment's length and quality characters (see -H)
+template<typename T>
+inline void tally_read(T & aln) {
+	int len = aln.get_read_len();
+	if((size_t)len >= read_len_hist.size()) {
+		read_len_hist.resize(len + 1, 0);
+	}
+	read_len_hist[len]++;
+	for(int i = 0; i != len; i++) {
+		read_qual_hist[(unsigned char)aln.get_qual(i)]++;
+	}
+}
+
+/// Take back tally_read() of an alignment that was counted already
+template<typename T>
+inline void untally_read(T & aln) {
+	int len = aln.get_read_len();
+	read_len_hist[len]--;
+	for(int i = 0; i != len; i++) {
+		read_qual_hist[(unsigned char)aln.get_qual(i)]--;
+	}
+}
+
+/**
+ * Like read_aln(), but if the input has targets, skip alignments
+ * outside them, seeking forward over the gaps.  Every alignment
+ * returned is tallied with tally_read().
+ */
+template<typename T>
+bool read_targeted_aln(Aln_istream & in, T & aln) {
+	Prof_timer timer(PROF_PARSE);
+	if(in.targets.empty()) {
+		if(!read_aln(in, aln)) {
+			return false;
+		}
+		tally_read(aln);
+		return true;
+	}
+	while(in.cur_target < in.targets.size()) {
+		const Aln_target & t = in.targets[in.cur_target];
+		if(!in.target_entered) {
+			in.target_entered = true;
+			if(t.offset > (long long)in.tellg()) {
+				in.seekg(t.offset);
+				if(!in) {
+					cerr << "Could not seek in alignment input" << endl;
+					exit(255);
+				}
+				// A binary record reader resumes mid-file on t.chr
+				in.bin_chr = t.chr;
+				in.bin_header_read = true;
+			}
+		}
+		if(!read_aln(in, aln)) {
+			return false;
+		}
+		if(aln.get_chr_name() == t.chr && aln.get_pos() <= t.end) {
+			tally_read(aln);
+			return true;
+		}
+		// Past this target; aln may still belong to a later one, so
+		// don't seek past it if we're already beyond its start
+		long long here = (long long)in.tellg();
+		while(++in.cur_target < in.targets.size()) {
+			const Aln_target & n = in.targets[in.cur_target];
+			in.target_entered = (n.offset < here);
+			if(!in.target_entered) {
+				break;
+			}
+			if(aln.get_chr_name() == n.chr && aln.get_pos() <= n.end) {
+				tally_read(aln);
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+typedef std::string Chr_name;
+class Genome;
+
+/**
+ * Resolves the chromosome names of a stream of alignments or records to
+ * Genome IDs.  Input is grouped by chromosome, so the last name seen is
+ * kept and the dictionary is only searched when the name changes.
+ */
+class Chr_lookup {
+	const Genome * genome;
+	Chr_name last;
+	int last_id;
+public:
+	Chr_lookup(const Genome * genome) : genome(genome), last_id(-1) {}
+	int operator()(const Chr_name & name); // after Genome, below
+};
+
+/**
+ * Merges several sorted alignment inputs into a single stream with a
+ * heap-based k-way merge.  Inputs must be sorted by chromosome name
+ * (lexicographically) and then by offset, which is how Crossbow and
+ * the SOAP tools sort them.  With a single input, records are passed
+ * through exactly as read and no particular chromosome order is
+ * required.  Each record's chromosome is looked up once, as it is read,
+ * and records are ordered by that ID, since IDs follow name order.
+ */
+template<typename T>
+class Aln_merge {
+	struct Head {
+		T aln;
+		size_t src;
+		long long start, end; // byte offsets, if tracked
+	};
+	struct Later {
+		bool operator()(const Head & a, const Head & b) const {
+			if(a.aln.get_chr_id() != b.aln.get_chr_id()) return a.aln.get_chr_id() > b.aln.get_chr_id();
+			if(a.aln.get_pos() != b.aln.get_pos()) return a.aln.get_pos() > b.aln.get_pos();
+			return a.src > b.src;
+		}
+	};
+	Aln_inputs & ins;
+	std::priority_queue<Head, std::vector<Head>, Later> heap;
+	std::vector<Chr_lookup> lookups; // per input
+	std::vector<int> last_id; // per input, to check sortedness
+	std::vector<std::string> last_chr; // ... and its name, for errors
+	bool primed;
+
+	/// Read the next record of input src and look up its chromosome
+	bool take(size_t src, T & aln) {
+		if(!read_targeted_aln(*ins[src], aln)) {
+			return false;
+		}
+		aln.set_chr_id(lookups[src](aln.get_chr_name()));
+		return true;
+	}
+
+	bool read(size_t src, Head & h) {
+		h.src = src;
+		if(!track) {
+			return take(src, h.aln);
+		}
+		h.start = (long long)ins[src]->tellg();
+		if(h.start >= parsed[src]) {
+			if(!take(src, h.aln)) {
+				return false;
+			}
+		} else {
+			// Counted before a checkpoint this run resumed from
+			Aln_counts before;
+			before.get();
+			if(!take(src, h.aln)) {
+				return false;
+			}
+			before.set();
+			untally_read(h.aln);
+		}
+		h.end = (long long)ins[src]->tellg();
+		parsed[src] = std::max(parsed[src], h.end);
+		return true;
+	}
+
+	void advance(size_t src) {
+		Head h;
+		if(!read(src, h)) {
+			return;
+		}
+		const int id = h.aln.get_chr_id();
+		if(id != last_id[src]) {
+			// A chromosome not in the reference (-1) is reported by
+			// the caller
+			if(ins.size() > 1 && id >= 0 && id < last_id[src]) {
+				cerr << "Alignment input " << (src+1) << " is not sorted by chromosome name: "
+				     << h.aln.get_chr_name() << " follows " << last_chr[src] << endl;
+				cerr << "Inputs must be sorted by chromosome name when several are given with -i" << endl;
+				exit(255);
+			}
+			last_id[src] = id;
+			last_chr[src] = h.aln.get_chr_name();
+		}
+		heap.push(h);
+	}
+public:
+	// With track set, the input and the byte offsets at which the last
+	// record returned starts and ends (for checkpoints, see -C), and
+	// how far each input has been parsed and counted
+	bool track;
+	size_t last_src;
+	long long last_start, last_end;
+	std::vector<long long> parsed;
+
+	Aln_merge(Aln_inputs & inputs, const Genome * genome) :
+		ins(inputs), lookups(inputs.size(), Chr_lookup(genome)),
+		last_id(inputs.size(), -1), last_chr(inputs.size()), primed(false),
+		track(false), last_src(0), last_start(-1), last_end(-1),
+		parsed(inputs.size(), -1) { }
+
+	bool next(T & soap) {
+		if(ins.size() == 1 && !track) {
+			return take(0, soap);
+		}
+		if(!primed) {
+			for(size_t i = 0; i != ins.size(); i++) {
+				advance(i);
+			}
+			primed = true;
+		}
+		if(heap.empty()) {
+			return false;
+		}
+		soap = heap.top().aln;
+		size_t src = heap.top().src;
+		last_src = src;
+		last_start = heap.top().start;
+		last_end = heap.top().end;
+		heap.pop();
+		advance(src);
+		return true;
+	}
+};
+
+/**
+ * Reads alignments of type T from a merged input and hands them back sorted
+ * by offset within each chromosome, tolerating records that arrive up
+ * to max_dist positions out of order.  Records are held in a min-heap
+ * until the input has moved more than max_dist past them; a change of
+ * chromosome flushes the heap.  With max_dist == 0 records are passed
+ * through exactly as read.
+ */
+template<typename T>
+class Aln_reorder {
+	struct Entry {
+		int pos;
+		ubit64_t seq; // arrival order; keeps the sort stable
+		T aln;
+	};
+	struct Later {
+		bool operator()(const Entry & a, const Entry & b) const {
+			return a.pos > b.pos || (a.pos == b.pos && a.seq > b.seq);
+		}
+	};
+	Aln_merge<T> & in;
+	int max_dist;
+	std::priority_queue<Entry, std::vector<Entry>, Later> heap;
+	int chr; // chromosome ID of the records in the heap
+	int newest; // greatest offset pushed for chr
+	ubit64_t seq;
+	Entry pending; // first record of the next chromosome
+	Entry e; // read into, so that its strings keep their capacity
+	bool has_pending, eof;
+public:
+	ubit64_t max_buffered; // high-water mark of the heap
+
+	Aln_reorder(Aln_merge<T> & alignment, int dist) :
+		in(alignment), max_dist(dist), chr(-1), newest(0), seq(0),
+		has_pending(false), eof(false), max_buffered(0) { }
+
+	bool next(T & soap) {
+		if(max_dist == 0) {
+			// -R 0: nothing to reorder, so read straight into soap
+			return in.next(soap);
+		}
+		while(true) {
+			if(!heap.empty() &&
+			   (eof || has_pending || newest - heap.top().pos > max_dist))
+			{
+				soap = heap.top().aln;
+				heap.pop();
+				return true;
+			}
+			if(has_pending) {
+				// Previous chromosome is drained; start on the next
+				chr = pending.aln.get_chr_id();
+				newest = pending.pos;
+				heap.push(pending);
+				has_pending = false;
+				continue;
+			}
+			if(eof) {
+				return false;
+			}
+			if(!in.next(e.aln)) {
+				eof = true;
+				continue;
+			}
+			if(e.aln.get_pos() < 0) {
+				soap = e.aln;
+				return true;
+			}
+			e.pos = e.aln.get_pos();
+			e.seq = seq++;
+			if(heap.empty() || e.aln.get_chr_id() == chr) {
+				chr = e.aln.get_chr_id();
+				if(e.pos > newest || heap.empty()) newest = e.pos;
+				heap.push(e);
+				if(heap.size() > max_buffered) max_buffered = heap.size();
+			} else {
+				pending = e;
+				has_pending = true;
+			}
+		}
+	}
+};
+
 // dbSNP information
 class Snp_info {
 	bool validated;
 	bool hapmap_site;
 	bool indel_site;
 	rate_t * freq; // elements record frequency of ACTG
+	rate_t * log_prior; // -2: log10 genotype priors here; see Genome::snp_priors
 	string name;
 public:
 	Snp_info(){
 		validated=hapmap_site=indel_site=false;
 		freq = new rate_t [4];
 		memset(freq,0,sizeof(rate_t)*4);
+		log_prior = NULL;
 	}
 	Snp_info(const Snp_info & other) {
 		validated = other.validated;
@@ -267,9 +1500,14 @@ public:
 		indel_site = other.indel_site;
 		freq = new rate_t [4];
 		memcpy(freq, other.freq, sizeof(rate_t)*4);
+		log_prior = NULL;
+		if(other.log_prior != NULL) {
+			set_log_prior(other.log_prior);
+		}
 	}
 	~Snp_info(){
 		delete [] freq;
+		delete [] log_prior;
 	}
 	/**
 	 * Here's where the SNP format is defined (beyond the first two
@@ -295,6 +1533,12 @@ public:
 		this->name = other.name;
 		this->freq = new rate_t [4];
 		memcpy(this->freq, other.freq, sizeof(rate_t)*4);
+		if(other.log_prior != NULL) {
+			set_log_prior(other.log_prior);
+		} else {
+			delete [] this->log_prior;
+			this->log_prior = NULL;
+		}
 		return *this;
 
 	}
@@ -313,8 +1557,19 @@ public:
 	const string& get_name() {
 		return name;
 	}
+	const rate_t * get_log_prior() {
+		return log_prior;
+	}
+	void set_log_prior(const rate_t * p) {
+		if(log_prior == NULL) {
+			log_prior = new rate_t [16];
+		}
+		memcpy(log_prior, p, sizeof(rate_t)*16);
+	}
 };
 
+class Prob_matrix;
+
 // Chromosome(Reference) information
 class Chr_info {
 	ubit32_t len;
@@ -325,12 +1580,24 @@ class Chr_info {
 	// The Parameter.region_only flag will be set iff region_mask is
 	// initialized.
 	ubit64_t* region_mask;
-	// 4bits for one base: 1 bit dbSNPstatus, 1bit for N, followed two bit of base A: 00, C: 01, T: 10, G:11,
-	// Every ubit64_t could store 16 bases
+	// 2bits for one base: A: 00, C: 01, T: 10, G:11
+	// Every ubit64_t could store 32 bases
+	// The N and dbSNP flags are sparse, so they are kept apart from
+	// bin_seq: N stretches as sorted half-open runs, and dbSNP sites as
+	// sorted positions.  The *_first arrays give, for every BLOCK bases,
+	// the first run ending after (or site at or after) the block start.
+	vector<pair<ubit32_t, ubit32_t> > n_runs;
+	vector<ubit32_t> n_first;
+	vector<ubit32_t> snp_pos;
+	vector<ubit32_t> snp_first;
 	map<ubit64_t, Snp_info*> dbsnp;
 	vector<pair<int, int> > regions;
+	void index_runs();
 public:
+	static const ubit32_t BLOCK = 4096;
+	int id; // dense ID in the Genome, once the reference is read
 	Chr_info(){
+		id = -1;
 		bin_seq_is_mm = false;
 		len = 0;
 		elts = 0;
@@ -348,10 +1615,31 @@ public:
 	ubit32_t length() {
 		return len;
 	}
+	bool is_n(std::string::size_type pos) {
+		ubit32_t i = n_first[pos/BLOCK];
+		while(i != n_runs.size() && n_runs[i].first <= pos) {
+			if(pos < n_runs[i].second) return true;
+			i++;
+		}
+		return false;
+	}
+	bool is_snp(std::string::size_type pos) {
+		for(ubit32_t i = snp_first[pos/BLOCK]; i != snp_first[pos/BLOCK+1]; i++) {
+			if(snp_pos[i] >= pos) return snp_pos[i] == pos;
+		}
+		return false;
+	}
+	/**
+	 * 4 bits for one base: 1 bit dbSNP status, 1 bit for N, followed
+	 * by the two bits of base.
+	 */
 	ubit64_t get_bin_base(std::string::size_type pos) {
-		return (bin_seq[pos/capacity]>>(pos%capacity*4))&0xF; // All 4 bits
+		ubit64_t base = (bin_seq[pos/capacity]>>(pos%capacity*2))&0x3;
+		return base | ((ubit64_t)is_n(pos)<<2) | ((ubit64_t)is_snp(pos)<<3);
 	}
+	void decode(ubit64_t start, ubit64_t n, small_int * code);
 	int binarize(std::string & seq);
+	void index_snps();
 	void dump_binarized(std::string fn);
 	int insert_snp(std::string::size_type pos, Snp_info & new_snp, bool quiet);
 	int region_mask_ini();
@@ -361,13 +1649,13 @@ public:
 	}
 	int set_region(int start, int end);
 	/**
-	 * The only place this is called is in Call_win::call_cns when it
-	 * passes the result to snp_p_prior_gen in order to generate a
-	 * prior probability for each diploid genotype.
+	 * The only place this is called is in Call_win::site_prior, for the
+	 * genotype priors of a known SNP.
 	 */
 	Snp_info * find_snp(ubit64_t pos) {
 		return dbsnp.find(pos)->second;
 	}
+	void snp_priors(Prob_matrix * mat, Parameter * para);
 	ubit64_t * get_region() {
 		return region_mask;
 	}
@@ -382,11 +1670,12 @@ public:
 	}
 };
 
-typedef std::string Chr_name;
-
 class Genome {
 public:
 	map<Chr_name, Chr_info*> chromosomes;
+	/// The chromosomes by dense integer ID, numbered in name order once
+	/// the reference is read
+	std::vector<map<Chr_name, Chr_info*>::iterator> by_id;
 
 	Genome(ifstream & fasta, ifstream & known_snp, bool quiet);
 	~Genome();
@@ -394,88 +1683,119 @@ public:
 	/// Add a new chromosome to the map
 	bool add_chr(Chr_name &);
 
+	/// ID of the named chromosome, or -1 if it isn't in the reference
+	int chr_id(const Chr_name & name) const;
+
 	/// Read in and parse a region file
 	int read_region(std::ifstream & region, Parameter * para);
+
+	/// Work out the log10 genotype priors of every known SNP (-2)
+	void snp_priors(Prob_matrix * mat, Parameter * para);
 };
 
+inline int Chr_lookup::operator()(const Chr_name & name) {
+	if(last_id < 0 || name != last) {
+		last = name;
+		last_id = genome->chr_id(name);
+	}
+	return last_id;
+}
+
 class Prob_matrix {
 public:
 	rate_t *p_matrix, *p_prior; // Calibration matrix and prior probabilities
-	rate_t *base_freq, *type_likely, *type_prob; // Estimate base frequency, conditional probability, and posterior probablity
+	rate_t *log_prior; // log10 of p_prior
+	rate_t *base_freq; // Estimate base frequency
 	rate_t *p_rank, *p_binom; // Ranksum test and binomial test on HETs
 	Prob_matrix();
 	~Prob_matrix();
-	template<typename T> int matrix_gen(std::ifstream & alignment, Parameter * para, Genome * genome);
+	template<typename T> int matrix_gen(Aln_inputs & alignments, Parameter * para, Genome * genome);
 	int matrix_read(std::fstream & mat_in, Parameter * para);
 	int matrix_write(std::fstream & mat_out, Parameter * para);
 	int prior_gen(Parameter * para);
+	int snp_prior_gen(double * real_p_prior, Snp_info* snp, Parameter * para, char ref);
 	int rank_table_gen();
 
 };
 
 template<typename T>
-int Prob_matrix::matrix_gen(std::ifstream & alignment, Parameter * para, Genome * genome) {
+int Prob_matrix::matrix_gen(Aln_inputs & alignments, Parameter * para, Genome * genome) {
 	// Read Alignment files
 	T soap;
-	ubit64_t * count_matrix = new ubit64_t [256*256*4*4];
-	memset(count_matrix, 0, sizeof(ubit64_t)*256*256*4*4);
+	// Counts by quality, read cycle, ref base and observed base, only
+	// over the qualities and cycles kept in p_matrix.  Bases that are
+	// not counted go to the spare cell at the end.
+	const ubit64_t q_span = para->q_max - para->q_min + 1;
+	const ubit64_t cell_count = q_span * para->read_length * 16;
+	ubit64_t * count_matrix = new ubit64_t [cell_count+1];
+	memset(count_matrix, 0, sizeof(ubit64_t)*(cell_count+1));
 	map<Chr_name, Chr_info*>::iterator current_chr;
 	current_chr = genome->chromosomes.end();
-	ubit64_t ref(0);
+	Chr_lookup lookup(genome);
+	int current_id = -1;
+	std::vector<small_int> ref;
+	std::vector<ubit64_t> cell;
 	std::string::size_type coord;
 	if(para->do_recal) {
 		// For each alignment
-		for(std::string line; getline(alignment, line);) {
-			std::istringstream s(line);
-			// Parse the alignment
-			if(s >> soap) {
+		for(size_t f = 0; f != alignments.size(); f++) {
+			// Order doesn't matter here, so read inputs one after another
+			while(read_aln(*alignments[f], soap)) {
 				if(soap.get_pos() < 0) {
 					continue;
 				}
 				// In the overloaded "+" above, soap.position will be substracted by 1 so that coordiates start from 0
-				if (current_chr == genome->chromosomes.end() || current_chr->first != soap.get_chr_name()) {
-					current_chr = genome->chromosomes.find(soap.get_chr_name());
-					if(current_chr == genome->chromosomes.end()) {
+				int id = lookup(soap.get_chr_name());
+				if (id != current_id || id < 0) {
+					current_id = id;
+					if(id < 0) {
 						for(map<Chr_name, Chr_info*>::iterator test = genome->chromosomes.begin();test != genome->chromosomes.end();test++) {
 							cerr<<'!'<<(test->first)<<'!'<<endl;
 						}
 						cerr<<"Assertion Failed: Chromosome: !"<<soap.get_chr_name()<<"! NOT found"<<endl;
 						exit(255);
 					}
+					current_chr = genome->by_id[id];
 				}
 				else {
 					;
 				}
 				if (soap.is_unique()) {
-					for(coord = 0; coord != soap.get_read_len(); coord++) {
-						if (soap.is_N(coord)) {
-							;
-						}
-						else {
-							if(! (soap.get_pos()+coord<current_chr->second->length())) {
+					Chr_info * chr = current_chr->second;
+					ubit64_t read_len = soap.get_read_len();
+					ubit64_t on_ref = read_len;
+					if(soap.get_pos() + read_len > chr->length()) {
+						on_ref = chr->length() > (ubit64_t)soap.get_pos() ? chr->length() - soap.get_pos() : 0;
+						for(coord = on_ref; coord != read_len; coord++) {
+							if(!soap.is_N(coord)) {
 								cerr<<soap<<endl;
 								cerr<<"The program found the above read has exceed the reference length:\n";
 								cerr<<"The read is aligned to postion: "<<soap.get_pos()<<" with read length: "<<soap.get_read_len()<<endl;
 								cerr<<"Reference: "<<current_chr->first<<" FASTA Length: "<<current_chr->second->length()<<endl;
 								exit(255);
 							}
-							ref = current_chr->second->get_bin_base(soap.get_pos()+coord);
-							if ( (ref&12) !=0 ) {
-								// This is an N on reference or a dbSNP which should be excluded from calibration
-								;
-							}
-							else {
-								if(soap.is_fwd()) {
-									// forward strand
-									count_matrix[(((ubit64_t)soap.get_qual(coord))<<12) | (coord<<4) | ((ref&0x3)<<2) | (soap.get_base(coord)>>1)&3] += 1;
-								}
-								else {
-									// reverse strand
-									count_matrix[(((ubit64_t)soap.get_qual(coord))<<12) | ((soap.get_read_len()-1-coord)<<4) | ((ref&0x3)<<2) | (soap.get_base(coord)>>1)&3] += 1;
-								}
-							}
 						}
 					}
+					if(ref.size() < on_ref) {
+						ref.resize(on_ref);
+						cell.resize(on_ref);
+					}
+					// Decode the reference under the read once, then work
+					// out every base's cell without branching
+					chr->decode(soap.get_pos(), on_ref, &ref[0]);
+					bool fwd = soap.is_fwd();
+					for(coord = 0; coord != on_ref; coord++) {
+						// N or dbSNP on reference, N in the read, or a
+						// quality or cycle outside the matrix
+						ubit64_t q = (ubit64_t)(soap.get_qual(coord) - para->q_min);
+						ubit64_t cycle = fwd ? coord : read_len-1-coord;
+						bool skip = ((ref[coord] & 12) != 0) | soap.is_N(coord) | (q >= q_span) | (cycle >= para->read_length);
+						ubit64_t c = ((q * para->read_length + cycle) << 4) | ((ref[coord]&0x3)<<2) | ((soap.get_base(coord)>>1)&3);
+						cell[coord] = skip ? cell_count : c;
+					}
+					for(coord = 0; coord != on_ref; coord++) {
+						count_matrix[cell[coord]] += 1;
+					}
 				}
 			}
 		}
@@ -489,15 +1809,16 @@ int Prob_matrix::matrix_gen(std::ifstream & alignment, Parameter * para, Genome
 		memset(same_qual_count_by_t_base, 0, sizeof(ubit64_t)*4);
 		same_qual_count_total = 0;
 		same_qual_count_mismatch = 0;
+		ubit64_t * counts = count_matrix + ((ubit64_t)(q_char-para->q_min) * para->read_length << 4);
 		for(coord=0; coord != para->read_length ; coord++) {
 			for(type=0;type!=16;type++) {
 				// If the sample is small, then we will not consider the effect of read cycle.
-				same_qual_count_by_type[type] += count_matrix[ ((ubit64_t)q_char<<12) | coord <<4 | type];
-				same_qual_count_by_t_base[(type>>2)&3] += count_matrix[ ((ubit64_t)q_char<<12) | coord <<4 | type];
-				same_qual_count_total += count_matrix[ ((ubit64_t)q_char<<12) | coord <<4 | type];
+				same_qual_count_by_type[type] += counts[ coord <<4 | type];
+				same_qual_count_by_t_base[(type>>2)&3] += counts[ coord <<4 | type];
+				same_qual_count_total += counts[ coord <<4 | type];
 				if(type % 5 != 0) {
 					// Mismatches
-					same_qual_count_mismatch += count_matrix[ ((ubit64_t)q_char<<12) | coord <<4 | type];
+					same_qual_count_mismatch += counts[ coord <<4 | type];
 				}
 			}
 		}
@@ -505,13 +1826,13 @@ int Prob_matrix::matrix_gen(std::ifstream & alignment, Parameter * para, Genome
 			memset(sum, (ubit64_t)0, sizeof(ubit64_t)*4);
 			// Count of all ref base at certain coord and quality
 			for(type=0;type!=16;type++) {
-				sum[(type>>2)&3] += count_matrix[ ((ubit64_t)q_char<<12) | (coord <<4) | type]; // (type>>2)&3: the ref base
+				sum[(type>>2)&3] += counts[ (coord <<4) | type]; // (type>>2)&3: the ref base
 			}
 			for(t_base=0; t_base!=4; t_base++) {
 				for(o_base=0; o_base!=4; o_base++) {
-					if (count_matrix[ ((ubit64_t)q_char<<12) | (coord <<4) | (t_base<<2) | o_base] > sta_pow) {
+					if (counts[ (coord <<4) | (t_base<<2) | o_base] > sta_pow) {
 						// Statistically powerful
-						p_matrix [ ((ubit64_t)(q_char-para->q_min)<<12) | (coord <<4) | (t_base<<2) | o_base] = ((double)count_matrix[ ((ubit64_t)q_char<<12) | (coord <<4) | (t_base<<2) | o_base]) / sum[t_base];
+						p_matrix [ ((ubit64_t)(q_char-para->q_min)<<12) | (coord <<4) | (t_base<<2) | o_base] = ((double)counts[ (coord <<4) | (t_base<<2) | o_base]) / sum[t_base];
 					}
 					else if (same_qual_count_by_type[t_base<<2|o_base] > sta_pow) {
 						// Smaller sample, given up effect from read cycle
@@ -557,35 +1878,20 @@ int Prob_matrix::matrix_gen(std::ifstream & alignment, Parameter * para, Genome
 	return 1;
 }
 
+/// The evidence at a site: its unique observations, tallied by kind
 struct Pos_info {
-	unsigned char ori;
 	small_int base_info[4*2*64*256];
 #ifdef FAST_BOUNDS
 	small_int coordmin, coordmax;
 	char qmin, qmax;
 #endif
-	int pos, depth, dep_uni, repeat_time;
-	int dep_pair, dep_uni_pair;
-	int count_uni[4];
-	int q_sum[4];
-	int count_all[4];
 
 	Pos_info(){
-		ori = 0xFF;
 		memset(base_info,0,sizeof(small_int)*4*2*64*256);
-		pos = -1;
-		memset(count_uni,0,sizeof(int)*4);
-		memset(q_sum,0,sizeof(int)*4);
-		depth = 0;
-		dep_uni = 0;
-		dep_pair = 0;
-		dep_uni_pair = 0;
-		repeat_time = 0;
 #ifdef FAST_BOUNDS
 		coordmin = coordmax = 0;
 		qmin = qmax = 0;
 #endif
-		memset(count_all,0,sizeof(int)*4);
 	}
 
 	static void clear(Pos_info* p, int num) {
@@ -593,26 +1899,225 @@ struct Pos_info {
 	}
 };
 
+/**
+ * The counters of every site of a calling window, one array per field
+ * and indexed like the window's sites.  They are kept apart from the
+ * sites' evidence, where a site's counters would be 128 KB from the
+ * next site's, so that scanning a window's worth of one is a scan of
+ * contiguous memory.
+ */
+struct Site_counts {
+	int * depth, * dep_uni, * repeat_time;
+	int * dep_pair, * dep_uni_pair;
+	int (* count_uni)[4];
+	int (* q_sum)[4];
+	int (* count_all)[4];
+	small_int * ori; // reference base, set when the site is called
+
+	Site_counts(size_t num) {
+		depth = new int [num];
+		dep_uni = new int [num];
+		repeat_time = new int [num];
+		dep_pair = new int [num];
+		dep_uni_pair = new int [num];
+		count_uni = new int [num][4];
+		q_sum = new int [num][4];
+		count_all = new int [num][4];
+		ori = new small_int [num];
+		for(size_t i = 0; i != num; i++) {
+			clear(i);
+			ori[i] = 0xFF;
+		}
+	}
+	~Site_counts() {
+		delete [] depth;
+		delete [] dep_uni;
+		delete [] repeat_time;
+		delete [] dep_pair;
+		delete [] dep_uni_pair;
+		delete [] count_uni;
+		delete [] q_sum;
+		delete [] count_all;
+		delete [] ori;
+	}
+
+	void clear(size_t i) {
+		depth[i] = dep_uni[i] = repeat_time[i] = 0;
+		dep_pair[i] = dep_uni_pair[i] = 0;
+		memset(count_uni[i], 0, sizeof(int)*4);
+		memset(q_sum[i], 0, sizeof(int)*4);
+		memset(count_all[i], 0, sizeof(int)*4);
+	}
+private:
+	Site_counts(const Site_counts &);
+	Site_counts & operator=(const Site_counts &);
+};
+
+/**
+ * A contiguous stretch [start, end) of a chromosome that is called on
+ * its own by a worker thread (-P).  start and end are multiples of the
+ * window size.  Besides the alignments starting in the shard, alns
+ * holds a halo of those starting up to read_length bases before it,
+ * which spill over into it.
+ */
+template<typename T>
+struct Call_shard {
+	map<Chr_name, Chr_info*>::iterator chr;
+	int start, end;
+	// No alignments start on chr after this shard, so every remaining
+	// window through end is called, like a serial run does at the end
+	// of a chromosome
+	bool flush;
+	std::vector<T> alns;
+	std::string header; // output preceding the shard's calls
+	std::ostringstream out;
+	Aln_index index; // -O, with offsets into out
+	Call_counts counts;
+	bool done;
+	Call_shard() : start(0), end(0), flush(false), index("consensus"), done(false) { }
+};
+
+template<typename T> class Shard_pool;
+
+/// What call_cns works out for one site, before it is written out
+struct Site_call {
+	char type1, type2; // best and second-best genotypes
+	char base1, base2, base3; // best-supported bases
+	int qual1, qual2, qual3; // their summed qualities
+	int q_cns; // consensus quality
+	double rank_sum; // rank sum test p-value
+};
+
 class Call_win {
 public:
 	ubit64_t win_size;
 	ubit64_t read_len;
-	Pos_info * sites; // a single Pos_info is 50 bytes or so
-	Call_win(ubit64_t read_length, ubit64_t window_size=1000) {
-		sites = new Pos_info [window_size+read_length];
+	// The window and the read_len sites past it that alignments spill
+	// into, as a ring of exactly that many sites: win_start is kept in
+	// slot head, and the sites after it in the slots after that,
+	// wrapping around.  Advancing the window just resets the slots it
+	// leaves, which then hold the sites at its far end.
+	ubit64_t ring_size, head;
+	Pos_info * sites; // a single Pos_info is 130 KB or so
+	Site_counts counts; // by slot, like sites
+	int win_start; // first position of the window being filled
+	// When a maximum depth is set (-D), each site keeps a reservoir of
+	// at most max_depth unique observations, each encoded as its
+	// base_info index.  The number of valid entries is
+	// min(dep_uni, max_depth).
+	ubit64_t max_depth;
+	ubit32_t * sample;
+	// call_cns scratch: genotype likelihoods and posteriors in log10
+	// scale; the 17th element is used in comparisons
+	rate_t type_likely[16+1], type_prob[16+1];
+	int * pcr_dep_count; // per strand and cycle
+	small_int * ref_code; // get_bin_base codes of the window being called
+	Checkpoint * ckpt; // -C; serial calling only
+	Ref_block block; // -B block not yet written
+	Aln_index * out_index; // -O; offsets are those of the output stream
+	Call_win(ubit64_t read_length, ubit64_t window_size=1000, ubit64_t max_dep=0) :
+		ring_size(window_size+read_length),
+		counts(ring_size)
+	{
+		head = 0;
+		// Zeroed, as Pos_info() would leave it
+		sites = (Pos_info *)huge_alloc(sizeof(Pos_info)*ring_size);
+		win_start = 0;
 		win_size = window_size;
 		read_len = read_length;
+		max_depth = max_dep;
+		sample = NULL;
+		if(max_depth > 0) {
+			sample = new ubit32_t [ring_size*max_depth];
+		}
+		memset(type_likely, 0, sizeof(type_likely));
+		memset(type_prob, 0, sizeof(type_prob));
+		pcr_dep_count = new int [read_length*2];
+		ref_code = new small_int [window_size+read_length];
+		ckpt = NULL;
+		out_index = NULL;
 	}
 	~Call_win(){
-		delete [] sites;
+		huge_free(sites, sizeof(Pos_info)*ring_size);
+		delete [] sample;
+		delete [] pcr_dep_count;
+		delete [] ref_code;
+	}
+
+	/// Slot of pos, for pos in [win_start, win_start+ring_size)
+	int slot(int pos) const {
+		ubit64_t sub = head + (ubit64_t)(pos - win_start);
+		return (int)(sub < ring_size ? sub : sub - ring_size);
+	}
+
+	/// Empty a slot, which only needs clearing if an alignment covered it
+	void reset(int sub) {
+		if(counts.depth[sub] != 0) {
+			Pos_info::clear(&sites[sub], 1);
+			counts.clear(sub);
+		}
+	}
+
+	/**
+	 * The n'th random draw for the site at pos (splitmix64 of both).
+	 * Draws depend only on the site, so that reruns, and runs split
+	 * into shards, give identical calls.
+	 */
+	static ubit64_t site_rand(int pos, ubit64_t n) {
+		ubit64_t z = ((ubit64_t)(ubit32_t)pos << 32 | (n & 0xFFFFFFFFULL)) + 0x9E3779B97F4A7C15ULL;
+		z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+		z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+		return z ^ (z >> 31);
+	}
+
+	/**
+	 * Remove a previously kept unique observation from a site's
+	 * evidence.  Saturated base_info cells are left alone since their
+	 * true count is unknown.
+	 */
+	void evict(int sub, ubit32_t bi) {
+		if(sites[sub].base_info[bi] != 0xFF) sites[sub].base_info[bi] -= 1;
+		counts.count_uni[sub][bi >> 15] -= 1;
+		counts.q_sum[sub][bi >> 15] -= ((bi >> 8) & 0x3F);
+	}
+
+	/**
+	 * Reservoir-sample the dep_uni'th unique observation at pos, in slot
+	 * sub.  Returns true iff the observation should be added to the
+	 * site's evidence; if so, it may have displaced an earlier
+	 * observation.
+	 */
+	bool sample_obs(int sub, int pos, ubit32_t bi) {
+		ubit64_t n = counts.dep_uni[sub];
+		ubit32_t * res = sample + sub * max_depth;
+		if(n <= max_depth) {
+			res[n-1] = bi;
+			return true;
+		}
+		ubit64_t r = site_rand(pos, n) % n;
+		if(r >= max_depth) {
+			return false;
+		}
+		evict(sub, res[r]);
+		res[r] = bi;
+		return true;
 	}
 
 	int initialize(ubit64_t start);
 	int recycle(int start = -1);
-	int call_cns(Chr_name call_name, Chr_info* call_chr, ubit64_t call_length, Prob_matrix * mat, Parameter * para, std::ofstream & consensus);
-	template<typename T> int soap2cns(std::ifstream & alignment, std::ofstream & consensus, Genome * genome, Prob_matrix * mat, Parameter * para);
-	int snp_p_prior_gen(double * real_p_prior, Snp_info* snp, Parameter * para, char ref);
-	double rank_test(Pos_info & info, char best_type, rate_t * p_rank, Parameter * para);
+	void top_bases(int sub, Site_call & call);
+	void likelihood(int sub, Prob_matrix * mat, Parameter * para);
+	const rate_t * site_prior(int pos, small_int ori, Chr_info * chr, Prob_matrix * mat, Parameter * para);
+	void posterior(const rate_t * log_prior, Parameter * para, Site_call & call);
+	void cns_quality(int sub, Prob_matrix * mat, Parameter * para, Site_call & call);
+	int call_cns(const Chr_name & call_name, Chr_info* call_chr, ubit64_t call_length, Prob_matrix * mat, Parameter * para, std::ostream & consensus);
+	void add_to_block(const Chr_name & name, int pos, int depth, int q_cns, std::ostream & consensus);
+	void flush_block(const Chr_name & name, std::ostream & consensus);
+	template<typename T> int soap2cns(Aln_inputs & alignments, std::ofstream & consensus, Genome * genome, Prob_matrix * mat, Parameter * para);
+	template<typename T> int soap2cns_sharded(Aln_inputs & alignments, std::ofstream & consensus, Genome * genome, Prob_matrix * mat, Parameter * para);
+	template<typename T> void commit(T & soap, Chr_info * chr, Parameter * para);
+	template<typename T> void call_shard(Call_shard<T> & shard, Prob_matrix * mat, Parameter * para);
+	double rank_test(int sub, char best_type, rate_t * p_rank, Parameter * para);
 	double normal_value(double z);
 	double normal_test(int n1, int n2, double T1, double T2);
 	double table_test(rate_t *p_rank, int n1, int n2, double T1, double T2);
@@ -622,157 +2127,685 @@ public:
  * Loop over SNP-calling windows.
  */
 template<typename T>
-int Call_win::soap2cns(std::ifstream & alignment, std::ofstream & consensus, Genome * genome, Prob_matrix * mat, Parameter * para) {
+int Call_win::soap2cns(Aln_inputs & alignments, std::ofstream & consensus, Genome * genome, Prob_matrix * mat, Parameter * para) {
+	if(para->threads > 1) {
+		return soap2cns_sharded<T>(alignments, consensus, genome, mat, para);
+	}
 	T soap;
 	map<Chr_name, Chr_info*>::iterator current_chr, prev_chr;
 	current_chr = prev_chr = genome->chromosomes.end();
-	int coord, sub;
+	int current_id = -1;
 	int last_start(0);
 	int aln = 0;
-	for(std::string line; getline(alignment, line);) {
-		std::istringstream s(line);
-		if(s >> soap) {
-			aln++;
-			if(para->verbose) {
-				clog << "Processing alignment " << aln << endl;
+	Aln_merge<T> merged(alignments, genome);
+	Aln_reorder<T> reader(merged, para->reorder_dist);
+	// With -C, where each input's recent alignments are, and the
+	// window before which a resumed run skips alignments
+	std::vector<Aln_mark> marks(alignments.size());
+	int resume_from = -1;
+	bool halo = false; // current window was called before the checkpoint
+	if(ckpt != NULL) {
+		// Checkpoints need alignments in input order, so there's no
+		// reordering (-R) here
+		merged.track = true;
+		if(ckpt->resumed) {
+			for(size_t i = 0; i != alignments.size(); i++) {
+				if(ckpt->offsets[i] < 0) {
+					continue;
+				}
+				alignments[i]->seekg(ckpt->offsets[i]);
+				if(!*alignments[i]) {
+					cerr << "Could not seek in alignment input" << endl;
+					exit(255);
+				}
+				alignments[i]->bin_chr = ckpt->offset_chrs[i];
+				alignments[i]->bin_header_read = true;
 			}
-			if(soap.get_pos() < 0) {
-				continue;
+			current_id = genome->chr_id(ckpt->chr);
+			if(current_id < 0) {
+				cerr << "Checkpoint chromosome " << ckpt->chr << " is not in the reference" << endl;
+				exit(255);
 			}
-			if (current_chr == genome->chromosomes.end() ||
-			    current_chr->first != soap.get_chr_name())
-			{
-				// Moved on to a new Chromosome
-				if(current_chr != genome->chromosomes.end()) {
-					// This it not the first chromosome, so we ha
-					while(current_chr->second->length() > sites[win_size-1].pos) {
-						call_cns(current_chr->first, current_chr->second, win_size, mat, para, consensus);
-						recycle();
-						last_start = sites[win_size-1].pos;
-					}
-					call_cns(current_chr->first, current_chr->second, current_chr->second->length()%win_size, mat, para, consensus);
+			current_chr = genome->by_id[current_id];
+			block = ckpt->block;
+			merged.parsed = ckpt->counted;
+			ckpt->give_counts();
+			if(out_index != NULL && !out_index->load(ckpt->index_name())) {
+				cerr << "Could not read checkpoint output index " << ckpt->index_name() << endl;
+				exit(255);
+			}
+			resume_from = ckpt->start - win_size;
+			initialize(resume_from);
+			last_start = resume_from;
+			halo = true;
+			cerr << "Resuming from checkpoint at " << ckpt->chr << ":" << ckpt->start << endl;
+		}
+	}
+	while(ckpt != NULL ? merged.next(soap) : reader.next(soap)) {
+		aln++;
+		if(para->verbose) {
+			clog << "Processing alignment " << aln << endl;
+		}
+		if(soap.get_pos() < 0) {
+			continue;
+		}
+		if(ckpt != NULL) {
+			marks[merged.last_src].note(soap.get_chr_name(), soap.get_pos() / win_size, merged.last_start, merged.last_end);
+		}
+		int id = soap.get_chr_id();
+		if (id != current_id || id < 0) {
+			// Moved on to a new Chromosome
+			if(current_chr != genome->chromosomes.end()) {
+				// This it not the first chromosome, so we ha
+				while(current_chr->second->length() > win_start + win_size - 1) {
+					call_cns(current_chr->first, current_chr->second, win_size, mat, para, consensus);
 					recycle();
+					last_start = win_start + win_size - 1;
 				}
-				// Get the chromosome info corresponding to the next
-				// chunk of alignments
-				current_chr = genome->chromosomes.find(soap.get_chr_name());
-				initialize(0);
-				if(para->verbose) {
-					clog << "Returned from initialize(0) for chromosome " << current_chr->first << endl;
-				}
-				last_start = 0;
-				if(para->glf_format) {
-					cerr << "Processing " << current_chr->first << endl;
-					int temp_int(current_chr->first.size()+1);
-					consensus.write(reinterpret_cast<char *> (&temp_int), sizeof(temp_int));
-					consensus.write(current_chr->first.c_str(), current_chr->first.size()+1);
-					temp_int = current_chr->second->length();
-					consensus.write(reinterpret_cast<char *> (&temp_int), sizeof(temp_int));
-					consensus<<flush;
-					if (!consensus.good()) {
-						cerr<<"Broken IO stream after writing chromosome info."<<endl;
-						exit(255);
-					}
-					assert(consensus.good());
-				}
+				call_cns(current_chr->first, current_chr->second, current_chr->second->length()%win_size, mat, para, consensus);
+				flush_block(current_chr->first, consensus);
+				recycle();
 			}
-			else {
-				;
+			// Get the chromosome info corresponding to the next
+			// chunk of alignments
+			if(id < 0) {
+				cerr << "Assertion Failed: Chromosome: !" << soap.get_chr_name() << "! NOT found" << endl;
+				exit(255);
 			}
-			Chr_info *chr = current_chr->second;
-			if(para->region_only && !chr->is_in_region(soap.get_pos())) {
-				continue;
+			current_id = id;
+			current_chr = genome->by_id[id];
+			resume_from = -1;
+			initialize(0);
+			if(para->verbose) {
+				clog << "Returned from initialize(0) for chromosome " << current_chr->first << endl;
 			}
-			if(soap.get_pos() < last_start) {
-				cerr << "Errors in sorting:" << soap.get_pos() << "<" << last_start << endl;
-				exit(255);
+			last_start = 0;
+			if(para->glf_format) {
+				cerr << "Processing " << current_chr->first << endl;
+				int temp_int(current_chr->first.size()+1);
+				consensus.write(reinterpret_cast<char *> (&temp_int), sizeof(temp_int));
+				consensus.write(current_chr->first.c_str(), current_chr->first.size()+1);
+				temp_int = current_chr->second->length();
+				consensus.write(reinterpret_cast<char *> (&temp_int), sizeof(temp_int));
+				consensus<<flush;
+				if (!consensus.good()) {
+					cerr<<"Broken IO stream after writing chromosome info."<<endl;
+					exit(255);
+				}
+				assert(consensus.good());
+			}
+		}
+		else {
+			;
+		}
+		Chr_info *chr = current_chr->second;
+		if(soap.get_pos() < resume_from) {
+			// Can't reach the resumed window
+			continue;
+		}
+		if(para->region_only && !chr->is_in_region(soap.get_pos())) {
+			continue;
+		}
+		if(soap.get_pos() < last_start) {
+			cerr << "Errors in sorting:" << soap.get_pos() << "<" << last_start;
+			if(para->reorder_dist > 0) {
+				cerr << " (more than " << para->reorder_dist << " out of order; see -R)";
 			}
-			// Call the previous window
-			int aln_win = soap.get_pos() / win_size;
-			int last_aln_win = last_start / win_size;
-			if (aln_win > last_aln_win) {
-				// We should call the base here
+			cerr << endl;
+			exit(255);
+		}
+		// Call the previous window
+		int aln_win = soap.get_pos() / win_size;
+		int last_aln_win = last_start / win_size;
+		if (aln_win > last_aln_win) {
+			// We should call the base here
+			if(halo) {
+				// Only gathered the alignments reaching the resumed window
+				halo = false;
+			} else {
 				call_cns(current_chr->first, current_chr->second,
 				         win_size, mat, para, consensus);
-				if(aln_win > last_aln_win+1) {
-					recycle(aln_win * win_size);
-				} else {
-					recycle();
-				}
-				last_start = sites[win_size-1].pos;
-				if((last_start + 1) / win_size == 1000) {
-					cerr << "Called " << last_start;
-				}
 			}
-			last_start = soap.get_pos();
-			// Commit the read information
-			for(coord = 0; coord < soap.get_read_len(); coord++) {
-				const int pos = soap.get_pos() + coord;
-				if(!chr->is_in_region(pos)) {
-					continue;
-				}
-				if(pos / win_size == soap.get_pos() / win_size ) {
-					// In the same sliding window
-					sub = pos % win_size;
-				}
-				else {
-					sub = pos % win_size + win_size; // Use the tail to store the info so that it won't intervene the uncalled bases
-				}
-				sites[sub].depth += 1;
-				if(soap.get_mate() > 0) sites[sub].dep_pair += 1;
-				sites[sub].repeat_time += soap.get_hit();
-				if((soap.is_N(coord)) ||
-				   soap.get_qual(coord) < para->q_min ||
-				   sites[sub].dep_uni >= 0xFF)
+			if(aln_win > last_aln_win+1) {
+				recycle(aln_win * win_size);
+			} else {
+				recycle();
+			}
+			last_start = win_start + win_size - 1;
+			if((last_start + 1) / win_size == 1000) {
+				cerr << "Called " << last_start;
+			}
+			if(ckpt != NULL && ckpt->due()) {
+				consensus.flush();
+				ckpt->note(marks, current_chr->first, aln_win * win_size, win_size);
+				ckpt->out_off = (long long)consensus.tellp();
+				ckpt->block = block;
+				ckpt->take_counts(merged.parsed);
+				if(!consensus || !ckpt->save() ||
+				   (out_index != NULL && !out_index->write(ckpt->index_name())))
 				{
-					// An N, low quality or meaningless huge depth
-					continue;
-				}
-				if(soap.get_hit() == 1) {
-					sites[sub].dep_uni += 1;
-					if(soap.get_mate() > 0) sites[sub].dep_uni_pair += 1;
-					int rcoord = coord;
-					// Update the covering info: 4x2x64x64 matrix, base x strand x q_score x read_pos, 2-1-6-6 bits for each
-					if(soap.is_fwd()) {
-						// Binary strand: 0 for plus and 1 for minus
-						sites[sub].base_info[(((ubit64_t)(soap.get_base(coord)&0x6)|0))<<14 | ((ubit64_t)(soap.get_qual(coord)-para->q_min))<<8 | coord ] += 1;
-					} else {
-						rcoord = (soap.get_read_len()-1-coord);
-						sites[sub].base_info[(((ubit64_t)(soap.get_base(coord)&0x6)|1))<<14 | ((ubit64_t)(soap.get_qual(coord)-para->q_min))<<8 | rcoord ] += 1;
-					}
-#ifdef FAST_BOUNDS
-					char qu = soap.get_qual(coord) - para->q_min;
-					if(qu+1 > sites[sub].qmax || sites[sub].qmax == 0) sites[sub].qmax = qu+1;
-					if(qu+1 < sites[sub].qmin || sites[sub].qmin == 0) sites[sub].qmin = qu+1;
-					if(rcoord+1 > sites[sub].coordmax || sites[sub].coordmax == 0) sites[sub].coordmax = rcoord+1;
-					if(rcoord+1 < sites[sub].coordmin || sites[sub].coordmin == 0) sites[sub].coordmin = rcoord+1;
-#endif
-					// Update # of unique alignments having the given
-					// unambiguous base
-					sites[sub].count_uni[(soap.get_base(coord)>>1)&3] += 1;
-					// Update sum-of-Phreds
-					sites[sub].q_sum[(soap.get_base(coord)>>1)&3] += (soap.get_qual(coord)-para->q_min);
+					cerr << "Could not write checkpoint " << ckpt->file << endl;
+					exit(255);
 				}
-				// Update # of alignments having the given unambiguous base
-				sites[sub].count_all[(soap.get_base(coord)>>1)&3] += 1;
 			}
 		}
+		last_start = soap.get_pos();
+		commit(soap, chr, para);
 	} // end loop over alignments
+	if(para->verbose && para->reorder_dist > 0) {
+		clog << "Most alignments held for reordering: " << reader.max_buffered << endl;
+	}
 	if(aln == 0) {
 		cerr << "Error: did not read any alignments" << endl;
 		exit(1);
 	}
-	while(current_chr->second->length() > sites[win_size-1].pos) {
+	while(current_chr->second->length() > win_start + win_size - 1) {
 		int ret = call_cns(current_chr->first, current_chr->second,
 		                   win_size, mat, para, consensus);
 		recycle();
-		last_start = sites[win_size-1].pos;
+		last_start = win_start + win_size - 1;
 		if(ret == -2) break;
 	}
 	call_cns(current_chr->first, current_chr->second,
 	         current_chr->second->length() % win_size,
 	         mat, para, consensus);
-	alignment.close();
+	flush_block(current_chr->first, consensus);
+	Prof_timer out_timer(PROF_OUTPUT);
+	consensus.close();
+	return 1;
+}
+
+/**
+ * Add an alignment's evidence to the window.  Bases past the current
+ * window land in the slots after it, which are not called until the
+ * window gets there.
+ */
+template<typename T>
+void Call_win::commit(T & soap, Chr_info * chr, Parameter * para) {
+	Prof_timer timer(PROF_FILL);
+	int coord, sub;
+	for(coord = 0; coord < soap.get_read_len(); coord++) {
+		const int pos = soap.get_pos() + coord;
+		if(!chr->is_in_region(pos)) {
+			continue;
+		}
+		sub = slot(pos);
+		counts.depth[sub] += 1;
+		if(soap.get_mate() > 0) counts.dep_pair[sub] += 1;
+		counts.repeat_time[sub] += soap.get_hit();
+		if((soap.is_N(coord)) ||
+		   soap.get_qual(coord) < para->q_min ||
+		   (max_depth == 0 && counts.dep_uni[sub] >= 0xFF))
+		{
+			// An N, low quality or meaningless huge depth
+			continue;
+		}
+		if(soap.get_hit() == 1) {
+			counts.dep_uni[sub] += 1;
+			if(soap.get_mate() > 0) counts.dep_uni_pair[sub] += 1;
+			// Update the covering info: 4x2x64x64 matrix, base x strand x q_score x read_pos, 2-1-6-6 bits for each
+			// Binary strand: 0 for plus and 1 for minus
+			int rcoord = (soap.is_fwd() ? coord : (soap.get_read_len()-1-coord));
+			const ubit32_t bi = ((ubit32_t)(soap.get_base(coord)&0x6)|(soap.is_fwd() ? 0 : 1))<<14 |
+			                    ((ubit32_t)(soap.get_qual(coord)-para->q_min))<<8 | rcoord;
+			if(max_depth > 0 && !sample_obs(sub, pos, bi)) {
+				// Site is over -D and the reservoir passed on
+				// this observation
+				counts.count_all[sub][(soap.get_base(coord)>>1)&3] += 1;
+				continue;
+			}
+			if(sites[sub].base_info[bi] != 0xFF) {
+				// Saturate rather than wrap
+				sites[sub].base_info[bi] += 1;
+			}
+#ifdef FAST_BOUNDS
+			char qu = soap.get_qual(coord) - para->q_min;
+			if(qu+1 > sites[sub].qmax || sites[sub].qmax == 0) sites[sub].qmax = qu+1;
+			if(qu+1 < sites[sub].qmin || sites[sub].qmin == 0) sites[sub].qmin = qu+1;
+			if(rcoord+1 > sites[sub].coordmax || sites[sub].coordmax == 0) sites[sub].coordmax = rcoord+1;
+			if(rcoord+1 < sites[sub].coordmin || sites[sub].coordmin == 0) sites[sub].coordmin = rcoord+1;
+#endif
+			// Update # of unique alignments having the given
+			// unambiguous base
+			counts.count_uni[sub][(soap.get_base(coord)>>1)&3] += 1;
+			// Update sum-of-Phreds
+			counts.q_sum[sub][(soap.get_base(coord)>>1)&3] += (soap.get_qual(coord)-para->q_min);
+		}
+		// Update # of alignments having the given unambiguous base
+		counts.count_all[sub][(soap.get_base(coord)>>1)&3] += 1;
+	}
+}
+
+/**
+ * Call one shard exactly as a serial run calls that stretch.  The halo
+ * is committed to the window just before the shard, which is recycled
+ * without being called, so that what spills over from it is carried
+ * into the shard's first window.
+ */
+template<typename T>
+void Call_win::call_shard(Call_shard<T> & shard, Prob_matrix * mat, Parameter * para) {
+	const Chr_name & name = shard.chr->first;
+	Chr_info * chr = shard.chr->second;
+	int cur_win = (shard.start == 0) ? 0 : (int)(shard.start / win_size) - 1;
+	initialize(cur_win * win_size);
+	for(size_t i = 0; i != shard.alns.size(); i++) {
+		T & soap = shard.alns[i];
+		int aln_win = soap.get_pos() / win_size;
+		if(aln_win > cur_win) {
+			if(win_start >= shard.start) {
+				call_cns(name, chr, win_size, mat, para, shard.out);
+			}
+			if(aln_win > cur_win + 1) {
+				recycle(aln_win * win_size);
+			} else {
+				recycle();
+			}
+			cur_win = aln_win;
+		}
+		commit(soap, chr, para);
+	}
+	if(!shard.flush) {
+		if(win_start >= shard.start) {
+			call_cns(name, chr, win_size, mat, para, shard.out);
+		}
+		flush_block(name, shard.out);
+		return;
+	}
+	// Same as the end of a chromosome in soap2cns, up to the shard's end
+	while(chr->length() > (ubit64_t)(win_start + win_size - 1) && win_start < shard.end) {
+		if(win_start >= shard.start) {
+			call_cns(name, chr, win_size, mat, para, shard.out);
+		}
+		recycle();
+	}
+	if(shard.end >= (int)chr->length()) {
+		call_cns(name, chr, chr->length() % win_size, mat, para, shard.out);
+	}
+	flush_block(name, shard.out);
+}
+
+/**
+ * Worker threads that call shards, and the bookkeeping to write their
+ * output in submission order.  At most a few shards per thread are in
+ * flight at once, which bounds memory.
+ */
+template<typename T>
+class Shard_pool {
+	Prob_matrix * mat;
+	Parameter * para;
+	std::ostream & out;
+	Aln_index * index; // -O
+	std::vector<pthread_t> workers;
+	std::deque<Call_shard<T>*> todo; // not yet picked up by a worker
+	std::deque<Call_shard<T>*> pending; // submitted but not yet written
+	size_t max_pending;
+	bool stop;
+	pthread_mutex_t lock;
+	pthread_cond_t cond_todo, cond_done;
+
+	static void * run(void * self) {
+		((Shard_pool<T> *)self)->work();
+		return NULL;
+	}
+
+	void work() {
+		Call_win win(para->read_length, 1000, para->max_depth);
+		while(true) {
+			pthread_mutex_lock(&lock);
+			while(todo.empty() && !stop) {
+				pthread_cond_wait(&cond_todo, &lock);
+			}
+			if(todo.empty()) {
+				pthread_mutex_unlock(&lock);
+				return;
+			}
+			Call_shard<T> * shard = todo.front();
+			todo.pop_front();
+			pthread_mutex_unlock(&lock);
+			win.out_index = (index != NULL ? &shard->index : NULL);
+			win.call_shard(*shard, mat, para);
+			shard->counts.take();
+			pthread_mutex_lock(&lock);
+			shard->done = true;
+			pthread_cond_broadcast(&cond_done);
+			pthread_mutex_unlock(&lock);
+		}
+	}
+
+	/// Write finished shards from the head of the queue; if block is
+	/// set, wait for the head to finish first
+	void write_ready(bool block) {
+		std::vector<Call_shard<T>*> ready;
+		pthread_mutex_lock(&lock);
+		while(block && !pending.empty() && !pending.front()->done) {
+			pthread_cond_wait(&cond_done, &lock);
+		}
+		while(!pending.empty() && pending.front()->done) {
+			ready.push_back(pending.front());
+			pending.pop_front();
+		}
+		pthread_mutex_unlock(&lock);
+		Prof_timer timer(PROF_OUTPUT);
+		for(size_t i = 0; i != ready.size(); i++) {
+			const std::string calls = ready[i]->out.str();
+			if(index != NULL) {
+				index->append(ready[i]->index, (long long)out.tellp() + ready[i]->header.size());
+			}
+			out.write(ready[i]->header.data(), ready[i]->header.size());
+			out.write(calls.data(), calls.size());
+			if(!out.good()) {
+				cerr << "Broken ofstream after writing shard at " << ready[i]->chr->first << ":" << ready[i]->start << endl;
+				exit(255);
+			}
+			ready[i]->counts.give();
+			delete ready[i];
+		}
+	}
+
+public:
+	Shard_pool(int threads, Prob_matrix * m, Parameter * p, std::ostream & o, Aln_index * idx) :
+		mat(m), para(p), out(o), index(idx), workers(threads), max_pending(4 * threads), stop(false)
+	{
+		pthread_mutex_init(&lock, NULL);
+		pthread_cond_init(&cond_todo, NULL);
+		pthread_cond_init(&cond_done, NULL);
+		for(int i = 0; i != threads; i++) {
+			if(pthread_create(&workers[i], NULL, Shard_pool<T>::run, this) != 0) {
+				cerr << "Could not start calling thread" << endl;
+				exit(255);
+			}
+		}
+	}
+
+	~Shard_pool() {
+		pthread_cond_destroy(&cond_done);
+		pthread_cond_destroy(&cond_todo);
+		pthread_mutex_destroy(&lock);
+	}
+
+	/// Queue a shard for calling; may wait for earlier shards to finish
+	void submit(Call_shard<T> * shard) {
+		// Only this thread touches pending's length, so no lock needed
+		while(pending.size() >= max_pending) {
+			write_ready(true);
+		}
+		pthread_mutex_lock(&lock);
+		pending.push_back(shard);
+		todo.push_back(shard);
+		pthread_cond_signal(&cond_todo);
+		pthread_mutex_unlock(&lock);
+		write_ready(false);
+	}
+
+	/// Write everything still outstanding and stop the workers
+	void finish() {
+		while(!pending.empty()) {
+			write_ready(true);
+		}
+		pthread_mutex_lock(&lock);
+		stop = true;
+		pthread_cond_broadcast(&cond_todo);
+		pthread_mutex_unlock(&lock);
+		for(size_t i = 0; i != workers.size(); i++) {
+			pthread_join(workers[i], NULL);
+		}
+		workers.clear();
+	}
+};
+
+/**
+ * soap2cns for -P: read the alignments here and hand them out by
+ * coordinate to shards of SHARD_WINDOWS windows, which worker threads
+ * call independently.  Output is identical to a serial run.
+ */
+template<typename T>
+int Call_win::soap2cns_sharded(Aln_inputs & alignments, std::ofstream & consensus, Genome * genome, Prob_matrix * mat, Parameter * para) {
+	const int SHARD_WINDOWS = 100;
+	const int shard_len = SHARD_WINDOWS * win_size;
+	Shard_pool<T> pool(para->threads, mat, para, consensus, out_index);
+	T soap;
+	map<Chr_name, Chr_info*>::iterator current_chr = genome->chromosomes.end();
+	int id = -1, current_id = -1;
+	Call_shard<T> * shard = NULL;
+	std::vector<T> halo; // alignments that spill into the next shard
+	int last_start(0);
+	int aln = 0;
+	Aln_merge<T> merged(alignments, genome);
+	Aln_reorder<T> reader(merged, para->reorder_dist);
+	while(true) {
+		bool more = reader.next(soap);
+		if(more) {
+			aln++;
+			if(para->verbose) {
+				clog << "Processing alignment " << aln << endl;
+			}
+			if(soap.get_pos() < 0) {
+				continue;
+			}
+			id = soap.get_chr_id();
+		}
+		if(shard != NULL && (!more || id != current_id)) {
+			// Done with a chromosome: every window from the last
+			// alignment on is called, so the remaining shards are all
+			// flushed in full
+			int len = current_chr->second->length();
+			shard->flush = true;
+			for(int start = shard->end; start < len; start += shard_len) {
+				Call_shard<T> * next = new Call_shard<T>;
+				next->chr = current_chr;
+				next->start = start;
+				next->end = start + shard_len;
+				next->flush = true;
+				if(start == shard->end) {
+					next->alns.swap(halo);
+				}
+				pool.submit(shard);
+				shard = next;
+			}
+			pool.submit(shard);
+			shard = NULL;
+			halo.clear();
+		}
+		if(!more) {
+			break;
+		}
+		if(shard == NULL) {
+			// Moved on to a new chromosome
+			if(id < 0) {
+				cerr << "Assertion Failed: Chromosome: !" << soap.get_chr_name() << "! NOT found" << endl;
+				exit(255);
+			}
+			current_id = id;
+			current_chr = genome->by_id[id];
+			shard = new Call_shard<T>;
+			shard->chr = current_chr;
+			shard->start = 0;
+			shard->end = shard_len;
+			last_start = 0;
+			if(para->glf_format) {
+				cerr << "Processing " << current_chr->first << endl;
+				int temp_int(current_chr->first.size()+1);
+				shard->header.append(reinterpret_cast<char *>(&temp_int), sizeof(temp_int));
+				shard->header.append(current_chr->first.c_str(), current_chr->first.size()+1);
+				temp_int = current_chr->second->length();
+				shard->header.append(reinterpret_cast<char *>(&temp_int), sizeof(temp_int));
+			}
+		}
+		if(para->region_only && !current_chr->second->is_in_region(soap.get_pos())) {
+			continue;
+		}
+		if(soap.get_pos() < last_start) {
+			cerr << "Errors in sorting:" << soap.get_pos() << "<" << last_start;
+			if(para->reorder_dist > 0) {
+				cerr << " (more than " << para->reorder_dist << " out of order; see -R)";
+			}
+			cerr << endl;
+			exit(255);
+		}
+		last_start = soap.get_pos();
+		if(soap.get_pos() >= shard->end) {
+			// Shards skipped over hold no alignments and, like the
+			// windows a serial run jumps over, aren't called
+			Call_shard<T> * next = new Call_shard<T>;
+			next->chr = current_chr;
+			next->start = soap.get_pos() / shard_len * shard_len;
+			next->end = next->start + shard_len;
+			if(next->start == shard->end) {
+				next->alns.swap(halo);
+			}
+			halo.clear();
+			pool.submit(shard);
+			shard = next;
+		}
+		shard->alns.push_back(soap);
+		if(soap.get_pos() >= shard->end - (int)read_len) {
+			halo.push_back(soap);
+		}
+	}
+	if(para->verbose && para->reorder_dist > 0) {
+		clog << "Most alignments held for reordering: " << reader.max_buffered << endl;
+	}
+	pool.finish();
+	if(aln == 0) {
+		cerr << "Error: did not read any alignments" << endl;
+		exit(1);
+	}
+	Prof_timer out_timer(PROF_OUTPUT);
+	consensus.close();
+	return 1;
+}
+
+/**
+ * Joint calling of several samples in one pass (-A).  Each sample's
+ * sorted inputs are merged on their own and its evidence is kept in a
+ * window of sites of its own; the windows advance in lockstep, so each
+ * site is called for every sample at once and written as one record.
+ * The calibration matrix and the genotype priors are shared.
+ */
+class Joint_call {
+	std::vector<std::string> names;
+	std::vector<Call_win*> wins; // one per sample
+	ubit64_t win_size;
+	std::vector<Site_call> calls; // scratch, one per sample
+	void finish_chr(map<Chr_name, Chr_info*>::iterator chr, Prob_matrix * mat, Parameter * para, std::ostream & consensus);
+public:
+	Aln_index * out_index; // -O
+	Joint_call(const std::vector<std::string> & sample_names, Parameter * para);
+	~Joint_call();
+	void initialize(ubit64_t start);
+	void recycle(int start = -1);
+	int call_cns(const Chr_name & call_name, Chr_info* call_chr, ubit64_t call_length, Prob_matrix * mat, Parameter * para, std::ostream & consensus);
+	template<typename T> int soap2cns(std::vector<Aln_inputs> & samples, std::ofstream & consensus, Genome * genome, Prob_matrix * mat, Parameter * para);
+};
+
+/**
+ * Loop over SNP-calling windows of all samples; the alignments of the
+ * sample furthest behind are taken first.
+ */
+template<typename T>
+int Joint_call::soap2cns(std::vector<Aln_inputs> & samples, std::ofstream & consensus, Genome * genome, Prob_matrix * mat, Parameter * para) {
+	size_t n = samples.size();
+	std::vector<Aln_merge<T>*> merged(n);
+	std::vector<Aln_reorder<T>*> readers(n);
+	std::vector<T> heads(n);
+	std::vector<bool> live(n);
+	for(size_t i = 0; i != n; i++) {
+		merged[i] = new Aln_merge<T>(samples[i], genome);
+		readers[i] = new Aln_reorder<T>(*merged[i], para->reorder_dist);
+		live[i] = readers[i]->next(heads[i]);
+	}
+	consensus << "#Chr\tPos\tRef";
+	for(size_t i = 0; i != n; i++) {
+		consensus << '\t' << names[i] << ".cns\t" << names[i] << ".qual\t" << names[i] << ".depth";
+	}
+	consensus << "\tdbSNP" << endl;
+	T soap;
+	map<Chr_name, Chr_info*>::iterator current_chr = genome->chromosomes.end();
+	int current_id = -1;
+	int last_start(0);
+	int aln = 0;
+	while(true) {
+		size_t s = n;
+		for(size_t i = 0; i != n; i++) {
+			if(!live[i]) continue;
+			if(s == n) {
+				s = i;
+				continue;
+			}
+			// Chromosome IDs are in name order
+			const int a = heads[i].get_chr_id(), b = heads[s].get_chr_id();
+			if(a < b || (a == b && heads[i].get_pos() < heads[s].get_pos())) {
+				s = i;
+			}
+		}
+		if(s == n) {
+			break;
+		}
+		soap = heads[s];
+		int id = soap.get_chr_id();
+		live[s] = readers[s]->next(heads[s]);
+		aln++;
+		if(para->verbose) {
+			clog << "Processing alignment " << aln << " of sample " << names[s] << endl;
+		}
+		if(soap.get_pos() < 0) {
+			continue;
+		}
+		if (id != current_id || id < 0) {
+			if(id < 0) {
+				cerr << "Assertion Failed: Chromosome: !" << soap.get_chr_name() << "! NOT found" << endl;
+				exit(255);
+			}
+			if(current_chr != genome->chromosomes.end()) {
+				if(n > 1 && id < current_id) {
+					cerr << "Alignments of sample " << names[s] << " are not sorted by chromosome name: "
+					     << soap.get_chr_name() << " follows " << current_chr->first << endl;
+					cerr << "Inputs must be sorted by chromosome name when several samples are given with -A" << endl;
+					exit(255);
+				}
+				finish_chr(current_chr, mat, para, consensus);
+			}
+			current_id = id;
+			current_chr = genome->by_id[id];
+			initialize(0);
+			last_start = 0;
+		}
+		Chr_info *chr = current_chr->second;
+		if(para->region_only && !chr->is_in_region(soap.get_pos())) {
+			continue;
+		}
+		if(soap.get_pos() < last_start) {
+			cerr << "Errors in sorting:" << soap.get_pos() << "<" << last_start;
+			if(para->reorder_dist > 0) {
+				cerr << " (more than " << para->reorder_dist << " out of order; see -R)";
+			}
+			cerr << endl;
+			exit(255);
+		}
+		// Call the previous window of every sample
+		int aln_win = soap.get_pos() / win_size;
+		int last_aln_win = last_start / win_size;
+		if (aln_win > last_aln_win) {
+			call_cns(current_chr->first, chr, win_size, mat, para, consensus);
+			if(aln_win > last_aln_win+1) {
+				recycle(aln_win * win_size);
+			} else {
+				recycle();
+			}
+		}
+		last_start = soap.get_pos();
+		wins[s]->commit(soap, chr, para);
+	}
+	for(size_t i = 0; i != n; i++) {
+		delete readers[i];
+		delete merged[i];
+	}
+	if(aln == 0) {
+		cerr << "Error: did not read any alignments" << endl;
+		exit(1);
+	}
+	finish_chr(current_chr, mat, para, consensus);
+	Prof_timer out_timer(PROF_OUTPUT);
 	consensus.close();
 	return 1;
 }
@@ -0,0 +1,31 @@
+#!/bin/bash
+# aln2bin: calling its binary output, plain or compressed, is the same
+# as calling the SOAP or Crossbow text it was converted from, and it
+# counts what it converted.
+
+. "$(dirname "$0")/common.sh"
+
+mkref ref.fa chr1:20000 chr2:8000
+mkaln ref.fa 8000 30 > aln.cb
+# The same alignments in SOAP format
+awk -F'\t' '{ printf "%s\t%s\t%s\t%d\t%s\t%d\t%s\t%s\t%d\t0\n", $10, $5, $6, $7 + 1, "a", length($5), $4, $1, $3 + 1 }' aln.cb > aln.soap
+C="-d ref.fa -z ! -L 40"
+
+for f in cb soap; do
+	opt=$([ $f = cb ] && echo -c)
+	"$BIN/aln2bin" $opt -i aln.$f -o $f.bin 2> $f.log || fail "aln2bin exited with $?"
+	grep -q "Converted 8000 alignments" $f.log &&
+		pass "$f: count of converted alignments" ||
+		fail "$f: count of converted alignments: $(cat $f.log)"
+	"$BIN/soapsnp" -i aln.$f $opt $C -o $f.cns > /dev/null 2>&1 || fail "soapsnp exited with $?"
+	"$BIN/soapsnp" -i $f.bin $C -o $f.bin.cns > /dev/null 2>&1 || fail "soapsnp exited with $?"
+	same "$f: binary input" $f.cns $f.bin.cns
+done
+
+gzip -c < aln.cb | "$BIN/aln2bin" -c > stdin.bin 2> /dev/null
+same "compressed text on stdin" cb.bin stdin.bin
+gzip -c cb.bin > cb.bin.gz
+"$BIN/soapsnp" -i cb.bin.gz $C -o gz.cns > /dev/null 2>&1 || fail "soapsnp exited with $?"
+same "compressed binary input" cb.cns gz.cns
+
+finish
@@ -0,0 +1,49 @@
+#!/bin/bash
+# binsort: ReduceWrap.pl hands every reducer the same bins, in the same
+# order within each bin, whether it bins and sorts with binsort or with
+# its Perl fallback (--binsort=).  The two may group bins into tasks
+# differently, so the outputs are compared bin by bin.
+
+. "$(dirname "$0")/common.sh"
+
+mkdir in
+awk 'BEGIN {
+	srand(41)
+	for(f = 0; f < 4; f++) {
+		fn = "in/f" f ".txt"
+		for(i = 0; i < 3000; i++) {
+			printf "chr%d\t%d\t%d\tr%d.%d\t%s\n", int(rand() * 3) + 1, int(rand() * 20),
+				int(rand() * 100000), f, i, substr("ACGT", int(rand() * 4) + 1, 1) > fn
+		}
+		close(fn)
+	}
+}'
+gzip in/f3.txt
+
+for m in native perl; do
+	opt=--binsort=$([ $m = native ] && echo "$BIN/binsort")
+	perl "$CROSSBOW/ReduceWrap.pl" --input in --output out.$m --intermediate int.$m \
+		--bin-fields 2 --sort-fields 3 --tasks 8 --reducers 3 $opt -- cat > $m.log 2>&1 ||
+		fail "$m: ReduceWrap.pl exited with $?"
+	grep -q "Binning and sorting with $([ $m = native ] && echo "$BIN/binsort" || echo Perl)" $m.log ||
+		fail "$m: wrong binner used"
+	# No bin may reach two reducers
+	for f in out.$m/*; do
+		cut -f1,2 $f | sort -u
+	done | sort | uniq -d > split.txt
+	[ -s split.txt ] && fail "$m: bin $(head -n 1 split.txt) split"
+	# Bins in a fixed order, each keeping the order it was reduced in
+	cat out.$m/* | sort -s -t "$(printf '\t')" -k1,2 > $m.bins
+done
+[ -s native.bins ] || fail "no output"
+# binsort also hands each reducer its bins sorted, each in one piece
+# (the Perl sort interleaves bins such as "1" and "11")
+for f in out.native/*; do
+	sort -c -t "$(printf '\t')" -k1,3 $f 2> /dev/null || fail "$(basename $f) not sorted"
+done
+same "bins through binsort and Perl" native.bins perl.bins
+gzip -dc in/f3.txt.gz | cat in/f[0-2].txt - | sort > all.txt
+sort native.bins > got.txt
+same "every record reduced once" all.txt got.txt
+
+finish
@@ -0,0 +1,48 @@
+#!/bin/bash
+# cbfinish: CBFinish.pl writes the same per-chromosome files and
+# counters whether it splits the calls with cbfinish or with its Perl
+# loop (--cbfinish=), with and without a chromosome map, and for empty
+# input.
+
+. "$(dirname "$0")/common.sh"
+
+printf 'chr1\t0\nchr2\t1\nchrM\t2\n' > cmap.txt
+awk 'BEGIN {
+	srand(44)
+	for(i = 0; i < 20000; i++) {
+		if(i % 3000 == 11) print "FAKE"
+		if(i % 4000 == 5) print ""
+		c = int(rand() * 4)
+		printf "%s\t%010d\t%s\tR\t%d\t%s\t%d\n", (c == 3) ? "unmapped" : c,
+			int(rand() * 1000000), substr("ACGT", c + 1, 1), int(rand() * 99),
+			substr("ACGTRYKM", int(rand() * 8) + 1, 1), int(rand() * 40)
+	}
+}' > calls.txt
+: > empty.txt
+
+## finish_calls <what> <input> <CBFinish.pl options>...
+finish_calls() {
+	what=$1; in=$2; shift 2
+	for m in native perl; do
+		rm -rf $m; mkdir $m
+		(cd $m && perl "$CROSSBOW/CBFinish.pl" --output="$WORK/$m/out" \
+			--cbfinish=$([ $m = native ] && echo "$BIN/cbfinish") "$@" < "$WORK/$in" > /dev/null 2> ../$m.log) ||
+			fail "$what: $m: CBFinish.pl exited with $?"
+		grep -q "finisher: $([ $m = native ] && echo "$BIN/cbfinish" || echo Perl)" $m.log ||
+			fail "$what: $m: wrong finisher used"
+		grep "^reporter:counter:" $m.log | sort > $m.cnt
+		for f in $(cd $m/out 2> /dev/null && ls); do
+			echo "== $f"
+			gzip -dc $m/out/$f || fail "$what: $m: $f is not gzip"
+		done > $m.calls
+	done
+	same "$what" native.calls perl.calls
+	same "$what: counters" native.cnt perl.cnt
+}
+
+finish_calls "with --cmap" calls.txt --cmap="$WORK/cmap.txt"
+grep -q "^== chr1.gz" native.calls || fail "no chr1.gz written"
+finish_calls "without --cmap" calls.txt
+finish_calls "empty input" empty.txt --cmap="$WORK/cmap.txt"
+
+finish
@@ -0,0 +1,62 @@
+#!/bin/bash
+# -C: a run killed part way, once or twice, and rerun with the same
+# command resumes from its checkpoint and ends with the same output, -O
+# index and -H counters as a run that was never interrupted.  Uses soapsnp-ckpt
+# ("make soapsnp-ckpt"), which saves a checkpoint after every window.
+
+. "$(dirname "$0")/common.sh"
+
+if [ ! -x "$BIN/soapsnp-ckpt" ]; then
+	echo "skip $(basename "$0" .sh): no $BIN/soapsnp-ckpt"
+	exit 0
+fi
+
+mkref ref.fa chr1:120000 chr2:30000 chr3:40000
+mkaln ref.fa 16000 35 > aln.txt
+awk 'NR % 2' aln.txt > a.txt
+awk 'NR % 2 == 0' aln.txt > b.txt
+# Inputs on different chromosomes: c.txt has nothing left to give
+# once chr1 is done, so it is not read at all after the first resume
+awk '$1 == "chr1"' aln.txt > c.txt
+awk '$1 != "chr1"' aln.txt > d.txt
+awk -F'\t' '{ printf "%s\t%d\t%s\t%d\t60\t36M\t*\t0\t0\t%s\t%s\tNH:i:%d\n", $10, ($4 == "-") ? 16 : 0, $1, $3 + 1, $5, $6, $7 + 1 }' aln.txt > aln.sam
+"$BIN/aln2bin" -c -i aln.txt -o aln.bin 2> /dev/null || fail "aln2bin exited with $?"
+
+## counters <log>: the -H counters of a run, less progress reports
+counters() {
+	grep "reporter:counter" "$1" | grep -v "Positions called,\|status" | sort
+}
+
+## resume <what> <percent of output at each kill, e.g. "35 55"> <options>...
+resume() {
+	what=$1; kills=$2; shift 2
+	rm -f full.out* part.out* ck.txt*
+	"$BIN/soapsnp" "$@" -H -o full.out 2> full.log > /dev/null || fail "$what: soapsnp exited with $?"
+	counters full.log > full.cnt
+	for at in $kills; do
+		"$BIN/soapsnp-ckpt" "$@" -H -o part.out -C ck.txt > /dev/null 2>&1 &
+		pid=$!
+		target=$(( $(wc -c < full.out) * at / 100 ))
+		while kill -0 $pid 2> /dev/null && [ $(cat part.out 2> /dev/null | wc -c) -lt $target ]; do
+			sleep 0.01
+		done
+		kill -9 $pid 2> /dev/null
+		wait $pid 2> /dev/null
+	done
+	"$BIN/soapsnp-ckpt" "$@" -H -o part.out -C ck.txt 2> part.log > /dev/null || fail "$what: resumed soapsnp exited with $?"
+	grep -q "Resuming" part.log || fail "$what: did not resume (killed too late?)"
+	counters part.log > part.cnt
+	same "$what" full.out part.out
+	same "$what: -H counters" full.cnt part.cnt
+	[ -f full.out.cidx ] && same "$what: -O index" full.out.cidx part.out.cidx
+	[ ! -f ck.txt ] && [ ! -f ck.txt.matrix ] || fail "$what: checkpoint files left behind"
+}
+
+C="-d ref.fa -z ! -L 40"
+resume "two text inputs, -B 20, killed at 30%" 30 -i a.txt,b.txt -c $C -B 20
+resume "two text inputs, -B 20, killed at 70%" 70 -i a.txt,b.txt -c $C -B 20
+resume "SAM, -O" 50 -i aln.sam $C -O
+resume "binary, GLF" 50 -i aln.bin $C -F 1
+resume "inputs on different chromosomes, killed at 70% and 85%" "70 85" -i c.txt,d.txt -c $C
+
+finish
@@ -0,0 +1,107 @@
+# Sourced by the regression scripts in this directory.  Each script
+# builds its own small fixtures in a scratch directory, runs the tools
+# from the directory above (or $BIN), and exits non-zero on a mismatch.
+
+export LC_ALL=C
+TESTS=$(cd "$(dirname "$0")" && pwd)
+BIN=${BIN:-$(cd "$TESTS/.." && pwd)}
+CROSSBOW=${CROSSBOW:-$(cd "$TESTS/../.." && pwd)}
+WORK=$(mktemp -d "${TMPDIR:-/tmp}/soapsnp-test.XXXXXX")
+trap 'rm -rf "$WORK"' EXIT
+cd "$WORK"
+
+failed=0
+
+## pass <what> / fail <what>: report one check
+pass() { echo "ok   $(basename "$0" .sh): $*"; }
+fail() { echo "FAIL $(basename "$0" .sh): $*"; failed=1; }
+
+## same <what> <file1> <file2>: the files must be identical
+same() {
+	if cmp -s "$2" "$3"; then
+		pass "$1"
+	else
+		fail "$1 ($2 and $3 differ)"
+	fi
+}
+
+## mkref <file> <name>:<length> ...: a reproducible random reference
+mkref() {
+	out=$1; shift
+	: > "$out"
+	for c in "$@"; do
+		awk -v name="${c%%:*}" -v len="${c##*:}" 'BEGIN {
+			s = length(name) * 7919 + len
+			print ">" name
+			line = ""
+			for(i = 0; i < len; i++) {
+				s = (s * 1103515245 + 12345) % 2147483648
+				line = line substr("ACGT", int(s / 65536) % 4 + 1, 1)
+				if(length(line) == 60) { print line; line = "" }
+			}
+			if(line != "") print line
+		}' >> "$out"
+	done
+}
+
+## mkaln <ref> <reads> <seed>: Crossbow-format (-c) alignments of
+## <reads> 36-base reads drawn from <ref>, sorted.  One site in 97 is
+## heterozygous, one base in 100 is an error, one read in ten is a
+## repeat and one in five is paired.
+mkaln() {
+	awk -v n="$2" -v seed="$3" '
+	/^>/ { name = substr($1, 2); names[++nc] = name; next }
+	{ seq[name] = seq[name] $0 }
+	END {
+		srand(seed)
+		for(c = 1; c <= nc; c++) {
+			total += length(seq[names[c]]) - 36
+			cum[c] = total
+		}
+		for(i = 0; i < n; i++) {
+			r = int(rand() * total)
+			for(c = 1; cum[c] <= r; c++) ;
+			s = seq[names[c]]
+			pos = int(rand() * (length(s) - 36))
+			read = qual = ""
+			for(j = 1; j <= 36; j++) {
+				b = toupper(substr(s, pos + j, 1))
+				if((pos + j) % 97 == 0 && rand() < 0.5) {
+					b = substr("CGTAN", index("ACGTN", b), 1)
+				}
+				if(rand() < 0.01) {
+					b = substr("ACGT", int(rand() * 4) + 1, 1)
+				}
+				read = read b
+				qual = qual substr("+5?I", int(rand() * 4) + 1, 1)
+			}
+			mate = (rand() < 0.2) ? int(rand() * 2) + 1 : 0
+			printf "%s\t%d\t%d\t%s\t%s\t%s\t%d\t-\t%d\tr%d\n", names[c], 0, pos,
+				(rand() < 0.5) ? "+" : "-", read, qual, (rand() < 0.1), mate, i
+		}
+	}' "$1" | sort -k1,1 -k3,3n
+}
+
+## mksnps <ref>: known SNPs (-s) at every 194th and 301st site of
+## <ref>, half of them with allele frequencies, so that some are among
+## the heterozygous sites of mkaln and some are not
+mksnps() {
+	awk '/^>/ { name = substr($1, 2); off = 0; next }
+	{
+		for(i = 1; i <= length($0); i++) {
+			p = off + i
+			if(p % 194 && p % 301) continue
+			b = toupper(substr($0, i, 1))
+			a = substr("CGTA", index("ACGT", b), 1)
+			f["A"] = f["C"] = f["T"] = f["G"] = 0
+			if(p % 2) { f[b] = 0.7; f[a] = 0.3 } else { f[b] = f[a] = 1 }
+			printf "%s\t%d\t%d\t%d\t0\t%s\t%s\t%s\t%s\trs%d\n", name, p, p % 2, p % 3 != 0,
+				f["A"], f["C"], f["T"], f["G"], p
+		}
+		off += length($0)
+	}' "$1"
+}
+
+finish() {
+	exit $failed
+}
@@ -0,0 +1,39 @@
+#!/bin/bash
+# Compressed inputs, read on a background thread, are called exactly as
+# the plain text is: gzip, several concatenated gzip members, and bzip2
+# and zstd where soapsnp was built with them.
+
+. "$(dirname "$0")/common.sh"
+
+mkref ref.fa chr1:20000 chr2:8000
+mkaln ref.fa 8000 29 > aln.txt
+C="-d ref.fa -z ! -L 40 -c"
+
+"$BIN/soapsnp" -i aln.txt $C -o plain.cns > /dev/null 2>&1 || fail "soapsnp exited with $?"
+
+gzip -c aln.txt > aln.txt.gz
+"$BIN/soapsnp" -i aln.txt.gz $C -o gz.cns > /dev/null 2>&1 || fail "soapsnp exited with $?"
+same "gzip input" plain.cns gz.cns
+
+head -n 3000 aln.txt | gzip -c > multi.txt.gz
+tail -n +3001 aln.txt | gzip -c >> multi.txt.gz
+"$BIN/soapsnp" -i multi.txt.gz $C -o multi.cns > /dev/null 2>&1 || fail "soapsnp exited with $?"
+same "concatenated gzip members" plain.cns multi.cns
+
+# bzip2 and zstd only where soapsnp was built with them
+for z in bzip2 zstd; do
+	ext=$([ $z = bzip2 ] && echo bz2 || echo zst)
+	if ! command -v $z > /dev/null; then
+		echo "skip $(basename "$0" .sh): $z input (no $z command)"
+		continue
+	fi
+	$z -c aln.txt > aln.txt.$ext
+	"$BIN/soapsnp" -i aln.txt.$ext $C -o $z.cns > $z.log 2>&1
+	if grep -q "built without $z" $z.log; then
+		echo "skip $(basename "$0" .sh): $z input (not built with it)"
+	else
+		same "$z input" plain.cns $z.cns
+	fi
+done
+
+finish
@@ -0,0 +1,39 @@
+#!/bin/bash
+# -X and -T: calling regions through an input's position index gives
+# the same output as scanning the whole input, for text, SAM and binary
+# inputs, and an index that no longer matches its input is ignored.
+
+. "$(dirname "$0")/common.sh"
+
+mkref ref.fa chr1:60000 chr2:8000
+mkaln ref.fa 12000 32 > aln.cb
+awk -F'\t' '{ printf "%s\t%d\t%s\t%d\t60\t36M\t*\t0\t0\t%s\t%s\tNH:i:%d\n", $10, ($4 == "-") ? 16 : 0, $1, $3 + 1, $5, $6, $7 + 1 }' aln.cb > aln.sam
+"$BIN/aln2bin" -c -i aln.cb -o aln.bin 2> /dev/null || fail "aln2bin exited with $?"
+# Regions within one 16 kb bucket, across two and on the next chromosome
+printf 'chr1\t100\t500\nchr1\t20000\t36000\nchr1\t50000\t50100\nchr2\t5000\t5100\n' > region.txt
+C="-d ref.fa -z ! -L 40 -T region.txt"
+
+for f in aln.cb aln.sam aln.bin; do
+	opt=$([ $f = aln.cb ] && echo -c)
+	for q in "" -q; do
+		"$BIN/soapsnp" -i $f $opt $C $q -o $f$q.scan.cns > /dev/null 2>&1 || fail "soapsnp exited with $?"
+	done
+	"$BIN/soapsnp" -i $f $opt -X > /dev/null 2>&1 && [ -s $f.sidx ] || fail "$f: no index written"
+	for q in "" -q; do
+		"$BIN/soapsnp" -i $f $opt $C $q -o $f$q.seek.cns > $f.log 2>&1 || fail "soapsnp exited with $?"
+		grep -q "Using alignment index" $f.log || fail "$f: index not used"
+		same "$f${q:+ $q} through the index" $f$q.scan.cns $f$q.seek.cns
+	done
+done
+
+# Cut the input short after indexing it
+head -n 6000 aln.cb > short.cb
+"$BIN/soapsnp" -i short.cb -c -X > /dev/null 2>&1
+head -n 5000 aln.cb > short.cb
+"$BIN/soapsnp" -i short.cb -c $C -o stale.cns > stale.log 2>&1 || fail "soapsnp exited with $?"
+grep -q "Using alignment index" stale.log && fail "stale index used"
+rm short.cb.sidx
+"$BIN/soapsnp" -i short.cb -c $C -o short.cns > /dev/null 2>&1 || fail "soapsnp exited with $?"
+same "stale index ignored" short.cns stale.cns
+
+finish
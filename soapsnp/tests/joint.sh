@@ -0,0 +1,42 @@
+#!/bin/bash
+# -A: each sample of a joint call gets the genotype, quality and depth
+# that calling it on its own gives, when the samples share a correction
+# matrix; with one sample that holds without one too.  -q keeps the
+# sites where any sample is not the reference.
+
+. "$(dirname "$0")/common.sh"
+
+mkref ref.fa chr1:20000 chr2:8000
+mkaln ref.fa 8000 34 > a.txt
+mkaln ref.fa 6000 35 > b.txt
+mksnps ref.fa > snps.txt
+C="-d ref.fa -z ! -L 40 -c -s snps.txt -2"
+
+# Chr, Pos, Ref, then genotype, quality and depth of one sample
+serial() {
+	awk -F'\t' 'BEGIN { OFS = "\t" } { print $1, $2, $3, $4, $5, $14 }' "$1"
+}
+sample() {
+	awk -F'\t' -v i="$2" 'BEGIN { OFS = "\t" } NR > 1 { print $1, $2, $3, $(3*i+1), $(3*i+2), $(3*i+3) }' "$1"
+}
+
+"$BIN/soapsnp" -i a.txt $C -M a.matrix -o a.cns > /dev/null 2>&1 || fail "soapsnp exited with $?"
+"$BIN/soapsnp" -A a=a.txt $C -o one.cns > /dev/null 2>&1 || fail "soapsnp -A exited with $?"
+serial a.cns > a.cols
+sample one.cns 1 > one.cols
+same "one sample" a.cols one.cols
+
+"$BIN/soapsnp" -i b.txt $C -I a.matrix -o b.cns > /dev/null 2>&1 || fail "soapsnp exited with $?"
+"$BIN/soapsnp" -A a=a.txt -A b=b.txt $C -I a.matrix -o ab.cns > /dev/null 2>&1 || fail "soapsnp -A exited with $?"
+serial b.cns > b.cols
+sample ab.cns 1 > ab1.cols
+sample ab.cns 2 > ab2.cols
+same "first of two samples" a.cols ab1.cols
+same "second of two samples" b.cols ab2.cols
+
+"$BIN/soapsnp" -A a=a.txt -A b=b.txt $C -I a.matrix -q -o q.cns > /dev/null 2>&1 || fail "soapsnp -A -q exited with $?"
+awk -F'\t' 'NR == 1 || $4 != $3 || $7 != $3' ab.cns > nonref.cns
+[ $(wc -l < nonref.cns) -gt 1 ] || fail "no non-reference sites"
+same "-q" nonref.cns q.cns
+
+finish
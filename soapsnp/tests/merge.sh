@@ -0,0 +1,36 @@
+#!/bin/bash
+# Several sorted -i inputs are merged into one sorted stream: calling
+# them is the same as calling their concatenation, however the records
+# are spread over the inputs.  An input that is not sorted by
+# chromosome is refused.
+
+. "$(dirname "$0")/common.sh"
+
+mkref ref.fa chr1:20000 chr2:8000 chr3:5000
+mkaln ref.fa 9000 28 > all.txt
+C="-d ref.fa -z ! -L 40 -c"
+
+"$BIN/soapsnp" -i all.txt $C -o all.cns > /dev/null 2>&1 || fail "soapsnp exited with $?"
+
+# Round robin over three inputs
+awk '{ print > ("rr" NR % 3 ".txt") }' all.txt
+"$BIN/soapsnp" -i rr0.txt,rr1.txt,rr2.txt $C -o rr.cns > /dev/null 2>&1 || fail "soapsnp exited with $?"
+same "three round-robin inputs" all.cns rr.cns
+
+# One input per chromosome, given out of order, and one with only the
+# start of chr1
+awk '$1 != "chr1" || $3 >= 5000 { print > ($1 ".txt"); next } { print > "head.txt" }' all.txt
+"$BIN/soapsnp" -i chr3.txt,chr1.txt,head.txt -i chr2.txt $C -o chr.cns > /dev/null 2>&1 || fail "soapsnp exited with $?"
+same "inputs holding different chromosomes" all.cns chr.cns
+
+# An input with its chromosomes out of order is refused
+cat chr2.txt chr1.txt > unsorted.txt
+if "$BIN/soapsnp" -i chr3.txt,unsorted.txt $C -o unsorted.cns > unsorted.log 2>&1; then
+	fail "unsorted input: soapsnp succeeded"
+else
+	grep -q "is not sorted by chromosome name: chr1 follows chr2" unsorted.log &&
+		pass "unsorted input refused" ||
+		fail "unsorted input: $(tail -1 unsorted.log)"
+fi
+
+finish
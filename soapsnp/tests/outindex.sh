@@ -0,0 +1,66 @@
+#!/bin/bash
+# -O: every entry of the .cidx index points at the first output line
+# that covers or follows the start of its bucket, every bucket with
+# output has an entry (also for -A output), and the index is the same
+# with -P and -C.
+
+. "$(dirname "$0")/common.sh"
+
+mkref ref.fa chr1:60000 chr2:20000
+mkaln ref.fa 8000 37 > aln.cb
+C="-d ref.fa -z ! -L 40 -c -O"
+
+## check <what> <output>: the index of a text output against its lines
+check() {
+	awk -F'\t' -v bucket=16384 '
+	BEGIN { off = 0 }
+	NR == FNR {
+		if($0 !~ /^#/) {
+			chr = ($1 == "B") ? $2 : $1
+			if(!(chr in rank)) rank[chr] = ++nchr
+			n++
+			at[off] = n; c[n] = rank[chr]
+			first[n] = ($1 == "B") ? $3 : $2
+			last[n] = ($1 == "B") ? $4 : $2
+			need[chr "\t" int((first[n] - 1) / bucket)] = 1
+		}
+		off += length($0) + 1
+		next
+	}
+	FNR == 1 { next }
+	{
+		delete need[$1 "\t" $2]
+		start = $2 * bucket + 1
+		i = at[$3]
+		if(!i || c[i] < rank[$1] || (c[i] == rank[$1] && last[i] < start)) {
+			print "entry " $1 " " $2 " points before its bucket"; bad = 1
+		}
+		if(i > 1 && (c[i - 1] > rank[$1] || (c[i - 1] == rank[$1] && last[i - 1] >= start))) {
+			print "entry " $1 " " $2 " skips output in its bucket"; bad = 1
+		}
+	}
+	END {
+		for(k in need) { print "no entry for " k; bad = 1 }
+		exit bad
+	}' "$2" "$2.cidx" > check.log && pass "$1" || fail "$1: $(head -n 1 check.log)"
+}
+
+for opt in "" "-B 20" "-q"; do
+	"$BIN/soapsnp" -i aln.cb $C $opt -o serial.cns > /dev/null 2>&1 || fail "soapsnp exited with $?"
+	[ -s serial.cns.cidx ] || fail "${opt:+$opt: }no index written"
+	check "${opt:+$opt: }index entries" serial.cns
+	"$BIN/soapsnp" -i aln.cb $C $opt -P 3 -o par.cns > /dev/null 2>&1 || fail "soapsnp exited with $?"
+	same "${opt:+$opt }-P 3 index" serial.cns.cidx par.cns.cidx
+	"$BIN/soapsnp" -i aln.cb $C $opt -C ck.txt -o ck.cns > /dev/null 2>&1 || fail "soapsnp exited with $?"
+	same "${opt:+$opt }-C index" serial.cns.cidx ck.cns.cidx
+done
+
+"$BIN/soapsnp" -A s=aln.cb $C -o joint.cns > /dev/null 2>&1 || fail "soapsnp exited with $?"
+check "-A index entries" joint.cns
+
+"$BIN/soapsnp" -i aln.cb $C -F 1 -o serial.glf > /dev/null 2>&1 || fail "soapsnp exited with $?"
+[ -s serial.glf.cidx ] || fail "GLF: no index written"
+"$BIN/soapsnp" -i aln.cb $C -F 1 -P 3 -o par.glf > /dev/null 2>&1 || fail "soapsnp exited with $?"
+same "GLF -P 3 index" serial.glf.cidx par.glf.cidx
+
+finish
@@ -0,0 +1,29 @@
+#!/bin/bash
+# -P: calling chromosomes in 100 kb shards on several threads writes
+# exactly what a serial run writes, whatever the output options.
+
+. "$(dirname "$0")/common.sh"
+
+mkref ref.fa chr1:210000 chr2:30000
+mkaln ref.fa 25000 33 > aln.txt
+mksnps ref.fa > snps.txt
+printf 'chr1\t90000\t110000\nchr1\t180000\t190000\nchr2\t150\t7000\n' > region.txt
+C="-i aln.txt -d ref.fa -z ! -L 40 -c"
+
+check() { # <what> <threads> <options>...
+	what=$1; threads=$2; shift 2
+	"$BIN/soapsnp" $C "$@" -o serial.cns > /dev/null 2>&1 || fail "$what: soapsnp exited with $?"
+	[ -s serial.cns ] || fail "$what: no output"
+	for p in $threads; do
+		"$BIN/soapsnp" $C "$@" -P $p -o p$p.cns > /dev/null 2>&1 || fail "$what: soapsnp -P $p exited with $?"
+		same "$what, -P $p" serial.cns p$p.cns
+	done
+}
+
+check "-B 20 -O" "2 3" -B 20 -O
+same "-O index, -P 3" serial.cns.cidx p3.cns.cidx
+check "-q -u -s -2 -D 4" 3 -q -u -s snps.txt -2 -D 4
+check "-T" 3 -T region.txt
+check "GLF" 3 -F 1
+
+finish
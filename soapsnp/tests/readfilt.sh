@@ -0,0 +1,76 @@
+#!/bin/bash
+# readfilt: Align.pl hands bowtie the same reads and reports the same
+# counters whether it filters them with readfilt or with its Perl loop
+# (--readfilt=), for each quality encoding, truncation, discard-small
+# and discard-mate, through a file and straight through.
+
+. "$(dirname "$0")/common.sh"
+
+# A stand-in for bowtie that keeps the reads it is given, and an index
+# that passes Align.pl's checks
+for i in 1 2 3 4 rev.1 rev.2; do
+	echo index > idx.$i.ebwt
+done
+cat > bowtie <<EOS
+#!/bin/sh
+while [ \$# -gt 0 ]; do
+	[ "\$1" = --12 ] && cat "\$2" > "$WORK/reads.txt"
+	shift
+done
+EOS
+chmod +x bowtie
+
+## mkreads <lowest quality character> <highest>: unpaired and paired
+## reads of 20 to 50 bases, with the FAKE and blank lines Align.pl skips
+mkreads() {
+	awk -v lo="$1" -v hi="$2" 'BEGIN {
+		srand(42)
+		for(i = 0; i < 3000; i++) {
+			if(i % 500 == 7) print "FAKE"
+			if(i % 700 == 3) print ""
+			printf "r%d", i
+			for(m = 0; m < ((rand() < 0.4) ? 2 : 1); m++) {
+				len = 20 + int(rand() * 31)
+				s = q = ""
+				for(j = 0; j < len; j++) {
+					s = s substr("ACGTN", int(rand() * 5) + 1, 1)
+					q = q sprintf("%c", lo + int(rand() * (hi - lo + 1)))
+				}
+				printf "\t%s\t%s", s, q
+			}
+			printf "\n"
+		}
+	}'
+}
+mkreads 33 73 > phred33.txt
+mkreads 64 104 > phred64.txt
+mkreads 59 104 > solexa64.txt
+
+## filter <what> <input> <Align.pl options>...
+filter() {
+	what=$1; in=$2; shift 2
+	for m in native perl; do
+		rm -f reads.txt
+		perl "$CROSSBOW/Align.pl" --bowtie="$WORK/bowtie" --index-local="$WORK/idx" \
+			--readfilt=$([ $m = native ] && echo "$BIN/readfilt") "$@" < $in > /dev/null 2> $m.log ||
+			fail "$what: $m: Align.pl exited with $?"
+		grep -q "read filter: $([ $m = native ] && echo "$BIN/readfilt" || echo Perl)" $m.log ||
+			fail "$what: $m: wrong filter used"
+		mv reads.txt $m.reads
+		grep "^reporter:counter:" $m.log | sort > $m.cnt
+	done
+	[ -s native.reads ] || fail "$what: no reads given to bowtie"
+	same "$what" native.reads perl.reads
+	same "$what: counters" native.cnt perl.cnt
+}
+
+filter "phred33" phred33.txt
+filter "phred64" phred64.txt --qual phred64
+filter "solexa64" solexa64.txt --qual solexa64
+filter "--truncate 30" phred33.txt --truncate 30
+filter "--truncate 30 --discard-small" solexa64.txt --qual solexa64 --truncate 30 --discard-small
+filter "--discard-mate 1" phred33.txt --discard-mate 1
+filter "--discard-mate 2" phred64.txt --qual phred64 --discard-mate 2 --truncate 25
+filter "--straight-through" phred33.txt --straight-through --truncate 30
+
+finish
@@ -0,0 +1,78 @@
+#!/bin/bash
+# readprep: Copy.pl writes the same read files and counters whether it
+# preprocesses the manifest's FASTQ and SAM inputs with readprep or with
+# its Perl loop (--readprep=), including paired, gzip and bzip2 inputs
+# and --label-rg.
+
+. "$(dirname "$0")/common.sh"
+
+## mkfastq <mate> <reads>: FASTQ with lowercase and N bases, read names
+## with descriptions, and a repeated name on some '+' lines
+mkfastq() {
+	awk -v mate="$1" -v n="$2" 'BEGIN {
+		srand(45)
+		for(i = 0; i < n; i++) {
+			len = 20 + int(rand() * 17)
+			s = q = ""
+			for(j = 0; j < len; j++) {
+				s = s substr("ACGTNacgt", int(rand() * 9) + 1, 1)
+				q = q sprintf("%c", 35 + int(rand() * 40))
+			}
+			if(mate == 1) printf "@r%d/1 extra stuff\n%s\n+\n%s\n", i, s, q
+			else printf "@r%d/2\t x\n%s\n+r%d\n%s\n", i, s, i, q
+		}
+	}'
+}
+mkfastq 1 1200 > a_1.fq
+mkfastq 2 1200 > a_2.fq
+gzip -c a_1.fq > b.fq.gz
+cp a_2.fq d.fq
+awk 'BEGIN {
+	srand(46)
+	for(i = 0; i < 1500; i++) {
+		len = 20 + int(rand() * 17)
+		s = q = ""
+		for(j = 0; j < len; j++) {
+			s = s substr("ACGTNacgt", int(rand() * 9) + 1, 1)
+			q = q sprintf("%c", 35 + int(rand() * 40))
+		}
+		printf "q%d desc\t%d\tchr%d\t%d\t%d\t%dM\t*\t0\t0\t%s\t%s\tNM:i:1\tRG:Z:grp%d\tXA:Z:a:b\n",
+			i, substr("0 16 99", int(rand() * 3) * 2 + 1, 2) + 0, i % 2, 1 + int(rand() * 1000000),
+			int(rand() * 61), len, s, q, i % 3
+	}
+}' > s.sam
+printf 'a_1.fq\t0\ta_2.fq\t0\nb.fq.gz\t0\tlab1\nd.fq\t0\n' > fastq.man
+if command -v bzip2 > /dev/null; then
+	bzip2 -c a_1.fq > c_1.fq.bz2
+	bzip2 -c a_2.fq > c_2.fq.bz2
+	printf 'c_1.fq.bz2\t0\tc_2.fq.bz2\t0\tlabp\n' >> fastq.man
+fi
+printf 's.sam\t0\n' > sam.man
+
+## prep <what> <manifest> <Copy.pl options>...
+prep() {
+	what=$1; man=$2; shift 2
+	for m in native perl; do
+		rm -rf $m; mkdir $m
+		cp a_[12].fq b.fq.gz c_[12].fq.bz2 d.fq s.sam $m/ 2> /dev/null
+		(cd $m && perl "$CROSSBOW/Copy.pl" --maxperfile 500 --verbose \
+			--readprep=$([ $m = native ] && echo "$BIN/readprep") "$@" < "$WORK/$man" > ../$m.stdout 2> ../$m.log) ||
+			fail "$what: $m: Copy.pl exited with $?"
+		grep -q "Read preprocessor: $([ $m = native ] && echo "$BIN/readprep" || echo Perl)" $m.log ||
+			fail "$what: $m: wrong preprocessor used"
+		grep "^reporter:counter:" $m.log | sort > $m.cnt
+		for f in $(cd $m && ls *.out); do
+			echo "== $f"
+			cat $m/$f
+		done > $m.reads
+	done
+	grep -q "^== " native.reads || fail "$what: no read files written"
+	same "$what" native.reads perl.reads
+	same "$what: counters" native.cnt perl.cnt
+}
+
+prep "FASTQ" fastq.man
+prep "SAM" sam.man
+prep "SAM --label-rg" sam.man --label-rg
+
+finish
@@ -0,0 +1,59 @@
+#!/bin/bash
+# The 2-bit reference: every site of a reference with lowercase bases,
+# N runs (at the ends of chromosomes, across word and 4 kb index block
+# boundaries) and IUPAC codes is reported with the reference base and
+# dbSNP flag it had when the reference was stored a character per base.
+
+. "$(dirname "$0")/common.sh"
+
+mkref plain.fa chr1:70001 chr2:9000 chr3:100
+awk '/^>/ { print; p = 0; next }
+{
+	line = ""
+	for(i = 1; i <= length($0); i++) {
+		b = substr($0, i, 1); p++
+		if(p <= 45 || (p >= 4090 && p <= 4103) || (p >= 8000 && p < 8192) ||
+		   (p % 517 < int(p / 517) % 40 && p % 3)) {
+			b = "N"
+		}
+		else if(p % 1013 == 0) {
+			b = substr("RYKMSWBDHVnrykm", int(p / 1013) % 15 + 1, 1)
+		}
+		else if(int(p / 700) % 3 == 1) {
+			b = tolower(b)
+		}
+		line = line b
+	}
+	print line
+}' plain.fa > ref.fa
+# chr3 ends in an N run
+sed -i '$s/.\{20\}$/NNNNNNNNNNNNNNNNNNNN/' ref.fa
+mkaln plain.fa 12000 38 > aln.cb
+mksnps plain.fa > snps.txt
+
+## expect: chr, position, reference base and dbSNP flag of every site,
+## the base being "ACTGNNNN"[(c >> 1) & 7] of its character c
+awk 'BEGIN { for(i = 32; i < 127; i++) ord[sprintf("%c", i)] = i }
+NR == FNR { snp[$1 "\t" $2] = 1; next }
+/^>/ { chr = substr($1, 2); p = 0; next }
+{
+	for(i = 1; i <= length($0); i++) {
+		c = int(ord[substr($0, i, 1)] / 2) % 8
+		p++
+		printf "%s\t%d\t%s\t%d\n", chr, p, substr("ACTGNNNN", c + 1, 1), (chr "\t" p) in snp
+	}
+}' snps.txt ref.fa > expect.txt
+
+C="-d ref.fa -z ! -L 40 -c -s snps.txt"
+"$BIN/soapsnp" -i aln.cb $C -o out.cns > /dev/null 2>&1 || fail "soapsnp exited with $?"
+# An uncovered N is reported without its dbSNP flag
+awk -F'\t' '{ print $1 "\t" $2 "\t" $3 "\t" (($3 == "N" && $14 == 0) ? "-" : $NF) }' out.cns > got.txt
+awk -F'\t' 'NR == FNR { if($4 == "-") n[$1 "\t" $2] = 1; next }
+	{ if(($1 "\t" $2) in n) $4 = "-"; print }' OFS='\t' got.txt expect.txt > want.txt
+same "reference bases and dbSNP flags" want.txt got.txt
+
+"$BIN/soapsnp" -A s=aln.cb $C -o joint.cns > /dev/null 2>&1 || fail "soapsnp exited with $?"
+awk -F'\t' '!/^#/ { print $1 "\t" $2 "\t" $3 "\t" $NF }' joint.cns > got.txt
+same "-A reference bases and dbSNP flags" expect.txt got.txt
+
+finish
@@ -0,0 +1,26 @@
+#!/bin/bash
+# -R: alignments out of order by up to the given distance are called
+# exactly as the sorted input is; without -R they are a sorting error.
+
+. "$(dirname "$0")/common.sh"
+
+mkref ref.fa chr1:20000 chr2:8000
+mkaln ref.fa 8000 27 > sorted.txt
+# Move every record up to 30 bp out of place
+awk 'BEGIN { srand(27) } { print $1 "\t" $3 + int(rand() * 31) "\t" $0 }' sorted.txt |
+	sort -k1,1 -k2,2n | cut -f 3- > shuffled.txt
+cmp -s sorted.txt shuffled.txt && fail "shuffled input is still sorted"
+C="-d ref.fa -z ! -L 40 -c"
+
+"$BIN/soapsnp" -i sorted.txt $C -o sorted.cns > /dev/null 2>&1 || fail "soapsnp exited with $?"
+"$BIN/soapsnp" -i shuffled.txt $C -R 30 -o shuffled.cns > /dev/null 2>&1 || fail "soapsnp -R 30 exited with $?"
+same "-R 30 on records 30 bp out of order" sorted.cns shuffled.cns
+
+"$BIN/soapsnp" -i shuffled.txt $C -o unsorted.cns > unsorted.log 2>&1
+if [ $? -ne 0 ] && grep -q "Errors in sorting" unsorted.log; then
+	pass "out of order records rejected without -R"
+else
+	fail "out of order records rejected without -R"
+fi
+
+finish
@@ -0,0 +1,29 @@
+#!/bin/bash
+# -D: a cap above every site's depth changes nothing, and a low cap
+# keeps at most that many unique observations per site while still
+# reporting the full depth.
+
+. "$(dirname "$0")/common.sh"
+
+mkref ref.fa chr1:3000 chr2:20000
+mkaln ref.fa 6000 26 > aln.txt
+C="-d ref.fa -z ! -L 40 -c"
+
+"$BIN/soapsnp" -i aln.txt $C -o d0.cns > /dev/null 2>&1 || fail "soapsnp exited with $?"
+"$BIN/soapsnp" -i aln.txt $C -D 1000 -o d1000.cns > /dev/null 2>&1 || fail "soapsnp -D 1000 exited with $?"
+same "-D above every depth" d0.cns d1000.cns
+
+"$BIN/soapsnp" -i aln.txt $C -D 5 -o d5.cns > /dev/null 2>&1 || fail "soapsnp -D 5 exited with $?"
+awk -F'\t' 'NR == FNR { depth[$1 " " $2] = $14; next }
+$14 != depth[$1 " " $2] { print "  " $1 ":" $2 ": depth " $14 ", expected " depth[$1 " " $2]; bad++ }
+$8 + $12 > 5 { print "  " $1 ":" $2 ": " $8 " + " $12 " unique observations kept"; bad++ }
+$14 > 5 { deep++ }
+END {
+	if(deep < 1000) { print "  only " deep + 0 " sites deeper than 5"; bad++ }
+	exit bad > 0
+}' d0.cns d5.cns && pass "-D 5 keeps 5 observations" || fail "-D 5 keeps 5 observations"
+
+"$BIN/soapsnp" -i aln.txt $C -D 5 -o d5b.cns > /dev/null 2>&1
+same "-D 5 is reproducible" d5.cns d5b.cns
+
+finish
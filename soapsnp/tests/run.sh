@@ -0,0 +1,14 @@
+#!/bin/bash
+# Run the regression scripts named on the command line, or all of them.
+# BIN overrides the directory the tools are taken from.
+
+cd "$(dirname "$0")"
+if [ $# -eq 0 ]; then
+	set -- $(ls *.sh | grep -v -e '^common.sh$' -e '^run.sh$')
+fi
+status=0
+for t in "$@"; do
+	./"${t%.sh}.sh" || status=1
+done
+[ $status -eq 0 ] && echo "All tests passed" || echo "Some tests FAILED"
+exit $status
@@ -0,0 +1,94 @@
+#!/bin/bash
+# SAM and BAM input is called exactly as the same alignments in
+# Crossbow format, with secondary and supplementary records skipped and
+# duplicates skipped unless -x is given.  BAM is read both as BGZF
+# blocks and as a single gzip member.
+
+. "$(dirname "$0")/common.sh"
+
+mkref ref.fa chr1:20000 chr2:8000
+mkaln ref.fa 8000 31 > aln.cb
+# Every 7th record again as a duplicate
+awk 'NR % 7 == 0' aln.cb | cat aln.cb - | sort -s -k1,1 -k3,3n > dup.cb
+
+# The same alignments as SAM, plus secondary and supplementary copies
+# of some and a duplicate of every 7th
+awk -F'\t' 'BEGIN {
+	print "@HD\tVN:1.0\tSO:coordinate"
+	print "@SQ\tSN:chr1\tLN:20000"
+	print "@SQ\tSN:chr2\tLN:8000"
+}
+function rec(flag) {
+	printf "%s\t%d\t%s\t%d\t60\t36M\t*\t0\t0\t%s\t%s\tNH:i:%d\n", $10, flag, $1, $3 + 1, $5, $6, $7 + 1
+}
+{
+	flag = ($4 == "-") ? 16 : 0
+	if($9 == 1) flag += 65
+	if($9 == 2) flag += 129
+	rec(flag)
+	if(NR % 10 == 0) rec(flag + 256)
+	if(NR % 13 == 0) rec(flag + 2048)
+	if(NR % 7 == 0) rec(flag + 1024)
+}' aln.cb > aln.sam
+
+# BAM, as BGZF blocks and as one gzip member
+cat > sam2bam.pl <<'PERL'
+use strict;
+use warnings;
+use Compress::Zlib;
+my ($bgzf) = @ARGV;
+my (%ref, @refs, $text);
+my $bam = "";
+while(<STDIN>) {
+	chomp;
+	if(/^@/) {
+		$text .= "$_\n";
+		if(/^\@SQ\tSN:(\S+)\tLN:(\d+)/) { $ref{$1} = scalar(@refs); push @refs, [$1, $2]; }
+		next;
+	}
+	if($bam eq "") {
+		$bam = "BAM\1" . pack("l<", length($text)) . $text . pack("l<", scalar(@refs));
+		$bam .= pack("l<", length($_->[0]) + 1) . $_->[0] . "\0" . pack("l<", $_->[1]) for @refs;
+	}
+	my @f = split /\t/;
+	my $len = length($f[9]);
+	my $packed = "";
+	my @codes = map { index("=ACMGRSVTWYHKDBN", $_) } split //, uc($f[9]);
+	push @codes, 0 if $len % 2;
+	$packed .= chr($codes[$_] << 4 | $codes[$_ + 1]) for grep { $_ % 2 == 0 } 0..$#codes;
+	my $qual = join("", map { chr(ord($_) - 33) } split //, $f[10]);
+	my ($nh) = $f[11] =~ /^NH:i:(\d+)$/;
+	my $r = pack("l<l<CCS<S<S<l<l<l<l<", $ref{$f[2]}, $f[3] - 1, length($f[0]) + 1, $f[4], 0, 1, $f[1], $len, -1, -1, 0)
+	      . $f[0] . "\0" . pack("L<", $len << 4) . $packed . $qual . "NHC" . chr($nh);
+	$bam .= pack("l<", length($r)) . $r;
+}
+binmode STDOUT;
+if(!$bgzf) {
+	print Compress::Zlib::memGzip($bam);
+	exit 0;
+}
+for(my $off = 0; $off <= length($bam); $off += 60000) {
+	my $chunk = substr($bam, $off, 60000);
+	my ($d) = Compress::Raw::Zlib::Deflate->new(-WindowBits => -15, -AppendOutput => 1);
+	my $c = "";
+	$d->deflate($chunk, $c);
+	$d->flush($c);
+	print pack("CCCCVCCvCCvv", 31, 139, 8, 4, 0, 0, 255, 6, 66, 67, 2, length($c) + 25)
+	    . $c . pack("VV", crc32($chunk), length($chunk));
+	last if $chunk eq "";
+}
+PERL
+perl sam2bam.pl 1 < aln.sam > bgzf.bam && perl sam2bam.pl 0 < aln.sam > gzip.bam ||
+	fail "could not write the BAM fixtures"
+
+C="-d ref.fa -z ! -L 40"
+"$BIN/soapsnp" -i aln.cb -c $C -o cb.cns > /dev/null 2>&1 || fail "soapsnp exited with $?"
+"$BIN/soapsnp" -i dup.cb -c $C -o dup.cns > /dev/null 2>&1 || fail "soapsnp exited with $?"
+for f in aln.sam bgzf.bam gzip.bam; do
+	"$BIN/soapsnp" -i $f $C -o $f.cns > /dev/null 2>&1 || fail "soapsnp exited with $?"
+	same "$f" cb.cns $f.cns
+	"$BIN/soapsnp" -i $f $C -x -o $f.x.cns > /dev/null 2>&1 || fail "soapsnp -x exited with $?"
+	same "$f with -x" dup.cns $f.x.cns
+done
+
+finish